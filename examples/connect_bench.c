@@ -0,0 +1,86 @@
+//measure the cost of connect() against the raw system call, run it with and without LD_PRELOAD=libproxysocket_preload.so
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 10000
+
+uint64_t get_nanoseconds ()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//connect to the listener the specified number of times, returns average nanoseconds per connect() or 0 on error
+uint64_t run (int listener, const struct sockaddr_in* addr, int iterations, int raw)
+{
+  int i;
+  int sock;
+  int client;
+  int result;
+  uint64_t start;
+  uint64_t total = 0;
+  for (i = 0; i < iterations; i++) {
+    if ((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+      return 0;
+    start = get_nanoseconds();
+#ifdef SYS_connect
+    if (raw)
+      result = syscall(SYS_connect, sock, (const struct sockaddr*)addr, sizeof(*addr));
+    else
+#endif
+      result = connect(sock, (const struct sockaddr*)addr, sizeof(*addr));
+    total += get_nanoseconds() - start;
+    if (result != 0) {
+      close(sock);
+      return 0;
+    }
+    if ((client = accept(listener, NULL, NULL)) != -1)
+      close(client);
+    close(sock);
+  }
+  return total / iterations;
+}
+
+int main (int argc, char* argv[])
+{
+  int listener;
+  int iterations;
+  uint64_t raw;
+  uint64_t wrapped;
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  iterations = (argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS);
+  if (iterations <= 0) {
+    printf("Usage:  connect_bench [iterations]\n");
+    return 1;
+  }
+  //listen on a loopback port (loopback connections are never proxied)
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if ((listener = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || getsockname(listener, (struct sockaddr*)&addr, &addrlen) != 0 || listen(listener, 128) != 0) {
+    fprintf(stderr, "Error creating listening socket\n");
+    return 2;
+  }
+  //warm up before measuring
+  run(listener, &addr, iterations / 10 + 1, 0);
+  raw = run(listener, &addr, iterations, 1);
+  wrapped = run(listener, &addr, iterations, 0);
+  close(listener);
+  if (!raw || !wrapped) {
+    fprintf(stderr, "Error connecting\n");
+    return 3;
+  }
+  printf("system call: %lu ns\nconnect():   %lu ns\noverhead:    %ld ns\n", (unsigned long)raw, (unsigned long)wrapped, (long)wrapped - (long)raw);
+  return 0;
+}
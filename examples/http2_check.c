@@ -0,0 +1,698 @@
+//check of the HTTP/2 proxy support against a stand-in CONNECT proxy running in a thread on a loopback port
+//the stand-in grants small flow control windows, sends Huffman coded headers that fill, reference and shrink the dynamic table,
+//pads frames and splits header blocks, then echoes the data of several tunnels back to the library
+//returns zero when all data came back unchanged and neither side broke the protocol
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+//include the library itself to reach the HTTP/2 framing and HPACK internals
+#include "proxysocket.c"
+
+#define DEFAULT_TUNNELS 6                //enough for all kinds of responses sent by the stand-in proxy
+#define DEFAULT_BYTES (1024 * 1024)     //data echoed through each tunnel
+#define CHECK_DESTINATION "h2check.invalid"
+#define CHECK_DESTINATION_PORT 443
+#define CHECK_AUTHORITY "h2check.invalid:443"
+#define CHECK_STREAM_WINDOW 4096        //receive window of each stream on the stand-in proxy (small to make the library wait for window updates)
+#define CHECK_MAX_STREAMS 16
+#define CHECK_PADDING 16                //padding added to every other data frame sent to the library
+#define CHECK_TIMEOUT 10000             //milliseconds without progress before the check fails
+#define CHECK_PING "h2check"            //payload of the ping sent to the library (8 bytes with the terminating zero)
+
+//first response: RFC 7541 C.6.1 with :status 200 instead of 302 (literal fields with incremental indexing, all strings Huffman coded),
+//fills the dynamic table with location (62), date (63), cache-control (64) and :status (65) taking 222 of 256 bytes
+static const uint8_t check_first_response[] = {
+  0x3F, 0xE1, 0x01,                                                                     //dynamic table size update to 256
+  0x48, 0x82, 0x10, 0x01,                                                               //:status: 200
+  0x58, 0x85, 0xAE, 0xC3, 0x77, 0x1A, 0x4B,                                             //cache-control: private
+  0x61, 0x96, 0xD0, 0x7A, 0xBE, 0x94, 0x10, 0x54, 0xD4, 0x44, 0xA8, 0x20, 0x05, 0x95,   //date: Mon, 21 Oct 2013 20:13:21 GMT
+  0x04, 0x0B, 0x81, 0x66, 0xE0, 0x82, 0xA6, 0x2D, 0x1B, 0xFF,
+  0x6E, 0x91, 0x9D, 0x29, 0xAD, 0x17, 0x18, 0x63, 0xC7, 0x8F, 0x0B, 0x97, 0xC8, 0xE9,   //location: https://www.example.com
+  0xAE, 0x82, 0xAE, 0x43, 0xD3
+};
+
+//second and third response: date and :status from the dynamic table
+static const uint8_t check_indexed_response[] = {0xBF, 0xC1};
+
+//fourth response: shrink the dynamic table to 64 bytes (only location is kept), then add :status again which evicts location too
+static const uint8_t check_evicting_response[] = {0x3F, 0x21, 0x48, 0x82, 0x10, 0x01};
+
+//later responses: :status as the only entry of the dynamic table
+static const uint8_t check_last_response[] = {0xBE};
+
+struct check_stream {
+  uint32_t streamid;
+  int32_t sendwindow;                   //data the library allows the stand-in to send
+  int32_t recvwindow;                   //data the stand-in allows the library to send
+  struct http2_buffer echo;             //data waiting to be sent back
+  uint64_t received;
+  int8_t remoteclosed;
+  int8_t localclosed;
+  int8_t badheader;                     //request had a pseudo-header that does not belong in a CONNECT request
+  char method[16];
+  char authority[64];
+};
+
+struct check_proxy {
+  SOCKET listener;
+  SOCKET sock;
+  size_t tunnels;
+  struct check_stream streams[CHECK_MAX_STREAMS];
+  size_t streamcount;
+  size_t finished;
+  uint32_t laststreamid;
+  int32_t initialwindow;                //initial stream window of the library
+  int32_t sendwindow;
+  int32_t recvwindow;
+  uint32_t maxframesize;
+  size_t responses;
+  size_t dataframes;
+  int8_t preface;                       //client connection preface was received
+  int8_t settingsacked;
+  int8_t pingacked;
+  uint32_t updatesreceived;
+  uint32_t updatessent;
+  struct hpack_decoder decoder;
+  struct http2_buffer input;
+  struct http2_buffer output;
+  char error[256];
+};
+
+uint64_t get_milliseconds ()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//data sent through a tunnel, so mixed up tunnels or offsets are detected
+uint8_t check_pattern (size_t tunnel, uint64_t offset)
+{
+  return (uint8_t)(offset % 251 + tunnel * 37);
+}
+
+//remember the first problem found by the stand-in proxy, always returns -1
+int check_fail (struct check_proxy* proxy, const char* format, ...)
+{
+  va_list args;
+  if (proxy->error[0])
+    return -1;
+  va_start(args, format);
+  vsnprintf(proxy->error, sizeof(proxy->error), format, args);
+  va_end(args);
+  return -1;
+}
+
+int check_queue_frame (struct check_proxy* proxy, uint8_t type, uint8_t flags, uint32_t streamid, const void* payload, size_t payloadlen)
+{
+  uint8_t* p;
+  if ((p = http2_buffer_reserve(&proxy->output, 9 + payloadlen)) == NULL)
+    return check_fail(proxy, "Memory allocation error");
+  http2_write_frame_header(p, payloadlen, type, flags, streamid);
+  if (payloadlen > 0)
+    memcpy(p + 9, payload, payloadlen);
+  proxy->output.len += 9 + payloadlen;
+  return 0;
+}
+
+int check_queue_window_update (struct check_proxy* proxy, uint32_t streamid, uint32_t increment)
+{
+  uint8_t payload[4];
+  http2_write_uint32(payload, increment);
+  proxy->updatessent++;
+  return check_queue_frame(proxy, HTTP2_FRAME_WINDOW_UPDATE, 0, streamid, payload, 4);
+}
+
+struct check_stream* check_find_stream (struct check_proxy* proxy, uint32_t streamid)
+{
+  size_t i;
+  for (i = 0; i < proxy->streamcount; i++) {
+    if (proxy->streams[i].streamid == streamid)
+      return &proxy->streams[i];
+  }
+  return NULL;
+}
+
+void check_request_header (void* callbackdata, const char* name, size_t namelen, const char* value, size_t valuelen)
+{
+  struct check_stream* stream = (struct check_stream*)callbackdata;
+  if (namelen == 7 && memcmp(name, ":method", 7) == 0) {
+    snprintf(stream->method, sizeof(stream->method), "%.*s", (int)valuelen, value);
+  } else if (namelen == 10 && memcmp(name, ":authority", 10) == 0) {
+    snprintf(stream->authority, sizeof(stream->authority), "%.*s", (int)valuelen, value);
+  } else if ((namelen == 7 && memcmp(name, ":scheme", 7) == 0) || (namelen == 5 && memcmp(name, ":path", 5) == 0)) {
+    stream->badheader = 1;
+  }
+}
+
+//answer a CONNECT request, the first response is split over a padded HEADERS frame with priority and a CONTINUATION frame
+int check_respond (struct check_proxy* proxy, struct check_stream* stream)
+{
+  uint8_t payload[64];
+  size_t split = sizeof(check_first_response) / 2;
+  if (proxy->responses == 0) {
+    payload[0] = 4;
+    memset(payload + 1, 0, 5);
+    memcpy(payload + 6, check_first_response, split);
+    memset(payload + 6 + split, 0, 4);
+    if (check_queue_frame(proxy, HTTP2_FRAME_HEADERS, HTTP2_FLAG_PADDED | HTTP2_FLAG_PRIORITY, stream->streamid, payload, 6 + split + 4) != 0)
+      return -1;
+    if (check_queue_frame(proxy, HTTP2_FRAME_CONTINUATION, HTTP2_FLAG_END_HEADERS, stream->streamid, check_first_response + split, sizeof(check_first_response) - split) != 0)
+      return -1;
+  } else if (proxy->responses < 3) {
+    if (check_queue_frame(proxy, HTTP2_FRAME_HEADERS, HTTP2_FLAG_END_HEADERS, stream->streamid, check_indexed_response, sizeof(check_indexed_response)) != 0)
+      return -1;
+  } else if (proxy->responses == 3) {
+    if (check_queue_frame(proxy, HTTP2_FRAME_HEADERS, HTTP2_FLAG_END_HEADERS, stream->streamid, check_evicting_response, sizeof(check_evicting_response)) != 0)
+      return -1;
+  } else {
+    if (check_queue_frame(proxy, HTTP2_FRAME_HEADERS, HTTP2_FLAG_END_HEADERS, stream->streamid, check_last_response, sizeof(check_last_response)) != 0)
+      return -1;
+  }
+  proxy->responses++;
+  return 0;
+}
+
+int check_process_settings (struct check_proxy* proxy, const uint8_t* payload, size_t len)
+{
+  size_t i;
+  size_t j;
+  uint16_t id;
+  uint32_t value;
+  if (len % 6 != 0)
+    return check_fail(proxy, "SETTINGS frame of %lu bytes", (unsigned long)len);
+  for (i = 0; i < len; i += 6) {
+    id = ((uint16_t)payload[i] << 8) | payload[i + 1];
+    value = http2_read_uint32(payload + i + 2);
+    switch (id) {
+      case HTTP2_SETTINGS_ENABLE_PUSH :
+        if (value != 0)
+          return check_fail(proxy, "server push was not disabled");
+        break;
+      case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE :
+        for (j = 0; j < proxy->streamcount; j++)
+          proxy->streams[j].sendwindow += (int32_t)value - proxy->initialwindow;
+        proxy->initialwindow = (int32_t)value;
+        break;
+      case HTTP2_SETTINGS_MAX_FRAME_SIZE :
+        proxy->maxframesize = value;
+        break;
+    }
+  }
+  return check_queue_frame(proxy, HTTP2_FRAME_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+}
+
+int check_process_frame (struct check_proxy* proxy, uint8_t type, uint8_t flags, uint32_t streamid, const uint8_t* payload, size_t len)
+{
+  uint32_t value;
+  struct check_stream* stream;
+  switch (type) {
+    case HTTP2_FRAME_SETTINGS :
+      if (flags & HTTP2_FLAG_ACK) {
+        proxy->settingsacked = 1;
+        return 0;
+      }
+      return check_process_settings(proxy, payload, len);
+    case HTTP2_FRAME_PING :
+      if (len != 8)
+        return check_fail(proxy, "PING frame of %lu bytes", (unsigned long)len);
+      if (!(flags & HTTP2_FLAG_ACK))
+        return check_queue_frame(proxy, HTTP2_FRAME_PING, HTTP2_FLAG_ACK, 0, payload, 8);
+      if (memcmp(payload, CHECK_PING, 8) != 0)
+        return check_fail(proxy, "PING acknowledged with a different payload");
+      proxy->pingacked = 1;
+      return 0;
+    case HTTP2_FRAME_WINDOW_UPDATE :
+      if (len != 4 || (value = http2_read_uint32(payload) & 0x7FFFFFFF) == 0)
+        return check_fail(proxy, "invalid WINDOW_UPDATE frame");
+      proxy->updatesreceived++;
+      if (!streamid)
+        proxy->sendwindow += value;
+      else if ((stream = check_find_stream(proxy, streamid)) != NULL)
+        stream->sendwindow += value;
+      return 0;
+    case HTTP2_FRAME_HEADERS :
+      if (!(flags & HTTP2_FLAG_END_HEADERS) || (flags & (HTTP2_FLAG_PADDED | HTTP2_FLAG_PRIORITY)))
+        return check_fail(proxy, "unexpected HEADERS frame flags 0x%02X", (unsigned)flags);
+      if (!(streamid & 1) || streamid <= proxy->laststreamid)
+        return check_fail(proxy, "new stream %lu after stream %lu", (unsigned long)streamid, (unsigned long)proxy->laststreamid);
+      if (proxy->streamcount >= proxy->tunnels)
+        return check_fail(proxy, "more streams than tunnels");
+      proxy->laststreamid = streamid;
+      stream = &proxy->streams[proxy->streamcount++];
+      stream->streamid = streamid;
+      stream->sendwindow = proxy->initialwindow;
+      stream->recvwindow = CHECK_STREAM_WINDOW;
+      if (hpack_decode_block(&proxy->decoder, payload, len, check_request_header, stream) != 0)
+        return check_fail(proxy, "request headers of stream %lu can't be decoded", (unsigned long)streamid);
+      if (strcmp(stream->method, "CONNECT") != 0 || strcmp(stream->authority, CHECK_AUTHORITY) != 0 || stream->badheader)
+        return check_fail(proxy, "request on stream %lu is not a CONNECT to %s (method: %s, authority: %s)", (unsigned long)streamid, CHECK_AUTHORITY, stream->method, stream->authority);
+      return check_respond(proxy, stream);
+    case HTTP2_FRAME_DATA :
+      if ((stream = check_find_stream(proxy, streamid)) == NULL || stream->remoteclosed)
+        return check_fail(proxy, "DATA frame on stream %lu that is not open", (unsigned long)streamid);
+      //the library must never send more than the windows granted to it
+      stream->recvwindow -= (int32_t)len;
+      proxy->recvwindow -= (int32_t)len;
+      if (stream->recvwindow < 0 || proxy->recvwindow < 0)
+        return check_fail(proxy, "flow control window exceeded on stream %lu (stream: %li, connection: %li)", (unsigned long)streamid, (long)stream->recvwindow, (long)proxy->recvwindow);
+      if (len > 0 && http2_buffer_append(&stream->echo, payload, len) != 0)
+        return check_fail(proxy, "Memory allocation error");
+      stream->received += len;
+      if (flags & HTTP2_FLAG_END_STREAM)
+        stream->remoteclosed = 1;
+      //grant the windows back when half of them were used
+      if (!stream->remoteclosed && stream->recvwindow <= CHECK_STREAM_WINDOW / 2) {
+        if (check_queue_window_update(proxy, streamid, CHECK_STREAM_WINDOW - stream->recvwindow) != 0)
+          return -1;
+        stream->recvwindow = CHECK_STREAM_WINDOW;
+      }
+      if (proxy->recvwindow <= HTTP2_DEFAULT_WINDOW / 2) {
+        if (check_queue_window_update(proxy, 0, HTTP2_DEFAULT_WINDOW - proxy->recvwindow) != 0)
+          return -1;
+        proxy->recvwindow = HTTP2_DEFAULT_WINDOW;
+      }
+      return 0;
+    case HTTP2_FRAME_CONTINUATION :
+      return check_fail(proxy, "unexpected CONTINUATION frame");
+    case HTTP2_FRAME_RST_STREAM :
+      return check_fail(proxy, "stream %lu was reset", (unsigned long)streamid);
+    case HTTP2_FRAME_GOAWAY :
+      return check_fail(proxy, "connection was closed with GOAWAY (error %lu)", (unsigned long)(len >= 8 ? http2_read_uint32(payload + 4) : 0));
+    default :
+      return 0;
+  }
+}
+
+//echo data as far as the windows of the library allow, padding every other frame
+int check_send_data (struct check_proxy* proxy)
+{
+  size_t i;
+  size_t len;
+  size_t padding;
+  size_t window;
+  uint8_t* p;
+  struct check_stream* stream;
+  for (i = 0; i < proxy->streamcount; i++) {
+    stream = &proxy->streams[i];
+    while (stream->echo.pos < stream->echo.len && stream->sendwindow > 0 && proxy->sendwindow > 0) {
+      window = (size_t)(stream->sendwindow < proxy->sendwindow ? stream->sendwindow : proxy->sendwindow);
+      if (window > proxy->maxframesize)
+        window = proxy->maxframesize;
+      padding = ((proxy->dataframes++ % 2) && window > CHECK_PADDING + 1 ? CHECK_PADDING + 1 : 0);
+      len = stream->echo.len - stream->echo.pos;
+      if (len > window - padding)
+        len = window - padding;
+      if ((p = http2_buffer_reserve(&proxy->output, 9 + len + padding)) == NULL)
+        return check_fail(proxy, "Memory allocation error");
+      http2_write_frame_header(p, len + padding, HTTP2_FRAME_DATA, (padding ? HTTP2_FLAG_PADDED : 0), stream->streamid);
+      if (padding) {
+        p[9] = CHECK_PADDING;
+        memset(p + 10 + len, 0, CHECK_PADDING);
+      }
+      memcpy(p + 9 + (padding ? 1 : 0), stream->echo.data + stream->echo.pos, len);
+      proxy->output.len += 9 + len + padding;
+      stream->echo.pos += len;
+      stream->sendwindow -= (int32_t)(len + padding);
+      proxy->sendwindow -= (int32_t)(len + padding);
+    }
+    //end the stream once all data was echoed
+    if (stream->remoteclosed && !stream->localclosed && stream->echo.pos == stream->echo.len) {
+      if (check_queue_frame(proxy, HTTP2_FRAME_DATA, HTTP2_FLAG_END_STREAM, stream->streamid, NULL, 0) != 0)
+        return -1;
+      stream->localclosed = 1;
+      proxy->finished++;
+    }
+  }
+  return 0;
+}
+
+int check_flush (struct check_proxy* proxy)
+{
+  ssize_t n;
+  while (proxy->output.pos < proxy->output.len) {
+    if ((n = send(proxy->sock, proxy->output.data + proxy->output.pos, proxy->output.len - proxy->output.pos, MSG_NOSIGNAL)) <= 0)
+      return check_fail(proxy, "sending to the library failed: %s", strerror(errno));
+    proxy->output.pos += n;
+  }
+  proxy->output.pos = proxy->output.len = 0;
+  return 0;
+}
+
+//accept the connection of the library and serve its tunnels until all of them ended
+int check_proxy_serve (struct check_proxy* proxy)
+{
+  ssize_t n;
+  size_t len;
+  uint8_t settings[12];
+  const uint8_t* p;
+  struct pollfd pollinfo;
+  pollinfo.fd = proxy->listener;
+  pollinfo.events = POLLIN;
+  if (poll(&pollinfo, 1, CHECK_TIMEOUT) <= 0 || (proxy->sock = accept(proxy->listener, NULL, NULL)) == INVALID_SOCKET)
+    return check_fail(proxy, "no connection from the library");
+  //small stream windows, followed by a ping to be acknowledged
+  settings[0] = 0;
+  settings[1] = HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  http2_write_uint32(settings + 2, CHECK_MAX_STREAMS);
+  settings[6] = 0;
+  settings[7] = HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+  http2_write_uint32(settings + 8, CHECK_STREAM_WINDOW);
+  if (check_queue_frame(proxy, HTTP2_FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) != 0 || check_queue_frame(proxy, HTTP2_FRAME_PING, 0, 0, CHECK_PING, 8) != 0)
+    return -1;
+  while (proxy->finished < proxy->tunnels) {
+    if (check_send_data(proxy) != 0 || check_flush(proxy) != 0)
+      return -1;
+    if (proxy->finished == proxy->tunnels)
+      break;
+    pollinfo.fd = proxy->sock;
+    pollinfo.events = POLLIN;
+    if (poll(&pollinfo, 1, CHECK_TIMEOUT) <= 0)
+      return check_fail(proxy, "no data from the library for %i ms (%lu of %lu streams ended)", CHECK_TIMEOUT, (unsigned long)proxy->finished, (unsigned long)proxy->tunnels);
+    if (http2_buffer_reserve(&proxy->input, 65536) == NULL)
+      return check_fail(proxy, "Memory allocation error");
+    if ((n = recv(proxy->sock, proxy->input.data + proxy->input.len, proxy->input.size - proxy->input.len, 0)) <= 0)
+      return check_fail(proxy, "connection closed by the library");
+    proxy->input.len += n;
+    //the connection starts with the client preface
+    if (!proxy->preface) {
+      if (proxy->input.len - proxy->input.pos < 24)
+        continue;
+      if (memcmp(proxy->input.data + proxy->input.pos, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24) != 0)
+        return check_fail(proxy, "invalid connection preface");
+      proxy->input.pos += 24;
+      proxy->preface = 1;
+    }
+    while (proxy->input.len - proxy->input.pos >= 9) {
+      p = proxy->input.data + proxy->input.pos;
+      len = ((size_t)p[0] << 16) | ((size_t)p[1] << 8) | p[2];
+      if (len > HTTP2_MAX_FRAME_SIZE)
+        return check_fail(proxy, "frame of %lu bytes exceeds the maximum frame size", (unsigned long)len);
+      if (proxy->input.len - proxy->input.pos < 9 + len)
+        break;
+      if (check_process_frame(proxy, p[3], p[4], http2_read_uint32(p + 5) & 0x7FFFFFFF, p + 9, len) != 0)
+        return -1;
+      proxy->input.pos += 9 + len;
+    }
+  }
+  if (!proxy->settingsacked || !proxy->pingacked)
+    return check_fail(proxy, "SETTINGS or PING frame was not acknowledged");
+  return 0;
+}
+
+void* check_proxy_thread (void* arg)
+{
+  struct check_proxy* proxy = (struct check_proxy*)arg;
+  if (check_proxy_serve(proxy) != 0 && proxy->sock != INVALID_SOCKET) {
+    //let the library notice the failure instead of waiting for data
+    closesocket(proxy->sock);
+    proxy->sock = INVALID_SOCKET;
+  }
+  return NULL;
+}
+
+//send data through all tunnels at the same time and check it comes back unchanged, returns zero on success
+int check_tunnels (SOCKET* socks, size_t tunnels, uint64_t bytes)
+{
+  size_t i;
+  size_t len;
+  ssize_t n;
+  uint8_t buf[16384];
+  uint64_t* sent;
+  uint64_t* received;
+  struct pollfd* pollinfo;
+  size_t done = 0;
+  int result = 0;
+  sent = (uint64_t*)calloc(tunnels, sizeof(uint64_t));
+  received = (uint64_t*)calloc(tunnels, sizeof(uint64_t));
+  pollinfo = (struct pollfd*)calloc(tunnels, sizeof(struct pollfd));
+  if (!sent || !received || !pollinfo) {
+    fprintf(stderr, "Memory allocation error\n");
+    result = -1;
+  }
+  for (i = 0; i < tunnels && result == 0; i++) {
+    socket_set_nonblocking(socks[i], 1);
+    pollinfo[i].fd = socks[i];
+  }
+  while (done < tunnels && result == 0) {
+    for (i = 0; i < tunnels; i++)
+      pollinfo[i].events = (pollinfo[i].fd < 0 ? 0 : POLLIN | (sent[i] < bytes ? POLLOUT : 0));
+    if (poll(pollinfo, tunnels, CHECK_TIMEOUT) <= 0) {
+      fprintf(stderr, "Tunnels stalled for %i ms\n", CHECK_TIMEOUT);
+      result = -1;
+      break;
+    }
+    for (i = 0; i < tunnels && result == 0; i++) {
+      if (pollinfo[i].revents & POLLOUT) {
+        for (len = 0; len < sizeof(buf) && sent[i] + len < bytes; len++)
+          buf[len] = check_pattern(i, sent[i] + len);
+        if ((n = send(socks[i], buf, len, MSG_NOSIGNAL)) > 0)
+          sent[i] += n;
+        if (sent[i] == bytes)
+          shutdown(socks[i], SHUT_WR);
+      }
+      if (pollinfo[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+        if ((n = recv(socks[i], buf, sizeof(buf), 0)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          continue;
+        if (n <= 0) {
+          //the tunnel must end only after all data came back
+          if (received[i] != bytes) {
+            fprintf(stderr, "Tunnel %lu ended after %lu of %lu bytes\n", (unsigned long)i, (unsigned long)received[i], (unsigned long)bytes);
+            result = -1;
+          }
+          pollinfo[i].fd = -1;
+          done++;
+          continue;
+        }
+        for (len = 0; len < (size_t)n; len++) {
+          if (received[i] + len >= bytes || buf[len] != check_pattern(i, received[i] + len)) {
+            fprintf(stderr, "Tunnel %lu returned wrong data at offset %lu\n", (unsigned long)i, (unsigned long)(received[i] + len));
+            result = -1;
+            break;
+          }
+        }
+        received[i] += n;
+      }
+    }
+  }
+  free(sent);
+  free(received);
+  free(pollinfo);
+  return result;
+}
+
+//connect the tunnels with plain system calls, made in a process running under the LD_PRELOAD library (-c)
+int check_preloaded_client (size_t tunnels, uint64_t bytes)
+{
+  size_t j;
+  SOCKET* socks;
+  struct addrinfo hints;
+  struct addrinfo* res;
+  int result = 0;
+  if ((socks = (SOCKET*)malloc(tunnels * sizeof(SOCKET))) == NULL)
+    return 2;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  for (j = 0; j < tunnels && result == 0; j++) {
+    if (getaddrinfo(CHECK_DESTINATION, "443", &hints, &res) != 0) {
+      fprintf(stderr, "Looking up %s failed (PROXYSOCKET_PROXY_DNS not in effect?)\n", CHECK_DESTINATION);
+      tunnels = j;
+      result = 3;
+      break;
+    }
+    if ((socks[j] = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET || connect(socks[j], res->ai_addr, res->ai_addrlen) != 0) {
+      fprintf(stderr, "Tunnel %lu failed: %s\n", (unsigned long)j, strerror(errno));
+      if (socks[j] != INVALID_SOCKET)
+        closesocket(socks[j]);
+      tunnels = j;
+      result = 3;
+    }
+    freeaddrinfo(res);
+  }
+  if (result == 0 && check_tunnels(socks, tunnels, bytes) != 0)
+    result = 3;
+  for (j = 0; j < tunnels; j++)
+    closesocket(socks[j]);
+  free(socks);
+  return result;
+}
+
+//run this program with -c under the LD_PRELOAD library, configured to use the stand-in proxy by host name with proxy DNS,
+//so connections and lookups of the relay thread would be caught by the library itself if it didn't recognize them
+int check_run_preloaded (const char* program, const char* preloadlib, uint16_t port, size_t tunnels, uint64_t bytes)
+{
+  int status;
+  pid_t pid;
+  char hostname[256];
+  char chain[300];
+  char tunnelsarg[32];
+  char bytesarg[32];
+  if (gethostname(hostname, sizeof(hostname)) != 0 || get_ipv4_address(hostname) == INADDR_NONE) {
+    fprintf(stderr, "The host name of this system can't be resolved, using localhost\n");
+    strcpy(hostname, "localhost");
+  }
+  snprintf(chain, sizeof(chain), "http2://%s:%u", hostname, (unsigned)port);
+  snprintf(tunnelsarg, sizeof(tunnelsarg), "%lu", (unsigned long)tunnels);
+  snprintf(bytesarg, sizeof(bytesarg), "%lu", (unsigned long)bytes);
+  if ((pid = fork()) == -1)
+    return 2;
+  if (pid == 0) {
+    setenv("LD_PRELOAD", preloadlib, 1);
+    setenv("PROXYSOCKET_CHAIN", chain, 1);
+    setenv("PROXYSOCKET_PROXY_DNS", "1", 1);
+    setenv("PROXYSOCKET_TIMEOUT", "5000", 1);
+    execlp(program, program, "-c", "-n", tunnelsarg, "-b", bytesarg, (char*)NULL);
+    fprintf(stderr, "Error running %s: %s\n", program, strerror(errno));
+    _exit(2);
+  }
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+    return 3;
+  return WEXITSTATUS(status);
+}
+
+int main (int argc, char* argv[])
+{
+  int i;
+  size_t j;
+  size_t tunnels = DEFAULT_TUNNELS;
+  uint64_t bytes = DEFAULT_BYTES;
+  const char* preloadlib = NULL;
+  int preloadedclient = 0;
+  char url[64];
+  char* errmsg;
+  uint64_t start;
+  SOCKET* socks;
+  pthread_t thread;
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  struct check_proxy* checkproxy;
+  proxysocketconfig proxy = NULL;
+  int result = 0;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      tunnels = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      bytes = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      preloadlib = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0) {
+      preloadedclient = 1;
+    } else {
+      tunnels = 0;
+      break;
+    }
+  }
+  if (tunnels == 0 || tunnels > CHECK_MAX_STREAMS || bytes == 0) {
+    printf(
+      "Usage:  http2_check [-n tunnels] [-b bytes] [-p preloadlib]\n"
+      "Parameters:\n"
+      "  -n tunnels          number of tunnels on the HTTP/2 connection (default: %i, maximum: %i)\n"
+      "  -b bytes            data echoed through each tunnel (default: %i)\n"
+      "  -p preloadlib       make the tunnels with connect() in a process running under the LD_PRELOAD library\n"
+      "                      (e.g. ./libproxysocket_preload.so) instead of with proxysocket_connect()\n", DEFAULT_TUNNELS, CHECK_MAX_STREAMS, DEFAULT_BYTES);
+    return 1;
+  }
+  if (preloadedclient)
+    return check_preloaded_client(tunnels, bytes);
+  if ((checkproxy = (struct check_proxy*)calloc(1, sizeof(struct check_proxy))) == NULL || (socks = (SOCKET*)malloc(tunnels * sizeof(SOCKET))) == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    return 2;
+  }
+  //stand-in proxy on a loopback port chosen by the system
+  checkproxy->sock = INVALID_SOCKET;
+  checkproxy->tunnels = tunnels;
+  checkproxy->initialwindow = HTTP2_DEFAULT_WINDOW;
+  checkproxy->sendwindow = HTTP2_DEFAULT_WINDOW;
+  checkproxy->recvwindow = HTTP2_DEFAULT_WINDOW;
+  checkproxy->maxframesize = HTTP2_MAX_FRAME_SIZE;
+  checkproxy->decoder.maxsize = HTTP2_HEADER_TABLE_SIZE;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((checkproxy->listener = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET || bind(checkproxy->listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(checkproxy->listener, 4) != 0 || getsockname(checkproxy->listener, (struct sockaddr*)&addr, &addrlen) != 0) {
+    fprintf(stderr, "Error listening on a loopback port: %s\n", strerror(errno));
+    return 2;
+  }
+  if (pthread_create(&thread, NULL, check_proxy_thread, checkproxy) != 0) {
+    fprintf(stderr, "Error starting the stand-in proxy\n");
+    return 2;
+  }
+  start = get_milliseconds();
+  if (preloadlib) {
+    if (check_run_preloaded(argv[0], preloadlib, ntohs(addr.sin_port), tunnels, bytes) != 0)
+      result = 3;
+    //a stand-in still waiting for a connection gives up after its timeout
+    tunnels = 0;
+  } else {
+    //all tunnels share a single connection to the proxy
+    snprintf(url, sizeof(url), "http2://127.0.0.1:%u", (unsigned)ntohs(addr.sin_port));
+    proxysocket_initialize();
+    if ((proxy = proxysocketconfig_create_direct()) == NULL || proxysocketconfig_add_proxy_url(proxy, url) != 0 || proxysocketconfig_set_http2_connections(proxy, 1) != 0) {
+      fprintf(stderr, "Error setting up proxy %s\n", url);
+      return 2;
+    }
+    proxysocketconfig_use_proxy_dns(proxy, 1);
+    proxysocketconfig_set_timeout(proxy, CHECK_TIMEOUT, CHECK_TIMEOUT);
+    for (j = 0; j < tunnels && result == 0; j++) {
+      errmsg = NULL;
+      if ((socks[j] = proxysocket_connect(proxy, CHECK_DESTINATION, CHECK_DESTINATION_PORT, &errmsg)) == INVALID_SOCKET) {
+        fprintf(stderr, "Tunnel %lu failed: %s\n", (unsigned long)j, (errmsg ? errmsg : "unknown error"));
+        free(errmsg);
+        tunnels = j;
+        result = 3;
+      }
+    }
+    if (result == 0 && check_tunnels(socks, tunnels, bytes) != 0)
+      result = 3;
+  }
+  for (j = 0; j < tunnels; j++)
+    closesocket(socks[j]);
+  //a stand-in still waiting for data gives up when the library closes the connection
+  if (proxy)
+    proxysocketconfig_free(proxy);
+  pthread_join(thread, NULL);
+  tunnels = checkproxy->tunnels;
+  if (checkproxy->error[0]) {
+    fprintf(stderr, "Stand-in proxy: %s\n", checkproxy->error);
+    result = 3;
+  } else if (result == 0 && bytes >= HTTP2_STREAM_WINDOW && (checkproxy->updatesreceived == 0 || checkproxy->updatessent == 0)) {
+    //enough data to use up the stream windows on both sides must have led to window updates
+    fprintf(stderr, "No window updates were sent (%lu) or received (%lu) by the proxy\n", (unsigned long)checkproxy->updatessent, (unsigned long)checkproxy->updatesreceived);
+    result = 3;
+  }
+  if (result == 0)
+    printf("%lu tunnels echoed %lu bytes each in %lu ms (window updates: %lu sent, %lu received by the proxy)\n", (unsigned long)tunnels, (unsigned long)bytes, (unsigned long)(get_milliseconds() - start), (unsigned long)checkproxy->updatessent, (unsigned long)checkproxy->updatesreceived);
+  if (checkproxy->sock != INVALID_SOCKET)
+    closesocket(checkproxy->sock);
+  closesocket(checkproxy->listener);
+  for (j = 0; j < checkproxy->streamcount; j++)
+    http2_buffer_free(&checkproxy->streams[j].echo);
+  http2_buffer_free(&checkproxy->input);
+  http2_buffer_free(&checkproxy->output);
+  hpack_decoder_free(&checkproxy->decoder);
+  free(checkproxy);
+  free(socks);
+  return result;
+}
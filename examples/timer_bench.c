@@ -0,0 +1,168 @@
+//microbenchmark for the timer wheel used by the event loops of the library
+//reports nanoseconds per timer for starting, moving, cancelling and expiring large numbers of timers, and checks no timer expires early or late
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+//include the library itself to reach the timer wheel
+#include "proxysocket.c"
+
+#define DEFAULT_TIMERS 1000000
+#define DEFAULT_SPREAD 600000           //timers expire up to this many milliseconds ahead
+#define BENCH_START_TIME 1000000        //arbitrary start time of the wheel (not aligned to any level)
+
+uint64_t get_nanoseconds ()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//pseudo random numbers (xorshift) so runs are repeatable
+uint32_t bench_random (uint64_t* state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return (uint32_t)(*state >> 32);
+}
+
+void bench_print (const char* name, uint64_t nanoseconds, size_t operations)
+{
+  printf("%-24s %10.1f ns/op\n", name, (double)nanoseconds / (operations ? operations : 1));
+}
+
+//start all timers, returns nanoseconds taken
+uint64_t bench_add (struct timer_wheel* wheel, struct timer_entry* entries, size_t count, uint32_t spread, uint64_t* seed)
+{
+  size_t i;
+  uint64_t start = get_nanoseconds();
+  for (i = 0; i < count; i++)
+    timer_add(wheel, &entries[i], wheel->now + 1 + bench_random(seed) % spread);
+  return get_nanoseconds() - start;
+}
+
+//advance the wheel by step milliseconds at a time like an event loop would until all timers expired,
+//returns nanoseconds taken (including steps without expired timers) or 0 if a timer expired early or late
+uint64_t bench_expire (struct timer_wheel* wheel, size_t count, uint32_t step)
+{
+  size_t expired = 0;
+  uint64_t now = wheel->now;
+  uint64_t previous;
+  uint64_t nanoseconds = 0;
+  uint64_t start;
+  struct timer_entry* entry;
+  while (wheel->count > 0) {
+    previous = now;
+    now += step;
+    start = get_nanoseconds();
+    timer_wheel_advance(wheel, now);
+    while ((entry = timer_wheel_next_expired(wheel)) != NULL) {
+      if (entry->expires > now || entry->expires <= previous) {
+        fprintf(stderr, "Timer expiring at %lu expired at %lu\n", (unsigned long)entry->expires, (unsigned long)now);
+        return 0;
+      }
+      expired++;
+    }
+    nanoseconds += get_nanoseconds() - start;
+  }
+  if (expired != count) {
+    fprintf(stderr, "Only %lu of %lu timers expired\n", (unsigned long)expired, (unsigned long)count);
+    return 0;
+  }
+  return nanoseconds;
+}
+
+int main (int argc, char* argv[])
+{
+  int i;
+  size_t j;
+  size_t count = DEFAULT_TIMERS;
+  uint32_t spread = DEFAULT_SPREAD;
+  uint64_t seed = 88172645463325252ULL;
+  uint64_t start;
+  uint64_t nanoseconds;
+  struct timer_wheel* wheel;
+  struct timer_entry* entries;
+  //process command line arguments
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      count = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      spread = strtoul(argv[++i], NULL, 10);
+    } else {
+      count = 0;
+      break;
+    }
+  }
+  if (count == 0 || spread == 0) {
+    printf(
+      "Usage:  timer_bench [-n timers] [-t milliseconds]\n"
+      "Parameters:\n"
+      "  -n timers           number of timers (default: %i)\n"
+      "  -t milliseconds     timers expire randomly up to this far ahead (default: %i)\n", DEFAULT_TIMERS, DEFAULT_SPREAD);
+    return 1;
+  }
+  if ((wheel = (struct timer_wheel*)malloc(sizeof(struct timer_wheel))) == NULL || (entries = (struct timer_entry*)malloc(count * sizeof(struct timer_entry))) == NULL) {
+    fprintf(stderr, "Memory allocation error\n");
+    return 2;
+  }
+  timer_wheel_init(wheel, BENCH_START_TIME);
+  for (j = 0; j < count; j++)
+    timer_entry_init(&entries[j], NULL);
+  printf("%lu timers expiring up to %lu ms ahead\n", (unsigned long)count, (unsigned long)spread);
+  //start and cancel (like deadlines of handshakes that complete in time)
+  bench_print("add", bench_add(wheel, entries, count, spread, &seed), count);
+  start = get_nanoseconds();
+  for (j = 0; j < count; j++)
+    timer_add(wheel, &entries[j], wheel->now + 1 + bench_random(&seed) % spread);
+  bench_print("move", get_nanoseconds() - start, count);
+  start = get_nanoseconds();
+  for (j = 0; j < count; j++)
+    timer_cancel(wheel, &entries[(j * 7919) % count]);
+  bench_print("cancel", get_nanoseconds() - start, count);
+  if (wheel->count != 0) {
+    fprintf(stderr, "%lu timers left after cancelling all of them\n", (unsigned long)wheel->count);
+    return 3;
+  }
+  //let all timers expire (like idle timeouts), one millisecond and one second at a time
+  bench_add(wheel, entries, count, spread, &seed);
+  if ((nanoseconds = bench_expire(wheel, count, 1)) == 0)
+    return 3;
+  bench_print("expire (1 ms steps)", nanoseconds, count);
+  bench_add(wheel, entries, count, spread, &seed);
+  if ((nanoseconds = bench_expire(wheel, count, 1000)) == 0)
+    return 3;
+  bench_print("expire (1 s steps)", nanoseconds, count);
+  //an idle wheel should cost nearly nothing per loop iteration
+  timer_add(wheel, &entries[0], wheel->now + spread);
+  start = get_nanoseconds();
+  for (j = 0; j < count; j++) {
+    timer_wheel_advance(wheel, wheel->now + (j % 2));
+    timer_wheel_timeout(wheel);
+  }
+  bench_print("advance without expiry", get_nanoseconds() - start, count);
+  timer_cancel(wheel, &entries[0]);
+  free(entries);
+  free(wheel);
+  return 0;
+}
@@ -1,23 +1,46 @@
 #define _GNU_SOURCE     //fix warning about vasprintf
+#if defined(__WIN32__) && (!defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600)
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600     //needed for WSAPoll
+#endif
 #include "proxysocket.h"
 #ifdef __WIN32__
-//#include <ws2tcpip.h>
+#include <ws2tcpip.h>
+#define poll WSAPoll
+#define SHUT_WR SD_SEND
 #else
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #ifndef SOCKET_ERROR
 #define SOCKET_ERROR -1
 #endif
+#define closesocket close
 #endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 #ifdef _MSC_VER
 #define va_copy(dst,src) ((dst) = (src))
 #endif
@@ -31,6 +54,73 @@
 #define HAVE_ASPRINTF 1
 #endif
 
+//atomic operations (using GCC/Clang builtins)
+#define ATOMIC_LOAD(ptr)          __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(ptr, val)    __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_EXCHANGE(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(ptr, val)      __atomic_add_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_SUB(ptr, val)      __atomic_sub_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_OR(ptr, val)       __atomic_or_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_AND(ptr, val)      __atomic_and_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_COMPARE_EXCHANGE(ptr, expected, val) __atomic_compare_exchange_n(ptr, expected, val, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#ifdef _WIN32
+#define thread_yield() SwitchToThread()
+#else
+#define thread_yield() sched_yield()
+#endif
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+//USDT probes (provider "proxysocket") that tracers like bpftrace attach to in a running process (see tools/*.bt),
+//a probe is a single nop instruction plus a note telling where its arguments are, so arguments must be cheap to compute
+#if defined(HAVE_SDT)
+#include <sys/sdt.h>
+#define TRACE_PROBE2(name, a1, a2)              DTRACE_PROBE2(proxysocket, name, a1, a2)
+#define TRACE_PROBE3(name, a1, a2, a3)          DTRACE_PROBE3(proxysocket, name, a1, a2, a3)
+#define TRACE_PROBE4(name, a1, a2, a3, a4)      DTRACE_PROBE4(proxysocket, name, a1, a2, a3, a4)
+#define TRACE_PROBE5(name, a1, a2, a3, a4, a5)  DTRACE_PROBE5(proxysocket, name, a1, a2, a3, a4, a5)
+#elif defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) && defined(__GNUC__) && !defined(NO_USDT)
+//without sys/sdt.h the same note is emitted here (all arguments are passed as signed 64-bit values)
+#define TRACE_PROBE_(name, argformat, ...) \
+  __asm__ __volatile__ ( \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"proxysocket\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" argformat "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n" \
+    : : __VA_ARGS__)
+#define TRACE_ARG(a) "nor"((int64_t)(a))
+#define TRACE_PROBE2(name, a1, a2)              TRACE_PROBE_(name, "-8@%0 -8@%1", TRACE_ARG(a1), TRACE_ARG(a2))
+#define TRACE_PROBE3(name, a1, a2, a3)          TRACE_PROBE_(name, "-8@%0 -8@%1 -8@%2", TRACE_ARG(a1), TRACE_ARG(a2), TRACE_ARG(a3))
+#define TRACE_PROBE4(name, a1, a2, a3, a4)      TRACE_PROBE_(name, "-8@%0 -8@%1 -8@%2 -8@%3", TRACE_ARG(a1), TRACE_ARG(a2), TRACE_ARG(a3), TRACE_ARG(a4))
+#define TRACE_PROBE5(name, a1, a2, a3, a4, a5)  TRACE_PROBE_(name, "-8@%0 -8@%1 -8@%2 -8@%3 -8@%4", TRACE_ARG(a1), TRACE_ARG(a2), TRACE_ARG(a3), TRACE_ARG(a4), TRACE_ARG(a5))
+#else
+#define TRACE_PROBE2(name, a1, a2)
+#define TRACE_PROBE3(name, a1, a2, a3)
+#define TRACE_PROBE4(name, a1, a2, a3, a4)
+#define TRACE_PROBE5(name, a1, a2, a3, a4, a5)
+#endif
+
 #define PROXYSOCKET_VERSION_STRINGIZE_(major, minor, micro) #major"."#minor"."#micro
 #define PROXYSOCKET_VERSION_STRINGIZE(major, minor, micro) PROXYSOCKET_VERSION_STRINGIZE_(major, minor, micro)
 
@@ -41,11 +131,69 @@
 
 struct proxysocketconfig_struct {
   struct proxyinfo_struct* proxyinfolist;
+  struct proxyinfo_block_struct* proxyinfoblocks;
   proxysocketconfig_log_fn log_function;
   void* log_data;
   int8_t proxy_dns;
+  int8_t frozen;
+  int8_t fastopen;
+  uint32_t refcount;
   uint32_t sendtimeout;
   uint32_t recvtimeout;
+  uint32_t adaptivemin;                 //shortest adaptive timeout of a handshake step in milliseconds
+  uint32_t adaptivemax;                 //longest adaptive timeout of a handshake step in milliseconds (0 if adaptive timeouts are not used)
+  int32_t socketoptions[2][PROXYSOCKET_SOCKOPT_COUNT];
+  struct proxysocket_source_struct* sources;
+  uint32_t sourcecount;
+  uint32_t sourcenext;
+  uint16_t sourcefirstport;
+  uint16_t sourcelastport;
+  uint32_t sourcepartitions;
+  uint32_t http2connections;
+  char* tlscafile;
+  struct bind_pool* bindpool;           //BIND sessions armed in advance (NULL if not used)
+  struct proxysocket_shared_struct* shared;     //state shared between processes (NULL if not used)
+  struct resolver_cache_struct* dnscache;       //recently resolved host names when no shared state is used (NULL until needed, protected by dnscachelock)
+  int dnscachelock;
+  int8_t groupselection;                //how a proxy is selected from a group (one of the PROXYSOCKET_GROUP_SELECT_* values)
+  uint32_t groupmaxload;                //percentage of the average load a proxy of a group may take (0 for no limit)
+  uint32_t groupnext;                   //counter used for round robin selection
+};
+
+//local address used for direct connections
+struct proxysocket_source_struct {
+  uint32_t addr;
+  struct proxysocket_source_stats stats;
+};
+
+//statistics and health of a proxy (kept in a shared memory region when one is used)
+struct proxyinfo_state {
+  struct proxysocket_proxy_stats stats;
+  uint32_t latency;                     //moving average of the time taken by the hop of the proxy in microseconds (0 if not measured yet)
+  uint32_t rtobackoff;                  //number of times the retransmission timeout was doubled since the last round trip time was measured
+  uint64_t lastfailure;                 //time of the last failure (monotonic milliseconds)
+  uint64_t rtt;                         //smoothed round trip time (low 32 bits) and its mean deviation (high 32 bits) in microseconds of handshake steps through the proxy (0 if not measured yet)
+};
+
+//connections recently made through a proxy selected from a group (counted per window of GROUP_LOAD_WINDOW milliseconds)
+struct proxyinfo_load {
+  uint32_t window;                      //number of the current window
+  uint32_t current;                     //connections in the current window
+  uint32_t previous;                    //connections in the window before it
+};
+
+//what is learned and counted while a proxy is used (kept apart from the entry so the entries of frozen proxy information are never written)
+struct proxyinfo_runtime {
+  struct proxyinfo_state* state;        //points to localstate or to an entry in a shared memory region
+  struct proxyinfo_state localstate;
+  struct proxysocket_proxy_capabilities capabilities; //behavior learned from connections or loaded from a capability cache
+  struct proxyinfo_load load;           //connections made through the proxy when it is part of a group (protected by lock)
+  struct proxyinfo_auth_struct* auth;   //authentication details learned from a web proxy (protected by lock)
+  struct http2_pool* http2pool;         //shared connections to an HTTP/2 proxy (protected by lock)
+  struct tls_proxy* tlsproxy;           //TLS context and session cache of an HTTPS proxy (protected by lock)
+  struct proxyinfo_limits* limits;      //connection rate and concurrency limits (NULL if not limited)
+  struct bandwidth_limits* bandwidth;   //bandwidth limits shared by all tunnels through the proxy (NULL if not limited)
+  int lock;
 };
 
 struct proxyinfo_struct {
@@ -54,9 +202,140 @@ struct proxyinfo_struct {
   uint16_t proxyport;
   char* proxyuser;
   char* proxypass;
+  int8_t flags;
+  struct proxyinfo_runtime* runtime;    //allocated together with the entry (or its block)
   struct proxyinfo_struct* next;
 };
 
+#define PROXYINFO_FLAG_IN_BLOCK 0x01
+#define PROXYINFO_FLAG_GROUP    0x02    //the proxy is used instead of the entry added before it (the next one in the list), not after it
+
+#define HTTP_AUTH_NONE                  0
+#define HTTP_AUTH_BASIC                 1
+#define HTTP_AUTH_DIGEST                2
+
+//authentication scheme required by a web proxy as learned from its challenge (allocated together with its strings)
+struct proxyinfo_auth_struct {
+  int8_t scheme;                        //one of the HTTP_AUTH_* values
+  int8_t qop;                           //digest: quality of protection "auth" is used
+  int8_t sess;                          //digest: MD5-sess algorithm is used
+  int8_t stale;                         //digest: the challenge was sent because the previous nonce expired
+  uint32_t nc;                          //digest: number of requests sent with this nonce
+  char* realm;
+  char* nonce;
+  char* opaque;
+};
+
+#define HTTP2_DEFAULT_CONNECTIONS       4
+
+//shared connections to an HTTP/2 proxy (freed when the proxy information and all its sessions are gone)
+struct http2_pool {
+  int lock;                             //protects sessions
+  uint32_t refcount;
+  int8_t released;                      //the proxy information was freed
+  SOCKET wakeup[2];                     //socket pair whose writing end is closed when the proxy information is freed
+  size_t maxsessions;
+  struct http2_session** sessions;
+  size_t sessioncount;
+};
+
+#define LIMITS_CHECK_INTERVAL           10      //milliseconds between checks of a queue that is only waiting for handshakes to finish
+#define LIMITS_DEFAULT_RETRY_AFTER      1000    //milliseconds no handshakes are admitted after a proxy answered 429 without Retry-After
+#define LIMITS_MAX_RETRY_AFTER          60000   //longest pause taken from Retry-After
+
+//place of a handshake in the queue of a proxy with connection limits
+struct proxyinfo_limits_waiter {
+  struct proxyinfo_limits_waiter* next;
+  int8_t admitted;                      //set when the handshake was given a place
+};
+
+//connection limits of a proxy with the handshakes waiting for them (freed with the last proxy information using them)
+struct proxyinfo_limits {
+  uint32_t refcount;                    //proxy information using the limits (it is carried over when it is replaced)
+  int lock;                             //protects everything below
+  uint32_t rate;                        //new connections per second (0 for no rate limit)
+  uint32_t burst;                       //maximum number of tokens
+  uint32_t maxhandshakes;               //maximum number of handshakes in progress (0 for no limit)
+  uint32_t maxwait;                     //maximum time in milliseconds to wait in the queue (0 to wait indefinitely)
+  uint64_t tokens;                      //available connections in thousandths
+  uint64_t refilled;                    //time tokens were last added (0 if not used yet)
+  uint64_t pauseduntil;                 //no handshakes are admitted before this time (after the proxy asked to slow down)
+  uint32_t handshakes;                  //handshakes in progress
+  uint32_t queuelength;
+  struct proxyinfo_limits_waiter* first;        //waiting handshakes in FIFO order
+  struct proxyinfo_limits_waiter** last;
+};
+
+#define BANDWIDTH_SEND                  0
+#define BANDWIDTH_RECV                  1
+#define BANDWIDTH_BURST_MILLISECONDS    100     //default burst size in time at the configured rate
+#define BANDWIDTH_MIN_BURST             16384
+
+//token bucket limiting the bandwidth in one direction
+struct bandwidth_bucket {
+  int lock;                             //protects refilled
+  uint64_t rate;                        //bytes per second (0 for no limit)
+  int64_t burst;                        //maximum number of tokens
+  int64_t tokens;                       //bytes that can be transferred (negative when overdrawn, only changed with atomic operations)
+  uint64_t refilled;                    //time tokens were last added
+};
+
+//bandwidth limits of a tunnel or of all tunnels through a proxy (freed with the tunnel or the proxy information)
+struct bandwidth_limits {
+  struct bandwidth_bucket direction[2]; //indexed by BANDWIDTH_SEND and BANDWIDTH_RECV
+};
+
+#define TLS_SESSION_CACHE_SIZE          8
+
+#ifdef HAVE_OPENSSL
+//TLS state shared by all connections to an HTTPS proxy (freed when the proxy information and the relay thread are gone)
+struct tls_proxy {
+  int lock;                             //protects sessions, newtunnels and running
+  uint32_t refcount;
+  SSL_CTX* ctx;
+  SSL_SESSION* sessions[TLS_SESSION_CACHE_SIZE];        //resumable sessions (most recent last)
+  int sessioncount;
+  int8_t running;                       //the relay thread is running
+  SOCKET wakeup[2];                     //socket pair used to wake up the relay thread
+  struct tls_tunnel** newtunnels;
+  size_t newcount;
+  size_t newalloc;
+  uint32_t handshakes;
+  uint32_t resumptions;
+  uint32_t earlydata;
+};
+#endif
+
+#define TLS_FAILURE_REASON_SIZE         128
+
+//outcome of the TLS handshake of a tunnel, shared by the relay thread and the handshake using the tunnel (freed by the last one to let go)
+struct tls_tunnel_result {
+  uint32_t refcount;
+  int failed;                           //set (after reason) when the TLS handshake failed
+  char reason[TLS_FAILURE_REASON_SIZE];
+};
+
+//BIND sessions armed in advance so a listening address on the proxy is available right away (freed with the proxy information)
+struct bind_pool {
+  int lock;                             //protects sessions and count
+  char* peerhost;                       //host incoming connections are expected from (NULL for any)
+  uint16_t peerport;
+  uint32_t size;                        //number of sessions to keep armed
+  uint32_t maxidle;                     //milliseconds after which an armed session is discarded (0 for no limit)
+  struct proxysocket_bind_struct* sessions;     //armed sessions (most recent first)
+  uint32_t count;
+};
+
+//contiguous allocation holding many proxy entries and their (interned) strings
+struct proxyinfo_block_struct {
+  struct proxyinfo_block_struct* next;
+  size_t count;
+  struct proxyinfo_struct* entries;
+  struct proxyinfo_runtime* runtimes;   //runtime state of the entries (kept apart so the entries are only read)
+  char* strings;
+  size_t stringslen;
+};
+
 #ifndef HAVE_VASPRINTF
 int vasprintf (char** strp, const char* fmt, va_list ap)
 {
@@ -115,17 +394,21 @@ static const char* memory_allocation_error = "Memory allocation error";
 uint32_t get_ipv4_address (const char* hostname)
 {
   uint32_t addr;
-  struct hostent* hostdata;
+  struct addrinfo hints;
+  struct addrinfo* result;
   if (!hostname || !*hostname)
     return INADDR_NONE;
   //check if host is dotted IP address
   if ((addr = inet_addr(hostname)) != INADDR_NONE)
     return addr;
-  //look up hostname (this will block), note: gethostbyname() is not thread-safe
-  if ((hostdata = gethostbyname(hostname)) != NULL)
-    memcpy(&addr, hostdata->h_addr_list[0], sizeof(addr));
-  else
-    addr = INADDR_NONE;
+  //look up hostname (this will block)
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(hostname, NULL, &hints, &result) != 0)
+    return INADDR_NONE;
+  addr = (result && result->ai_addr ? ((struct sockaddr_in*)result->ai_addr)->sin_addr.s_addr : INADDR_NONE);
+  freeaddrinfo(result);
   return addr;
 }
 
@@ -149,17 +432,17 @@ char* make_base64_string (const char* str)
   base64_table[63] = '/';
   //encode data
   while (!done) {
-    char igroup[3];
+    unsigned char igroup[3];
     int n;
 
-    //read input
+    //read input (unsigned so characters above 0x7F don't index before the table)
     igroup[0] = igroup[1] = igroup[2] = 0;
     for (n = 0; n < 3; n++) {
       if (!*src) {
         done++;
         break;
       }
-      igroup[n] = *src++;
+      igroup[n] = (unsigned char)*src++;
     }
     //code
     if (n > 0) {
@@ -173,49 +456,124 @@ char* make_base64_string (const char* str)
   return buf;
 }
 
-int send_http_request (SOCKET sock, const char* request, char** response)
+/* * * MD5 message digest (RFC 1321, needed for HTTP digest authentication) * * */
+
+struct md5_context {
+  uint32_t state[4];
+  uint64_t length;
+  uint8_t block[64];
+};
+
+static const uint32_t md5_sines[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint8_t md5_shifts[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+void md5_init (struct md5_context* ctx)
 {
-  char* responseline;
-  int responselinelen;
-  int responselen = 0;
-  int resultcode = -1;
-  char* p;
-  if (response)
-    *response = NULL;
-  //send request
-  if (request) {
-    if (send(sock, request, strlen(request), 0) == -1)
-      return -1;
-  }
-  //get result code
-  if ((responseline = socket_receiveline(sock)) == NULL)
-    return -1;
-  if (strncasecmp(responseline, "HTTP/", 5) != 0)
-    return -1;
-  p = responseline + 5;
-  while (*p && (isdigit(*p) || *p == '.'))
-    p++;
-  if (!*p || *p++ != ' ')
-    return -1;
-  if ((resultcode = strtol(p, &p, 10)) == 0)
-    return -1;
-  //get entire response header
-  while (responseline && *responseline) {
-    if (response) {
-      responselinelen = strlen(responseline);
-      *response = (char*)realloc(*response, responselen + responselinelen + 2);
-      memcpy(*response + responselen, responseline, responselinelen);
-      responselen += responselinelen;
-      (*response)[responselen++] = '\n';
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  ctx->length = 0;
+}
+
+void md5_transform (struct md5_context* ctx)
+{
+  int i;
+  uint32_t f;
+  uint32_t g;
+  uint32_t m[16];
+  uint32_t a = ctx->state[0];
+  uint32_t b = ctx->state[1];
+  uint32_t c = ctx->state[2];
+  uint32_t d = ctx->state[3];
+  for (i = 0; i < 16; i++)
+    m[i] = (uint32_t)ctx->block[i * 4] | ((uint32_t)ctx->block[i * 4 + 1] << 8) | ((uint32_t)ctx->block[i * 4 + 2] << 16) | ((uint32_t)ctx->block[i * 4 + 3] << 24);
+  for (i = 0; i < 64; i++) {
+    switch (i / 16) {
+      case 0 :
+        f = (b & c) | (~b & d);
+        g = i;
+        break;
+      case 1 :
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+        break;
+      case 2 :
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+        break;
+      default :
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+        break;
     }
-    free(responseline);
-    responseline = socket_receiveline(sock);
+    f += a + md5_sines[i] + m[g];
+    a = d;
+    d = c;
+    c = b;
+    b += (f << md5_shifts[(i / 16) * 4 + i % 4]) | (f >> (32 - md5_shifts[(i / 16) * 4 + i % 4]));
+  }
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+}
+
+void md5_update (struct md5_context* ctx, const void* data, size_t datalen)
+{
+  const uint8_t* p = (const uint8_t*)data;
+  while (datalen-- > 0) {
+    ctx->block[ctx->length++ % 64] = *p++;
+    if (ctx->length % 64 == 0)
+      md5_transform(ctx);
+  }
+}
+
+//finish the digest and store it as a hexadecimal string of 32 characters
+void md5_final_hex (struct md5_context* ctx, char* hex)
+{
+  int i;
+  uint8_t lengthbytes[8];
+  uint64_t bits = ctx->length * 8;
+  static const char hexdigits[] = "0123456789abcdef";
+  for (i = 0; i < 8; i++)
+    lengthbytes[i] = (uint8_t)(bits >> (i * 8));
+  md5_update(ctx, "\x80", 1);
+  while (ctx->length % 64 != 56)
+    md5_update(ctx, "", 1);
+  md5_update(ctx, lengthbytes, 8);
+  for (i = 0; i < 16; i++) {
+    hex[i * 2] = hexdigits[(ctx->state[i / 4] >> ((i % 4) * 8 + 4)) & 0x0F];
+    hex[i * 2 + 1] = hexdigits[(ctx->state[i / 4] >> ((i % 4) * 8)) & 0x0F];
+  }
+  hex[32] = 0;
+}
+
+//calculate the MD5 digest of strings joined with colons (as used by HTTP digest authentication), list ends with NULL
+void md5_hex_joined (char* hex, const char* first, ...)
+{
+  va_list ap;
+  const char* s;
+  struct md5_context ctx;
+  md5_init(&ctx);
+  md5_update(&ctx, first, strlen(first));
+  va_start(ap, first);
+  while ((s = va_arg(ap, const char*)) != NULL) {
+    md5_update(&ctx, ":", 1);
+    md5_update(&ctx, s, strlen(s));
   }
-  if (responseline)
-    free(responseline);
-  if (response)
-    (*response)[responselen] = 0;
-  return resultcode;
+  va_end(ap);
+  md5_final_hex(&ctx, hex);
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -225,7 +583,7 @@ int send_http_request (SOCKET sock, const char* request, char** response)
 #define SOCKS4_VERSION   0x04
 
 #define SOCKS4_COMMAND_CONNECT   0x01
-//#define SOCKS4_COMMAND_BIND      0x02
+#define SOCKS4_COMMAND_BIND      0x02
 
 #define SOCKS4_STATUS_SUCCESS                    90
 #define SOCKS4_STATUS_FAILED                     91
@@ -241,6 +599,7 @@ struct __attribute__((packed, aligned(1))) socks4_connect_request {
   uint32_t dst_addr;
   uint8_t userid[1];
 };
+#pragma pack()
 
 /* * * definitions needed for SOCKS5 proxy client * * */
 
@@ -252,7 +611,8 @@ struct __attribute__((packed, aligned(1))) socks4_connect_request {
 #define SOCKS5_METHOD_NONE   0xFF
 
 #define SOCKS5_COMMAND_CONNECT   0x01
-//#define SOCKS5_COMMAND_BIND      0x02
+#define SOCKS5_COMMAND_BIND      0x02
+#define SOCKS5_COMMAND_UDP_ASSOCIATE 0x03
 
 #define SOCKS5_ADDRESSTYPE_IPV4        0x01
 #define SOCKS5_ADDRESSTYPE_DOMAINNAME  0x03
@@ -278,6 +638,7 @@ struct __attribute__((packed, aligned(1))) socks5_connect_request_ipv4 {
   uint32_t dst_addr;
   uint16_t dst_port;
 };
+#pragma pack()
 
 void write_log_info (proxysocketconfig proxy, int level, const char* fmt, ...)
 {
@@ -300,12 +661,191 @@ void write_log_info (proxysocketconfig proxy, int level, const char* fmt, ...)
   }
 }
 
+//simple spin lock (only held for short operations)
+void spin_lock (int* lock)
+{
+  while (ATOMIC_EXCHANGE(lock, 1) != 0)
+    thread_yield();
+}
+
+void spin_unlock (int* lock)
+{
+  ATOMIC_STORE(lock, 0);
+}
+
+//resolver cache shared by handshakes started together, also used to keep recently resolved host names with the proxy information
+struct resolver_cache_entry {
+  char* hostname;
+  uint32_t addr;
+  uint64_t expires;                     //time the host name must be resolved again (monotonic milliseconds, only used for the cache of the proxy information)
+};
+
+struct resolver_cache_struct {
+  struct resolver_cache_entry* entries;
+  size_t count;
+  size_t mask;
+};
+
+struct resolver_cache_struct* resolver_cache_create (size_t maxcount)
+{
+  size_t size = 16;
+  struct resolver_cache_struct* cache;
+  while (size < maxcount * 2)
+    size <<= 1;
+  if ((cache = (struct resolver_cache_struct*)malloc(sizeof(struct resolver_cache_struct))) == NULL)
+    return NULL;
+  if ((cache->entries = (struct resolver_cache_entry*)calloc(size, sizeof(struct resolver_cache_entry))) == NULL) {
+    free(cache);
+    return NULL;
+  }
+  cache->count = 0;
+  cache->mask = size - 1;
+  return cache;
+}
+
+void resolver_cache_free (struct resolver_cache_struct* cache)
+{
+  size_t i;
+  if (cache) {
+    for (i = 0; i <= cache->mask; i++)
+      free(cache->entries[i].hostname);
+    free(cache->entries);
+    free(cache);
+  }
+}
+
+//find the entry of a host name in the cache or the free entry where it belongs
+struct resolver_cache_entry* resolver_cache_find (struct resolver_cache_struct* cache, const char* hostname)
+{
+  size_t i;
+  const char* p;
+  uint32_t hash = 2166136261U;
+  for (p = hostname; *p; p++)
+    hash = (hash ^ (uint8_t)tolower((unsigned char)*p)) * 16777619U;
+  for (i = hash & cache->mask; cache->entries[i].hostname; i = (i + 1) & cache->mask) {
+    if (strcasecmp(cache->entries[i].hostname, hostname) == 0)
+      break;
+  }
+  return &cache->entries[i];
+}
+
+//get the entry of a host name in the cache, adding it if needed (NULL if the cache is full)
+struct resolver_cache_entry* resolver_cache_add (struct resolver_cache_struct* cache, const char* hostname)
+{
+  struct resolver_cache_entry* entry;
+  if ((entry = resolver_cache_find(cache, hostname))->hostname)
+    return entry;
+  if ((cache->count + 1) * 2 > cache->mask + 1 || (entry->hostname = strdup(hostname)) == NULL)
+    return NULL;
+  entry->addr = INADDR_NONE;
+  entry->expires = 0;
+  cache->count++;
+  return entry;
+}
+
+void http2_pool_unref (struct http2_pool* pool)
+{
+  if (ATOMIC_SUB(&pool->refcount, 1) == 0) {
+    closesocket(pool->wakeup[0]);
+    free(pool->sessions);
+    free(pool);
+  }
+}
+
+//sessions end when their last tunnel is closed after the pool is released
+void http2_pool_release (struct http2_pool* pool)
+{
+  if (!pool)
+    return;
+  ATOMIC_STORE(&pool->released, 1);
+  closesocket(pool->wakeup[1]);
+  http2_pool_unref(pool);
+}
+
+void tls_proxy_ref (struct tls_proxy* tls)
+{
+#ifdef HAVE_OPENSSL
+  if (tls)
+    ATOMIC_ADD(&tls->refcount, 1);
+#else
+  (void)tls;
+#endif
+}
+
+void tls_proxy_unref (struct tls_proxy* tls)
+{
+#ifdef HAVE_OPENSSL
+  int i;
+  if (!tls || ATOMIC_SUB(&tls->refcount, 1) != 0)
+    return;
+  for (i = 0; i < tls->sessioncount; i++)
+    SSL_SESSION_free(tls->sessions[i]);
+  SSL_CTX_free(tls->ctx);
+  closesocket(tls->wakeup[0]);
+  closesocket(tls->wakeup[1]);
+  free(tls->newtunnels);
+  free(tls);
+#else
+  (void)tls;
+#endif
+}
+
+void tls_tunnel_result_unref (struct tls_tunnel_result* result)
+{
+  if (result && ATOMIC_SUB(&result->refcount, 1) == 0)
+    free(result);
+}
+
+void limits_unref (struct proxyinfo_limits* limits)
+{
+  if (limits && ATOMIC_SUB(&limits->refcount, 1) == 0)
+    free(limits);
+}
+
+//set up the runtime state of a new proxy entry
+void proxyinfo_runtime_init (struct proxyinfo_runtime* runtime)
+{
+  memset(&runtime->localstate, 0, sizeof(runtime->localstate));
+  runtime->state = &runtime->localstate;
+  memset(&runtime->capabilities, 0, sizeof(runtime->capabilities));
+  memset(&runtime->load, 0, sizeof(runtime->load));
+  runtime->auth = NULL;
+  runtime->http2pool = NULL;
+  runtime->tlsproxy = NULL;
+  runtime->limits = NULL;
+  runtime->bandwidth = NULL;
+  runtime->lock = 0;
+}
+
+//take over the runtime state of another entry (leaving it nothing that must be freed)
+void proxyinfo_runtime_move (struct proxyinfo_runtime* runtime, struct proxyinfo_runtime* from)
+{
+  *runtime = *from;
+  runtime->state = (from->state == &from->localstate ? &runtime->localstate : from->state);
+  runtime->lock = 0;
+  from->auth = NULL;
+  from->http2pool = NULL;
+  from->tlsproxy = NULL;
+  from->limits = NULL;
+  from->bandwidth = NULL;
+}
+
 void proxyinfolist_free (struct proxyinfo_struct* proxyinfo)
 {
   struct proxyinfo_struct* next;
   struct proxyinfo_struct* current = proxyinfo;
   while (current) {
     next = current->next;
+    free(current->runtime->auth);
+    http2_pool_release(current->runtime->http2pool);
+    tls_proxy_unref(current->runtime->tlsproxy);
+    limits_unref(current->runtime->limits);
+    free(current->runtime->bandwidth);
+    //entries from a bulk loaded block are released together with the block
+    if (current->flags & PROXYINFO_FLAG_IN_BLOCK) {
+      current = next;
+      continue;
+    }
     if (current->proxyhost)
       free(current->proxyhost);
     if (current->proxyuser)
@@ -343,6 +883,10 @@ DLL_EXPORT_PROXYSOCKET const char* proxysocketconfig_get_type_name (int proxytyp
       return "SOCKS5";
     case PROXYSOCKET_TYPE_WEB_CONNECT:
       return "WEB";
+    case PROXYSOCKET_TYPE_WEB_CONNECT_TLS:
+      return "HTTPS";
+    case PROXYSOCKET_TYPE_WEB_CONNECT_H2:
+      return "HTTP2";
     default:
       return "INVALID";
   }
@@ -358,6 +902,10 @@ DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_name_type (const char* proxytyp
     return PROXYSOCKET_TYPE_SOCKS5;
   if (strcasecmp(proxytypename, "WEB") == 0 || strcasecmp(proxytypename, "HTTP") == 0)
     return PROXYSOCKET_TYPE_WEB_CONNECT;
+  if (strcasecmp(proxytypename, "HTTPS") == 0)
+    return PROXYSOCKET_TYPE_WEB_CONNECT_TLS;
+  if (strcasecmp(proxytypename, "HTTP2") == 0 || strcasecmp(proxytypename, "H2") == 0)
+    return PROXYSOCKET_TYPE_WEB_CONNECT_H2;
   return PROXYSOCKET_TYPE_INVALID;
 }
 
@@ -376,17 +924,53 @@ DLL_EXPORT_PROXYSOCKET int proxysocket_initialize ()
   return 0;
 }
 
+//called at the start of threads started by the library
+static proxysocket_thread_start_fn thread_start_hook = NULL;
+static void* thread_start_hook_data = NULL;
+
+DLL_EXPORT_PROXYSOCKET void proxysocket_set_thread_start_hook (proxysocket_thread_start_fn hook_fn, void* userdata)
+{
+  thread_start_hook_data = userdata;
+  thread_start_hook = hook_fn;
+}
+
 DLL_EXPORT_PROXYSOCKET proxysocketconfig proxysocketconfig_create_direct ()
 {
+  int i;
   struct proxysocketconfig_struct* proxy;
   if ((proxy = (struct proxysocketconfig_struct*)malloc(sizeof(struct proxysocketconfig_struct))) == NULL)
     return NULL;
   proxy->proxyinfolist = NULL;
+  proxy->proxyinfoblocks = NULL;
   proxy->log_function = NULL;
   proxy->log_data = NULL;
   proxy->proxy_dns = USE_CLIENT_DNS;
+  proxy->frozen = 0;
+  proxy->fastopen = 0;
+  proxy->refcount = 1;
   proxy->sendtimeout = 0;
   proxy->recvtimeout = 0;
+  proxy->adaptivemin = 0;
+  proxy->adaptivemax = 0;
+  proxy->sources = NULL;
+  proxy->sourcecount = 0;
+  proxy->sourcenext = 0;
+  proxy->sourcefirstport = 0;
+  proxy->sourcelastport = 0;
+  proxy->sourcepartitions = 0;
+  proxy->http2connections = HTTP2_DEFAULT_CONNECTIONS;
+  proxy->tlscafile = NULL;
+  proxy->bindpool = NULL;
+  proxy->shared = NULL;
+  proxy->dnscache = NULL;
+  proxy->dnscachelock = 0;
+  proxy->groupselection = PROXYSOCKET_GROUP_SELECT_ROUND_ROBIN;
+  proxy->groupmaxload = 0;
+  proxy->groupnext = 0;
+  for (i = 0; i < PROXYSOCKET_SOCKOPT_COUNT; i++) {
+    proxy->socketoptions[PROXYSOCKET_PHASE_HANDSHAKE][i] = -1;
+    proxy->socketoptions[PROXYSOCKET_PHASE_DATA][i] = -1;
+  }
   if (proxysocketconfig_add_proxy(proxy, PROXYSOCKET_TYPE_NONE, NULL, 0, NULL, NULL) != 0) {
     free(proxy);
     return NULL;
@@ -407,51 +991,70 @@ DLL_EXPORT_PROXYSOCKET proxysocketconfig proxysocketconfig_create (int proxytype
 
 DLL_EXPORT_PROXYSOCKET int proxysocketconfig_add_proxy (proxysocketconfig proxy, int proxytype, const char* proxyhost, uint16_t proxyport, const char* proxyuser, const char* proxypass)
 {
+  struct proxyinfo_struct* next;
+  //frozen proxy information can't be modified
+  if (!proxy || proxy->frozen)
+    return -1;
   //determine next entry (clean up and remove if a direct connection is inserted before)
-  struct proxyinfo_struct* next = proxy->proxyinfolist;
+  next = proxy->proxyinfolist;
   if (proxytype == PROXYSOCKET_TYPE_NONE && next) {
     proxyinfolist_free(next);
     next = NULL;
   }
-  //insert new proxy in front of the list
-  if (!proxy || (proxy->proxyinfolist = (struct proxyinfo_struct*)malloc(sizeof(struct proxyinfo_struct))) == NULL)
+  //insert new proxy in front of the list (with its runtime state right behind it)
+  if (!proxy || (proxy->proxyinfolist = (struct proxyinfo_struct*)malloc(sizeof(struct proxyinfo_struct) + sizeof(struct proxyinfo_runtime))) == NULL)
     return -1;
   proxy->proxyinfolist->proxytype = proxytype;
   proxy->proxyinfolist->proxyhost = (proxyhost ? strdup(proxyhost) : NULL);
   proxy->proxyinfolist->proxyport = proxyport;
   proxy->proxyinfolist->proxyuser = (proxyuser ? strdup(proxyuser) : NULL);
   proxy->proxyinfolist->proxypass = (proxypass ? strdup(proxypass) : NULL);
+  proxy->proxyinfolist->flags = 0;
+  proxy->proxyinfolist->runtime = (struct proxyinfo_runtime*)(proxy->proxyinfolist + 1);
+  proxyinfo_runtime_init(proxy->proxyinfolist->runtime);
   proxy->proxyinfolist->next = next;
   return 0;
 }
 
 char* proxysocketconfig_get_description_entry (proxysocketconfig proxy, struct proxyinfo_struct* proxyinfo, char* desc, int desclen)
 {
-  if (!proxy || !proxyinfo)
+  if (!proxy)
     return desc;
-  if (proxyinfo != proxy->proxyinfolist)
-    desclen = appendsprintf(&desc, desclen, " -> ");
-  switch (proxyinfo->proxytype) {
-    case PROXYSOCKET_TYPE_NONE :
-      desclen = appendsprintf(&desc, desclen, "direct connection");
-      break;
-    case PROXYSOCKET_TYPE_SOCKS4 :
-      desclen = appendsprintf(&desc, desclen, "SOCKS4 proxy: %s:%u (%s%s)", proxyinfo->proxyhost, (unsigned int)proxyinfo->proxyport, (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "no authentication" : "user: "), (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "" : proxyinfo->proxyuser));
-      break;
-    case PROXYSOCKET_TYPE_SOCKS5 :
-      desclen = appendsprintf(&desc, desclen, "SOCKS5 proxy: %s:%u (%s%s)", proxyinfo->proxyhost, (unsigned int)proxyinfo->proxyport, (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "no authentication" : "user: "), (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "" : proxyinfo->proxyuser));
-      break;
-    case PROXYSOCKET_TYPE_WEB_CONNECT :
-      desclen = appendsprintf(&desc, desclen, "web proxy: %s:%u (%s%s)", proxyinfo->proxyhost, (unsigned int)proxyinfo->proxyport, (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "no authentication" : "user: "), (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "" : proxyinfo->proxyuser));
-      break;
-    //case PROXYSOCKET_TYPE_INVALID :
-    default :
-      desclen = appendsprintf(&desc, desclen, "INVALID");
+  struct proxyinfo_struct* previous = NULL;
+  //walk the list iteratively (proxy lists can contain many entries)
+  while (proxyinfo) {
+    if (previous)
+      desclen = appendsprintf(&desc, desclen, (previous->flags & PROXYINFO_FLAG_GROUP ? " | " : " -> "));
+    switch (proxyinfo->proxytype) {
+      case PROXYSOCKET_TYPE_NONE :
+        desclen = appendsprintf(&desc, desclen, "direct connection");
+        break;
+      case PROXYSOCKET_TYPE_SOCKS4 :
+        desclen = appendsprintf(&desc, desclen, "SOCKS4 proxy: %s:%u (%s%s)", proxyinfo->proxyhost, (unsigned int)proxyinfo->proxyport, (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "no authentication" : "user: "), (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "" : proxyinfo->proxyuser));
+        break;
+      case PROXYSOCKET_TYPE_SOCKS5 :
+        desclen = appendsprintf(&desc, desclen, "SOCKS5 proxy: %s:%u (%s%s)", proxyinfo->proxyhost, (unsigned int)proxyinfo->proxyport, (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "no authentication" : "user: "), (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "" : proxyinfo->proxyuser));
+        break;
+      case PROXYSOCKET_TYPE_WEB_CONNECT :
+        desclen = appendsprintf(&desc, desclen, "web proxy: %s:%u (%s%s)", proxyinfo->proxyhost, (unsigned int)proxyinfo->proxyport, (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "no authentication" : "user: "), (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "" : proxyinfo->proxyuser));
+        break;
+      case PROXYSOCKET_TYPE_WEB_CONNECT_TLS :
+        desclen = appendsprintf(&desc, desclen, "HTTPS proxy: %s:%u (%s%s)", proxyinfo->proxyhost, (unsigned int)proxyinfo->proxyport, (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "no authentication" : "user: "), (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "" : proxyinfo->proxyuser));
+        break;
+      case PROXYSOCKET_TYPE_WEB_CONNECT_H2 :
+        desclen = appendsprintf(&desc, desclen, "HTTP/2 proxy: %s:%u (%s%s)", proxyinfo->proxyhost, (unsigned int)proxyinfo->proxyport, (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "no authentication" : "user: "), (!proxyinfo->proxyuser || !*proxyinfo->proxyuser ? "" : proxyinfo->proxyuser));
+        break;
+      //case PROXYSOCKET_TYPE_INVALID :
+      default :
+        desclen = appendsprintf(&desc, desclen, "INVALID");
+        break;
+    }
+    if (!proxyinfo->next || proxyinfo->next->proxytype == PROXYSOCKET_TYPE_NONE)
       break;
+    previous = proxyinfo;
+    proxyinfo = proxyinfo->next;
   }
-  if (!proxyinfo->next || proxyinfo->next->proxytype == PROXYSOCKET_TYPE_NONE)
-    return desc;
-  return proxysocketconfig_get_description_entry(proxy, proxyinfo->next, desc, desclen);
+  return desc;
 }
 
 DLL_EXPORT_PROXYSOCKET char* proxysocketconfig_get_description (proxysocketconfig proxy)
@@ -467,443 +1070,8332 @@ DLL_EXPORT_PROXYSOCKET char* proxysocketconfig_get_description (proxysocketconfi
 
 DLL_EXPORT_PROXYSOCKET void proxysocketconfig_set_logging (proxysocketconfig proxy, proxysocketconfig_log_fn log_fn, void* userdata)
 {
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change logging of frozen proxy information");
+    return;
+  }
   proxy->log_function = log_fn;
   proxy->log_data = userdata;
 }
 
 DLL_EXPORT_PROXYSOCKET void proxysocketconfig_set_timeout (proxysocketconfig proxy, uint32_t sendtimeout, uint32_t recvtimeout)
 {
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change timeouts of frozen proxy information");
+    return;
+  }
   proxy->sendtimeout = sendtimeout;
   proxy->recvtimeout = recvtimeout;
 }
 
-DLL_EXPORT_PROXYSOCKET void proxysocketconfig_use_proxy_dns (proxysocketconfig proxy, int proxy_dns)
+DLL_EXPORT_PROXYSOCKET void proxysocketconfig_set_adaptive_timeout (proxysocketconfig proxy, uint32_t minimum, uint32_t maximum)
 {
-  proxy->proxy_dns = (proxy_dns == 0 ? USE_CLIENT_DNS : USE_PROXY_DNS);
+  if (!proxy)
+    return;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change timeouts of frozen proxy information");
+    return;
+  }
+  proxy->adaptivemin = (minimum < maximum ? minimum : maximum);
+  proxy->adaptivemax = maximum;
 }
 
-DLL_EXPORT_PROXYSOCKET void proxysocketconfig_free (proxysocketconfig proxy)
+DLL_EXPORT_PROXYSOCKET void proxysocketconfig_use_proxy_dns (proxysocketconfig proxy, int proxy_dns)
 {
-  if (proxy) {
-    proxyinfolist_free(proxy->proxyinfolist);
-    free(proxy);
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change name resolution of frozen proxy information");
+    return;
   }
+  proxy->proxy_dns = (proxy_dns == 0 ? USE_CLIENT_DNS : USE_PROXY_DNS);
 }
 
-void log_and_keep_error_message (proxysocketconfig proxy, char** pmsg, const char* fmt, ...)
+DLL_EXPORT_PROXYSOCKET void proxysocketconfig_use_fastopen (proxysocketconfig proxy, int fastopen)
 {
-  if (fmt && (proxy->log_function || pmsg)) {
-    char* msg;
-    int msglen;
-    //generate message
-    va_list ap;
-    va_start(ap, fmt);
-    msglen = vasprintf(&msg, fmt, ap);
-    va_end(ap);
-    //log message
-    if (msglen >= 0) {
-      if (proxy->log_function)
-        proxy->log_function(PROXYSOCKET_LOG_ERROR, msg, proxy->log_data);
-      if (pmsg)
-        *pmsg = msg;
-      else
-        free(msg);
-    }
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change TCP Fast Open setting of frozen proxy information");
+    return;
   }
+  proxy->fastopen = (fastopen ? 1 : 0);
 }
 
-#define ERROR_DISCONNECT_AND_ABORT(...) \
-{ \
-  log_and_keep_error_message(proxy, errmsg, __VA_ARGS__); \
-  if (sock != INVALID_SOCKET) \
-    proxysocket_disconnect(proxy, sock); \
-  return INVALID_SOCKET; \
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_http2_connections (proxysocketconfig proxy, int connections)
+{
+  if (!proxy || connections < 0)
+    return -1;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change number of HTTP/2 proxy connections of frozen proxy information");
+    return -1;
+  }
+  proxy->http2connections = (connections > 0 ? connections : HTTP2_DEFAULT_CONNECTIONS);
+  return 0;
 }
 
-SOCKET proxyinfo_connect (proxysocketconfig proxy, struct proxyinfo_struct* proxyinfo, const char* dsthost, uint16_t dstport, char** errmsg)
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_tls_ca_file (proxysocketconfig proxy, const char* cafile)
 {
-  uint32_t hostaddr;
-  uint32_t proxyaddr;
-  SOCKET sock = INVALID_SOCKET;
-  if (!proxyinfo)
-    ERROR_DISCONNECT_AND_ABORT("Proxy connection information missing")
-  //resolve destination host if needed (when client DNS is used or for a direct connection)
-  if (proxy->proxy_dns == USE_CLIENT_DNS || proxyinfo->proxytype == PROXYSOCKET_TYPE_NONE) {
-    if ((hostaddr = get_ipv4_address(dsthost)) == INADDR_NONE)
-      ERROR_DISCONNECT_AND_ABORT("Error looking up host: %s", dsthost)
-    write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Resolved host %s to IP: %s", dsthost, inet_ntoa(*(struct in_addr*)&hostaddr));
-  } else {
-    hostaddr = INADDR_NONE;
-  }
-  //resolve proxy host address
-  proxyaddr = INADDR_NONE;
-  if (proxyinfo->proxyhost && *proxyinfo->proxyhost) {
-    if ((proxyaddr = get_ipv4_address(proxyinfo->proxyhost)) == INADDR_NONE)
-      ERROR_DISCONNECT_AND_ABORT("Error looking up proxy host: %s", proxyinfo->proxyhost)
-    write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Resolved proxy host %s to IP: %s", proxyinfo->proxyhost, inet_ntoa(*(struct in_addr*)&proxyaddr));
-  }
-  if (proxyaddr == INADDR_NONE && proxyinfo->proxytype != PROXYSOCKET_TYPE_NONE)
-    ERROR_DISCONNECT_AND_ABORT("Missing proxy host")
-  if (proxyinfo->proxytype == PROXYSOCKET_TYPE_NONE) {
-    /* * * DIRECT CONNECTION WITHOUT PROXY * * */
-    //create the socket
-    if ((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET)
-      ERROR_DISCONNECT_AND_ABORT("Error creating connection socket")
-/*
-    //set linger option
-    const struct linger option_linger = {~0, 3};   //linger 3 seconds when disconnecting
-    setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char*)&option_linger, sizeof(option_linger));
-*/
-    //bind the socket
-    if ((proxyaddr != INADDR_NONE && proxyaddr != INADDR_ANY) || proxyinfo->proxyport) {
-      struct sockaddr_in local_sock_addr;
-      local_sock_addr.sin_family = AF_INET;
-      local_sock_addr.sin_port = htons(proxyinfo->proxyport);
-      local_sock_addr.sin_addr.s_addr = (proxyaddr == INADDR_NONE ? INADDR_ANY : proxyaddr);
-      write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Binding to: %s:%lu", inet_ntoa(*(struct in_addr*)&local_sock_addr.sin_addr.s_addr), (unsigned long)ntohs(local_sock_addr.sin_port));
-      if (bind(sock, (struct sockaddr*)&local_sock_addr, sizeof(local_sock_addr)) != 0)
-        ERROR_DISCONNECT_AND_ABORT("Error binding socket to: %s:%lu", inet_ntoa(*(struct in_addr*)&local_sock_addr.sin_addr.s_addr), (unsigned long)ntohs(local_sock_addr.sin_port))
-    }
-    //set connection timeout
-    socket_set_timeouts_milliseconds(sock, proxy->sendtimeout, proxy->recvtimeout);
-    //connect to host
-    struct sockaddr_in remote_sock_addr;
-    remote_sock_addr.sin_family = AF_INET;
-    remote_sock_addr.sin_port = htons(dstport);
-    remote_sock_addr.sin_addr.s_addr = hostaddr;
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connecting to host: %s:%lu", inet_ntoa(*(struct in_addr*)&remote_sock_addr.sin_addr.s_addr), (unsigned long)dstport);
-    if (connect(sock, (struct sockaddr*)&remote_sock_addr, sizeof(remote_sock_addr)) == SOCKET_ERROR)
-      ERROR_DISCONNECT_AND_ABORT("Error connecting to host: %s:%lu", inet_ntoa(*(struct in_addr*)&hostaddr), (unsigned long)dstport)
-  } else if (proxyinfo->proxytype == PROXYSOCKET_TYPE_SOCKS4) {
-    /* * * CONNECTION USING SOCKS4 PROXY * * */
-    //connect to the SOCKS4 proxy server
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Preparing to connect to SOCKS4 proxy: %s:%lu", inet_ntoa(*(struct in_addr*)&proxyaddr), (unsigned long)proxyinfo->proxyport);
-    if ((sock = proxyinfo_connect(proxy, proxyinfo->next, proxyinfo->proxyhost, proxyinfo->proxyport, errmsg)) == INVALID_SOCKET)
-      //ERROR_DISCONNECT_AND_ABORT("Error connecting to SOCKS4 proxy: %s:%lu", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);/////
-      ERROR_DISCONNECT_AND_ABORT(NULL);
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connected to SOCKS4 proxy: %s:%lu", inet_ntoa(*(struct in_addr*)&proxyaddr), (unsigned long)proxyinfo->proxyport);
-    //send connect command
-    struct socks4_connect_request* request;
-    size_t requestlen = sizeof(struct socks4_connect_request);
-    if ((request = (struct socks4_connect_request*)malloc(requestlen)) == NULL)
-      ERROR_DISCONNECT_AND_ABORT(memory_allocation_error)
-    request->socks_version = SOCKS4_VERSION;
-    request->socks_command = SOCKS4_COMMAND_CONNECT;
-    request->dst_port = htons(dstport);
-    request->dst_addr = (proxy->proxy_dns == USE_CLIENT_DNS ? hostaddr : htonl(0x000000FF));
-    request->userid[0] = 0;
-    if (proxyinfo->proxyuser && *proxyinfo->proxyuser) {
-      requestlen += strlen(proxyinfo->proxyuser);
-      if ((request = (struct socks4_connect_request*)realloc(request, requestlen)) == NULL)
-        ERROR_DISCONNECT_AND_ABORT(memory_allocation_error)
-      strcpy((char*)&(request->userid), proxyinfo->proxyuser);
-    }
-    if (proxy->proxy_dns) {
-      size_t dsthostlen = (dsthost ? strlen(dsthost) : 0);
-      if ((request = (struct socks4_connect_request*)realloc(request, requestlen + dsthostlen + 1)) == NULL)
-        ERROR_DISCONNECT_AND_ABORT(memory_allocation_error)
-      strcpy(((char*)request) + requestlen, (dsthost ? dsthost : ""));
-      requestlen += dsthostlen + 1;
-    }
-    if (!(proxyinfo->proxyuser && *proxyinfo->proxyuser))
-      write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connecting to destination: %s:%lu", (proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : dsthost), (unsigned long)dstport);
-    else
-      write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connecting to destination: %s:%lu (user-id: %s)", (proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : dsthost), (unsigned long)dstport, proxyinfo->proxyuser);
-    if (send(sock, (void*)request, requestlen, 0) < requestlen)
-      ERROR_DISCONNECT_AND_ABORT("Error sending connect command to SOCKS4 proxy")
-    free(request);
-    //receive response
-    struct socks4_connect_request response;
-    if (recv(sock, (void*)&response, 8, 0) < 8)
-      ERROR_DISCONNECT_AND_ABORT("Connection lost while reading connect response from SOCKS4 proxy")
-    //display response information
-    if (response.socks_version != 0)
-      write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Invalid SOCKS4 reply code version (%u)", (unsigned int)response.socks_version);
-    switch (response.socks_command) {
-      case SOCKS4_STATUS_SUCCESS :
-        write_log_info(proxy, PROXYSOCKET_LOG_INFO, "SOCKS4 proxy connection established to: %s:%lu", inet_ntoa(*(struct in_addr*)&hostaddr), (unsigned long)dstport);
-        break;
-      case SOCKS4_STATUS_FAILED :
-        ERROR_DISCONNECT_AND_ABORT("SOCKS4 connection rejected or failed")
-      case SOCKS4_STATUS_IDENT_FAILED :
-        ERROR_DISCONNECT_AND_ABORT("SOCKS4 request rejected because SOCKS server cannot connect to identd on the client")
-      case SOCKS4_STATUS_IDENT_MISMATCH :
-        ERROR_DISCONNECT_AND_ABORT("SOCKS4 request rejected because the client program and identd report different user-ids")
-      default :
-        ERROR_DISCONNECT_AND_ABORT("Unsupported reply from SOCKS4 server (%u)", (unsigned int)response.socks_command)
-    }
-  } else if (proxyinfo->proxytype == PROXYSOCKET_TYPE_SOCKS5) {
-    /* * * CONNECTION USING SOCKS5 PROXY * * */
-    //connect to the SOCKS5 proxy server
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Preparing to connect to SOCKS5 proxy: %s:%lu", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);
-    if ((sock = proxyinfo_connect(proxy, proxyinfo->next, proxyinfo->proxyhost, proxyinfo->proxyport, errmsg)) == INVALID_SOCKET)
-      //ERROR_DISCONNECT_AND_ABORT("Error connecting to SOCKS5 proxy: %s:%lu", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);/////
-      ERROR_DISCONNECT_AND_ABORT(NULL);
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connected to SOCKS5 proxy: %s:%lu", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);
-    //send initial data
-    if (!(proxyinfo->proxyuser && *proxyinfo->proxyuser) && !(proxyinfo->proxypass && *proxyinfo->proxypass)) {
-      uint8_t initsend[] = {SOCKS5_VERSION, 1, SOCKS5_METHOD_NOAUTH};
-      if (send(sock, (void*)initsend, sizeof(initsend), 0) < sizeof(initsend))
-        ERROR_DISCONNECT_AND_ABORT("Error sending data to SOCKS5 proxy")
-    } else {
-      uint8_t initsend[] = {SOCKS5_VERSION, 2, SOCKS5_METHOD_LOGIN, SOCKS5_METHOD_NOAUTH};
-      if (send(sock, (void*)initsend, sizeof(initsend), 0) < sizeof(initsend))
-        ERROR_DISCONNECT_AND_ABORT("Error sending data to SOCKS5 proxy")
-    }
-    //receive initial data
-    uint8_t initrecv[2];
-    if (recv(sock, (void*)initrecv, sizeof(initrecv), 0) < sizeof(initrecv))
-      ERROR_DISCONNECT_AND_ABORT("Connection lost while reading data from SOCKS5 proxy")
-    //display response information
-    if (initrecv[0] != SOCKS5_VERSION)
-      write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "SOCKS5 proxy version mismatch (%u)", (unsigned int)initrecv[0]);
-    static const char* methodmsg = "SOCKS5 proxy authentication method: %s";
-    switch (initrecv[1]) {
-      case SOCKS5_METHOD_NOAUTH :
-        write_log_info(proxy, PROXYSOCKET_LOG_INFO, methodmsg, "no authentication required");
-        break;
-/*
-      case SOCKS5_METHOD_GSSAPI :
-        write_log_info(proxy, PROXYSOCKET_LOG_INFO, methodmsg, "GSSAPI");
-        break;
-*/
-      case SOCKS5_METHOD_LOGIN :
-        write_log_info(proxy, PROXYSOCKET_LOG_INFO, methodmsg, "username/password");
-        break;
-      case SOCKS5_METHOD_NONE :
-        write_log_info(proxy, PROXYSOCKET_LOG_ERROR, methodmsg, "no compatible methods");
-        ERROR_DISCONNECT_AND_ABORT("Unable to negociate SOCKS5 proxy authentication method")
-      default :
-        write_log_info(proxy, PROXYSOCKET_LOG_ERROR, methodmsg, "unknown (%u)", (unsigned int)initrecv[1]);
-        ERROR_DISCONNECT_AND_ABORT("Received unknown SOCKS5 proxy authentication method (%u)", (unsigned int)initrecv[1])
-    }
-    //authenticate if needed
-    if (initrecv[1] == SOCKS5_METHOD_LOGIN) {
-      char* authbuf;
-      size_t proxyuserlen = (proxyinfo->proxyuser ? strlen(proxyinfo->proxyuser) : 0);
-      size_t proxypasslen = (proxyinfo->proxypass ? strlen(proxyinfo->proxypass) : 0);
-      size_t authbuflen = 3 + proxyuserlen + proxypasslen;
-      if ((authbuf = (char*)malloc(authbuflen)) == NULL)
-        ERROR_DISCONNECT_AND_ABORT(memory_allocation_error)
-      authbuf[0] = 1;
-      authbuf[1] = proxyuserlen;
-      memcpy(authbuf + 2, proxyinfo->proxyuser, proxyuserlen);
-      authbuf[2 + proxyuserlen] = proxypasslen;
-      memcpy(authbuf + 3 + proxyuserlen, proxyinfo->proxypass, proxypasslen);
-      write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Sending authentication (login: %s)", (proxyinfo->proxyuser ? proxyinfo->proxyuser : NULL));
-      if (send(sock, (void*)authbuf, authbuflen, 0) < authbuflen) {
-        free(authbuf);
-        ERROR_DISCONNECT_AND_ABORT("Error sending authentication data to SOCKS5 proxy")
-      }
-      free(authbuf);
-      if (recv(sock, (void*)initrecv, sizeof(initrecv), 0) < sizeof(initrecv))
-        ERROR_DISCONNECT_AND_ABORT("Connection lost while reading authentication response from SOCKS5 proxy")
-      if (initrecv[0] != 1)
-        ERROR_DISCONNECT_AND_ABORT("SOCKS5 proxy subnegotiation version mismatch (%u)", (unsigned int)initrecv[0])
-      if (initrecv[1] == SOCKS5_STATUS_CONNECTION_REFUSED)
-        ERROR_DISCONNECT_AND_ABORT("SOCKS5 access denied")
-      if (initrecv[1] != 0)
-        ERROR_DISCONNECT_AND_ABORT("SOCKS5 authentication failed with status code %u (login: %s)", (unsigned int)initrecv[1], (proxyinfo->proxyuser ? proxyinfo->proxyuser : NULL))
-      /////TO DO: check and report status
-      //write_log_info(proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 authentication succeeded (login: %s)", (proxyinfo->proxyuser ? proxyinfo->proxyuser : NULL));
-    }
-    //send connect command
-    if (proxy->proxy_dns == USE_CLIENT_DNS) {
-      struct socks5_connect_request_ipv4 request = { SOCKS5_VERSION, SOCKS5_COMMAND_CONNECT, 0, SOCKS5_ADDRESSTYPE_IPV4, hostaddr, htons(dstport) };
-      write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connecting to IPv4 destination: %s:%lu", inet_ntoa(*(struct in_addr*)&hostaddr), (unsigned long)dstport);
-      if (send(sock, (void*)&request, sizeof(request), 0) < sizeof(request))
-        ERROR_DISCONNECT_AND_ABORT("Error sending connect command with IPv4 address to SOCKS5 proxy")
-    } else {
-      struct socks5_connect_request_ipv4* request;
-      size_t dsthostlen = (dsthost ? strlen(dsthost) : 0);
-      int requestlen = sizeof(struct socks5_connect_request_ipv4) - sizeof(uint32_t) + 1 + dsthostlen;
-      request = (struct socks5_connect_request_ipv4*)malloc(requestlen);
-      request->socks_version = SOCKS5_VERSION;
-      request->socks_command = SOCKS5_COMMAND_CONNECT;
-      request->reserved = 0;
-      request->socks_addresstype = SOCKS5_ADDRESSTYPE_DOMAINNAME;
-      *(uint8_t*)&(request->dst_addr) = dsthostlen;
-      if (dsthostlen > 0)
-        memcpy((void*)(((uint8_t*)&(request->dst_addr)) + 1), dsthost, dsthostlen);
-      *(uint16_t*)(((uint8_t*)&(request->dst_addr)) + 1 + dsthostlen) = htons(dstport);
-      write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connecting to destination host: %s:%lu", dsthost, (unsigned long)dstport);
-      if (send(sock, (void*)request, requestlen, 0) < requestlen)
-        ERROR_DISCONNECT_AND_ABORT("Error sending connect command with hostname to SOCKS5 proxy")
-      free(request);
-    }
-    //receive response
-    if (recv(sock, (void*)initrecv, sizeof(initrecv), 0) < sizeof(initrecv))
-      ERROR_DISCONNECT_AND_ABORT("Connection lost while reading connect response from SOCKS5 proxy")
-    if (initrecv[0] != SOCKS5_VERSION)
-      ERROR_DISCONNECT_AND_ABORT("SOCKS5 proxy version mismatch (%u)", (unsigned int)initrecv[0])
-    switch (initrecv[1]) {
-      case SOCKS5_STATUS_SUCCESS :
-        write_log_info(proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 proxy connection established to: %s:%lu", inet_ntoa(*(struct in_addr*)&hostaddr), (unsigned long)dstport);
-        break;
-      case SOCKS5_STATUS_SOCKS_SERVER_FAILURE :
-        ERROR_DISCONNECT_AND_ABORT("General SOCKS5 server failure")
-      case SOCKS5_STATUS_DENIED :
-        ERROR_DISCONNECT_AND_ABORT("Connection denied by SOCKS5 server")
-      case SOCKS5_STATUS_NETWORK_UNREACHABLE :
-        ERROR_DISCONNECT_AND_ABORT("SOCKS5 server response: Network unreachable")
-      case SOCKS5_STATUS_HOST_UNREACHABLE :
-        ERROR_DISCONNECT_AND_ABORT("SOCKS5 server response: Host unreachable")
-      case SOCKS5_STATUS_CONNECTION_REFUSED :
-        ERROR_DISCONNECT_AND_ABORT("SOCKS5 server response: Connection refused")
-      case SOCKS5_STATUS_TTL_EXPIRES :
-        ERROR_DISCONNECT_AND_ABORT("SOCKS5 server response: TTL expired")
-      case SOCKS5_STATUS_COMMAND_NOT_SUPPORTED :
-        ERROR_DISCONNECT_AND_ABORT("Command not supported by SOCKS5 server")
-      case SOCKS5_STATUS_ADDRESS_TYPE_NOT_SUPPORTED :
-        ERROR_DISCONNECT_AND_ABORT("Address type not supported by SOCKS5 server")
-      default :
-        ERROR_DISCONNECT_AND_ABORT("Unsupported status code from SOCKS5 server (%u)", (unsigned int)initrecv[1])
-    }
-    if (recv(sock, (void*)initrecv, sizeof(initrecv), 0) < sizeof(initrecv))
-      ERROR_DISCONNECT_AND_ABORT("Connection lost while reading connect response from SOCKS5 proxy")
-    if (initrecv[0] != 0)
-      write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Expected SOCKS5 response reserved value to be zero (%u)", (unsigned int)initrecv[0]);
-    switch (initrecv[1]) {
-      case 1 :
-        {
-          uint32_t bindaddr;
-          if (recv(sock, (void*)&bindaddr, sizeof(bindaddr), 0) < sizeof(bindaddr))
-            ERROR_DISCONNECT_AND_ABORT("Connection lost while reading connect response from SOCKS5 proxy")
-          write_log_info(proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 connection bound to IPv4 address: %s", inet_ntoa(*(struct in_addr*)&bindaddr));
-        }
-        break;
-      case 3 :
-        {
-          char* bindaddr;
-          uint8_t bindaddrlen;
-          if (recv(sock, (void*)&bindaddrlen, sizeof(bindaddrlen), 0) < sizeof(bindaddrlen))
-            ERROR_DISCONNECT_AND_ABORT("Connection lost while reading connect response from SOCKS5 proxy")
-          if ((bindaddr = (char*)malloc(bindaddrlen + 1)) == NULL)
-            ERROR_DISCONNECT_AND_ABORT(memory_allocation_error)
-          if (recv(sock, (void*)bindaddr, bindaddrlen, 0) < bindaddrlen)
-            ERROR_DISCONNECT_AND_ABORT("Connection lost while reading connect response from SOCKS5 proxy")
-          bindaddr[bindaddrlen] = 0;
-          write_log_info(proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 connection bound to host: %s", bindaddr);
-          free(bindaddr);
-        }
-        break;
-      case 4 :
-        {
-          uint8_t bindaddr[16];
-          if (recv(sock, (void*)bindaddr, sizeof(bindaddr), 0) < sizeof(bindaddr))
-            ERROR_DISCONNECT_AND_ABORT("Connection lost while reading connect response from SOCKS5 proxy")
-          //To do log IPv6 address
-          //write_log_info(proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 connection bound to IPv6 address: %s", inet_ntoa(*(struct in_addr*)&bindaddr));
-        }
-        break;
-      default :
-        ERROR_DISCONNECT_AND_ABORT("Unsupported SOCKS5 address type (%u)", (unsigned int)initrecv[1])
-    }
-    uint16_t bindport;
-    if (recv(sock, (void*)&bindport, sizeof(bindport), 0) < sizeof(bindport))
-      ERROR_DISCONNECT_AND_ABORT("Connection lost while reading connect response from SOCKS5 proxy")
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 connection bound to port: %lu", (unsigned long)bindport);
-  } else if (proxyinfo->proxytype == PROXYSOCKET_TYPE_WEB_CONNECT) {
-    /* * * CONNECTION USING HTTP/WEB PROXY * * */
-    //connect to the HTTP proxy server
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Preparing to connect to web proxy: %s:%lu", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);
-    if ((sock = proxyinfo_connect(proxy, proxyinfo->next, proxyinfo->proxyhost, proxyinfo->proxyport, errmsg)) == INVALID_SOCKET)
-      //ERROR_DISCONNECT_AND_ABORT("Error connecting to web proxy: %s:%lu", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);/////
-      ERROR_DISCONNECT_AND_ABORT(NULL);
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connected to web proxy: %s:%lu", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);
-    //prepare basic authentication data
-    char* proxyauth = NULL;
-    if (proxyinfo->proxyuser && *proxyinfo->proxyuser) {
-      write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Proxy authentication user: %s", proxyinfo->proxyuser);
-      char* userpass;
-      int proxyuserlen = strlen(proxyinfo->proxyuser);
-      if ((userpass = (char*)malloc(proxyuserlen + (proxyinfo->proxypass ? strlen(proxyinfo->proxypass) : 0) + 2)) == NULL)
-        ERROR_DISCONNECT_AND_ABORT(memory_allocation_error)
-      memcpy(userpass, proxyinfo->proxyuser, proxyuserlen);
-      userpass[proxyuserlen] = ':';
-      if (proxyinfo->proxypass)
-        strcpy(userpass + proxyuserlen + 1, proxyinfo->proxypass);
-      proxyauth = make_base64_string(userpass);
-      free(userpass);
-    }
-    //connect proxy to destination
-    int result;
-    char* response;
-    char* proxycmd;
-    const char* host = (proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : (dsthost ? dsthost : ""));
-    size_t proxycmdlen = 22 + 15 + 1 + 5 + 1 + (proxyauth ? 29 + strlen(proxyauth) : 0);
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Sending HTTP proxy CONNECT %s:%u", host, dstport);
-    if ((proxycmd = (char*)malloc(proxycmdlen)) == NULL)
-      ERROR_DISCONNECT_AND_ABORT(memory_allocation_error)
-    snprintf(proxycmd, proxycmdlen, "CONNECT %s:%u HTTP/1.0%s%s\r\n\r\n", host, dstport, (proxyauth ? "\r\nProxy-Authorization: Basic " : ""), (proxyauth ? proxyauth : ""));
-    if (proxyauth)
-      free(proxyauth);
-    result = send_http_request(sock, proxycmd, &response);
-    free(proxycmd);
-    if (result != 200)
-      write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "HTTP proxy response code %i, details:\n%s", result, response);
-    free(response);
-    response = NULL;
-    if (result < 100 || result >= 600)
-      ERROR_DISCONNECT_AND_ABORT("Invalid response, probably not from a web proxy")
-    switch (result) {
-      case 400 :
-        ERROR_DISCONNECT_AND_ABORT("Bad request")
-      case 401 :
-        ERROR_DISCONNECT_AND_ABORT("Authentication required")
-      case 403 :
-        ERROR_DISCONNECT_AND_ABORT("Access denied")
-      case 404 :
-        ERROR_DISCONNECT_AND_ABORT("Not found")
-      case 405 :
-        ERROR_DISCONNECT_AND_ABORT("Method not allowed")
-      case 407 :
-        if (proxyinfo->proxyuser && *proxyinfo->proxyuser)
-          ERROR_DISCONNECT_AND_ABORT("Proxy authentication failed (user: %s)", proxyinfo->proxyuser)
-        else
-          ERROR_DISCONNECT_AND_ABORT("Proxy authentication required")
-      case 408 :
-        ERROR_DISCONNECT_AND_ABORT("Request timed out")
-      case 429 :
-        ERROR_DISCONNECT_AND_ABORT("Too many requests")
-    }
-    if (result < 100)
-      ERROR_DISCONNECT_AND_ABORT("Web proxy returned unexpected progress response")
-    if (result >= 500)
-      ERROR_DISCONNECT_AND_ABORT("Web proxy returned a server error")
-    if (result >= 400)
-      ERROR_DISCONNECT_AND_ABORT("Web proxy returned a client error")
-    if (result >= 300)
-      ERROR_DISCONNECT_AND_ABORT("Web proxy returned unexpected redirection")
-    if (result < 100 || result >= 300)
-      ERROR_DISCONNECT_AND_ABORT("Web proxy error")
-    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Web proxy connection established to: %s:%lu", host, (unsigned long)dstport);
-    //write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connected to %s:%u via proxy %s:%u", dsthost, dstport, inet_ntoa(*(struct in_addr*)&proxyaddr), (unsigned long)proxyinfo->proxyport);/////
-  } else {
-    /* * * INVALID PROXY TYPE SPECIFIED * * */
-    ERROR_DISCONNECT_AND_ABORT("Unknown proxy type")
+  char* newcafile = NULL;
+  if (!proxy)
+    return -1;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change TLS certificate authorities of frozen proxy information");
+    return -1;
   }
-  return sock;
+  if (cafile && (newcafile = strdup(cafile)) == NULL)
+    return -1;
+  free(proxy->tlscafile);
+  proxy->tlscafile = newcafile;
+  return 0;
 }
 
-DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_connect (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, char** errmsg)
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_socket_option (proxysocketconfig proxy, int phase, int option, int value)
+{
+  if (!proxy || (phase != PROXYSOCKET_PHASE_HANDSHAKE && phase != PROXYSOCKET_PHASE_DATA) || option < 0 || option >= PROXYSOCKET_SOCKOPT_COUNT)
+    return -1;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change socket options of frozen proxy information");
+    return -1;
+  }
+  proxy->socketoptions[phase][option] = (value < 0 ? -1 : value);
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_add_source_address (proxysocketconfig proxy, const char* address)
+{
+  uint32_t addr;
+  struct proxysocket_source_struct* sources;
+  if (!proxy || !address)
+    return -1;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to add source address to frozen proxy information");
+    return -1;
+  }
+  if ((addr = get_ipv4_address(address)) == INADDR_NONE) {
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, "Error looking up source address: %s", address);
+    return -1;
+  }
+  if ((sources = (struct proxysocket_source_struct*)realloc(proxy->sources, (proxy->sourcecount + 1) * sizeof(struct proxysocket_source_struct))) == NULL)
+    return -1;
+  proxy->sources = sources;
+  sources[proxy->sourcecount].addr = addr;
+  memset(&sources[proxy->sourcecount].stats, 0, sizeof(sources[proxy->sourcecount].stats));
+  proxy->sourcecount++;
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_source_port_range (proxysocketconfig proxy, uint16_t firstport, uint16_t lastport, int partitions)
+{
+  if (!proxy || (firstport && (lastport < firstport || partitions < 0 || (unsigned int)partitions > (unsigned int)(lastport - firstport) + 1)))
+    return -1;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change source port range of frozen proxy information");
+    return -1;
+  }
+  proxy->sourcefirstport = (firstport ? firstport : 0);
+  proxy->sourcelastport = (firstport ? lastport : 0);
+  proxy->sourcepartitions = (firstport && partitions > 1 ? partitions : 1);
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_source_address_stats (proxysocketconfig proxy, int index, struct proxysocket_source_stats* stats)
+{
+  if (!proxy || !stats || index < 0 || (uint32_t)index >= proxy->sourcecount)
+    return -1;
+  stats->connections = ATOMIC_LOAD(&proxy->sources[index].stats.connections);
+  stats->failures = ATOMIC_LOAD(&proxy->sources[index].stats.failures);
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_proxy_count (proxysocketconfig proxy)
+{
+  int count = 0;
+  struct proxyinfo_struct* proxyinfo;
+  if (!proxy)
+    return 0;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next)
+    count++;
+  return count;
+}
+
+//get proxy entry by index in the order they were added (the list itself is in reverse order)
+struct proxyinfo_struct* proxyinfo_get_by_index (proxysocketconfig proxy, int index)
+{
+  struct proxyinfo_struct* proxyinfo;
+  int count = proxysocketconfig_get_proxy_count(proxy);
+  if (index < 0 || index >= count)
+    return NULL;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo && ++index < count; proxyinfo = proxyinfo->next)
+    ;
+  return proxyinfo;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_proxy_stats (proxysocketconfig proxy, int index, struct proxysocket_proxy_stats* stats)
+{
+  uint64_t rtt;
+  struct proxyinfo_struct* proxyinfo;
+  if (!proxy || !stats || (proxyinfo = proxyinfo_get_by_index(proxy, index)) == NULL)
+    return -1;
+  stats->fastopen_attempts = ATOMIC_LOAD(&proxyinfo->runtime->state->stats.fastopen_attempts);
+  stats->fastopen_successes = ATOMIC_LOAD(&proxyinfo->runtime->state->stats.fastopen_successes);
+  stats->tls_handshakes = 0;
+  stats->tls_resumptions = 0;
+  stats->tls_early_data = 0;
+#ifdef HAVE_OPENSSL
+  spin_lock(&proxyinfo->runtime->lock);
+  if (proxyinfo->runtime->tlsproxy) {
+    stats->tls_handshakes = ATOMIC_LOAD(&proxyinfo->runtime->tlsproxy->handshakes);
+    stats->tls_resumptions = ATOMIC_LOAD(&proxyinfo->runtime->tlsproxy->resumptions);
+    stats->tls_early_data = ATOMIC_LOAD(&proxyinfo->runtime->tlsproxy->earlydata);
+  }
+  spin_unlock(&proxyinfo->runtime->lock);
+#endif
+  stats->queued = ATOMIC_LOAD(&proxyinfo->runtime->state->stats.queued);
+  stats->queue_timeouts = ATOMIC_LOAD(&proxyinfo->runtime->state->stats.queue_timeouts);
+  stats->queue_wait_time = ATOMIC_LOAD(&proxyinfo->runtime->state->stats.queue_wait_time);
+  stats->queue_length = 0;
+  stats->handshakes = 0;
+  if (proxyinfo->runtime->limits) {
+    spin_lock(&proxyinfo->runtime->limits->lock);
+    stats->queue_length = proxyinfo->runtime->limits->queuelength;
+    stats->handshakes = proxyinfo->runtime->limits->handshakes;
+    spin_unlock(&proxyinfo->runtime->limits->lock);
+  }
+  stats->bytes_sent = ATOMIC_LOAD(&proxyinfo->runtime->state->stats.bytes_sent);
+  stats->bytes_received = ATOMIC_LOAD(&proxyinfo->runtime->state->stats.bytes_received);
+  stats->failures = ATOMIC_LOAD(&proxyinfo->runtime->state->stats.failures);
+  stats->consecutive_failures = ATOMIC_LOAD(&proxyinfo->runtime->state->stats.consecutive_failures);
+  stats->latency = (ATOMIC_LOAD(&proxyinfo->runtime->state->latency) + 500) / 1000;
+  rtt = ATOMIC_LOAD(&proxyinfo->runtime->state->rtt);
+  stats->rtt = (uint32_t)rtt;
+  stats->rtt_variation = (uint32_t)(rtt >> 32);
+  return 0;
+}
+
+//allocate connection limits that don't restrict anything yet
+struct proxyinfo_limits* limits_create ()
+{
+  struct proxyinfo_limits* limits;
+  if ((limits = (struct proxyinfo_limits*)malloc(sizeof(struct proxyinfo_limits))) == NULL)
+    return NULL;
+  limits->refcount = 1;
+  limits->lock = 0;
+  limits->rate = 0;
+  limits->burst = 1;
+  limits->maxhandshakes = 0;
+  limits->maxwait = 0;
+  limits->tokens = 1000;
+  limits->refilled = 0;
+  limits->pauseduntil = 0;
+  limits->handshakes = 0;
+  limits->queuelength = 0;
+  limits->first = NULL;
+  limits->last = &limits->first;
+  return limits;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_proxy_limits (proxysocketconfig proxy, int index, uint32_t rate, uint32_t burst, uint32_t maxhandshakes, uint32_t maxwait)
+{
+  struct proxyinfo_struct* proxyinfo;
+  struct proxyinfo_limits* limits;
+  if (!proxy || (proxyinfo = proxyinfo_get_by_index(proxy, index)) == NULL)
+    return -1;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change connection limits of frozen proxy information");
+    return -1;
+  }
+  //keep the queue when the limits are changed
+  if ((limits = proxyinfo->runtime->limits) == NULL && (limits = limits_create()) == NULL)
+    return -1;
+  spin_lock(&limits->lock);
+  limits->rate = rate;
+  limits->burst = (burst ? burst : 1);
+  limits->maxhandshakes = maxhandshakes;
+  limits->maxwait = maxwait;
+  limits->tokens = (uint64_t)limits->burst * 1000;
+  spin_unlock(&limits->lock);
+  proxyinfo->runtime->limits = limits;
+  return 0;
+}
+
+//configure a token bucket (burst 0 for the default), it starts full
+void bandwidth_bucket_set (struct bandwidth_bucket* bucket, uint32_t rate, uint32_t burst)
+{
+  spin_lock(&bucket->lock);
+  bucket->rate = rate;
+  if (!burst && (burst = (uint32_t)((uint64_t)rate * BANDWIDTH_BURST_MILLISECONDS / 1000)) < BANDWIDTH_MIN_BURST)
+    burst = BANDWIDTH_MIN_BURST;
+  bucket->burst = burst;
+  ATOMIC_STORE(&bucket->tokens, (int64_t)burst);
+  bucket->refilled = 0;
+  spin_unlock(&bucket->lock);
+}
+
+struct bandwidth_limits* bandwidth_limits_create ()
+{
+  struct bandwidth_limits* bandwidth;
+  if ((bandwidth = (struct bandwidth_limits*)malloc(sizeof(struct bandwidth_limits))) == NULL)
+    return NULL;
+  memset(bandwidth, 0, sizeof(struct bandwidth_limits));
+  return bandwidth;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_bandwidth_limit (proxysocketconfig proxy, int index, uint32_t sendrate, uint32_t recvrate, uint32_t burst)
+{
+  struct proxyinfo_struct* proxyinfo;
+  if (!proxy || (proxyinfo = proxyinfo_get_by_index(proxy, index)) == NULL)
+    return -1;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change bandwidth limits of frozen proxy information");
+    return -1;
+  }
+  if (!proxyinfo->runtime->bandwidth && (proxyinfo->runtime->bandwidth = bandwidth_limits_create()) == NULL)
+    return -1;
+  bandwidth_bucket_set(&proxyinfo->runtime->bandwidth->direction[BANDWIDTH_SEND], sendrate, burst);
+  bandwidth_bucket_set(&proxyinfo->runtime->bandwidth->direction[BANDWIDTH_RECV], recvrate, burst);
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET void proxysocketconfig_free (proxysocketconfig proxy)
+{
+  if (proxy) {
+    struct proxyinfo_block_struct* block;
+    proxyinfolist_free(proxy->proxyinfolist);
+    while ((block = proxy->proxyinfoblocks) != NULL) {
+      proxy->proxyinfoblocks = block->next;
+      free(block);
+    }
+    free(proxy->sources);
+    free(proxy->tlscafile);
+    proxysocket_shared_free(proxy->shared);
+    resolver_cache_free(proxy->dnscache);
+    if (proxy->bindpool) {
+      proxysocketconfig_set_bind_pool(proxy, NULL, 0, 0, 0);
+      free(proxy->bindpool->peerhost);
+      free(proxy->bindpool);
+    }
+    free(proxy);
+  }
+}
+
+void log_and_keep_error_message (proxysocketconfig proxy, char** pmsg, const char* fmt, ...)
+{
+  if (fmt && (proxy->log_function || pmsg)) {
+    char* msg;
+    int msglen;
+    //generate message
+    va_list ap;
+    va_start(ap, fmt);
+    msglen = vasprintf(&msg, fmt, ap);
+    va_end(ap);
+    //log message
+    if (msglen >= 0) {
+      if (proxy->log_function)
+        proxy->log_function(PROXYSOCKET_LOG_ERROR, msg, proxy->log_data);
+      if (pmsg)
+        *pmsg = msg;
+      else
+        free(msg);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/* * * bulk loading of proxy lists * * */
+
+//map an entire file in memory for reading (returns zero on success)
+int map_file (const char* filename, const char** pdata, size_t* psize, void** phandle)
+{
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+  DWORD sizehigh;
+  *pdata = NULL;
+  *psize = 0;
+  *phandle = NULL;
+  if ((file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE)
+    return -1;
+  *psize = GetFileSize(file, &sizehigh);
+  if (*psize == 0 && sizehigh == 0) {
+    CloseHandle(file);
+    return 0;
+  }
+  mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file);
+  if (!mapping)
+    return -1;
+  *pdata = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  return (*pdata ? 0 : -1);
+#else
+  int fd;
+  struct stat filestat;
+  void* data;
+  *pdata = NULL;
+  *psize = 0;
+  *phandle = NULL;
+  if ((fd = open(filename, O_RDONLY)) == -1)
+    return -1;
+  if (fstat(fd, &filestat) != 0) {
+    close(fd);
+    return -1;
+  }
+  if ((*psize = filestat.st_size) == 0) {
+    close(fd);
+    return 0;
+  }
+  data = mmap(NULL, *psize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return -1;
+#ifdef MADV_SEQUENTIAL
+  madvise(data, *psize, MADV_SEQUENTIAL);
+#endif
+  *pdata = (const char*)data;
+  return 0;
+#endif
+}
+
+void unmap_file (const char* data, size_t size, void* handle)
+{
+  (void)handle;
+  if (!data)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(data);
+#else
+  munmap((void*)data, size);
+#endif
+}
+
+//allocate a block of proxy entries with room for the specified size of string data
+struct proxyinfo_block_struct* proxyinfo_block_create (size_t count, size_t stringslen)
+{
+  size_t i;
+  struct proxyinfo_block_struct* block;
+  if ((block = (struct proxyinfo_block_struct*)malloc(sizeof(struct proxyinfo_block_struct) + count * (sizeof(struct proxyinfo_struct) + sizeof(struct proxyinfo_runtime)) + stringslen)) == NULL)
+    return NULL;
+  block->next = NULL;
+  block->count = 0;
+  block->entries = (struct proxyinfo_struct*)(block + 1);
+  block->runtimes = (struct proxyinfo_runtime*)(block->entries + count);
+  block->strings = (char*)(block->runtimes + count);
+  block->stringslen = 0;
+  for (i = 0; i < count; i++) {
+    block->entries[i].runtime = &block->runtimes[i];
+    proxyinfo_runtime_init(&block->runtimes[i]);
+  }
+  return block;
+}
+
+//insert proxy entry in front of the list (clean up and remove existing entries if a direct connection is inserted)
+void proxyinfolist_insert (proxysocketconfig proxy, struct proxyinfo_struct* proxyinfo)
+{
+  if (proxyinfo->proxytype == PROXYSOCKET_TYPE_NONE && proxy->proxyinfolist) {
+    proxyinfolist_free(proxy->proxyinfolist);
+    proxy->proxyinfolist = NULL;
+  }
+  proxyinfo->next = proxy->proxyinfolist;
+  proxy->proxyinfolist = proxyinfo;
+}
+
+//add all entries of a block to the proxy information and take ownership of the block
+void proxyinfo_block_insert (proxysocketconfig proxy, struct proxyinfo_block_struct* block)
+{
+  size_t i;
+  for (i = 0; i < block->count; i++)
+    proxyinfolist_insert(proxy, &block->entries[i]);
+  block->next = proxy->proxyinfoblocks;
+  proxy->proxyinfoblocks = block;
+}
+
+//table used to store each distinct string only once
+struct string_intern_struct {
+  char* strings;
+  size_t stringslen;
+  size_t* slots;
+  size_t slotmask;
+};
+
+int string_intern_init (struct string_intern_struct* intern, char* strings, size_t maxstrings)
+{
+  size_t slotcount = 16;
+  while (slotcount < maxstrings * 2)
+    slotcount <<= 1;
+  intern->strings = strings;
+  intern->stringslen = 0;
+  intern->slotmask = slotcount - 1;
+  return ((intern->slots = (size_t*)calloc(slotcount, sizeof(size_t))) == NULL ? -1 : 0);
+}
+
+//intern the string of the specified length that was just written at the end of the string data
+char* string_intern_commit (struct string_intern_struct* intern, size_t len)
+{
+  size_t i;
+  uint32_t hash = 2166136261U;
+  char* str = intern->strings + intern->stringslen;
+  str[len] = 0;
+  for (i = 0; i < len; i++)
+    hash = (hash ^ (uint8_t)str[i]) * 16777619U;
+  i = hash & intern->slotmask;
+  while (intern->slots[i]) {
+    //slots contain offset + 1 so zero can be used for empty slots
+    char* existing = intern->strings + intern->slots[i] - 1;
+    if (memcmp(existing, str, len + 1) == 0)
+      return existing;
+    i = (i + 1) & intern->slotmask;
+  }
+  intern->slots[i] = intern->stringslen + 1;
+  intern->stringslen += len + 1;
+  return str;
+}
+
+//copy a string and intern it
+char* string_intern (struct string_intern_struct* intern, const char* src, size_t srclen)
+{
+  memcpy(intern->strings + intern->stringslen, src, srclen);
+  return string_intern_commit(intern, srclen);
+}
+
+//decode URL escape sequences (%XX) and intern the result, returns NULL on invalid escape sequence
+char* string_intern_url_decoded (struct string_intern_struct* intern, const char* src, size_t srclen)
+{
+  char* dst = intern->strings + intern->stringslen;
+  size_t len = 0;
+  const char* end = src + srclen;
+  while (src < end) {
+    if (*src == '%') {
+      if (end - src < 3 || !isxdigit((unsigned char)src[1]) || !isxdigit((unsigned char)src[2]))
+        return NULL;
+      dst[len++] = (char)((isdigit((unsigned char)src[1]) ? src[1] - '0' : tolower((unsigned char)src[1]) - 'a' + 10) << 4 | (isdigit((unsigned char)src[2]) ? src[2] - '0' : tolower((unsigned char)src[2]) - 'a' + 10));
+      src += 3;
+    } else {
+      dst[len++] = *src++;
+    }
+  }
+  return string_intern_commit(intern, len);
+}
+
+//parse proxy URL of the form type://[user[:pass]@]host:port, returns NULL on success or error message on failure
+const char* parse_proxy_url (const char* url, size_t urllen, struct string_intern_struct* intern, struct proxyinfo_struct* proxyinfo)
+{
+  char scheme[16];
+  const char* p;
+  const char* end = url + urllen;
+  const char* hostpos;
+  const char* portpos;
+  unsigned long port;
+  //get proxy type
+  for (p = url; p < end && *p != ':'; p++)
+    ;
+  if (end - p < 3 || p[1] != '/' || p[2] != '/')
+    return "Missing proxy type";
+  if ((size_t)(p - url) >= sizeof(scheme))
+    return "Invalid proxy type";
+  memcpy(scheme, url, p - url);
+  scheme[p - url] = 0;
+  if ((proxyinfo->proxytype = proxysocketconfig_get_name_type(scheme)) == PROXYSOCKET_TYPE_INVALID)
+    return "Invalid proxy type";
+  hostpos = p + 3;
+  //ignore trailing slash
+  if (end > hostpos && end[-1] == '/')
+    end--;
+  //get authentication information
+  proxyinfo->proxyuser = NULL;
+  proxyinfo->proxypass = NULL;
+  for (p = end; p > hostpos && p[-1] != '@'; p--)
+    ;
+  if (p > hostpos) {
+    const char* userend = hostpos;
+    while (userend < p - 1 && *userend != ':')
+      userend++;
+    if (userend > hostpos && (proxyinfo->proxyuser = string_intern_url_decoded(intern, hostpos, userend - hostpos)) == NULL)
+      return "Invalid escape sequence in proxy user";
+    if (userend < p - 1 && (proxyinfo->proxypass = string_intern_url_decoded(intern, userend + 1, p - 1 - (userend + 1))) == NULL)
+      return "Invalid escape sequence in proxy password";
+    hostpos = p;
+  }
+  //get host and port
+  for (portpos = end; portpos > hostpos && portpos[-1] != ':'; portpos--)
+    ;
+  port = 0;
+  if (portpos > hostpos) {
+    if (portpos == end)
+      return "Missing proxy port";
+    for (p = portpos; p < end; p++) {
+      if (!isdigit((unsigned char)*p) || (port = port * 10 + (*p - '0')) > 65535)
+        return "Invalid proxy port";
+    }
+    portpos--;
+  } else {
+    portpos = end;
+  }
+  proxyinfo->proxyport = (uint16_t)port;
+  proxyinfo->proxyhost = (portpos > hostpos ? string_intern(intern, hostpos, portpos - hostpos) : NULL);
+  if (proxyinfo->proxytype != PROXYSOCKET_TYPE_NONE) {
+    if (!proxyinfo->proxyhost)
+      return "Missing proxy host";
+    if (!port)
+      return "Missing proxy port";
+  }
+  proxyinfo->flags = PROXYINFO_FLAG_IN_BLOCK;
+  proxyinfo->next = NULL;
+  return NULL;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_add_proxy_url (proxysocketconfig proxy, const char* url)
+{
+  struct string_intern_struct intern;
+  struct proxyinfo_struct proxyinfo;
+  char* strings;
+  const char* error;
+  int result;
+  size_t urllen = (url ? strlen(url) : 0);
+  if (!proxy || !url || proxy->frozen)
+    return -1;
+  if ((strings = (char*)malloc(urllen + 3)) == NULL)
+    return -1;
+  if (string_intern_init(&intern, strings, 3) != 0) {
+    free(strings);
+    return -1;
+  }
+  if ((error = parse_proxy_url(url, urllen, &intern, &proxyinfo)) != NULL) {
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, "%s in proxy URL: %s", error, url);
+    result = -1;
+  } else {
+    result = proxysocketconfig_add_proxy(proxy, proxyinfo.proxytype, proxyinfo.proxyhost, proxyinfo.proxyport, proxyinfo.proxyuser, proxyinfo.proxypass);
+  }
+  free(intern.slots);
+  free(strings);
+  return result;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_load_proxy_list (proxysocketconfig proxy, const char* filename, char** errmsg)
+{
+  const char* data;
+  size_t datalen;
+  void* maphandle;
+  const char* p;
+  const char* end;
+  const char* lineend;
+  size_t maxcount;
+  int linenumber;
+  const char* error;
+  struct proxyinfo_block_struct* block;
+  struct string_intern_struct intern;
+  if (!proxy || !filename || proxy->frozen)
+    return -1;
+  if (map_file(filename, &data, &datalen, &maphandle) != 0) {
+    log_and_keep_error_message(proxy, errmsg, "Error opening proxy list file: %s", filename);
+    return -1;
+  }
+  //count lines to determine the maximum number of entries
+  end = data + datalen;
+  maxcount = 1;
+  for (p = data; (p = (const char*)memchr(p, '\n', end - p)) != NULL; p++)
+    maxcount++;
+  //allocate all entries and strings at once (decoded strings are never longer than the original line)
+  if ((block = proxyinfo_block_create(maxcount, datalen + maxcount * 3)) == NULL) {
+    unmap_file(data, datalen, maphandle);
+    log_and_keep_error_message(proxy, errmsg, memory_allocation_error);
+    return -1;
+  }
+  if (string_intern_init(&intern, block->strings, maxcount * 3) != 0) {
+    free(block);
+    unmap_file(data, datalen, maphandle);
+    log_and_keep_error_message(proxy, errmsg, memory_allocation_error);
+    return -1;
+  }
+  //parse each line
+  linenumber = 0;
+  for (p = data; p < end; p = lineend + 1) {
+    linenumber++;
+    if ((lineend = (const char*)memchr(p, '\n', end - p)) == NULL)
+      lineend = end;
+    //skip leading and trailing whitespace, empty lines and comments
+    while (p < lineend && isspace((unsigned char)*p))
+      p++;
+    while (lineend > p && isspace((unsigned char)lineend[-1]))
+      lineend--;
+    if (p < lineend && *p != '#') {
+      if ((error = parse_proxy_url(p, lineend - p, &intern, &block->entries[block->count])) != NULL) {
+        log_and_keep_error_message(proxy, errmsg, "%s:%i: %s", filename, linenumber, error);
+        free(intern.slots);
+        free(block);
+        unmap_file(data, datalen, maphandle);
+        return -1;
+      }
+      block->count++;
+    }
+    while (lineend < end && *lineend != '\n')
+      lineend++;
+  }
+  block->stringslen = intern.stringslen;
+  free(intern.slots);
+  unmap_file(data, datalen, maphandle);
+  write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Loaded %lu proxies (%lu bytes of string data) from: %s", (unsigned long)block->count, (unsigned long)block->stringslen, filename);
+  if (block->count == 0) {
+    free(block);
+    return 0;
+  }
+  proxyinfo_block_insert(proxy, block);
+  return (int)block->count;
+}
+
+/* * * binary snapshot of proxy information * * */
+
+#define PROXYSOCKET_SNAPSHOT_MAGIC     "PSOCKSNP"
+#define PROXYSOCKET_SNAPSHOT_VERSION   1
+#define PROXYSOCKET_SNAPSHOT_BYTEORDER 0x01020304
+
+struct proxysocket_snapshot_header {
+  char magic[8];
+  uint32_t byteorder;
+  uint32_t version;
+  uint32_t count;
+  uint32_t stringslen;
+};
+
+//string references are offsets in the string data plus one, zero is used for NULL
+struct proxysocket_snapshot_entry {
+  int32_t proxytype;
+  uint32_t proxyhost;
+  uint32_t proxyuser;
+  uint32_t proxypass;
+  uint16_t proxyport;
+  uint16_t flags;                       //PROXYSOCKET_SNAPSHOT_FLAG_* values
+};
+
+#define PROXYSOCKET_SNAPSHOT_FLAG_GROUP 0x0001  //used instead of the entry before it (see proxysocketconfig_group_proxies())
+
+uint32_t snapshot_string_reference (struct string_intern_struct* intern, const char* str)
+{
+  if (!str)
+    return 0;
+  return (uint32_t)(string_intern(intern, str, strlen(str)) - intern->strings) + 1;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_save_snapshot (proxysocketconfig proxy, const char* filename)
+{
+  FILE* dst;
+  size_t i;
+  size_t count;
+  size_t stringslen;
+  struct proxyinfo_struct* proxyinfo;
+  struct proxyinfo_struct** entries;
+  struct proxysocket_snapshot_entry* records;
+  struct proxysocket_snapshot_header header;
+  struct string_intern_struct intern;
+  int result = -1;
+  if (!proxy || !filename)
+    return -1;
+  //determine size of entries and strings
+  count = 0;
+  stringslen = 0;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    count++;
+    stringslen += (proxyinfo->proxyhost ? strlen(proxyinfo->proxyhost) + 1 : 0) + (proxyinfo->proxyuser ? strlen(proxyinfo->proxyuser) + 1 : 0) + (proxyinfo->proxypass ? strlen(proxyinfo->proxypass) + 1 : 0);
+  }
+  entries = (struct proxyinfo_struct**)malloc(count * sizeof(struct proxyinfo_struct*) + 1);
+  records = (struct proxysocket_snapshot_entry*)malloc(count * sizeof(struct proxysocket_snapshot_entry) + 1);
+  intern.strings = (char*)malloc(stringslen + 1);
+  intern.slots = NULL;
+  if (entries && records && intern.strings && string_intern_init(&intern, intern.strings, count * 3) == 0) {
+    //store entries in the order they were added so loading them reproduces the same list
+    i = count;
+    for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next)
+      entries[--i] = proxyinfo;
+    for (i = 0; i < count; i++) {
+      records[i].proxytype = entries[i]->proxytype;
+      records[i].proxyhost = snapshot_string_reference(&intern, entries[i]->proxyhost);
+      records[i].proxyuser = snapshot_string_reference(&intern, entries[i]->proxyuser);
+      records[i].proxypass = snapshot_string_reference(&intern, entries[i]->proxypass);
+      records[i].proxyport = entries[i]->proxyport;
+      records[i].flags = (entries[i]->flags & PROXYINFO_FLAG_GROUP ? PROXYSOCKET_SNAPSHOT_FLAG_GROUP : 0);
+    }
+    memcpy(header.magic, PROXYSOCKET_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.byteorder = PROXYSOCKET_SNAPSHOT_BYTEORDER;
+    header.version = PROXYSOCKET_SNAPSHOT_VERSION;
+    header.count = count;
+    header.stringslen = intern.stringslen;
+    //write snapshot file
+    if ((dst = fopen(filename, "wb")) != NULL) {
+      if (fwrite(&header, sizeof(header), 1, dst) == 1 && fwrite(records, sizeof(struct proxysocket_snapshot_entry), count, dst) == count && fwrite(intern.strings, 1, intern.stringslen, dst) == intern.stringslen)
+        result = 0;
+      if (fclose(dst) != 0)
+        result = -1;
+    }
+  }
+  free(intern.slots);
+  free(intern.strings);
+  free(records);
+  free(entries);
+  if (result != 0)
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, "Error writing proxy snapshot file: %s", filename);
+  return result;
+}
+
+//check if a proxy type read from a file is one of the PROXYSOCKET_TYPE_* values
+int proxytype_is_valid (int proxytype)
+{
+  switch (proxytype) {
+    case PROXYSOCKET_TYPE_NONE :
+    case PROXYSOCKET_TYPE_SOCKS4 :
+    case PROXYSOCKET_TYPE_SOCKS5 :
+    case PROXYSOCKET_TYPE_WEB_CONNECT :
+    case PROXYSOCKET_TYPE_WEB_CONNECT_TLS :
+    case PROXYSOCKET_TYPE_WEB_CONNECT_H2 :
+      return 1;
+    default :
+      return 0;
+  }
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_load_snapshot (proxysocketconfig proxy, const char* filename, char** errmsg)
+{
+  const char* data;
+  size_t datalen;
+  void* maphandle;
+  size_t i;
+  const struct proxysocket_snapshot_header* header;
+  const struct proxysocket_snapshot_entry* records;
+  struct proxyinfo_block_struct* block;
+  if (!proxy || !filename || proxy->frozen)
+    return -1;
+  if (map_file(filename, &data, &datalen, &maphandle) != 0) {
+    log_and_keep_error_message(proxy, errmsg, "Error opening proxy snapshot file: %s", filename);
+    return -1;
+  }
+  //validate header
+  header = (const struct proxysocket_snapshot_header*)data;
+  if (datalen < sizeof(struct proxysocket_snapshot_header) || memcmp(header->magic, PROXYSOCKET_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->byteorder != PROXYSOCKET_SNAPSHOT_BYTEORDER || header->version != PROXYSOCKET_SNAPSHOT_VERSION || (datalen - sizeof(struct proxysocket_snapshot_header)) / sizeof(struct proxysocket_snapshot_entry) < header->count || datalen - sizeof(struct proxysocket_snapshot_header) - (size_t)header->count * sizeof(struct proxysocket_snapshot_entry) != header->stringslen || (header->stringslen > 0 && data[datalen - 1] != 0)) {
+    unmap_file(data, datalen, maphandle);
+    log_and_keep_error_message(proxy, errmsg, "Invalid proxy snapshot file: %s", filename);
+    return -1;
+  }
+  records = (const struct proxysocket_snapshot_entry*)(header + 1);
+  //copy all entries and strings into one block
+  if ((block = proxyinfo_block_create(header->count, header->stringslen)) == NULL) {
+    unmap_file(data, datalen, maphandle);
+    log_and_keep_error_message(proxy, errmsg, memory_allocation_error);
+    return -1;
+  }
+  block->stringslen = header->stringslen;
+  memcpy(block->strings, records + header->count, header->stringslen);
+  for (i = 0; i < header->count; i++) {
+    if (records[i].proxyhost > block->stringslen || records[i].proxyuser > block->stringslen || records[i].proxypass > block->stringslen) {
+      free(block);
+      unmap_file(data, datalen, maphandle);
+      log_and_keep_error_message(proxy, errmsg, "Invalid string reference in proxy snapshot file: %s", filename);
+      return -1;
+    }
+    if (!proxytype_is_valid(records[i].proxytype)) {
+      free(block);
+      unmap_file(data, datalen, maphandle);
+      log_and_keep_error_message(proxy, errmsg, "Invalid proxy type in proxy snapshot file: %s", filename);
+      return -1;
+    }
+    block->entries[i].proxytype = records[i].proxytype;
+    block->entries[i].proxyhost = (records[i].proxyhost ? block->strings + records[i].proxyhost - 1 : NULL);
+    block->entries[i].proxyport = records[i].proxyport;
+    block->entries[i].proxyuser = (records[i].proxyuser ? block->strings + records[i].proxyuser - 1 : NULL);
+    block->entries[i].proxypass = (records[i].proxypass ? block->strings + records[i].proxypass - 1 : NULL);
+    block->entries[i].flags = PROXYINFO_FLAG_IN_BLOCK | (i > 0 && (records[i].flags & PROXYSOCKET_SNAPSHOT_FLAG_GROUP) ? PROXYINFO_FLAG_GROUP : 0);
+    block->entries[i].next = NULL;
+  }
+  block->count = header->count;
+  unmap_file(data, datalen, maphandle);
+  if (block->count == 0) {
+    free(block);
+    return 0;
+  }
+  proxyinfo_block_insert(proxy, block);
+  return (int)block->count;
+}
+
+/* * * compact immutable proxy information * * */
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_freeze (proxysocketconfig proxy)
+{
+  size_t i;
+  size_t count;
+  size_t stringslen;
+  struct proxyinfo_struct* proxyinfo;
+  struct proxyinfo_block_struct* block;
+  struct string_intern_struct intern;
+  if (!proxy)
+    return -1;
+  if (proxy->frozen)
+    return 0;
+  //determine size of entries and strings
+  count = 0;
+  stringslen = 0;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    count++;
+    stringslen += (proxyinfo->proxyhost ? strlen(proxyinfo->proxyhost) + 1 : 0) + (proxyinfo->proxyuser ? strlen(proxyinfo->proxyuser) + 1 : 0) + (proxyinfo->proxypass ? strlen(proxyinfo->proxypass) + 1 : 0);
+  }
+  //pack all entries in list order (the last proxy first) into a single array followed by their runtime state and all strings
+  if ((block = proxyinfo_block_create(count, stringslen)) == NULL)
+    return -1;
+  if (string_intern_init(&intern, block->strings, count * 3) != 0) {
+    free(block);
+    return -1;
+  }
+  i = 0;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    block->entries[i].proxytype = proxyinfo->proxytype;
+    block->entries[i].proxyhost = (proxyinfo->proxyhost ? string_intern(&intern, proxyinfo->proxyhost, strlen(proxyinfo->proxyhost)) : NULL);
+    block->entries[i].proxyport = proxyinfo->proxyport;
+    block->entries[i].proxyuser = (proxyinfo->proxyuser ? string_intern(&intern, proxyinfo->proxyuser, strlen(proxyinfo->proxyuser)) : NULL);
+    block->entries[i].proxypass = (proxyinfo->proxypass ? string_intern(&intern, proxyinfo->proxypass, strlen(proxyinfo->proxypass)) : NULL);
+    block->entries[i].flags = PROXYINFO_FLAG_IN_BLOCK | (proxyinfo->flags & PROXYINFO_FLAG_GROUP);
+    //keep the statistics, the capabilities, what was learned about authentication, the HTTP/2 connections, the TLS sessions and the connection and bandwidth limits
+    proxyinfo_runtime_move(block->entries[i].runtime, proxyinfo->runtime);
+    block->entries[i].next = (proxyinfo->next ? &block->entries[i + 1] : NULL);
+    i++;
+  }
+  block->count = count;
+  block->stringslen = intern.stringslen;
+  free(intern.slots);
+  //release the original entries and replace them with the packed ones
+  proxyinfolist_free(proxy->proxyinfolist);
+  while (proxy->proxyinfoblocks) {
+    struct proxyinfo_block_struct* next = proxy->proxyinfoblocks->next;
+    free(proxy->proxyinfoblocks);
+    proxy->proxyinfoblocks = next;
+  }
+  proxy->proxyinfolist = (count > 0 ? block->entries : NULL);
+  proxy->proxyinfoblocks = block;
+  proxy->frozen = 1;
+  write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Froze proxy information (%lu entries, %lu bytes of string data)", (unsigned long)count, (unsigned long)block->stringslen);
+  return 0;
+}
+
+/* * * socket options * * */
+
+//apply all configured socket options of the specified phase
+void socket_apply_options (proxysocketconfig proxy, SOCKET sock, int phase)
+{
+  int i;
+  int level;
+  int name;
+  int value;
+  int keepalive = 0;
+  const char* description;
+  for (i = 0; i < PROXYSOCKET_SOCKOPT_COUNT; i++) {
+    if ((value = proxy->socketoptions[phase][i]) < 0)
+      continue;
+    level = -1;
+    name = 0;
+    switch (i) {
+      case PROXYSOCKET_SOCKOPT_NODELAY :
+        description = "TCP_NODELAY";
+        level = IPPROTO_TCP;
+        name = TCP_NODELAY;
+        break;
+      case PROXYSOCKET_SOCKOPT_QUICKACK :
+        description = "TCP_QUICKACK";
+#ifdef TCP_QUICKACK
+        level = IPPROTO_TCP;
+        name = TCP_QUICKACK;
+#endif
+        break;
+      case PROXYSOCKET_SOCKOPT_KEEPALIVE_IDLE :
+        description = "TCP_KEEPIDLE";
+        keepalive++;
+#if defined(TCP_KEEPIDLE)
+        level = IPPROTO_TCP;
+        name = TCP_KEEPIDLE;
+#elif defined(TCP_KEEPALIVE)
+        level = IPPROTO_TCP;
+        name = TCP_KEEPALIVE;
+#endif
+        break;
+      case PROXYSOCKET_SOCKOPT_KEEPALIVE_INTERVAL :
+        description = "TCP_KEEPINTVL";
+        keepalive++;
+#ifdef TCP_KEEPINTVL
+        level = IPPROTO_TCP;
+        name = TCP_KEEPINTVL;
+#endif
+        break;
+      case PROXYSOCKET_SOCKOPT_KEEPALIVE_COUNT :
+        description = "TCP_KEEPCNT";
+        keepalive++;
+#ifdef TCP_KEEPCNT
+        level = IPPROTO_TCP;
+        name = TCP_KEEPCNT;
+#endif
+        break;
+      case PROXYSOCKET_SOCKOPT_RCVBUF :
+        description = "SO_RCVBUF";
+        level = SOL_SOCKET;
+        name = SO_RCVBUF;
+        break;
+      case PROXYSOCKET_SOCKOPT_SNDBUF :
+        description = "SO_SNDBUF";
+        level = SOL_SOCKET;
+        name = SO_SNDBUF;
+        break;
+      case PROXYSOCKET_SOCKOPT_NOTSENT_LOWAT :
+        description = "TCP_NOTSENT_LOWAT";
+#ifdef TCP_NOTSENT_LOWAT
+        level = IPPROTO_TCP;
+        name = TCP_NOTSENT_LOWAT;
+#endif
+        break;
+      case PROXYSOCKET_SOCKOPT_TOS :
+        description = "IP_TOS";
+#ifdef IP_TOS
+        level = IPPROTO_IP;
+        name = IP_TOS;
+#endif
+        break;
+      case PROXYSOCKET_SOCKOPT_PRIORITY :
+        description = "SO_PRIORITY";
+#ifdef SO_PRIORITY
+        level = SOL_SOCKET;
+        name = SO_PRIORITY;
+#endif
+        break;
+      case PROXYSOCKET_SOCKOPT_MARK :
+        description = "SO_MARK";
+#ifdef SO_MARK
+        level = SOL_SOCKET;
+        name = SO_MARK;
+#endif
+        break;
+      case PROXYSOCKET_SOCKOPT_USER_TIMEOUT :
+        description = "TCP_USER_TIMEOUT";
+#ifdef TCP_USER_TIMEOUT
+        level = IPPROTO_TCP;
+        name = TCP_USER_TIMEOUT;
+#endif
+        break;
+      case PROXYSOCKET_SOCKOPT_LINGER :
+        {
+          struct linger option_linger;
+          option_linger.l_onoff = 1;
+          option_linger.l_linger = value;
+          if (setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char*)&option_linger, sizeof(option_linger)) != 0)
+            write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Error setting socket option SO_LINGER to %i", value);
+        }
+        continue;
+      default :
+        continue;
+    }
+    if (level == -1) {
+      write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Socket option %s not supported on this platform", description);
+      continue;
+    }
+    if (setsockopt(sock, level, name, (const char*)&value, sizeof(value)) != 0)
+      write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Error setting socket option %s to %i", description, value);
+  }
+  //keepalive parameters only have effect when keepalive is enabled
+  if (keepalive) {
+    value = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (const char*)&value, sizeof(value)) != 0)
+      write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Error setting socket option SO_KEEPALIVE");
+  }
+}
+
+/* * * source address pool * * */
+
+#if defined(__linux__) && !defined(IP_BIND_ADDRESS_NO_PORT)
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+//each thread gets its own slice of the source port range
+static uint32_t source_port_thread_count = 0;
+static THREAD_LOCAL uint32_t source_port_thread_index = 0;
+static THREAD_LOCAL uint32_t source_port_thread_cursor = 0;
+
+//bind socket to the next address of the source address pool, returns the used source or NULL on failure
+struct proxysocket_source_struct* socket_bind_source (proxysocketconfig proxy, SOCKET sock)
+{
+  struct sockaddr_in local_sock_addr;
+  struct proxysocket_source_struct* source;
+  //spread connections over all source addresses
+  source = &proxy->sources[ATOMIC_ADD(&proxy->sourcenext, 1) % proxy->sourcecount];
+  local_sock_addr.sin_family = AF_INET;
+  local_sock_addr.sin_addr.s_addr = source->addr;
+  local_sock_addr.sin_port = 0;
+  if (!proxy->sourcefirstport) {
+    //let the kernel choose the port at connect time so the same port can be used towards different destinations
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    int option_value = 1;
+    setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, (const void*)&option_value, sizeof(option_value));
+#endif
+    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Binding to source address: %s", inet_ntoa(*(struct in_addr*)&local_sock_addr.sin_addr.s_addr));
+    if (bind(sock, (struct sockaddr*)&local_sock_addr, sizeof(local_sock_addr)) == 0)
+      return source;
+  } else {
+    //try all ports in the slice of the port range assigned to this thread
+    uint32_t i;
+    uint32_t rangesize = (uint32_t)(proxy->sourcelastport - proxy->sourcefirstport) + 1;
+    uint32_t slicesize = rangesize / proxy->sourcepartitions;
+    uint32_t slicestart;
+    if (!source_port_thread_index)
+      source_port_thread_index = ATOMIC_ADD(&source_port_thread_count, 1);
+    slicestart = proxy->sourcefirstport + ((source_port_thread_index - 1) % proxy->sourcepartitions) * slicesize;
+    for (i = 0; i < slicesize; i++) {
+      local_sock_addr.sin_port = htons((uint16_t)(slicestart + source_port_thread_cursor++ % slicesize));
+      if (bind(sock, (struct sockaddr*)&local_sock_addr, sizeof(local_sock_addr)) == 0) {
+        write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Bound to source address: %s:%lu", inet_ntoa(*(struct in_addr*)&local_sock_addr.sin_addr.s_addr), (unsigned long)ntohs(local_sock_addr.sin_port));
+        return source;
+      }
+    }
+  }
+  ATOMIC_ADD(&source->stats.failures, 1);
+  return NULL;
+}
+
+/* * * capabilities of proxies learned from connections * * */
+
+#define PROXYSOCKET_CAPABILITY_CACHE_MAGIC     "PSOCKCAP"
+#define PROXYSOCKET_CAPABILITY_CACHE_VERSION   1
+
+struct proxysocket_capability_cache_header {
+  char magic[8];
+  uint32_t byteorder;
+  uint32_t version;
+  uint32_t count;
+  uint32_t stringslen;
+};
+
+//string references are offsets in the string data plus one (like in snapshots), proxies are matched by type, host, port and user
+struct proxysocket_capability_cache_entry {
+  int32_t proxytype;
+  uint32_t proxyhost;
+  uint32_t proxyuser;
+  uint16_t proxyport;
+  uint16_t reserved;
+  uint32_t flags;
+  uint32_t rtt;
+  int64_t updated;
+};
+
+//record what was learned about a proxy (PROXYSOCKET_CAPABILITY_* flags to set and to clear)
+void proxyinfo_learn (struct proxyinfo_struct* proxyinfo, uint32_t setflags, uint32_t clearflags)
+{
+  uint32_t flags = ATOMIC_LOAD(&proxyinfo->runtime->capabilities.flags);
+  //nothing is written when nothing changes so connections through the same proxy don't compete for the cache line
+  if ((flags & setflags) == setflags && !(flags & clearflags) && ATOMIC_LOAD(&proxyinfo->runtime->capabilities.updated))
+    return;
+  if (clearflags)
+    ATOMIC_AND(&proxyinfo->runtime->capabilities.flags, ~clearflags);
+  if (setflags)
+    ATOMIC_OR(&proxyinfo->runtime->capabilities.flags, setflags);
+  ATOMIC_STORE(&proxyinfo->runtime->capabilities.updated, (int64_t)time(NULL));
+}
+
+//record the time it took to connect to a proxy (the shortest one is kept as baseline)
+void proxyinfo_learn_rtt (struct proxyinfo_struct* proxyinfo, uint32_t rtt)
+{
+  if (!(ATOMIC_LOAD(&proxyinfo->runtime->capabilities.flags) & PROXYSOCKET_CAPABILITY_REACHABLE) || rtt < ATOMIC_LOAD(&proxyinfo->runtime->capabilities.rtt))
+    ATOMIC_STORE(&proxyinfo->runtime->capabilities.rtt, rtt);
+  proxyinfo_learn(proxyinfo, PROXYSOCKET_CAPABILITY_REACHABLE, 0);
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_proxy_capabilities (proxysocketconfig proxy, int index, struct proxysocket_proxy_capabilities* capabilities)
+{
+  struct proxyinfo_struct* proxyinfo;
+  if (!proxy || !capabilities || (proxyinfo = proxyinfo_get_by_index(proxy, index)) == NULL)
+    return -1;
+  capabilities->flags = ATOMIC_LOAD(&proxyinfo->runtime->capabilities.flags);
+  capabilities->rtt = ATOMIC_LOAD(&proxyinfo->runtime->capabilities.rtt);
+  capabilities->updated = ATOMIC_LOAD(&proxyinfo->runtime->capabilities.updated);
+  return 0;
+}
+
+//hash of the fields a cached entry is matched with
+uint32_t capability_cache_hash (int proxytype, const char* proxyhost, uint16_t proxyport, const char* proxyuser)
+{
+  uint32_t hash = 2166136261U;
+  hash = (hash ^ (uint8_t)proxytype) * 16777619U;
+  hash = (hash ^ (uint8_t)(proxyport >> 8)) * 16777619U;
+  hash = (hash ^ (uint8_t)proxyport) * 16777619U;
+  while (proxyhost && *proxyhost)
+    hash = (hash ^ (uint8_t)*proxyhost++) * 16777619U;
+  hash = (hash ^ '@') * 16777619U;
+  while (proxyuser && *proxyuser)
+    hash = (hash ^ (uint8_t)*proxyuser++) * 16777619U;
+  return hash;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_save_capabilities (proxysocketconfig proxy, const char* filename)
+{
+  FILE* dst;
+  size_t count;
+  size_t stringslen;
+  struct proxyinfo_struct* proxyinfo;
+  struct proxysocket_capability_cache_entry* records;
+  struct proxysocket_capability_cache_header header;
+  struct string_intern_struct intern;
+  int result = -1;
+  if (!proxy || !filename)
+    return -1;
+  //only proxies something was learned about are stored
+  count = 0;
+  stringslen = 0;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    if (proxyinfo->proxytype == PROXYSOCKET_TYPE_NONE || !ATOMIC_LOAD(&proxyinfo->runtime->capabilities.updated))
+      continue;
+    count++;
+    stringslen += (proxyinfo->proxyhost ? strlen(proxyinfo->proxyhost) + 1 : 0) + (proxyinfo->proxyuser ? strlen(proxyinfo->proxyuser) + 1 : 0);
+  }
+  records = (struct proxysocket_capability_cache_entry*)malloc(count * sizeof(struct proxysocket_capability_cache_entry) + 1);
+  intern.strings = (char*)malloc(stringslen + 1);
+  intern.slots = NULL;
+  if (records && intern.strings && string_intern_init(&intern, intern.strings, count * 2) == 0) {
+    count = 0;
+    for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+      if (proxyinfo->proxytype == PROXYSOCKET_TYPE_NONE || !ATOMIC_LOAD(&proxyinfo->runtime->capabilities.updated))
+        continue;
+      records[count].proxytype = proxyinfo->proxytype;
+      records[count].proxyhost = snapshot_string_reference(&intern, proxyinfo->proxyhost);
+      records[count].proxyuser = snapshot_string_reference(&intern, proxyinfo->proxyuser);
+      records[count].proxyport = proxyinfo->proxyport;
+      records[count].reserved = 0;
+      records[count].flags = ATOMIC_LOAD(&proxyinfo->runtime->capabilities.flags);
+      records[count].rtt = ATOMIC_LOAD(&proxyinfo->runtime->capabilities.rtt);
+      records[count].updated = ATOMIC_LOAD(&proxyinfo->runtime->capabilities.updated);
+      count++;
+    }
+    memcpy(header.magic, PROXYSOCKET_CAPABILITY_CACHE_MAGIC, sizeof(header.magic));
+    header.byteorder = PROXYSOCKET_SNAPSHOT_BYTEORDER;
+    header.version = PROXYSOCKET_CAPABILITY_CACHE_VERSION;
+    header.count = count;
+    header.stringslen = intern.stringslen;
+    //write cache file
+    if ((dst = fopen(filename, "wb")) != NULL) {
+      if (fwrite(&header, sizeof(header), 1, dst) == 1 && fwrite(records, sizeof(struct proxysocket_capability_cache_entry), count, dst) == count && fwrite(intern.strings, 1, intern.stringslen, dst) == intern.stringslen)
+        result = 0;
+      if (fclose(dst) != 0)
+        result = -1;
+    }
+  }
+  free(intern.slots);
+  free(intern.strings);
+  free(records);
+  if (result != 0)
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, "Error writing proxy capability cache file: %s", filename);
+  return result;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_load_capabilities (proxysocketconfig proxy, const char* filename, uint32_t maxage, char** errmsg)
+{
+  const char* data;
+  size_t datalen;
+  void* maphandle;
+  size_t i;
+  size_t slot;
+  size_t slotmask;
+  uint32_t* slots;
+  int64_t now;
+  int matched = 0;
+  const char* strings;
+  const struct proxysocket_capability_cache_header* header;
+  const struct proxysocket_capability_cache_entry* records;
+  const struct proxysocket_capability_cache_entry* record;
+  struct proxyinfo_struct* proxyinfo;
+  if (!proxy || !filename)
+    return -1;
+  if (map_file(filename, &data, &datalen, &maphandle) != 0) {
+    log_and_keep_error_message(proxy, errmsg, "Error opening proxy capability cache file: %s", filename);
+    return -1;
+  }
+  //validate header and string references
+  header = (const struct proxysocket_capability_cache_header*)data;
+  if (datalen < sizeof(struct proxysocket_capability_cache_header) || memcmp(header->magic, PROXYSOCKET_CAPABILITY_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->byteorder != PROXYSOCKET_SNAPSHOT_BYTEORDER || header->version != PROXYSOCKET_CAPABILITY_CACHE_VERSION || (datalen - sizeof(struct proxysocket_capability_cache_header)) / sizeof(struct proxysocket_capability_cache_entry) < header->count || datalen - sizeof(struct proxysocket_capability_cache_header) - (size_t)header->count * sizeof(struct proxysocket_capability_cache_entry) != header->stringslen || (header->stringslen > 0 && data[datalen - 1] != 0)) {
+    unmap_file(data, datalen, maphandle);
+    log_and_keep_error_message(proxy, errmsg, "Invalid proxy capability cache file: %s", filename);
+    return -1;
+  }
+  records = (const struct proxysocket_capability_cache_entry*)(header + 1);
+  strings = (const char*)(records + header->count) - 1;
+  for (i = 0; i < header->count; i++) {
+    if (records[i].proxyhost > header->stringslen || records[i].proxyuser > header->stringslen) {
+      unmap_file(data, datalen, maphandle);
+      log_and_keep_error_message(proxy, errmsg, "Invalid string reference in proxy capability cache file: %s", filename);
+      return -1;
+    }
+  }
+  //index the entries that are recent enough by the fields they are matched with (slots contain index + 1)
+  for (slotmask = 15; slotmask < (size_t)header->count * 2; slotmask = slotmask * 2 + 1)
+    ;
+  if ((slots = (uint32_t*)calloc(slotmask + 1, sizeof(uint32_t))) == NULL) {
+    unmap_file(data, datalen, maphandle);
+    log_and_keep_error_message(proxy, errmsg, memory_allocation_error);
+    return -1;
+  }
+  now = (int64_t)time(NULL);
+  for (i = 0; i < header->count; i++) {
+    if (maxage && records[i].updated + (int64_t)maxage < now)
+      continue;
+    slot = capability_cache_hash(records[i].proxytype, (records[i].proxyhost ? strings + records[i].proxyhost : NULL), records[i].proxyport, (records[i].proxyuser ? strings + records[i].proxyuser : NULL)) & slotmask;
+    while (slots[slot])
+      slot = (slot + 1) & slotmask;
+    slots[slot] = (uint32_t)i + 1;
+  }
+  //apply them to the proxies nothing was learned about yet
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    if (proxyinfo->proxytype == PROXYSOCKET_TYPE_NONE || ATOMIC_LOAD(&proxyinfo->runtime->capabilities.updated))
+      continue;
+    slot = capability_cache_hash(proxyinfo->proxytype, proxyinfo->proxyhost, proxyinfo->proxyport, proxyinfo->proxyuser) & slotmask;
+    for (; slots[slot]; slot = (slot + 1) & slotmask) {
+      record = records + slots[slot] - 1;
+      if (record->proxytype == proxyinfo->proxytype && record->proxyport == proxyinfo->proxyport &&
+          strcmp((record->proxyhost ? strings + record->proxyhost : ""), (proxyinfo->proxyhost ? proxyinfo->proxyhost : "")) == 0 &&
+          strcmp((record->proxyuser ? strings + record->proxyuser : ""), (proxyinfo->proxyuser ? proxyinfo->proxyuser : "")) == 0) {
+        ATOMIC_STORE(&proxyinfo->runtime->capabilities.flags, record->flags);
+        ATOMIC_STORE(&proxyinfo->runtime->capabilities.rtt, record->rtt);
+        ATOMIC_STORE(&proxyinfo->runtime->capabilities.updated, record->updated);
+        matched++;
+        break;
+      }
+    }
+  }
+  free(slots);
+  unmap_file(data, datalen, maphandle);
+  write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Loaded capabilities of %i proxies from: %s", matched, filename);
+  return matched;
+}
+
+/* * * TCP Fast Open * * */
+
+#if defined(__linux__) && !defined(TCP_FASTOPEN_CONNECT)
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+//enable TCP Fast Open so the first data sent on the socket goes in the SYN packet (the kernel falls back to a normal handshake without cookie)
+void socket_enable_fastopen (proxysocketconfig proxy, SOCKET sock)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+  int option_value = 1;
+  if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (const void*)&option_value, sizeof(option_value)) != 0)
+    write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "TCP Fast Open not available");
+#else
+  write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "TCP Fast Open not supported on this platform");
+#endif
+}
+
+//after the first reply from the first proxy, record if the request was sent in the SYN packet (returns non-zero if it was)
+int proxyinfo_update_fastopen_stats (proxysocketconfig proxy, struct proxyinfo_struct* proxyinfo, SOCKET sock)
+{
+#if defined(TCP_FASTOPEN_CONNECT) && defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+  int option_value = 0;
+  socklen_t option_len = sizeof(option_value);
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+  if (getsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (void*)&option_value, &option_len) != 0 || !option_value)
+    return 0;
+  ATOMIC_ADD(&proxyinfo->runtime->state->stats.fastopen_attempts, 1);
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void*)&info, &info_len) == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA)) {
+    ATOMIC_ADD(&proxyinfo->runtime->state->stats.fastopen_successes, 1);
+    proxyinfo_learn(proxyinfo, PROXYSOCKET_CAPABILITY_FASTOPEN, 0);
+    write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Request to proxy %s:%lu was sent with TCP Fast Open", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+/* * * error reporting without memory allocation * * */
+
+static const char* error_phase_strings[] = {
+  "no error",
+  "setup",
+  "name resolution",
+  "connecting",
+  "authentication",
+  "proxy request",
+  "waiting for connection limits",
+  "waiting for incoming connection"
+};
+
+static const char* error_cause_strings[] = {
+  "No error",
+  "Memory allocation error",
+  "Invalid proxy information",
+  "Host name, login or password too long",
+  "Host name lookup failed",
+  "Error creating socket",
+  "Error binding socket",
+  "Error connecting",
+  "Error sending data",
+  "Error receiving data",
+  "Connection closed by proxy",
+  "Timeout",
+  "Invalid response from proxy",
+  "Proxy authentication required",
+  "No supported proxy authentication method",
+  "Proxy authentication failed",
+  "Request rejected by proxy",
+  "Connection handshake aborted",
+  "Timeout waiting for proxy connection limits",
+  "TLS handshake with proxy failed",
+  "Too many requests to proxy"
+};
+
+//get the error code of the last failed socket operation
+int get_socket_error_code ()
+{
+#ifdef _WIN32
+  return WSAGetLastError();
+#else
+  return errno;
+#endif
+}
+
+//write the operating system error message in a buffer (thread-safe)
+void get_system_error_message (int error, char* buf, size_t buflen)
+{
+#ifdef _WIN32
+  DWORD len;
+  if ((len = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, error, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), buf, buflen, NULL)) == 0) {
+    snprintf(buf, buflen, "Error %i", error);
+    return;
+  }
+  //remove trailing new line
+  while (len > 0 && (buf[len - 1] == '\r' || buf[len - 1] == '\n' || buf[len - 1] == ' '))
+    buf[--len] = 0;
+#elif defined(__GLIBC__) && defined(_GNU_SOURCE)
+  //the GNU version may return a static string instead of filling the buffer
+  const char* msg = strerror_r(error, buf, buflen);
+  if (msg != buf) {
+    strncpy(buf, msg, buflen - 1);
+    buf[buflen - 1] = 0;
+  }
+#else
+  if (strerror_r(error, buf, buflen) != 0)
+    snprintf(buf, buflen, "Error %i", error);
+#endif
+}
+
+DLL_EXPORT_PROXYSOCKET const char* proxysocket_error_phase_string (int phase)
+{
+  if (phase < 0 || phase >= (int)(sizeof(error_phase_strings) / sizeof(error_phase_strings[0])))
+    return "unknown phase";
+  return error_phase_strings[phase];
+}
+
+DLL_EXPORT_PROXYSOCKET const char* proxysocket_error_cause_string (int cause)
+{
+  if (cause < 0 || cause >= (int)(sizeof(error_cause_strings) / sizeof(error_cause_strings[0])))
+    return "Unknown error";
+  return error_cause_strings[cause];
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_error_format (const struct proxysocket_error* error, char* buf, size_t buflen)
+{
+  char syserrmsg[128];
+  if (!error)
+    return -1;
+  syserrmsg[0] = 0;
+  if (error->syserror)
+    get_system_error_message(error->syserror, syserrmsg, sizeof(syserrmsg));
+  if (error->status)
+    return snprintf(buf, buflen, "%s (%s, hop %i, status %i)%s%s", proxysocket_error_cause_string(error->cause), proxysocket_error_phase_string(error->phase), error->hop, error->status, (syserrmsg[0] ? ": " : ""), syserrmsg);
+  else
+    return snprintf(buf, buflen, "%s (%s, hop %i)%s%s", proxysocket_error_cause_string(error->cause), proxysocket_error_phase_string(error->phase), error->hop, (syserrmsg[0] ? ": " : ""), syserrmsg);
+}
+
+//fill error details for a failure outside of a handshake
+void set_error (struct proxysocket_error* error, int phase, int cause)
+{
+  if (error) {
+    error->phase = phase;
+    error->cause = cause;
+    error->hop = 0;
+    error->status = 0;
+    error->syserror = 0;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/* * * socket and thread helpers * * */
+
+//don't raise SIGPIPE when the other end was closed
+#ifdef MSG_NOSIGNAL
+#define SOCKET_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SOCKET_SEND_FLAGS 0
+#endif
+
+//change the blocking mode of a socket
+int socket_set_nonblocking (SOCKET sock, int nonblocking)
+{
+#ifdef _WIN32
+  u_long mode = (nonblocking ? 1 : 0);
+  return (ioctlsocket(sock, FIONBIO, &mode) == 0 ? 0 : -1);
+#else
+  int flags;
+  if ((flags = fcntl(sock, F_GETFL, 0)) == -1)
+    return -1;
+  return fcntl(sock, F_SETFL, (nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK));
+#endif
+}
+
+//check if the last socket operation failed because it would block
+int socket_would_block ()
+{
+#ifdef _WIN32
+  int error = WSAGetLastError();
+  return (error == WSAEWOULDBLOCK || error == WSAEINPROGRESS);
+#else
+  return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS);
+#endif
+}
+
+//wait until a socket is ready for reading or writing (timeout in milliseconds, 0 to wait forever), returns zero on timeout
+int socket_wait (SOCKET sock, int status, uint32_t timeout)
+{
+  int result;
+  struct pollfd pollinfo;
+  pollinfo.fd = sock;
+  pollinfo.events = (status == PROXYSOCKET_HANDSHAKE_WANT_READ ? POLLIN : POLLOUT);
+  pollinfo.revents = 0;
+  do {
+    result = poll(&pollinfo, 1, (timeout ? (int)timeout : -1));
+#ifdef _WIN32
+  } while (0);
+#else
+  } while (result < 0 && errno == EINTR);
+#endif
+  return result;
+}
+
+//get monotonic time in milliseconds
+uint64_t get_monotonic_milliseconds ()
+{
+#ifdef _WIN32
+  return GetTickCount64();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+//get monotonic time in microseconds
+uint64_t get_monotonic_microseconds ()
+{
+#ifdef _WIN32
+  LARGE_INTEGER counter;
+  LARGE_INTEGER frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+//create a pair of connected stream sockets (emulated with a loopback connection on Windows)
+int socket_pair (SOCKET sockets[2])
+{
+#ifdef _WIN32
+  SOCKET listener;
+  struct sockaddr_in addr;
+  struct sockaddr_in peeraddr;
+  socklen_t addrlen = sizeof(addr);
+  socklen_t peeraddrlen = sizeof(peeraddr);
+  sockets[0] = sockets[1] = INVALID_SOCKET;
+  if ((listener = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0 && getsockname(listener, (struct sockaddr*)&addr, &addrlen) == 0 && listen(listener, 1) == 0 && (sockets[0] = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) != INVALID_SOCKET && connect(sockets[0], (struct sockaddr*)&addr, sizeof(addr)) == 0 && (sockets[1] = accept(listener, (struct sockaddr*)&peeraddr, &peeraddrlen)) != INVALID_SOCKET) {
+    //make sure no other process connected first
+    addrlen = sizeof(addr);
+    if (getsockname(sockets[0], (struct sockaddr*)&addr, &addrlen) == 0 && addr.sin_port == peeraddr.sin_port) {
+      closesocket(listener);
+      return 0;
+    }
+  }
+  if (sockets[0] != INVALID_SOCKET)
+    closesocket(sockets[0]);
+  if (sockets[1] != INVALID_SOCKET)
+    closesocket(sockets[1]);
+  closesocket(listener);
+  return -1;
+#else
+  return socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+#endif
+}
+
+//start a thread that cleans up after itself when it ends
+#ifdef _WIN32
+int thread_start_detached (LPTHREAD_START_ROUTINE function, void* arg)
+#else
+int thread_start_detached (void* (*function)(void*), void* arg)
+#endif
+{
+#ifdef _WIN32
+  HANDLE thread;
+  if ((thread = CreateThread(NULL, 0, function, arg, 0, NULL)) == NULL)
+    return -1;
+  CloseHandle(thread);
+  return 0;
+#else
+  int result;
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  result = pthread_create(&thread, &attr, function, arg);
+  pthread_attr_destroy(&attr);
+  return (result == 0 ? 0 : -1);
+#endif
+}
+
+#ifdef _WIN32
+typedef HANDLE thread_handle;
+#else
+typedef pthread_t thread_handle;
+#endif
+
+//start a thread that has to be waited for with thread_join()
+#ifdef _WIN32
+int thread_start (thread_handle* thread, LPTHREAD_START_ROUTINE function, void* arg)
+#else
+int thread_start (thread_handle* thread, void* (*function)(void*), void* arg)
+#endif
+{
+#ifdef _WIN32
+  return ((*thread = CreateThread(NULL, 0, function, arg, 0, NULL)) == NULL ? -1 : 0);
+#else
+  return (pthread_create(thread, NULL, function, arg) == 0 ? 0 : -1);
+#endif
+}
+
+//to be called first by each thread started by the library
+void thread_started ()
+{
+  if (thread_start_hook)
+    thread_start_hook(thread_start_hook_data);
+}
+
+//wait for a thread started with thread_start() to end
+void thread_join (thread_handle thread)
+{
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+//suspend the calling thread (time in milliseconds)
+void thread_sleep (uint32_t milliseconds)
+{
+#ifdef _WIN32
+  Sleep(milliseconds);
+#else
+  struct timespec delay;
+  delay.tv_sec = milliseconds / 1000;
+  delay.tv_nsec = (long)(milliseconds % 1000) * 1000000;
+  while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
+    ;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/* * * hierarchical timer wheel * * */
+
+//timers of one event loop thread (not thread safe), insert and cancel take constant time and expiring costs one step per timer and level
+//level 0 has one slot per millisecond, each higher level has slots covering a whole turn of the level below,
+//timers are moved to a lower level (cascaded) when the wheel reaches the start of their slot
+
+#define TIMER_WHEEL_BITS                6
+#define TIMER_WHEEL_SLOTS               (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS              4               //timers up to 64^4 milliseconds (about 4.6 hours) ahead, later ones are cascaded again
+#define TIMER_WHEEL_RANGE               ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+#define TIMER_NOT_PENDING               -1
+#define TIMER_EXPIRED                   -2              //on the list of expired timers
+
+struct timer_entry {
+  struct timer_entry* next;
+  struct timer_entry** pprev;
+  uint64_t expires;                     //monotonic time in milliseconds
+  void* data;
+  int16_t slot;                         //level * TIMER_WHEEL_SLOTS + index, or one of the TIMER_* values
+};
+
+struct timer_wheel {
+  uint64_t now;                         //coarse monotonic time cached by timer_wheel_advance(), all timers up to it are expired
+  uint64_t occupied[TIMER_WHEEL_LEVELS];//bitmap of non-empty slots per level
+  struct timer_entry* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  struct timer_entry* expired;
+  size_t count;                         //number of pending timers (including expired ones not yet taken)
+};
+
+void timer_wheel_init (struct timer_wheel* wheel, uint64_t now)
+{
+  memset(wheel, 0, sizeof(struct timer_wheel));
+  wheel->now = now;
+}
+
+void timer_entry_init (struct timer_entry* entry, void* data)
+{
+  entry->next = NULL;
+  entry->pprev = NULL;
+  entry->expires = 0;
+  entry->data = data;
+  entry->slot = TIMER_NOT_PENDING;
+}
+
+int timer_is_pending (const struct timer_entry* entry)
+{
+  return (entry->slot != TIMER_NOT_PENDING);
+}
+
+void timer_list_insert (struct timer_entry** list, struct timer_entry* entry)
+{
+  if ((entry->next = *list) != NULL)
+    entry->next->pprev = &entry->next;
+  entry->pprev = list;
+  *list = entry;
+}
+
+//index of the lowest bit set (value must not be 0)
+int timer_lowest_bit (uint64_t value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(value);
+#else
+  int bit = 0;
+  while (!(value & 1)) {
+    value >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+//put a timer in the slot matching its expiry time relative to the current time of the wheel
+void timer_wheel_place (struct timer_wheel* wheel, struct timer_entry* entry)
+{
+  int level = 0;
+  int index;
+  uint64_t expires = entry->expires;
+  if (expires <= wheel->now) {
+    entry->slot = TIMER_EXPIRED;
+    timer_list_insert(&wheel->expired, entry);
+    return;
+  }
+  //timers beyond the range of the wheel are cascaded again when their slot is reached
+  if (expires - wheel->now >= TIMER_WHEEL_RANGE)
+    expires = wheel->now + TIMER_WHEEL_RANGE - 1;
+  while (level < TIMER_WHEEL_LEVELS - 1 && expires - wheel->now >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+    level++;
+  index = (int)(expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  entry->slot = (int16_t)(level * TIMER_WHEEL_SLOTS + index);
+  timer_list_insert(&wheel->slots[level][index], entry);
+  wheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+//stop a timer (nothing happens if it is not pending)
+void timer_cancel (struct timer_wheel* wheel, struct timer_entry* entry)
+{
+  int level;
+  int index;
+  if (entry->slot == TIMER_NOT_PENDING)
+    return;
+  if ((*entry->pprev = entry->next) != NULL)
+    entry->next->pprev = entry->pprev;
+  if (entry->slot >= 0) {
+    level = entry->slot / TIMER_WHEEL_SLOTS;
+    index = entry->slot % TIMER_WHEEL_SLOTS;
+    if (!wheel->slots[level][index])
+      wheel->occupied[level] &= ~((uint64_t)1 << index);
+  }
+  entry->next = NULL;
+  entry->pprev = NULL;
+  entry->slot = TIMER_NOT_PENDING;
+  wheel->count--;
+}
+
+//start a timer expiring at the specified monotonic time in milliseconds (a pending timer is moved)
+void timer_add (struct timer_wheel* wheel, struct timer_entry* entry, uint64_t expires)
+{
+  timer_cancel(wheel, entry);
+  entry->expires = expires;
+  timer_wheel_place(wheel, entry);
+  wheel->count++;
+}
+
+//first time after the current time at which a slot of the wheel needs to be processed, 0 if there are no timers in the wheel
+uint64_t timer_wheel_next_tick (const struct timer_wheel* wheel)
+{
+  int level;
+  int shift;
+  int distance;
+  uint64_t bits;
+  uint64_t tick;
+  uint64_t next = 0;
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    if (!wheel->occupied[level])
+      continue;
+    //rotate the bitmap so the slot after the current one comes first (the current slot itself comes last, a whole turn ahead)
+    shift = (int)((wheel->now >> (TIMER_WHEEL_BITS * level)) + 1) & (TIMER_WHEEL_SLOTS - 1);
+    bits = (shift ? (wheel->occupied[level] >> shift) | (wheel->occupied[level] << (TIMER_WHEEL_SLOTS - shift)) : wheel->occupied[level]);
+    distance = timer_lowest_bit(bits) + 1;
+    tick = ((wheel->now >> (TIMER_WHEEL_BITS * level)) + distance) << (TIMER_WHEEL_BITS * level);
+    if (!next || tick < next)
+      next = tick;
+  }
+  return next;
+}
+
+//process the slots of the wheel for one point in time: cascade the higher levels starting a new slot, then expire the level 0 slot
+void timer_wheel_tick (struct timer_wheel* wheel, uint64_t tick)
+{
+  int level;
+  int index;
+  struct timer_entry* entry;
+  struct timer_entry* next;
+  wheel->now = tick;
+  for (level = TIMER_WHEEL_LEVELS - 1; level >= 0; level--) {
+    if (level > 0 && (tick & (((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+      continue;
+    index = (int)(tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    if (!(wheel->occupied[level] & ((uint64_t)1 << index)))
+      continue;
+    entry = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << index);
+    while (entry) {
+      next = entry->next;
+      timer_wheel_place(wheel, entry);
+      entry = next;
+    }
+  }
+}
+
+//update the cached time of the wheel and move the timers that expired to the list of expired timers
+void timer_wheel_advance (struct timer_wheel* wheel, uint64_t now)
+{
+  uint64_t tick;
+  //skip the slots without timers
+  while ((tick = timer_wheel_next_tick(wheel)) != 0 && tick <= now)
+    timer_wheel_tick(wheel, tick);
+  if (now > wheel->now)
+    wheel->now = now;
+}
+
+//take the next expired timer from the wheel, returns NULL when there are none left
+struct timer_entry* timer_wheel_next_expired (struct timer_wheel* wheel)
+{
+  struct timer_entry* entry;
+  if ((entry = wheel->expired) == NULL)
+    return NULL;
+  timer_cancel(wheel, entry);
+  return entry;
+}
+
+//milliseconds to wait for before the wheel needs to be advanced (suitable for poll()), -1 if there are no timers
+int timer_wheel_timeout (const struct timer_wheel* wheel)
+{
+  uint64_t tick;
+  if (wheel->expired)
+    return 0;
+  if ((tick = timer_wheel_next_tick(wheel)) == 0)
+    return -1;
+  return (tick - wheel->now > 0x7FFFFFFF ? 0x7FFFFFFF : (int)(tick - wheel->now));
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/* * * state shared between processes * * */
+
+//a region of fixed-size tables that any number of processes update with atomic operations only (no locks that a crashed process could keep),
+//entries are claimed once and never removed, values that change together are replaced as a single 64-bit word
+
+#define SHARED_MAGIC                    "PSOCKSHM"
+#define SHARED_VERSION                  2
+#define SHARED_DEFAULT_HOSTS            4096
+#define SHARED_DEFAULT_PROXIES          1024
+#define SHARED_DEFAULT_DNS_TTL          60      //seconds
+#define SHARED_NEGATIVE_DNS_TTL         5       //seconds a failed lookup is remembered
+#define SHARED_HOSTNAME_SIZE            256
+#define SHARED_ATTACH_WAIT              1000    //milliseconds to wait for another process to finish creating a named region
+
+#define SHARED_SLOT_FREE                0
+#define SHARED_SLOT_FILLING             1
+#define SHARED_SLOT_READY               2
+
+#define PROXY_LATENCY_WEIGHT            8       //a new latency measurement counts for 1/8 in the moving average
+#define PROXY_RTT_WEIGHT                8       //a new round trip time counts for 1/8 in the smoothed round trip time (like TCP, RFC 6298)
+#define PROXY_RTT_VARIATION_WEIGHT      4       //and its deviation for 1/4 in the mean deviation
+#define PROXY_RTT_VARIATION_FACTOR      4       //a step times out after the smoothed round trip time plus this many times the mean deviation
+#define PROXY_RTO_MAX_BACKOFF           16      //maximum number of times the retransmission timeout is doubled after timeouts
+
+struct shared_region_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t ready;                       //set once the creating process has filled in the header
+  uint64_t size;                        //size of the whole region in bytes
+  uint32_t hostslots;                   //number of entries in the resolver table (power of 2)
+  uint32_t proxyslots;                  //number of entries in the proxy table (power of 2)
+  uint32_t dnsttl;
+  uint32_t reserved;
+  struct proxysocket_shared_stats stats;
+};
+
+//resolver table entry, the host name is written before the slot is marked ready and never changes afterwards
+struct shared_host_entry {
+  uint32_t slot;                        //one of the SHARED_SLOT_* values
+  uint32_t hash;
+  uint64_t result;                      //address (low 32 bits) and time it expires in monotonic seconds (high 32 bits)
+  char hostname[SHARED_HOSTNAME_SIZE];
+};
+
+//proxy table entry
+struct shared_proxy_entry {
+  uint64_t key;                         //hash of type, host, port and user (0 for a free entry)
+  struct proxyinfo_state state;
+};
+
+struct proxysocket_shared_struct {
+  struct shared_region_header* header;
+  struct shared_host_entry* hosts;
+  struct shared_proxy_entry* proxies;
+  size_t size;
+  uint32_t refcount;
+};
+
+uint32_t shared_table_slots (uint32_t maxcount)
+{
+  uint32_t slots = 16;
+  while (slots < maxcount * 2 && slots < 0x40000000)
+    slots <<= 1;
+  return slots;
+}
+
+DLL_EXPORT_PROXYSOCKET proxysocketshared proxysocket_shared_create (const char* name, uint32_t maxhosts, uint32_t maxproxies, uint32_t dnsttl)
+{
+#ifdef _WIN32
+  return NULL;
+#else
+  int fd = -1;
+  int created = 1;
+  void* region;
+  size_t size;
+  uint32_t hostslots = shared_table_slots(maxhosts ? maxhosts : SHARED_DEFAULT_HOSTS);
+  uint32_t proxyslots = shared_table_slots(maxproxies ? maxproxies : SHARED_DEFAULT_PROXIES);
+  struct shared_region_header* header;
+  struct proxysocket_shared_struct* shared;
+  if ((shared = (struct proxysocket_shared_struct*)malloc(sizeof(struct proxysocket_shared_struct))) == NULL)
+    return NULL;
+  size = sizeof(struct shared_region_header) + (size_t)hostslots * sizeof(struct shared_host_entry) + (size_t)proxyslots * sizeof(struct shared_proxy_entry);
+  if (name) {
+    //create the named object or attach to an existing one
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+      if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0600)) < 0) {
+        free(shared);
+        return NULL;
+      }
+      created = 0;
+    }
+  } else {
+#ifdef MFD_CLOEXEC
+    //shows up as /memfd:proxysocket in /proc/<pid>/maps
+    fd = memfd_create("proxysocket", MFD_CLOEXEC);
+#endif
+  }
+  if (!created) {
+    //wait for the creating process to set the size
+    struct stat st;
+    uint64_t deadline = get_monotonic_milliseconds() + SHARED_ATTACH_WAIT;
+    while (fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(struct shared_region_header) && get_monotonic_milliseconds() < deadline)
+      usleep(1000);
+    size = (fstat(fd, &st) == 0 ? (size_t)st.st_size : 0);
+  } else if (fd >= 0 && ftruncate(fd, size) != 0) {
+    size = 0;
+  }
+  if (size < sizeof(struct shared_region_header) || (region = mmap(NULL, size, PROT_READ | PROT_WRITE, (fd >= 0 ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS), fd, 0)) == MAP_FAILED) {
+    if (fd >= 0)
+      close(fd);
+    if (created && name)
+      shm_unlink(name);
+    free(shared);
+    return NULL;
+  }
+  //the mapping stays valid without the file descriptor
+  if (fd >= 0)
+    close(fd);
+  header = (struct shared_region_header*)region;
+  if (created) {
+    //new memory is zero-filled, so all entries are free
+    memcpy(header->magic, SHARED_MAGIC, sizeof(header->magic));
+    header->version = SHARED_VERSION;
+    header->size = size;
+    header->hostslots = hostslots;
+    header->proxyslots = proxyslots;
+    header->dnsttl = (dnsttl ? dnsttl : SHARED_DEFAULT_DNS_TTL);
+    ATOMIC_STORE(&header->ready, 1);
+  } else {
+    uint64_t deadline = get_monotonic_milliseconds() + SHARED_ATTACH_WAIT;
+    while (!ATOMIC_LOAD(&header->ready) && get_monotonic_milliseconds() < deadline)
+      usleep(1000);
+    if (!ATOMIC_LOAD(&header->ready) || memcmp(header->magic, SHARED_MAGIC, sizeof(header->magic)) != 0 || header->version != SHARED_VERSION || header->size != size || sizeof(struct shared_region_header) + (uint64_t)header->hostslots * sizeof(struct shared_host_entry) + (uint64_t)header->proxyslots * sizeof(struct shared_proxy_entry) != size || (header->hostslots & (header->hostslots - 1)) != 0 || (header->proxyslots & (header->proxyslots - 1)) != 0) {
+      munmap(region, size);
+      free(shared);
+      return NULL;
+    }
+  }
+  shared->header = header;
+  shared->hosts = (struct shared_host_entry*)(header + 1);
+  shared->proxies = (struct shared_proxy_entry*)(shared->hosts + header->hostslots);
+  shared->size = size;
+  shared->refcount = 1;
+  return shared;
+#endif
+}
+
+DLL_EXPORT_PROXYSOCKET void proxysocket_shared_free (proxysocketshared shared)
+{
+  if (shared && ATOMIC_SUB(&shared->refcount, 1) == 0) {
+#ifndef _WIN32
+    munmap(shared->header, shared->size);
+#endif
+    free(shared);
+  }
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_shared_remove (const char* name)
+{
+#ifdef _WIN32
+  return -1;
+#else
+  return (name ? shm_unlink(name) : -1);
+#endif
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_shared_get_stats (proxysocketshared shared, struct proxysocket_shared_stats* stats)
+{
+  if (!shared || !stats)
+    return -1;
+  stats->resolver_hits = ATOMIC_LOAD(&shared->header->stats.resolver_hits);
+  stats->resolver_misses = ATOMIC_LOAD(&shared->header->stats.resolver_misses);
+  stats->hosts = ATOMIC_LOAD(&shared->header->stats.hosts);
+  stats->proxies = ATOMIC_LOAD(&shared->header->stats.proxies);
+  stats->table_full = ATOMIC_LOAD(&shared->header->stats.table_full);
+  return 0;
+}
+
+//find the entry of a host name in the resolver table (adding it if needed), returns NULL if the table is full
+struct shared_host_entry* shared_host_entry_get (struct proxysocket_shared_struct* shared, const char* hostname)
+{
+  uint32_t i;
+  uint32_t n;
+  uint32_t slot;
+  const char* p;
+  uint32_t hash = 2166136261U;
+  uint32_t mask = shared->header->hostslots - 1;
+  struct shared_host_entry* entry;
+  for (p = hostname; *p; p++)
+    hash = (hash ^ (uint8_t)tolower((unsigned char)*p)) * 16777619U;
+  for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+    entry = &shared->hosts[i];
+    if ((slot = ATOMIC_LOAD(&entry->slot)) == SHARED_SLOT_FREE) {
+      //claim the entry, another process may claim it first
+      if (ATOMIC_COMPARE_EXCHANGE(&entry->slot, &slot, SHARED_SLOT_FILLING)) {
+        strcpy(entry->hostname, hostname);
+        entry->hash = hash;
+        ATOMIC_STORE(&entry->slot, SHARED_SLOT_READY);
+        ATOMIC_ADD(&shared->header->stats.hosts, 1);
+        return entry;
+      }
+    }
+    //an entry that is still being filled is skipped (at worst a host name ends up in the table twice)
+    if (slot == SHARED_SLOT_READY && entry->hash == hash && strcasecmp(entry->hostname, hostname) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+//look up the address of a host name in the shared resolver cache (resolving it when not cached or expired)
+uint32_t shared_resolve (struct proxysocket_shared_struct* shared, const char* hostname)
+{
+  uint32_t addr;
+  uint32_t now;
+  uint64_t result;
+  struct shared_host_entry* entry;
+  if (!shared || !hostname || !*hostname || strlen(hostname) >= SHARED_HOSTNAME_SIZE || (addr = inet_addr(hostname)) != INADDR_NONE)
+    return get_ipv4_address(hostname);
+  if ((entry = shared_host_entry_get(shared, hostname)) == NULL) {
+    ATOMIC_ADD(&shared->header->stats.table_full, 1);
+    return get_ipv4_address(hostname);
+  }
+  now = (uint32_t)(get_monotonic_milliseconds() / 1000);
+  result = ATOMIC_LOAD(&entry->result);
+  if ((uint32_t)(result >> 32) > now) {
+    ATOMIC_ADD(&shared->header->stats.resolver_hits, 1);
+    return (uint32_t)result;
+  }
+  //processes that find the entry expired at the same time all resolve it, the last result is kept
+  ATOMIC_ADD(&shared->header->stats.resolver_misses, 1);
+  addr = get_ipv4_address(hostname);
+  ATOMIC_STORE(&entry->result, ((uint64_t)(now + (addr == INADDR_NONE ? SHARED_NEGATIVE_DNS_TTL : shared->header->dnsttl)) << 32) | addr);
+  return addr;
+}
+
+//get the address of a host name from the shared resolver cache without resolving it, returns zero if it isn't cached or expired
+int shared_resolve_cached (struct proxysocket_shared_struct* shared, const char* hostname, uint32_t* addr)
+{
+  uint64_t result;
+  struct shared_host_entry* entry;
+  if (strlen(hostname) >= SHARED_HOSTNAME_SIZE || (entry = shared_host_entry_get(shared, hostname)) == NULL)
+    return 0;
+  result = ATOMIC_LOAD(&entry->result);
+  if ((uint32_t)(result >> 32) <= (uint32_t)(get_monotonic_milliseconds() / 1000))
+    return 0;
+  ATOMIC_ADD(&shared->header->stats.resolver_hits, 1);
+  *addr = (uint32_t)result;
+  return 1;
+}
+
+//key a proxy is matched with in the proxy table (never 0)
+uint64_t shared_proxy_key (const struct proxyinfo_struct* proxyinfo)
+{
+  const char* p;
+  uint64_t hash = 14695981039346656037ULL;
+  hash = (hash ^ (uint8_t)proxyinfo->proxytype) * 1099511628211ULL;
+  hash = (hash ^ (uint8_t)(proxyinfo->proxyport >> 8)) * 1099511628211ULL;
+  hash = (hash ^ (uint8_t)proxyinfo->proxyport) * 1099511628211ULL;
+  for (p = proxyinfo->proxyhost; p && *p; p++)
+    hash = (hash ^ (uint8_t)tolower((unsigned char)*p)) * 1099511628211ULL;
+  hash = (hash ^ '@') * 1099511628211ULL;
+  for (p = proxyinfo->proxyuser; p && *p; p++)
+    hash = (hash ^ (uint8_t)*p) * 1099511628211ULL;
+  return (hash ? hash : 1);
+}
+
+//find the state of a proxy in the proxy table (adding it if needed), returns NULL if the table is full
+struct proxyinfo_state* shared_proxy_state_get (struct proxysocket_shared_struct* shared, const struct proxyinfo_struct* proxyinfo)
+{
+  uint32_t i;
+  uint32_t n;
+  uint64_t key = shared_proxy_key(proxyinfo);
+  uint64_t current;
+  uint32_t mask = shared->header->proxyslots - 1;
+  for (i = (uint32_t)key & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+    if ((current = ATOMIC_LOAD(&shared->proxies[i].key)) == 0) {
+      if (ATOMIC_COMPARE_EXCHANGE(&shared->proxies[i].key, &current, key)) {
+        ATOMIC_ADD(&shared->header->stats.proxies, 1);
+        return &shared->proxies[i].state;
+      }
+    }
+    if (current == key)
+      return &shared->proxies[i].state;
+  }
+  return NULL;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_use_shared (proxysocketconfig proxy, proxysocketshared shared)
+{
+  int count = 0;
+  struct proxyinfo_state* state;
+  struct proxyinfo_struct* proxyinfo;
+  if (!proxy || !shared || proxy->shared)
+    return -1;
+  ATOMIC_ADD(&shared->refcount, 1);
+  proxy->shared = shared;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    if (proxyinfo->proxytype == PROXYSOCKET_TYPE_NONE)
+      continue;
+    if ((state = shared_proxy_state_get(shared, proxyinfo)) == NULL) {
+      ATOMIC_ADD(&shared->header->stats.table_full, 1);
+      write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Shared proxy table full, keeping state of proxy %s:%lu in this process", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);
+      continue;
+    }
+    proxyinfo->runtime->state = state;
+    count++;
+  }
+  return count;
+}
+
+//a handshake got through the proxy (latency is the time its hop took in milliseconds)
+void proxyinfo_record_success (struct proxyinfo_struct* proxyinfo, uint32_t latency)
+{
+  uint32_t average;
+  uint32_t updated;
+  uint32_t sample = (latency < 4000000 ? latency * 1000 : 4000000000U);
+  if (ATOMIC_LOAD(&proxyinfo->runtime->state->stats.consecutive_failures))
+    ATOMIC_STORE(&proxyinfo->runtime->state->stats.consecutive_failures, 0);
+  //exponentially weighted moving average updated by any number of threads or processes
+  average = ATOMIC_LOAD(&proxyinfo->runtime->state->latency);
+  do {
+    updated = (average ? (uint32_t)((int64_t)average + ((int64_t)sample - (int64_t)average) / PROXY_LATENCY_WEIGHT) : sample);
+    if (updated == 0)
+      updated = 1;
+  } while (!ATOMIC_COMPARE_EXCHANGE(&proxyinfo->runtime->state->latency, &average, updated));
+}
+
+//a handshake failed at the proxy
+void proxyinfo_record_failure (struct proxyinfo_struct* proxyinfo)
+{
+  ATOMIC_ADD(&proxyinfo->runtime->state->stats.failures, 1);
+  ATOMIC_ADD(&proxyinfo->runtime->state->stats.consecutive_failures, 1);
+  ATOMIC_STORE(&proxyinfo->runtime->state->lastfailure, get_monotonic_milliseconds());
+}
+
+//a handshake step through the proxy completed (rtt is the time from request to reply in microseconds)
+void proxyinfo_record_rtt (struct proxyinfo_struct* proxyinfo, uint32_t rtt)
+{
+  uint64_t current;
+  uint64_t updated;
+  int64_t srtt;
+  int64_t rttvar;
+  //smoothed round trip time and mean deviation updated together by any number of threads or processes
+  current = ATOMIC_LOAD(&proxyinfo->runtime->state->rtt);
+  do {
+    srtt = (int64_t)(uint32_t)current;
+    rttvar = (int64_t)(current >> 32);
+    if (srtt == 0) {
+      srtt = rtt;
+      rttvar = rtt / 2;
+    } else {
+      rttvar += ((srtt > rtt ? srtt - rtt : rtt - srtt) - rttvar) / PROXY_RTT_VARIATION_WEIGHT;
+      srtt += ((int64_t)rtt - srtt) / PROXY_RTT_WEIGHT;
+    }
+    if (srtt == 0)
+      srtt = 1;
+    updated = (uint64_t)srtt | ((uint64_t)rttvar << 32);
+  } while (!ATOMIC_COMPARE_EXCHANGE(&proxyinfo->runtime->state->rtt, &current, updated));
+  //a measured round trip time ends the backoff after timeouts right away (like TCP, RFC 6298)
+  if (ATOMIC_LOAD(&proxyinfo->runtime->state->rtobackoff))
+    ATOMIC_STORE(&proxyinfo->runtime->state->rtobackoff, 0);
+}
+
+//a handshake step through the proxy timed out, double its timeout until the next round trip time is measured (like TCP)
+void proxyinfo_backoff_rtt (struct proxyinfo_struct* proxyinfo)
+{
+  if (ATOMIC_LOAD(&proxyinfo->runtime->state->rtobackoff) < PROXY_RTO_MAX_BACKOFF)
+    ATOMIC_ADD(&proxyinfo->runtime->state->rtobackoff, 1);
+}
+
+//get the retransmission timeout of the proxy in microseconds (0 if nothing is known about the proxy)
+uint64_t proxyinfo_get_rto (struct proxyinfo_struct* proxyinfo)
+{
+  uint64_t rto;
+  uint32_t backoff;
+  uint64_t rtt = ATOMIC_LOAD(&proxyinfo->runtime->state->rtt);
+  if (rtt == 0) {
+    //before the first measurement start from the connection time learned or loaded from a capability cache
+    if (!(ATOMIC_LOAD(&proxyinfo->runtime->capabilities.flags) & PROXYSOCKET_CAPABILITY_REACHABLE))
+      return 0;
+    rtt = (uint64_t)(ATOMIC_LOAD(&proxyinfo->runtime->capabilities.rtt) + 1) * 1000;
+    rto = rtt + PROXY_RTT_VARIATION_FACTOR * (rtt / 2);
+  } else {
+    rto = (uint32_t)rtt + PROXY_RTT_VARIATION_FACTOR * (rtt >> 32);
+  }
+  backoff = ATOMIC_LOAD(&proxyinfo->runtime->state->rtobackoff);
+  return rto << (backoff < PROXY_RTO_MAX_BACKOFF ? backoff : PROXY_RTO_MAX_BACKOFF);
+}
+
+/* * * groups of equivalent proxies * * */
+
+//a group is a run of entries used for the same hop, each entry with PROXYINFO_FLAG_GROUP shares the hop of the next one in the list
+
+#define GROUP_LOAD_WINDOW               1000    //milliseconds in which connections are counted for the load of a proxy
+#define GROUP_FAILURE_THRESHOLD         3       //consecutive failures after which a proxy is avoided
+#define GROUP_RETRY_INTERVAL            10000   //milliseconds after its last failure an avoided proxy is tried again
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_group_proxies (proxysocketconfig proxy, int index, int count)
+{
+  int i;
+  struct proxyinfo_struct* proxyinfo;
+  if (!proxy || index < 1 || count < 1 || index + count > proxysocketconfig_get_proxy_count(proxy))
+    return -1;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to group proxies of frozen proxy information");
+    return -1;
+  }
+  for (i = index + 1; i < index + count; i++) {
+    if ((proxyinfo = proxyinfo_get_by_index(proxy, i)) != NULL)
+      proxyinfo->flags |= PROXYINFO_FLAG_GROUP;
+  }
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_group_selection (proxysocketconfig proxy, int mode, uint32_t maxload)
+{
+  if (!proxy || (mode != PROXYSOCKET_GROUP_SELECT_ROUND_ROBIN && mode != PROXYSOCKET_GROUP_SELECT_AFFINITY) || (maxload > 0 && maxload < 100))
+    return -1;
+  if (proxy->frozen) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to change proxy selection of frozen proxy information");
+    return -1;
+  }
+  proxy->groupselection = mode;
+  proxy->groupmaxload = maxload;
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_hop_count (proxysocketconfig proxy)
+{
+  int count = 0;
+  struct proxyinfo_struct* proxyinfo;
+  if (!proxy)
+    return 0;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    if (!(proxyinfo->flags & PROXYINFO_FLAG_GROUP) || !proxyinfo->next)
+      count++;
+  }
+  return count;
+}
+
+//check if a proxy kept failing recently (the state can be shared with other processes)
+int proxyinfo_is_failing (struct proxyinfo_struct* proxyinfo, uint64_t now)
+{
+  return (ATOMIC_LOAD(&proxyinfo->runtime->state->stats.consecutive_failures) >= GROUP_FAILURE_THRESHOLD && now < ATOMIC_LOAD(&proxyinfo->runtime->state->lastfailure) + GROUP_RETRY_INTERVAL);
+}
+
+//get number of connections made through a proxy in the current and the previous window
+uint32_t proxyinfo_get_load (struct proxyinfo_struct* proxyinfo, uint32_t window)
+{
+  uint32_t load = 0;
+  spin_lock(&proxyinfo->runtime->lock);
+  if (proxyinfo->runtime->load.window == window)
+    load = proxyinfo->runtime->load.current + proxyinfo->runtime->load.previous;
+  else if (proxyinfo->runtime->load.window + 1 == window)
+    load = proxyinfo->runtime->load.current;
+  spin_unlock(&proxyinfo->runtime->lock);
+  return load;
+}
+
+//count a connection made through a proxy
+void proxyinfo_add_load (struct proxyinfo_struct* proxyinfo, uint32_t window)
+{
+  spin_lock(&proxyinfo->runtime->lock);
+  if (proxyinfo->runtime->load.window != window) {
+    proxyinfo->runtime->load.previous = (proxyinfo->runtime->load.window + 1 == window ? proxyinfo->runtime->load.current : 0);
+    proxyinfo->runtime->load.current = 0;
+    proxyinfo->runtime->load.window = window;
+  }
+  proxyinfo->runtime->load.current++;
+  spin_unlock(&proxyinfo->runtime->lock);
+}
+
+//weight of a proxy for a key in rendezvous hashing (highest random weight)
+uint64_t group_rendezvous_weight (uint64_t keyhash, uint64_t proxykey)
+{
+  uint64_t x = keyhash ^ proxykey;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+//select the proxy for a hop from the group of entries first to last (in list order)
+struct proxyinfo_struct* proxy_group_select (proxysocketconfig proxy, struct proxyinfo_struct* first, struct proxyinfo_struct* last, const char* key)
+{
+  const char* p;
+  struct proxyinfo_struct* proxyinfo;
+  struct proxyinfo_struct* selected = NULL;
+  struct proxyinfo_struct* preferred = NULL;
+  uint64_t now = get_monotonic_milliseconds();
+  uint32_t window = (uint32_t)(now / GROUP_LOAD_WINDOW);
+  uint64_t keyhash = 14695981039346656037ULL;
+  uint64_t weight;
+  uint64_t selectedweight = 0;
+  uint64_t preferredweight = 0;
+  uint32_t candidates = 0;
+  uint64_t totalload = 0;
+  uint64_t maxload;
+  uint32_t n;
+  int skipfailing;
+  //proxies that keep failing are only used when all of them do
+  skipfailing = 0;
+  for (proxyinfo = first; proxyinfo; proxyinfo = (proxyinfo == last ? NULL : proxyinfo->next)) {
+    if (!proxyinfo_is_failing(proxyinfo, now)) {
+      skipfailing = 1;
+      break;
+    }
+  }
+  for (proxyinfo = first; proxyinfo; proxyinfo = (proxyinfo == last ? NULL : proxyinfo->next)) {
+    if (!skipfailing || !proxyinfo_is_failing(proxyinfo, now)) {
+      candidates++;
+      totalload += proxyinfo_get_load(proxyinfo, window);
+    }
+  }
+  if (proxy->groupselection == PROXYSOCKET_GROUP_SELECT_AFFINITY) {
+    //rendezvous hashing: adding or removing a proxy only moves the keys it wins or had won,
+    //a proxy with more than its share of the recent connections (bounded load) passes them on to the proxy with the next highest weight
+    for (p = key; p && *p; p++)
+      keyhash = (keyhash ^ (uint8_t)*p) * 1099511628211ULL;
+    maxload = (proxy->groupmaxload ? ((totalload + 1) * proxy->groupmaxload + (uint64_t)candidates * 100 - 1) / ((uint64_t)candidates * 100) : 0);
+    for (proxyinfo = first; proxyinfo; proxyinfo = (proxyinfo == last ? NULL : proxyinfo->next)) {
+      if (skipfailing && proxyinfo_is_failing(proxyinfo, now))
+        continue;
+      weight = group_rendezvous_weight(keyhash, shared_proxy_key(proxyinfo));
+      if (!preferred || weight > preferredweight) {
+        preferred = proxyinfo;
+        preferredweight = weight;
+      }
+      if ((!selected || weight > selectedweight) && (!maxload || proxyinfo_get_load(proxyinfo, window) < maxload)) {
+        selected = proxyinfo;
+        selectedweight = weight;
+      }
+    }
+    if (!selected)
+      selected = preferred;
+  } else {
+    n = ATOMIC_ADD(&proxy->groupnext, 1) % candidates;
+    for (proxyinfo = first; proxyinfo; proxyinfo = (proxyinfo == last ? NULL : proxyinfo->next)) {
+      if (skipfailing && proxyinfo_is_failing(proxyinfo, now))
+        continue;
+      selected = proxyinfo;
+      if (n-- == 0)
+        break;
+    }
+  }
+  proxyinfo_add_load(selected, window);
+  write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Selected %s:%lu from group of %lu proxies for: %s", selected->proxyhost, (unsigned long)selected->proxyport, (unsigned long)candidates, (key ? key : ""));
+  return selected;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/* * * HTTP/2 tunnels multiplexed over shared proxy connections * * */
+
+//each tunnel is one end of a socket pair, the other end is handled by a relay thread that owns one HTTP/2 connection to the proxy
+//the handshake sends its usual HTTP/1.1 CONNECT request over the socket pair and the relay thread turns it into a CONNECT stream
+//and the response headers back into an HTTP/1.1 reply, so authentication and error handling are shared with web proxies
+
+#define HTTP2_FRAME_DATA                0x0
+#define HTTP2_FRAME_HEADERS             0x1
+#define HTTP2_FRAME_PRIORITY            0x2
+#define HTTP2_FRAME_RST_STREAM          0x3
+#define HTTP2_FRAME_SETTINGS            0x4
+#define HTTP2_FRAME_PUSH_PROMISE        0x5
+#define HTTP2_FRAME_PING                0x6
+#define HTTP2_FRAME_GOAWAY              0x7
+#define HTTP2_FRAME_WINDOW_UPDATE       0x8
+#define HTTP2_FRAME_CONTINUATION        0x9
+
+#define HTTP2_FLAG_END_STREAM           0x01
+#define HTTP2_FLAG_ACK                  0x01
+#define HTTP2_FLAG_END_HEADERS          0x04
+#define HTTP2_FLAG_PADDED               0x08
+#define HTTP2_FLAG_PRIORITY             0x20
+
+#define HTTP2_SETTINGS_HEADER_TABLE_SIZE        0x1
+#define HTTP2_SETTINGS_ENABLE_PUSH              0x2
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS   0x3
+#define HTTP2_SETTINGS_INITIAL_WINDOW_SIZE      0x4
+#define HTTP2_SETTINGS_MAX_FRAME_SIZE           0x5
+
+#define HTTP2_ERROR_NO_ERROR            0x0
+#define HTTP2_ERROR_PROTOCOL_ERROR      0x1
+#define HTTP2_ERROR_FLOW_CONTROL_ERROR  0x3
+#define HTTP2_ERROR_FRAME_SIZE_ERROR    0x6
+#define HTTP2_ERROR_CANCEL              0x8
+#define HTTP2_ERROR_COMPRESSION_ERROR   0x9
+
+#define HTTP2_DEFAULT_WINDOW            65535
+#define HTTP2_STREAM_WINDOW             (256 * 1024)    //receive window of each stream (limits data buffered for a slow reader)
+#define HTTP2_CONNECTION_WINDOW         (16 * 1024 * 1024)
+#define HTTP2_MAX_FRAME_SIZE            16384
+#define HTTP2_OUTPUT_LIMIT              (256 * 1024)    //stop reading from tunnels while this much data is waiting to be sent
+#define HTTP2_HEADER_TABLE_SIZE         4096
+#define HTTP2_MAX_HEADER_BLOCK          65536
+#define HTTP2_MAX_REQUEST               8192
+#define HTTP2_SESSION_TUNNELS           16              //tunnels on a connection before another connection is opened
+#define HTTP2_SESSION_IDLE_TIMEOUT      120000          //milliseconds a connection without tunnels is kept open
+
+#define HTTP2_TUNNEL_REQUEST            0               //waiting for the CONNECT request from the handshake
+#define HTTP2_TUNNEL_WAITING            1               //stream opened, waiting for the response headers
+#define HTTP2_TUNNEL_OPEN               2               //relaying data
+#define HTTP2_TUNNEL_CLOSED             3
+
+#define HTTP2_BAD_GATEWAY_RESPONSE      "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+//growable byte buffer (data between pos and len is pending)
+struct http2_buffer {
+  uint8_t* data;
+  size_t pos;
+  size_t len;
+  size_t size;
+};
+
+uint8_t* http2_buffer_reserve (struct http2_buffer* buffer, size_t size)
+{
+  if (buffer->pos > 0 && buffer->pos == buffer->len)
+    buffer->pos = buffer->len = 0;
+  if (buffer->len + size > buffer->size) {
+    uint8_t* data;
+    size_t newsize = (buffer->size ? buffer->size : 256);
+    //move pending data to the front before growing
+    if (buffer->pos > 0) {
+      memmove(buffer->data, buffer->data + buffer->pos, buffer->len - buffer->pos);
+      buffer->len -= buffer->pos;
+      buffer->pos = 0;
+    }
+    while (newsize < buffer->len + size)
+      newsize <<= 1;
+    if (newsize > buffer->size) {
+      if ((data = (uint8_t*)realloc(buffer->data, newsize)) == NULL)
+        return NULL;
+      buffer->data = data;
+      buffer->size = newsize;
+    }
+  }
+  return buffer->data + buffer->len;
+}
+
+int http2_buffer_append (struct http2_buffer* buffer, const void* data, size_t datalen)
+{
+  uint8_t* p;
+  if ((p = http2_buffer_reserve(buffer, datalen)) == NULL)
+    return -1;
+  memcpy(p, data, datalen);
+  buffer->len += datalen;
+  return 0;
+}
+
+void http2_buffer_free (struct http2_buffer* buffer)
+{
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->pos = buffer->len = buffer->size = 0;
+}
+
+/* * * HPACK header compression (RFC 7541) * * */
+
+//number of codes of each length (1 to 30 bits)
+static const uint8_t hpack_huffman_counts[31] = {0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4};
+
+//symbols ordered by code (the code is canonical, so codes of the same length are consecutive)
+static const uint16_t hpack_huffman_symbols[257] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+  52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+  110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+  77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+  119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+  43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+  179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+  163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+  233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+  158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+  144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+  200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+  212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+  2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+  21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+  256
+};
+
+static const char* hpack_static_table[61][2] = {
+  {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+  {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+  {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+  {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""}, {"content-disposition", ""},
+  {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""}, {"content-location", ""}, {"content-range", ""},
+  {"content-type", ""}, {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+  {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+  {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+  {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+  {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""}, {"set-cookie", ""},
+  {"strict-transport-security", ""}, {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+  {"www-authenticate", ""}
+};
+
+#define HPACK_STATIC_TABLE_SIZE         61
+#define HPACK_STATIC_INDEX_AUTHORITY    1
+#define HPACK_STATIC_INDEX_METHOD       2
+#define HPACK_STATIC_INDEX_PROXY_AUTHORIZATION 49
+
+struct hpack_entry {
+  char* name;
+  size_t namelen;
+  char* value;
+  size_t valuelen;
+};
+
+//dynamic table of the decoder (newest entry first)
+struct hpack_decoder {
+  struct hpack_entry* entries;
+  size_t count;
+  size_t alloc;
+  size_t size;
+  size_t maxsize;
+};
+
+typedef void (*hpack_header_fn)(void* callbackdata, const char* name, size_t namelen, const char* value, size_t valuelen);
+
+//encode an integer with the specified prefix length (the first byte already holds the flags)
+size_t hpack_encode_integer (uint8_t* buf, uint8_t flags, int prefixbits, uint32_t value)
+{
+  size_t len = 1;
+  uint32_t max = (1U << prefixbits) - 1;
+  if (value < max) {
+    buf[0] = flags | (uint8_t)value;
+    return 1;
+  }
+  buf[0] = flags | (uint8_t)max;
+  value -= max;
+  while (value >= 128) {
+    buf[len++] = (uint8_t)(value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  buf[len++] = (uint8_t)value;
+  return len;
+}
+
+//encode a header field without adding it to the dynamic table of the proxy (buf must hold 12 bytes more than the value)
+size_t hpack_encode_header (uint8_t* buf, int nameindex, const char* value, int sensitive)
+{
+  size_t len;
+  size_t valuelen = strlen(value);
+  len = hpack_encode_integer(buf, (sensitive ? 0x10 : 0x00), 4, nameindex);
+  len += hpack_encode_integer(buf + len, 0x00, 7, valuelen);
+  memcpy(buf + len, value, valuelen);
+  return len + valuelen;
+}
+
+int hpack_decode_integer (const uint8_t** p, const uint8_t* end, int prefixbits, uint32_t* value)
+{
+  int shift = 0;
+  uint32_t max = (1U << prefixbits) - 1;
+  if (*p >= end)
+    return -1;
+  *value = *(*p)++ & max;
+  if (*value < max)
+    return 0;
+  do {
+    if (*p >= end || shift > 21)
+      return -1;
+    *value += (uint32_t)(**p & 0x7F) << shift;
+    shift += 7;
+  } while (*(*p)++ & 0x80);
+  return 0;
+}
+
+//decode a Huffman encoded string (the result is at most 8/5 times longer than the input)
+int hpack_huffman_decode (const uint8_t* data, size_t datalen, char* out, size_t* outlen)
+{
+  size_t i;
+  int bit;
+  int len = 0;
+  int32_t code = 0;
+  int32_t first = 0;
+  int32_t index = 0;
+  *outlen = 0;
+  for (i = 0; i < datalen; i++) {
+    for (bit = 7; bit >= 0; bit--) {
+      code |= (data[i] >> bit) & 1;
+      len++;
+      if (code - first < hpack_huffman_counts[len]) {
+        //end of string symbol is not allowed
+        if (hpack_huffman_symbols[index + code - first] == 256)
+          return -1;
+        out[(*outlen)++] = (char)hpack_huffman_symbols[index + code - first];
+        code = first = index = len = 0;
+        continue;
+      }
+      index += hpack_huffman_counts[len];
+      first = (first + hpack_huffman_counts[len]) << 1;
+      code <<= 1;
+      if (len >= 30)
+        return -1;
+    }
+  }
+  //padding must be less than 8 bits of the end of string code (all ones)
+  if (len > 7 || (len > 0 && code != ((1 << len) - 1) << 1))
+    return -1;
+  return 0;
+}
+
+//decode a string literal into newly allocated memory
+int hpack_decode_string (const uint8_t** p, const uint8_t* end, char** str, size_t* len)
+{
+  uint32_t n;
+  int huffman;
+  if (*p >= end)
+    return -1;
+  huffman = (**p & 0x80);
+  if (hpack_decode_integer(p, end, 7, &n) != 0 || n > (size_t)(end - *p))
+    return -1;
+  if ((*str = (char*)malloc(huffman ? n * 8 / 5 + 1 : n + 1)) == NULL)
+    return -1;
+  if (huffman) {
+    if (hpack_huffman_decode(*p, n, *str, len) != 0) {
+      free(*str);
+      return -1;
+    }
+  } else {
+    memcpy(*str, *p, n);
+    *len = n;
+  }
+  (*str)[*len] = 0;
+  *p += n;
+  return 0;
+}
+
+void hpack_decoder_evict (struct hpack_decoder* decoder, size_t maxsize)
+{
+  struct hpack_entry* entry;
+  while (decoder->count > 0 && decoder->size > maxsize) {
+    entry = &decoder->entries[--decoder->count];
+    decoder->size -= entry->namelen + entry->valuelen + 32;
+    free(entry->name);
+    free(entry->value);
+  }
+}
+
+//add an entry to the dynamic table (takes ownership of the strings)
+int hpack_decoder_add (struct hpack_decoder* decoder, char* name, size_t namelen, char* value, size_t valuelen)
+{
+  size_t entrysize = namelen + valuelen + 32;
+  if (entrysize > decoder->maxsize) {
+    hpack_decoder_evict(decoder, 0);
+    free(name);
+    free(value);
+    return 0;
+  }
+  hpack_decoder_evict(decoder, decoder->maxsize - entrysize);
+  if (decoder->count >= decoder->alloc) {
+    struct hpack_entry* entries;
+    size_t alloc = (decoder->alloc ? decoder->alloc * 2 : 16);
+    if ((entries = (struct hpack_entry*)realloc(decoder->entries, alloc * sizeof(struct hpack_entry))) == NULL) {
+      free(name);
+      free(value);
+      return -1;
+    }
+    decoder->entries = entries;
+    decoder->alloc = alloc;
+  }
+  memmove(decoder->entries + 1, decoder->entries, decoder->count * sizeof(struct hpack_entry));
+  decoder->entries[0].name = name;
+  decoder->entries[0].namelen = namelen;
+  decoder->entries[0].value = value;
+  decoder->entries[0].valuelen = valuelen;
+  decoder->count++;
+  decoder->size += entrysize;
+  return 0;
+}
+
+void hpack_decoder_free (struct hpack_decoder* decoder)
+{
+  hpack_decoder_evict(decoder, 0);
+  free(decoder->entries);
+}
+
+//look up an entry in the static or dynamic table
+int hpack_decoder_lookup (struct hpack_decoder* decoder, uint32_t index, const char** name, size_t* namelen, const char** value, size_t* valuelen)
+{
+  if (index == 0)
+    return -1;
+  if (index <= HPACK_STATIC_TABLE_SIZE) {
+    *name = hpack_static_table[index - 1][0];
+    *namelen = strlen(*name);
+    *value = hpack_static_table[index - 1][1];
+    *valuelen = strlen(*value);
+    return 0;
+  }
+  if ((index -= HPACK_STATIC_TABLE_SIZE + 1) >= decoder->count)
+    return -1;
+  *name = decoder->entries[index].name;
+  *namelen = decoder->entries[index].namelen;
+  *value = decoder->entries[index].value;
+  *valuelen = decoder->entries[index].valuelen;
+  return 0;
+}
+
+//decode a complete header block and call the callback function for each header field
+int hpack_decode_block (struct hpack_decoder* decoder, const uint8_t* block, size_t blocklen, hpack_header_fn callback, void* callbackdata)
+{
+  uint32_t index;
+  const char* name;
+  size_t namelen;
+  const char* value;
+  size_t valuelen;
+  char* newname;
+  size_t newnamelen;
+  char* newvalue;
+  size_t newvaluelen;
+  int indexing;
+  const uint8_t* p = block;
+  const uint8_t* end = block + blocklen;
+  while (p < end) {
+    if (*p & 0x80) {
+      //indexed header field
+      if (hpack_decode_integer(&p, end, 7, &index) != 0 || hpack_decoder_lookup(decoder, index, &name, &namelen, &value, &valuelen) != 0)
+        return -1;
+      callback(callbackdata, name, namelen, value, valuelen);
+    } else if ((*p & 0xE0) == 0x20) {
+      //dynamic table size update
+      if (hpack_decode_integer(&p, end, 5, &index) != 0 || index > HTTP2_HEADER_TABLE_SIZE)
+        return -1;
+      decoder->maxsize = index;
+      hpack_decoder_evict(decoder, decoder->maxsize);
+    } else {
+      //literal header field (with incremental indexing, without indexing or never indexed)
+      indexing = ((*p & 0xC0) == 0x40);
+      if (hpack_decode_integer(&p, end, (indexing ? 6 : 4), &index) != 0)
+        return -1;
+      if (index == 0) {
+        if (hpack_decode_string(&p, end, &newname, &newnamelen) != 0)
+          return -1;
+      } else {
+        if (hpack_decoder_lookup(decoder, index, &name, &namelen, &value, &valuelen) != 0 || (newname = (char*)malloc(namelen + 1)) == NULL)
+          return -1;
+        memcpy(newname, name, namelen + 1);
+        newnamelen = namelen;
+      }
+      if (hpack_decode_string(&p, end, &newvalue, &newvaluelen) != 0) {
+        free(newname);
+        return -1;
+      }
+      callback(callbackdata, newname, newnamelen, newvalue, newvaluelen);
+      if (indexing) {
+        if (hpack_decoder_add(decoder, newname, newnamelen, newvalue, newvaluelen) != 0)
+          return -1;
+      } else {
+        free(newname);
+        free(newvalue);
+      }
+    }
+  }
+  return 0;
+}
+
+/* * * HTTP/2 sessions * * */
+
+struct http2_tunnel {
+  SOCKET sock;                          //relay end of the socket pair
+  int state;                            //one of the HTTP2_TUNNEL_* values
+  uint32_t streamid;
+  int32_t sendwindow;
+  uint32_t recvunacked;                 //data passed on to the caller that was not yet granted back to the proxy
+  size_t responselen;                   //length of the HTTP/1.1 response at the start of the pending data
+  int status;                           //status of the response being received
+  struct http2_buffer request;          //CONNECT request from the handshake or headers of the response being received
+  struct http2_buffer pending;          //data waiting to be written to the socket pair
+  int8_t localclosed;                   //end of data from the caller was sent to the proxy
+  int8_t remoteclosed;                  //end of data from the proxy was received
+  int8_t shutdown;                      //end of data was passed on to the caller
+};
+
+struct http2_session {
+  struct http2_pool* pool;
+  char* proxyhost;
+  uint16_t proxyport;
+  uint32_t timeout;
+  SOCKET sock;
+  SOCKET wakeup[2];                     //socket pair used to wake up the relay thread
+  int lock;                             //protects newtunnels
+  SOCKET* newtunnels;
+  size_t newcount;
+  size_t newalloc;
+  struct http2_tunnel** tunnels;
+  size_t tunnelcount;
+  size_t tunnelalloc;
+  uint32_t load;                        //number of tunnels assigned to this session
+  int8_t closing;                       //no new streams can be opened
+  int8_t removed;                       //no new tunnels are assigned to this session
+  uint32_t nextstreamid;
+  uint32_t openstreams;
+  uint32_t maxstreams;
+  int32_t initialwindow;
+  uint32_t maxframesize;
+  int32_t sendwindow;
+  uint32_t recvunacked;
+  struct http2_buffer input;
+  struct http2_buffer output;
+  struct http2_buffer headerblock;
+  uint32_t headerstream;
+  struct hpack_decoder decoder;
+};
+
+void http2_write_frame_header (uint8_t* p, size_t len, uint8_t type, uint8_t flags, uint32_t streamid)
+{
+  p[0] = (uint8_t)(len >> 16);
+  p[1] = (uint8_t)(len >> 8);
+  p[2] = (uint8_t)len;
+  p[3] = type;
+  p[4] = flags;
+  p[5] = (uint8_t)(streamid >> 24) & 0x7F;
+  p[6] = (uint8_t)(streamid >> 16);
+  p[7] = (uint8_t)(streamid >> 8);
+  p[8] = (uint8_t)streamid;
+}
+
+uint32_t http2_read_uint32 (const uint8_t* p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void http2_write_uint32 (uint8_t* p, uint32_t value)
+{
+  p[0] = (uint8_t)(value >> 24);
+  p[1] = (uint8_t)(value >> 16);
+  p[2] = (uint8_t)(value >> 8);
+  p[3] = (uint8_t)value;
+}
+
+//queue a frame to be sent to the proxy
+int http2_send_frame (struct http2_session* session, uint8_t type, uint8_t flags, uint32_t streamid, const void* payload, size_t payloadlen)
+{
+  uint8_t* p;
+  if ((p = http2_buffer_reserve(&session->output, 9 + payloadlen)) == NULL)
+    return -1;
+  http2_write_frame_header(p, payloadlen, type, flags, streamid);
+  if (payloadlen > 0)
+    memcpy(p + 9, payload, payloadlen);
+  session->output.len += 9 + payloadlen;
+  return 0;
+}
+
+int http2_send_window_update (struct http2_session* session, uint32_t streamid, uint32_t increment)
+{
+  uint8_t payload[4];
+  http2_write_uint32(payload, increment);
+  return http2_send_frame(session, HTTP2_FRAME_WINDOW_UPDATE, 0, streamid, payload, 4);
+}
+
+int http2_send_rst_stream (struct http2_session* session, uint32_t streamid, uint32_t errorcode)
+{
+  uint8_t payload[4];
+  http2_write_uint32(payload, errorcode);
+  return http2_send_frame(session, HTTP2_FRAME_RST_STREAM, 0, streamid, payload, 4);
+}
+
+int http2_send_goaway (struct http2_session* session, uint32_t errorcode)
+{
+  uint8_t payload[8];
+  http2_write_uint32(payload, 0);
+  http2_write_uint32(payload + 4, errorcode);
+  return http2_send_frame(session, HTTP2_FRAME_GOAWAY, 0, 0, payload, 8);
+}
+
+struct http2_tunnel* http2_find_tunnel (struct http2_session* session, uint32_t streamid)
+{
+  size_t i;
+  for (i = 0; i < session->tunnelcount; i++) {
+    if (session->tunnels[i]->streamid == streamid && session->tunnels[i]->state != HTTP2_TUNNEL_CLOSED)
+      return session->tunnels[i];
+  }
+  return NULL;
+}
+
+//the stream of a tunnel has ended
+void http2_tunnel_end_stream (struct http2_session* session, struct http2_tunnel* tunnel)
+{
+  if (tunnel->streamid) {
+    tunnel->streamid = 0;
+    session->openstreams--;
+  }
+}
+
+//close a tunnel (a handshake still waiting for a response gets a 502 response)
+void http2_tunnel_close (struct http2_session* session, struct http2_tunnel* tunnel)
+{
+  if (tunnel->state == HTTP2_TUNNEL_CLOSED)
+    return;
+  if (tunnel->state != HTTP2_TUNNEL_OPEN)
+    send(tunnel->sock, HTTP2_BAD_GATEWAY_RESPONSE, sizeof(HTTP2_BAD_GATEWAY_RESPONSE) - 1, SOCKET_SEND_FLAGS);
+  http2_tunnel_end_stream(session, tunnel);
+  tunnel->state = HTTP2_TUNNEL_CLOSED;
+}
+
+//open a stream for the CONNECT request received from the handshake
+int http2_tunnel_open_stream (struct http2_session* session, struct http2_tunnel* tunnel)
+{
+  char* p;
+  char* line;
+  char* authority = NULL;
+  char* authorization = NULL;
+  uint8_t* block;
+  size_t blocklen;
+  //parse the request (as generated by handshake_http_connect_request())
+  line = (char*)tunnel->request.data;
+  for (p = line; *p; p++) {
+    if (*p != '\r' && *p != '\n')
+      continue;
+    *p = 0;
+    if (line == (char*)tunnel->request.data) {
+      if (strncmp(line, "CONNECT ", 8) == 0 && (authority = strchr(line + 8, ' ')) != NULL) {
+        *authority = 0;
+        authority = line + 8;
+      }
+    } else if (strncasecmp(line, "Proxy-Authorization: ", 21) == 0) {
+      authorization = line + 21;
+    }
+    line = p + 1;
+  }
+  if (!authority)
+    return -1;
+  //send the request headers (encoded without modifying the dynamic table of the proxy)
+  if ((block = http2_buffer_reserve(&session->output, 9 + 31 + strlen(authority) + (authorization ? 12 + strlen(authorization) : 0))) == NULL)
+    return -1;
+  blocklen = hpack_encode_header(block + 9, HPACK_STATIC_INDEX_METHOD, "CONNECT", 0);
+  blocklen += hpack_encode_header(block + 9 + blocklen, HPACK_STATIC_INDEX_AUTHORITY, authority, 0);
+  if (authorization)
+    blocklen += hpack_encode_header(block + 9 + blocklen, HPACK_STATIC_INDEX_PROXY_AUTHORIZATION, authorization, 1);
+  if (blocklen > session->maxframesize)
+    return -1;
+  tunnel->streamid = session->nextstreamid;
+  session->nextstreamid += 2;
+  session->openstreams++;
+  http2_write_frame_header(block, blocklen, HTTP2_FRAME_HEADERS, HTTP2_FLAG_END_HEADERS, tunnel->streamid);
+  session->output.len += 9 + blocklen;
+  tunnel->state = HTTP2_TUNNEL_WAITING;
+  tunnel->sendwindow = session->initialwindow;
+  tunnel->recvunacked = 0;
+  tunnel->status = 0;
+  tunnel->request.pos = tunnel->request.len = 0;
+  return 0;
+}
+
+void http2_response_header (void* callbackdata, const char* name, size_t namelen, const char* value, size_t valuelen)
+{
+  struct http2_tunnel* tunnel = (struct http2_tunnel*)callbackdata;
+  if (!tunnel)
+    return;
+  if (namelen == 7 && memcmp(name, ":status", 7) == 0) {
+    tunnel->status = atoi(value);
+  } else if (namelen == 18 && memcmp(name, "proxy-authenticate", 18) == 0) {
+    //keep authentication challenges so they can be answered by the handshake
+    if (http2_buffer_append(&tunnel->request, "Proxy-Authenticate: ", 20) == 0 && http2_buffer_append(&tunnel->request, value, valuelen) == 0)
+      http2_buffer_append(&tunnel->request, "\r\n", 2);
+  }
+}
+
+//process a complete header block received from the proxy
+int http2_process_headers (struct http2_session* session, uint32_t streamid, int endstream)
+{
+  char status[64];
+  struct http2_tunnel* tunnel = http2_find_tunnel(session, streamid);
+  if (tunnel && tunnel->state != HTTP2_TUNNEL_WAITING)
+    tunnel = NULL;
+  if (tunnel)
+    tunnel->request.pos = tunnel->request.len = 0;
+  //the header block must always be decoded to keep the dynamic table in sync
+  if (hpack_decode_block(&session->decoder, session->headerblock.data, session->headerblock.len, http2_response_header, tunnel) != 0) {
+    http2_send_goaway(session, HTTP2_ERROR_COMPRESSION_ERROR);
+    return -1;
+  }
+  session->headerblock.pos = session->headerblock.len = 0;
+  if (!tunnel)
+    return 0;
+  //pass the response to the handshake as an HTTP/1.1 response
+  if (tunnel->status >= 200 && tunnel->status < 300) {
+    snprintf(status, sizeof(status), "HTTP/1.1 %i Connection established\r\n\r\n", tunnel->status);
+    tunnel->state = HTTP2_TUNNEL_OPEN;
+  } else {
+    //the handshake can send another request on the same tunnel (e.g. after an authentication challenge)
+    snprintf(status, sizeof(status), "HTTP/1.1 %i HTTP/2 proxy response\r\n", (tunnel->status > 0 ? tunnel->status : 502));
+    if (!endstream)
+      http2_send_rst_stream(session, tunnel->streamid, HTTP2_ERROR_CANCEL);
+    http2_tunnel_end_stream(session, tunnel);
+    tunnel->state = HTTP2_TUNNEL_REQUEST;
+  }
+  if (http2_buffer_append(&tunnel->pending, status, strlen(status)) != 0)
+    return -1;
+  if (tunnel->state == HTTP2_TUNNEL_REQUEST) {
+    if (http2_buffer_append(&tunnel->pending, tunnel->request.data + tunnel->request.pos, tunnel->request.len - tunnel->request.pos) != 0 || http2_buffer_append(&tunnel->pending, "Content-Length: 0\r\n\r\n", 21) != 0)
+      return -1;
+    tunnel->request.pos = tunnel->request.len = 0;
+  }
+  tunnel->responselen += tunnel->pending.len - tunnel->pending.pos;
+  if (endstream && tunnel->state == HTTP2_TUNNEL_OPEN) {
+    tunnel->remoteclosed = 1;
+    http2_tunnel_end_stream(session, tunnel);
+  }
+  return 0;
+}
+
+//apply the settings of the proxy
+int http2_process_settings (struct http2_session* session, const uint8_t* payload, size_t len)
+{
+  size_t i;
+  size_t j;
+  uint16_t id;
+  uint32_t value;
+  if (len % 6 != 0)
+    return -1;
+  for (i = 0; i < len; i += 6) {
+    id = ((uint16_t)payload[i] << 8) | payload[i + 1];
+    value = http2_read_uint32(payload + i + 2);
+    switch (id) {
+      case HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS :
+        session->maxstreams = value;
+        break;
+      case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE :
+        if (value > 0x7FFFFFFF)
+          return -1;
+        //adjust the send windows of all streams
+        for (j = 0; j < session->tunnelcount; j++) {
+          if (session->tunnels[j]->streamid)
+            session->tunnels[j]->sendwindow += (int32_t)value - session->initialwindow;
+        }
+        session->initialwindow = (int32_t)value;
+        break;
+      case HTTP2_SETTINGS_MAX_FRAME_SIZE :
+        if (value < HTTP2_MAX_FRAME_SIZE || value > 0xFFFFFF)
+          return -1;
+        session->maxframesize = value;
+        break;
+    }
+  }
+  return http2_send_frame(session, HTTP2_FRAME_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+}
+
+//process a frame received from the proxy, returns -1 on connection errors
+int http2_process_frame (struct http2_session* session, uint8_t type, uint8_t flags, uint32_t streamid, const uint8_t* payload, size_t len)
+{
+  size_t i;
+  size_t padding = 0;
+  uint32_t value;
+  struct http2_tunnel* tunnel;
+  //a header block must be continued without any other frames in between
+  if (session->headerstream && (type != HTTP2_FRAME_CONTINUATION || streamid != session->headerstream))
+    return -1;
+  switch (type) {
+    case HTTP2_FRAME_DATA :
+      if (!streamid)
+        return -1;
+      //grant the connection window right away, the stream windows limit what is buffered
+      session->recvunacked += len;
+      if (session->recvunacked >= HTTP2_CONNECTION_WINDOW / 2) {
+        http2_send_window_update(session, 0, session->recvunacked);
+        session->recvunacked = 0;
+      }
+      if (flags & HTTP2_FLAG_PADDED) {
+        if (len < 1 || (padding = payload[0] + 1) > len)
+          return -1;
+      }
+      if ((tunnel = http2_find_tunnel(session, streamid)) == NULL || tunnel->state != HTTP2_TUNNEL_OPEN)
+        return 0;
+      //padding does not reach the caller, so grant it back immediately
+      tunnel->recvunacked += padding;
+      if (http2_buffer_append(&tunnel->pending, payload + (padding > 0 ? 1 : 0), len - padding) != 0)
+        return -1;
+      if (flags & HTTP2_FLAG_END_STREAM) {
+        tunnel->remoteclosed = 1;
+        http2_tunnel_end_stream(session, tunnel);
+      }
+      return 0;
+    case HTTP2_FRAME_HEADERS :
+      if (!streamid)
+        return -1;
+      i = 0;
+      if (flags & HTTP2_FLAG_PADDED) {
+        if (len < 1 || (padding = payload[0]) + 1 > len)
+          return -1;
+        i = 1;
+      }
+      if (flags & HTTP2_FLAG_PRIORITY)
+        i += 5;
+      if (i + padding > len)
+        return -1;
+      session->headerblock.pos = session->headerblock.len = 0;
+      if (http2_buffer_append(&session->headerblock, payload + i, len - i - padding) != 0)
+        return -1;
+      if (!(flags & HTTP2_FLAG_END_HEADERS)) {
+        session->headerstream = streamid;
+        //remember end of stream flag in the unused top bit
+        if (flags & HTTP2_FLAG_END_STREAM)
+          session->headerstream |= 0x80000000;
+        return 0;
+      }
+      return http2_process_headers(session, streamid, flags & HTTP2_FLAG_END_STREAM);
+    case HTTP2_FRAME_CONTINUATION :
+      if (!session->headerstream || session->headerblock.len + len > HTTP2_MAX_HEADER_BLOCK)
+        return -1;
+      if (http2_buffer_append(&session->headerblock, payload, len) != 0)
+        return -1;
+      if (flags & HTTP2_FLAG_END_HEADERS) {
+        value = session->headerstream;
+        session->headerstream = 0;
+        return http2_process_headers(session, value & 0x7FFFFFFF, value & 0x80000000);
+      }
+      return 0;
+    case HTTP2_FRAME_RST_STREAM :
+      if ((tunnel = http2_find_tunnel(session, streamid)) != NULL) {
+        http2_tunnel_end_stream(session, tunnel);
+        http2_tunnel_close(session, tunnel);
+      }
+      return 0;
+    case HTTP2_FRAME_SETTINGS :
+      if (streamid)
+        return -1;
+      if (flags & HTTP2_FLAG_ACK)
+        return 0;
+      return http2_process_settings(session, payload, len);
+    case HTTP2_FRAME_PING :
+      if (len != 8)
+        return -1;
+      if (flags & HTTP2_FLAG_ACK)
+        return 0;
+      return http2_send_frame(session, HTTP2_FRAME_PING, HTTP2_FLAG_ACK, 0, payload, 8);
+    case HTTP2_FRAME_GOAWAY :
+      if (len < 8)
+        return -1;
+      //streams the proxy did not process can't be continued
+      value = http2_read_uint32(payload) & 0x7FFFFFFF;
+      session->closing = 1;
+      for (i = 0; i < session->tunnelcount; i++) {
+        if (session->tunnels[i]->streamid > value || session->tunnels[i]->state == HTTP2_TUNNEL_REQUEST)
+          http2_tunnel_close(session, session->tunnels[i]);
+      }
+      return 0;
+    case HTTP2_FRAME_WINDOW_UPDATE :
+      if (len != 4)
+        return -1;
+      value = http2_read_uint32(payload) & 0x7FFFFFFF;
+      if (!streamid)
+        session->sendwindow += value;
+      else if ((tunnel = http2_find_tunnel(session, streamid)) != NULL)
+        tunnel->sendwindow += value;
+      return 0;
+    case HTTP2_FRAME_PUSH_PROMISE :
+      //server push was disabled
+      return -1;
+    default :
+      return 0;
+  }
+}
+
+//read and process frames from the proxy, returns -1 when the connection can't be used anymore
+int http2_session_receive (struct http2_session* session)
+{
+  int n;
+  size_t len;
+  const uint8_t* p;
+  for (;;) {
+    if (http2_buffer_reserve(&session->input, 16384) == NULL)
+      return -1;
+    if ((n = recv(session->sock, (char*)session->input.data + session->input.len, session->input.size - session->input.len, 0)) <= 0) {
+      if (n < 0 && socket_would_block())
+        break;
+      return -1;
+    }
+    session->input.len += n;
+    //process all complete frames
+    while (session->input.len - session->input.pos >= 9) {
+      p = session->input.data + session->input.pos;
+      len = ((size_t)p[0] << 16) | ((size_t)p[1] << 8) | p[2];
+      if (len > HTTP2_MAX_FRAME_SIZE) {
+        http2_send_goaway(session, HTTP2_ERROR_FRAME_SIZE_ERROR);
+        return -1;
+      }
+      if (session->input.len - session->input.pos < 9 + len)
+        break;
+      if (http2_process_frame(session, p[3], p[4], http2_read_uint32(p + 5) & 0x7FFFFFFF, p + 9, len) != 0) {
+        http2_send_goaway(session, HTTP2_ERROR_PROTOCOL_ERROR);
+        return -1;
+      }
+      session->input.pos += 9 + len;
+    }
+  }
+  return 0;
+}
+
+//send queued frames to the proxy
+int http2_session_flush (struct http2_session* session)
+{
+  int n;
+  while (session->output.pos < session->output.len) {
+    if ((n = send(session->sock, (const char*)session->output.data + session->output.pos, session->output.len - session->output.pos, SOCKET_SEND_FLAGS)) < 0)
+      return (socket_would_block() ? 0 : -1);
+    session->output.pos += n;
+  }
+  session->output.pos = session->output.len = 0;
+  return 0;
+}
+
+//handle data from the handshake or the caller
+void http2_tunnel_receive (struct http2_session* session, struct http2_tunnel* tunnel)
+{
+  int n;
+  size_t len;
+  uint8_t* p;
+  if (tunnel->state == HTTP2_TUNNEL_REQUEST) {
+    //read the CONNECT request
+    if ((p = http2_buffer_reserve(&tunnel->request, 512)) == NULL) {
+      http2_tunnel_close(session, tunnel);
+      return;
+    }
+    if ((n = recv(tunnel->sock, (char*)p, tunnel->request.size - tunnel->request.len - 1, 0)) <= 0) {
+      if (n == 0 || !socket_would_block())
+        http2_tunnel_close(session, tunnel);
+      return;
+    }
+    tunnel->request.len += n;
+    tunnel->request.data[tunnel->request.len] = 0;
+    if (tunnel->request.len > HTTP2_MAX_REQUEST)
+      http2_tunnel_close(session, tunnel);
+    return;
+  }
+  //relay data as far as the flow control windows allow (other tunnels may have used up the connection window since the poll,
+  //and reading nothing would look like the end of data)
+  if (tunnel->sendwindow <= 0 || session->sendwindow <= 0)
+    return;
+  len = session->maxframesize;
+  if ((int32_t)len > tunnel->sendwindow)
+    len = tunnel->sendwindow;
+  if ((int32_t)len > session->sendwindow)
+    len = session->sendwindow;
+  if ((p = http2_buffer_reserve(&session->output, 9 + len)) == NULL) {
+    http2_tunnel_close(session, tunnel);
+    return;
+  }
+  if ((n = recv(tunnel->sock, (char*)p + 9, len, 0)) < 0) {
+    if (!socket_would_block()) {
+      http2_send_rst_stream(session, tunnel->streamid, HTTP2_ERROR_CANCEL);
+      http2_tunnel_close(session, tunnel);
+    }
+    return;
+  }
+  http2_write_frame_header(p, n, HTTP2_FRAME_DATA, (n == 0 ? HTTP2_FLAG_END_STREAM : 0), tunnel->streamid);
+  session->output.len += 9 + n;
+  tunnel->sendwindow -= n;
+  session->sendwindow -= n;
+  if (n == 0) {
+    tunnel->localclosed = 1;
+    if (tunnel->remoteclosed)
+      tunnel->state = HTTP2_TUNNEL_CLOSED;
+  }
+}
+
+//pass data from the proxy on to the handshake or the caller
+void http2_tunnel_send (struct http2_session* session, struct http2_tunnel* tunnel)
+{
+  int n;
+  size_t datalen;
+  while (tunnel->pending.pos < tunnel->pending.len) {
+    if ((n = send(tunnel->sock, (const char*)tunnel->pending.data + tunnel->pending.pos, tunnel->pending.len - tunnel->pending.pos, SOCKET_SEND_FLAGS)) < 0) {
+      if (!socket_would_block()) {
+        if (tunnel->streamid)
+          http2_send_rst_stream(session, tunnel->streamid, HTTP2_ERROR_CANCEL);
+        http2_tunnel_end_stream(session, tunnel);
+        tunnel->state = HTTP2_TUNNEL_CLOSED;
+      }
+      break;
+    }
+    tunnel->pending.pos += n;
+    //only relayed data counts for flow control
+    datalen = (size_t)n;
+    if (tunnel->responselen > 0) {
+      size_t responselen = (tunnel->responselen < datalen ? tunnel->responselen : datalen);
+      tunnel->responselen -= responselen;
+      datalen -= responselen;
+    }
+    tunnel->recvunacked += datalen;
+  }
+  if (tunnel->streamid && !tunnel->remoteclosed && tunnel->recvunacked >= HTTP2_STREAM_WINDOW / 2) {
+    http2_send_window_update(session, tunnel->streamid, tunnel->recvunacked);
+    tunnel->recvunacked = 0;
+  }
+  //end of data from the proxy
+  if (tunnel->state == HTTP2_TUNNEL_OPEN && tunnel->remoteclosed && !tunnel->shutdown && tunnel->pending.pos == tunnel->pending.len) {
+    shutdown(tunnel->sock, SHUT_WR);
+    tunnel->shutdown = 1;
+    if (tunnel->localclosed)
+      tunnel->state = HTTP2_TUNNEL_CLOSED;
+  }
+}
+
+void http2_tunnel_free (struct http2_tunnel* tunnel)
+{
+  closesocket(tunnel->sock);
+  http2_buffer_free(&tunnel->request);
+  http2_buffer_free(&tunnel->pending);
+  free(tunnel);
+}
+
+//take over tunnels added by proxysocket_connect() calls
+int http2_session_accept_tunnels (struct http2_session* session)
+{
+  size_t i;
+  struct http2_tunnel* tunnel;
+  char buf[64];
+  while (recv(session->wakeup[1], buf, sizeof(buf), 0) > 0)
+    ;
+  spin_lock(&session->lock);
+  for (i = 0; i < session->newcount; i++) {
+    if (session->tunnelcount >= session->tunnelalloc) {
+      struct http2_tunnel** tunnels;
+      size_t alloc = (session->tunnelalloc ? session->tunnelalloc * 2 : 16);
+      if ((tunnels = (struct http2_tunnel**)realloc(session->tunnels, alloc * sizeof(struct http2_tunnel*))) == NULL)
+        break;
+      session->tunnels = tunnels;
+      session->tunnelalloc = alloc;
+    }
+    if ((tunnel = (struct http2_tunnel*)calloc(1, sizeof(struct http2_tunnel))) == NULL)
+      break;
+    tunnel->sock = session->newtunnels[i];
+    tunnel->state = HTTP2_TUNNEL_REQUEST;
+    session->tunnels[session->tunnelcount++] = tunnel;
+  }
+  //tunnels that could not be added are closed
+  for (; i < session->newcount; i++) {
+    closesocket(session->newtunnels[i]);
+    ATOMIC_SUB(&session->load, 1);
+  }
+  session->newcount = 0;
+  spin_unlock(&session->lock);
+  return 0;
+}
+
+//stop assigning new tunnels to a session (if idleonly is set only when it has no tunnels), returns non-zero if the session was removed
+int http2_pool_remove_session (struct http2_session* session, int idleonly)
+{
+  size_t i;
+  struct http2_pool* pool = session->pool;
+  spin_lock(&pool->lock);
+  if (idleonly && ATOMIC_LOAD(&session->load) > 0) {
+    spin_unlock(&pool->lock);
+    return 0;
+  }
+  session->removed = 1;
+  session->closing = 1;
+  for (i = 0; i < pool->sessioncount; i++) {
+    if (pool->sessions[i] == session) {
+      pool->sessions[i] = pool->sessions[--pool->sessioncount];
+      break;
+    }
+  }
+  spin_unlock(&pool->lock);
+  return 1;
+}
+
+//stop assigning new tunnels to a session and take over the ones that were already assigned
+void http2_session_remove (struct http2_session* session)
+{
+  if (session->removed)
+    return;
+  http2_pool_remove_session(session, 0);
+  http2_session_accept_tunnels(session);
+}
+
+//connect to the proxy and send the connection preface
+int http2_session_connect (struct http2_session* session)
+{
+  int option_value = 1;
+  uint8_t settings[18];
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(session->proxyport);
+  if ((addr.sin_addr.s_addr = get_ipv4_address(session->proxyhost)) == INADDR_NONE)
+    return -1;
+  if ((session->sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET)
+    return -1;
+  setsockopt(session->sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&option_value, sizeof(option_value));
+  if (socket_set_nonblocking(session->sock, 1) != 0)
+    return -1;
+  if (connect(session->sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    int error = 0;
+    socklen_t errorlen = sizeof(error);
+    if (!socket_would_block() || socket_wait(session->sock, PROXYSOCKET_HANDSHAKE_WANT_WRITE, session->timeout) <= 0)
+      return -1;
+    if (getsockopt(session->sock, SOL_SOCKET, SO_ERROR, (char*)&error, &errorlen) != 0 || error != 0)
+      return -1;
+  }
+  //connection preface followed by settings (no server push, larger stream windows) and a larger connection window
+  if (http2_buffer_append(&session->output, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24) != 0)
+    return -1;
+  settings[0] = 0;
+  settings[1] = HTTP2_SETTINGS_ENABLE_PUSH;
+  http2_write_uint32(settings + 2, 0);
+  settings[6] = 0;
+  settings[7] = HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+  http2_write_uint32(settings + 8, HTTP2_STREAM_WINDOW);
+  settings[12] = 0;
+  settings[13] = HTTP2_SETTINGS_MAX_FRAME_SIZE;
+  http2_write_uint32(settings + 14, HTTP2_MAX_FRAME_SIZE);
+  if (http2_send_frame(session, HTTP2_FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) != 0)
+    return -1;
+  if (http2_send_window_update(session, 0, HTTP2_CONNECTION_WINDOW - HTTP2_DEFAULT_WINDOW) != 0)
+    return -1;
+  return 0;
+}
+
+void http2_session_free (struct http2_session* session)
+{
+  size_t i;
+  for (i = 0; i < session->tunnelcount; i++)
+    http2_tunnel_free(session->tunnels[i]);
+  for (i = 0; i < session->newcount; i++)
+    closesocket(session->newtunnels[i]);
+  if (session->sock != INVALID_SOCKET)
+    closesocket(session->sock);
+  closesocket(session->wakeup[0]);
+  closesocket(session->wakeup[1]);
+  http2_buffer_free(&session->input);
+  http2_buffer_free(&session->output);
+  http2_buffer_free(&session->headerblock);
+  hpack_decoder_free(&session->decoder);
+  free(session->tunnels);
+  free(session->newtunnels);
+  free(session->proxyhost);
+  free(session);
+}
+
+//relay thread of a session
+void http2_session_run (struct http2_session* session)
+{
+  size_t i;
+  size_t j;
+  size_t count;
+  size_t pollcount;
+  struct pollfd* pollinfo = NULL;
+  size_t pollalloc = 0;
+  struct http2_tunnel* tunnel;
+  struct timer_wheel timers;
+  struct timer_entry idletimer;
+  struct timer_entry* entry;
+  int failed = (http2_session_connect(session) != 0);
+  timer_wheel_init(&timers, get_monotonic_milliseconds());
+  timer_entry_init(&idletimer, NULL);
+  for (;;) {
+    http2_session_accept_tunnels(session);
+    //a session that can't open new streams anymore is replaced by a new one
+    if (failed || session->closing || session->nextstreamid >= 0x7FFFFFFF)
+      http2_session_remove(session);
+    if (failed) {
+      for (i = 0; i < session->tunnelcount; i++)
+        http2_tunnel_close(session, session->tunnels[i]);
+    }
+    //open streams for complete CONNECT requests
+    for (i = 0; i < session->tunnelcount; i++) {
+      tunnel = session->tunnels[i];
+      if (tunnel->state == HTTP2_TUNNEL_REQUEST && tunnel->request.len > 0 && strstr((const char*)tunnel->request.data, "\r\n\r\n") && !session->closing && session->openstreams < session->maxstreams) {
+        if (http2_tunnel_open_stream(session, tunnel) != 0)
+          http2_tunnel_close(session, tunnel);
+      }
+      if (tunnel->state == HTTP2_TUNNEL_REQUEST && session->closing)
+        http2_tunnel_close(session, tunnel);
+    }
+    //remove closed tunnels
+    for (i = j = 0; i < session->tunnelcount; i++) {
+      if (session->tunnels[i]->state == HTTP2_TUNNEL_CLOSED) {
+        http2_tunnel_free(session->tunnels[i]);
+        ATOMIC_SUB(&session->load, 1);
+      } else {
+        session->tunnels[j++] = session->tunnels[i];
+      }
+    }
+    session->tunnelcount = j;
+    if (!failed && http2_session_flush(session) != 0)
+      failed = 1;
+    //end when no tunnels are left and no new ones can be added
+    if (session->tunnelcount == 0 && (session->removed || ATOMIC_LOAD(&session->pool->released))) {
+      http2_session_remove(session);
+      if (session->tunnelcount > 0)
+        continue;
+      break;
+    }
+    if (failed)
+      continue;
+    //close the connection when it stays without tunnels for too long
+    if (session->tunnelcount == 0 && !session->removed) {
+      if (!timer_is_pending(&idletimer))
+        timer_add(&timers, &idletimer, timers.now + HTTP2_SESSION_IDLE_TIMEOUT);
+    } else {
+      timer_cancel(&timers, &idletimer);
+    }
+    //wait for the proxy connection, the wakeup socket and all tunnels
+    count = session->tunnelcount + 3;
+    if (count > pollalloc) {
+      struct pollfd* newpollinfo;
+      if ((newpollinfo = (struct pollfd*)realloc(pollinfo, count * 2 * sizeof(struct pollfd))) == NULL) {
+        failed = 1;
+        continue;
+      }
+      pollinfo = newpollinfo;
+      pollalloc = count * 2;
+    }
+    pollinfo[0].fd = session->sock;
+    pollinfo[0].events = POLLIN | (session->output.pos < session->output.len ? POLLOUT : 0);
+    pollinfo[1].fd = session->wakeup[1];
+    pollinfo[1].events = POLLIN;
+    pollcount = 2;
+    for (i = 0; i < session->tunnelcount; i++) {
+      tunnel = session->tunnels[i];
+      pollinfo[pollcount].fd = tunnel->sock;
+      pollinfo[pollcount].events = 0;
+      if (tunnel->state == HTTP2_TUNNEL_REQUEST || (tunnel->state == HTTP2_TUNNEL_OPEN && !tunnel->localclosed && tunnel->sendwindow > 0 && session->sendwindow > 0 && session->output.len < HTTP2_OUTPUT_LIMIT))
+        pollinfo[pollcount].events |= POLLIN;
+      if (tunnel->pending.pos < tunnel->pending.len)
+        pollinfo[pollcount].events |= POLLOUT;
+      pollinfo[pollcount++].revents = 0;
+    }
+    //the pool wakeup socket is closed when the proxy information is released
+    if (!ATOMIC_LOAD(&session->pool->released)) {
+      pollinfo[pollcount].fd = session->pool->wakeup[0];
+      pollinfo[pollcount].events = POLLIN;
+      pollinfo[pollcount++].revents = 0;
+    }
+    pollinfo[0].revents = 0;
+    pollinfo[1].revents = 0;
+    if (poll(pollinfo, pollcount, timer_wheel_timeout(&timers)) < 0) {
+#ifndef _WIN32
+      if (errno == EINTR)
+        continue;
+#endif
+      failed = 1;
+      continue;
+    }
+    timer_wheel_advance(&timers, get_monotonic_milliseconds());
+    while ((entry = timer_wheel_next_expired(&timers)) != NULL) {
+      if (entry == &idletimer)
+        http2_pool_remove_session(session, 1);
+    }
+    if (pollinfo[0].revents && http2_session_receive(session) != 0)
+      failed = 1;
+    for (i = 0; i < session->tunnelcount; i++) {
+      tunnel = session->tunnels[i];
+      if (tunnel->state == HTTP2_TUNNEL_CLOSED)
+        continue;
+      if (pollinfo[i + 2].revents & (POLLOUT | POLLERR | POLLHUP))
+        http2_tunnel_send(session, tunnel);
+      if ((pollinfo[i + 2].revents & (POLLIN | POLLERR | POLLHUP)) && (pollinfo[i + 2].events & POLLIN) && tunnel->state != HTTP2_TUNNEL_CLOSED)
+        http2_tunnel_receive(session, tunnel);
+    }
+    //data for tunnels that were not writable before is sent right away (as is the end of a stream that ended without data)
+    for (i = 0; i < session->tunnelcount; i++) {
+      if (session->tunnels[i]->state != HTTP2_TUNNEL_CLOSED && (session->tunnels[i]->pending.pos < session->tunnels[i]->pending.len || (session->tunnels[i]->remoteclosed && !session->tunnels[i]->shutdown)))
+        http2_tunnel_send(session, session->tunnels[i]);
+    }
+  }
+  free(pollinfo);
+  http2_pool_unref(session->pool);
+  http2_session_free(session);
+}
+
+#ifdef _WIN32
+DWORD WINAPI http2_session_thread (LPVOID arg)
+#else
+void* http2_session_thread (void* arg)
+#endif
+{
+  thread_started();
+  http2_session_run((struct http2_session*)arg);
+  return 0;
+}
+
+//create a session and start its relay thread (called with the pool locked)
+struct http2_session* http2_session_create (struct http2_pool* pool, proxysocketconfig proxy, struct proxyinfo_struct* proxyinfo)
+{
+  struct http2_session* session;
+  if ((session = (struct http2_session*)calloc(1, sizeof(struct http2_session))) == NULL)
+    return NULL;
+  session->pool = pool;
+  session->proxyport = proxyinfo->proxyport;
+  session->timeout = proxy->sendtimeout;
+  session->sock = INVALID_SOCKET;
+  session->nextstreamid = 1;
+  session->maxstreams = 100;
+  session->initialwindow = HTTP2_DEFAULT_WINDOW;
+  session->maxframesize = HTTP2_MAX_FRAME_SIZE;
+  session->sendwindow = HTTP2_DEFAULT_WINDOW;
+  session->decoder.maxsize = HTTP2_HEADER_TABLE_SIZE;
+  if ((session->proxyhost = strdup(proxyinfo->proxyhost)) == NULL || socket_pair(session->wakeup) != 0) {
+    free(session->proxyhost);
+    free(session);
+    return NULL;
+  }
+  socket_set_nonblocking(session->wakeup[0], 1);
+  socket_set_nonblocking(session->wakeup[1], 1);
+  ATOMIC_ADD(&pool->refcount, 1);
+  if (thread_start_detached(http2_session_thread, session) == 0)
+    return session;
+  ATOMIC_SUB(&pool->refcount, 1);
+  closesocket(session->wakeup[0]);
+  closesocket(session->wakeup[1]);
+  free(session->proxyhost);
+  free(session);
+  return NULL;
+}
+
+//get a socket for a new tunnel through an HTTP/2 proxy (the handshake continues with a CONNECT request on it)
+SOCKET http2_open_tunnel (proxysocketconfig proxy, struct proxyinfo_struct* proxyinfo)
+{
+  size_t i;
+  SOCKET sockets[2];
+  struct http2_pool* pool;
+  struct http2_session* session = NULL;
+  //create the pool of connections for this proxy when it is first used
+  spin_lock(&proxyinfo->runtime->lock);
+  if ((pool = proxyinfo->runtime->http2pool) == NULL) {
+    if ((pool = (struct http2_pool*)calloc(1, sizeof(struct http2_pool))) != NULL) {
+      pool->refcount = 1;
+      pool->maxsessions = proxy->http2connections;
+      if ((pool->sessions = (struct http2_session**)malloc(pool->maxsessions * sizeof(struct http2_session*))) == NULL || socket_pair(pool->wakeup) != 0) {
+        free(pool->sessions);
+        free(pool);
+        pool = NULL;
+      }
+    }
+    proxyinfo->runtime->http2pool = pool;
+  }
+  spin_unlock(&proxyinfo->runtime->lock);
+  if (!pool || socket_pair(sockets) != 0)
+    return INVALID_SOCKET;
+  socket_set_nonblocking(sockets[1], 1);
+  //use the least loaded session, adding sessions for busy ones until the maximum number of connections is reached
+  spin_lock(&pool->lock);
+  for (i = 0; i < pool->sessioncount; i++) {
+    if (!session || ATOMIC_LOAD(&pool->sessions[i]->load) < ATOMIC_LOAD(&session->load))
+      session = pool->sessions[i];
+  }
+  if ((!session || ATOMIC_LOAD(&session->load) >= HTTP2_SESSION_TUNNELS) && pool->sessioncount < pool->maxsessions) {
+    struct http2_session* newsession;
+    if ((newsession = http2_session_create(pool, proxy, proxyinfo)) != NULL)
+      session = pool->sessions[pool->sessioncount++] = newsession;
+  }
+  if (session) {
+    spin_lock(&session->lock);
+    if (session->newcount >= session->newalloc) {
+      SOCKET* newtunnels;
+      size_t alloc = (session->newalloc ? session->newalloc * 2 : 16);
+      if ((newtunnels = (SOCKET*)realloc(session->newtunnels, alloc * sizeof(SOCKET))) != NULL) {
+        session->newtunnels = newtunnels;
+        session->newalloc = alloc;
+      }
+    }
+    if (session->newcount < session->newalloc) {
+      session->newtunnels[session->newcount++] = sockets[1];
+      ATOMIC_ADD(&session->load, 1);
+      sockets[1] = INVALID_SOCKET;
+    }
+    spin_unlock(&session->lock);
+    send(session->wakeup[0], "", 1, SOCKET_SEND_FLAGS);
+  }
+  spin_unlock(&pool->lock);
+  if (sockets[1] != INVALID_SOCKET) {
+    closesocket(sockets[0]);
+    closesocket(sockets[1]);
+    return INVALID_SOCKET;
+  }
+  return sockets[0];
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/* * * TLS connections to HTTPS proxies * * */
+
+//the handshake hands its connection to the proxy over to a relay thread (one per proxy) and continues on one end of a socket pair,
+//the relay thread performs the TLS handshake (resuming a cached session and sending the CONNECT request as early data when possible)
+
+#ifdef HAVE_OPENSSL
+
+#define TLS_TUNNEL_EARLY_DATA           0               //waiting for the request to send as early data
+#define TLS_TUNNEL_HANDSHAKE            1
+#define TLS_TUNNEL_OPEN                 2
+#define TLS_TUNNEL_CLOSED               3
+
+#define TLS_BUFFER_SIZE                 16384
+
+struct tls_tunnel {
+  SOCKET sock;                          //relay end of the socket pair
+  SOCKET proxysock;                     //connection to the proxy
+  SSL* ssl;
+  struct tls_tunnel_result* result;
+  int state;                            //one of the TLS_TUNNEL_* values
+  short proxyevents;                    //events the TLS connection is waiting for
+  int8_t ready;                         //an event occurred since the tunnel was last handled
+  int8_t localclosed;                   //end of data from the caller was passed on
+  int8_t remoteclosed;                  //end of data from the proxy was received
+  int8_t shutdown;                      //end of data was passed on to the caller
+  size_t outpos;
+  size_t outlen;
+  size_t inpos;
+  size_t inlen;
+  uint8_t out[TLS_BUFFER_SIZE];         //data from the caller waiting to be encrypted
+  uint8_t in[TLS_BUFFER_SIZE];          //decrypted data waiting to be passed on to the caller
+};
+
+//keep sessions (TLS 1.3 tickets or TLS 1.2 sessions) received from the proxy for later connections
+int tls_new_session (SSL* ssl, SSL_SESSION* session)
+{
+  struct tls_proxy* tls = (struct tls_proxy*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  if (!SSL_SESSION_is_resumable(session))
+    return 0;
+  spin_lock(&tls->lock);
+  if (tls->sessioncount == TLS_SESSION_CACHE_SIZE) {
+    SSL_SESSION_free(tls->sessions[0]);
+    memmove(tls->sessions, tls->sessions + 1, --tls->sessioncount * sizeof(SSL_SESSION*));
+  }
+  tls->sessions[tls->sessioncount++] = session;
+  spin_unlock(&tls->lock);
+  return 1;
+}
+
+//get the most recent session from the cache (TLS 1.3 tickets are only used once)
+SSL_SESSION* tls_proxy_get_session (struct tls_proxy* tls)
+{
+  SSL_SESSION* session = NULL;
+  spin_lock(&tls->lock);
+  if (tls->sessioncount > 0) {
+    session = tls->sessions[tls->sessioncount - 1];
+    if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION)
+      tls->sessioncount--;
+    else
+      SSL_SESSION_up_ref(session);
+  }
+  spin_unlock(&tls->lock);
+  return session;
+}
+
+struct tls_proxy* tls_proxy_create (proxysocketconfig proxy)
+{
+  struct tls_proxy* tls;
+  if ((tls = (struct tls_proxy*)calloc(1, sizeof(struct tls_proxy))) == NULL)
+    return NULL;
+  tls->refcount = 1;
+  if (socket_pair(tls->wakeup) != 0) {
+    free(tls);
+    return NULL;
+  }
+  socket_set_nonblocking(tls->wakeup[0], 1);
+  socket_set_nonblocking(tls->wakeup[1], 1);
+  if ((tls->ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+    tls_proxy_unref(tls);
+    return NULL;
+  }
+  //verify the certificate of the proxy
+  SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_PEER, NULL);
+  if ((proxy->tlscafile ? SSL_CTX_load_verify_locations(tls->ctx, proxy->tlscafile, NULL) : SSL_CTX_set_default_verify_paths(tls->ctx)) != 1) {
+    tls_proxy_unref(tls);
+    return NULL;
+  }
+  SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+  SSL_CTX_set_mode(tls->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  SSL_CTX_set_options(tls->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+  //keep sessions in the cache of the proxy instead of the internal one
+  SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(tls->ctx, tls_new_session);
+  SSL_CTX_set_app_data(tls->ctx, tls);
+  return tls;
+}
+
+void tls_tunnel_free (struct tls_tunnel* tunnel)
+{
+  SSL_free(tunnel->ssl);
+  closesocket(tunnel->sock);
+  closesocket(tunnel->proxysock);
+  tls_tunnel_result_unref(tunnel->result);
+  free(tunnel);
+}
+
+//check if a TLS operation has to wait for the connection to the proxy (and remember what to wait for)
+int tls_tunnel_wait (struct tls_tunnel* tunnel, int result)
+{
+  switch (SSL_get_error(tunnel->ssl, result)) {
+    case SSL_ERROR_WANT_READ :
+      tunnel->proxyevents |= POLLIN;
+      return 1;
+    case SSL_ERROR_WANT_WRITE :
+      tunnel->proxyevents |= POLLOUT;
+      return 1;
+    default :
+      return 0;
+  }
+}
+
+//the TLS handshake failed, keep the reason for the handshake (which sees the tunnel closed once it is freed)
+void tls_tunnel_fail (struct tls_tunnel* tunnel)
+{
+  long verifyresult = SSL_get_verify_result(tunnel->ssl);
+  const char* reason = (verifyresult != X509_V_OK ? X509_verify_cert_error_string(verifyresult) : ERR_reason_error_string(ERR_peek_last_error()));
+  snprintf(tunnel->result->reason, sizeof(tunnel->result->reason), "%s", (reason ? reason : "connection closed"));
+  ATOMIC_STORE(&tunnel->result->failed, 1);
+  tunnel->state = TLS_TUNNEL_CLOSED;
+}
+
+//relay as much data as possible in both directions without blocking
+void tls_tunnel_relay (struct tls_proxy* tls, struct tls_tunnel* tunnel)
+{
+  int n;
+  int error;
+  int progress;
+  ERR_clear_error();
+  tunnel->proxyevents = 0;
+  if (tunnel->state == TLS_TUNNEL_EARLY_DATA) {
+    size_t written;
+    //send the request along with the handshake
+    if (tunnel->outlen == 0) {
+      if ((n = recv(tunnel->sock, (char*)tunnel->out, sizeof(tunnel->out), 0)) < 0 && socket_would_block())
+        return;
+      if (n <= 0) {
+        tunnel->state = TLS_TUNNEL_CLOSED;
+        return;
+      }
+      tunnel->outlen = n;
+    }
+    if (SSL_write_early_data(tunnel->ssl, tunnel->out, tunnel->outlen, &written) != 1) {
+      if (!tls_tunnel_wait(tunnel, 0))
+        tls_tunnel_fail(tunnel);
+      return;
+    }
+    tunnel->state = TLS_TUNNEL_HANDSHAKE;
+  }
+  if (tunnel->state == TLS_TUNNEL_HANDSHAKE) {
+    if ((n = SSL_connect(tunnel->ssl)) != 1) {
+      if (!tls_tunnel_wait(tunnel, n))
+        tls_tunnel_fail(tunnel);
+      return;
+    }
+    ATOMIC_ADD(&tls->handshakes, 1);
+    if (SSL_session_reused(tunnel->ssl))
+      ATOMIC_ADD(&tls->resumptions, 1);
+    //send the request again if it was not accepted as early data
+    if (tunnel->outlen > 0) {
+      if (SSL_get_early_data_status(tunnel->ssl) == SSL_EARLY_DATA_ACCEPTED) {
+        ATOMIC_ADD(&tls->earlydata, 1);
+        tunnel->outpos = tunnel->outlen;
+      } else {
+        tunnel->outpos = 0;
+      }
+    }
+    tunnel->state = TLS_TUNNEL_OPEN;
+  }
+  do {
+    progress = 0;
+    tunnel->proxyevents = 0;
+    //from the caller to the proxy
+    if (tunnel->outpos == tunnel->outlen && !tunnel->localclosed) {
+      tunnel->outpos = tunnel->outlen = 0;
+      if ((n = recv(tunnel->sock, (char*)tunnel->out, sizeof(tunnel->out), 0)) > 0) {
+        tunnel->outlen = n;
+        progress = 1;
+      } else if (n == 0 || !socket_would_block()) {
+        //pass on the end of data (the proxy can still send data)
+        tunnel->localclosed = 1;
+        SSL_shutdown(tunnel->ssl);
+      }
+    }
+    if (tunnel->outpos < tunnel->outlen) {
+      if ((n = SSL_write(tunnel->ssl, tunnel->out + tunnel->outpos, tunnel->outlen - tunnel->outpos)) > 0) {
+        tunnel->outpos += n;
+        progress = 1;
+      } else if (!tls_tunnel_wait(tunnel, n)) {
+        tunnel->state = TLS_TUNNEL_CLOSED;
+        return;
+      }
+    }
+    //from the proxy to the caller
+    if (tunnel->inpos == tunnel->inlen && !tunnel->remoteclosed) {
+      tunnel->inpos = tunnel->inlen = 0;
+      if ((n = SSL_read(tunnel->ssl, tunnel->in, sizeof(tunnel->in))) > 0) {
+        tunnel->inlen = n;
+        progress = 1;
+      } else if ((error = SSL_get_error(tunnel->ssl, n)) == SSL_ERROR_WANT_READ) {
+        tunnel->proxyevents |= POLLIN;
+      } else if (error == SSL_ERROR_WANT_WRITE) {
+        tunnel->proxyevents |= POLLOUT;
+      } else {
+        //closed by the proxy (with or without close notification)
+        tunnel->remoteclosed = 1;
+      }
+    }
+    if (tunnel->inpos < tunnel->inlen) {
+      if ((n = send(tunnel->sock, (const char*)tunnel->in + tunnel->inpos, tunnel->inlen - tunnel->inpos, SOCKET_SEND_FLAGS)) > 0) {
+        tunnel->inpos += n;
+        progress = 1;
+      } else if (!socket_would_block()) {
+        tunnel->state = TLS_TUNNEL_CLOSED;
+        return;
+      }
+    }
+  } while (progress);
+  //pass on the end of data from the proxy once everything was passed on
+  if (tunnel->remoteclosed && tunnel->inpos == tunnel->inlen && !tunnel->shutdown) {
+    shutdown(tunnel->sock, SHUT_WR);
+    tunnel->shutdown = 1;
+  }
+  //both directions ended normally, keep the session resumable even if the proxy closed before the close notification was sent
+  if (tunnel->shutdown && tunnel->localclosed) {
+    SSL_set_shutdown(tunnel->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    tunnel->state = TLS_TUNNEL_CLOSED;
+  }
+}
+
+//relay thread of an HTTPS proxy, ends when there are no more tunnels
+void tls_relay_run (struct tls_proxy* tls)
+{
+  size_t i;
+  size_t j;
+  size_t pollcount;
+  char buf[64];
+  struct tls_tunnel** tunnels = NULL;
+  size_t tunnelcount = 0;
+  size_t tunnelalloc = 0;
+  struct pollfd* pollinfo = NULL;
+  struct tls_tunnel* tunnel;
+  for (;;) {
+    //take over new tunnels
+    while (recv(tls->wakeup[1], buf, sizeof(buf), 0) > 0)
+      ;
+    spin_lock(&tls->lock);
+    if (tunnelcount + tls->newcount > tunnelalloc) {
+      struct tls_tunnel** newtunnels;
+      struct pollfd* newpollinfo;
+      size_t alloc = (tunnelcount + tls->newcount) * 2;
+      if ((newtunnels = (struct tls_tunnel**)realloc(tunnels, alloc * sizeof(struct tls_tunnel*))) != NULL)
+        tunnels = newtunnels;
+      if ((newpollinfo = (struct pollfd*)realloc(pollinfo, (alloc * 2 + 1) * sizeof(struct pollfd))) != NULL)
+        pollinfo = newpollinfo;
+      if (newtunnels && newpollinfo)
+        tunnelalloc = alloc;
+    }
+    for (i = 0; i < tls->newcount; i++) {
+      if (tunnelcount < tunnelalloc) {
+        tls->newtunnels[i]->ready = 1;
+        tunnels[tunnelcount++] = tls->newtunnels[i];
+      } else {
+        tls_tunnel_free(tls->newtunnels[i]);
+      }
+    }
+    tls->newcount = 0;
+    //the thread ends when there is nothing left to do (a new one is started for new tunnels)
+    if (tunnelcount == 0)
+      tls->running = 0;
+    spin_unlock(&tls->lock);
+    if (tunnelcount == 0)
+      break;
+    //handle tunnels with pending events and remove closed ones
+    for (i = j = 0; i < tunnelcount; i++) {
+      tunnel = tunnels[i];
+      if (tunnel->ready) {
+        tunnel->ready = 0;
+        tls_tunnel_relay(tls, tunnel);
+      }
+      if (tunnel->state == TLS_TUNNEL_CLOSED)
+        tls_tunnel_free(tunnel);
+      else
+        tunnels[j++] = tunnel;
+    }
+    if ((tunnelcount = j) == 0)
+      continue;
+    //wait for the wakeup socket and both ends of all tunnels
+    pollinfo[0].fd = tls->wakeup[1];
+    pollinfo[0].events = POLLIN;
+    pollinfo[0].revents = 0;
+    pollcount = 1;
+    for (i = 0; i < tunnelcount; i++) {
+      tunnel = tunnels[i];
+      pollinfo[pollcount].fd = tunnel->sock;
+      pollinfo[pollcount].events = 0;
+      if (tunnel->state == TLS_TUNNEL_EARLY_DATA || (tunnel->state == TLS_TUNNEL_OPEN && tunnel->outpos == tunnel->outlen && !tunnel->localclosed))
+        pollinfo[pollcount].events |= POLLIN;
+      if (tunnel->inpos < tunnel->inlen)
+        pollinfo[pollcount].events |= POLLOUT;
+      pollinfo[pollcount++].revents = 0;
+      pollinfo[pollcount].fd = tunnel->proxysock;
+      pollinfo[pollcount].events = tunnel->proxyevents;
+      pollinfo[pollcount++].revents = 0;
+    }
+    if (poll(pollinfo, pollcount, -1) < 0) {
+#ifndef _WIN32
+      if (errno == EINTR)
+        continue;
+#endif
+      for (i = 0; i < tunnelcount; i++)
+        tunnels[i]->state = TLS_TUNNEL_CLOSED;
+    }
+    for (i = 0; i < tunnelcount; i++) {
+      if (pollinfo[1 + i * 2].revents || pollinfo[2 + i * 2].revents)
+        tunnels[i]->ready = 1;
+      //the handshake was abandoned (e.g. after a timeout) before the TLS connection was established
+      if ((pollinfo[1 + i * 2].revents & (POLLHUP | POLLERR)) && tunnels[i]->state != TLS_TUNNEL_OPEN)
+        tunnels[i]->state = TLS_TUNNEL_CLOSED;
+    }
+  }
+  free(tunnels);
+  free(pollinfo);
+  tls_proxy_unref(tls);
+}
+
+#ifdef _WIN32
+DWORD WINAPI tls_relay_thread (LPVOID arg)
+#else
+void* tls_relay_thread (void* arg)
+#endif
+{
+  thread_started();
+  tls_relay_run((struct tls_proxy*)arg);
+  return 0;
+}
+
+//start TLS on the connection to an HTTPS proxy, returns the socket to continue on (the connection is taken over on success)
+//and the outcome of the TLS handshake (to be released with tls_tunnel_result_unref())
+SOCKET tls_open_tunnel (proxysocketconfig proxy, struct proxyinfo_struct* proxyinfo, SOCKET proxysock, struct tls_tunnel_result** result)
+{
+  SOCKET sockets[2];
+  SSL_SESSION* session;
+  struct tls_proxy* tls;
+  struct tls_tunnel* tunnel;
+  //create the TLS context and session cache for this proxy when it is first used
+  spin_lock(&proxyinfo->runtime->lock);
+  if ((tls = proxyinfo->runtime->tlsproxy) == NULL)
+    tls = proxyinfo->runtime->tlsproxy = tls_proxy_create(proxy);
+  spin_unlock(&proxyinfo->runtime->lock);
+  if (!tls || (tunnel = (struct tls_tunnel*)calloc(1, sizeof(struct tls_tunnel))) == NULL)
+    return INVALID_SOCKET;
+  if ((tunnel->result = (struct tls_tunnel_result*)calloc(1, sizeof(struct tls_tunnel_result))) == NULL || (tunnel->ssl = SSL_new(tls->ctx)) == NULL || socket_pair(sockets) != 0) {
+    SSL_free(tunnel->ssl);
+    free(tunnel->result);
+    free(tunnel);
+    return INVALID_SOCKET;
+  }
+  tunnel->result->refcount = 2;
+  *result = tunnel->result;
+  tunnel->sock = sockets[1];
+  tunnel->proxysock = proxysock;
+  socket_set_nonblocking(tunnel->sock, 1);
+  SSL_set_fd(tunnel->ssl, (int)proxysock);
+  //check the certificate against the proxy address or host name (also sent as server name)
+  if (inet_addr(proxyinfo->proxyhost) != INADDR_NONE) {
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(tunnel->ssl), proxyinfo->proxyhost);
+  } else {
+    SSL_set_tlsext_host_name(tunnel->ssl, proxyinfo->proxyhost);
+    SSL_set1_host(tunnel->ssl, proxyinfo->proxyhost);
+  }
+  //resume a previous session, sending the request as early data if the proxy allows it
+  //(not when it may carry credentials, as early data can be replayed)
+  tunnel->state = TLS_TUNNEL_HANDSHAKE;
+  if ((session = tls_proxy_get_session(tls)) != NULL) {
+    SSL_set_session(tunnel->ssl, session);
+    if (SSL_SESSION_get_max_early_data(session) > 0 && !(proxyinfo->proxyuser && *proxyinfo->proxyuser))
+      tunnel->state = TLS_TUNNEL_EARLY_DATA;
+    SSL_SESSION_free(session);
+  }
+  //hand the tunnel over to the relay thread (started if needed)
+  spin_lock(&tls->lock);
+  if (tls->newcount >= tls->newalloc) {
+    struct tls_tunnel** newtunnels;
+    size_t alloc = (tls->newalloc ? tls->newalloc * 2 : 16);
+    if ((newtunnels = (struct tls_tunnel**)realloc(tls->newtunnels, alloc * sizeof(struct tls_tunnel*))) != NULL) {
+      tls->newtunnels = newtunnels;
+      tls->newalloc = alloc;
+    }
+  }
+  if (tls->newcount < tls->newalloc && !tls->running) {
+    ATOMIC_ADD(&tls->refcount, 1);
+    if (thread_start_detached(tls_relay_thread, tls) == 0) {
+      tls->running = 1;
+    } else {
+      ATOMIC_SUB(&tls->refcount, 1);
+    }
+  }
+  if (tls->newcount < tls->newalloc && tls->running) {
+    tls->newtunnels[tls->newcount++] = tunnel;
+    tunnel = NULL;
+  }
+  spin_unlock(&tls->lock);
+  if (tunnel) {
+    //the connection to the proxy remains owned by the caller
+    SSL_free(tunnel->ssl);
+    closesocket(sockets[0]);
+    closesocket(sockets[1]);
+    free(tunnel->result);
+    free(tunnel);
+    return INVALID_SOCKET;
+  }
+  send(tls->wakeup[0], "", 1, SOCKET_SEND_FLAGS);
+  return sockets[0];
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////
+
+/* * * non-blocking connection handshake * * */
+
+#define HANDSHAKE_STATE_CONNECT         1
+#define HANDSHAKE_STATE_SEND            2
+#define HANDSHAKE_STATE_RECEIVE         3
+#define HANDSHAKE_STATE_DONE            4
+#define HANDSHAKE_STATE_FAILED          5
+#define HANDSHAKE_STATE_RESTART         6
+#define HANDSHAKE_STATE_QUEUED          7
+
+#define HANDSHAKE_STEP_NONE             0
+#define HANDSHAKE_STEP_SOCKS4_CONNECT   1
+#define HANDSHAKE_STEP_SOCKS5_METHOD    2
+#define HANDSHAKE_STEP_SOCKS5_AUTH      3
+#define HANDSHAKE_STEP_SOCKS5_CONNECT   4
+#define HANDSHAKE_STEP_HTTP_CONNECT     5
+#define HANDSHAKE_STEP_HTTP_DRAIN       6
+
+#define HANDSHAKE_MAX_HTTP_RESPONSE     65536
+
+#define PROBE_ROUND_PLAIN               1   //without TCP Fast Open so the round trip time can be measured
+#define PROBE_ROUND_FASTOPEN            2   //with TCP Fast Open to obtain a cookie
+#define PROBE_ROUND_PIPELINING          3   //with TCP Fast Open and all SOCKS5 requests sent at once
+#define PROBE_ROUNDS                    3
+
+#define READ_BUFFER_SIZE                128
+
+struct proxysocket_handshake_hop {
+  struct proxyinfo_struct* proxyinfo;
+  uint32_t targetaddr;                  //resolved address of the host this hop connects to (INADDR_NONE when resolved by the proxy)
+  struct proxyinfo_limits* limits;      //connection limits the handshake is queued for or holds a place in (NULL if none)
+};
+
+struct proxysocket_handshake_struct {
+  proxysocketconfig proxy;
+  struct resolver_cache_struct* resolvercache;
+  char* dsthost;
+  uint16_t dstport;
+  struct proxysocket_handshake_hop* hops;
+  int hopcount;
+  int hop;                              //index of the hop being negotiated (0 is the direct connection)
+  int state;
+  int step;
+  SOCKET sock;
+  struct proxysocket_source_struct* source;
+  struct tls_tunnel_result* tlsresult;  //outcome of the TLS handshake with the last HTTPS proxy (NULL if none)
+  uint8_t* buf;                         //request being sent or reply being received
+  size_t buflen;
+  size_t bufpos;
+  size_t bufsize;
+  size_t drainlen;                      //length of the web proxy response body to discard before repeating the request
+  int8_t authsent;                      //authentication scheme used in the last web proxy request (HTTP_AUTH_*)
+  int8_t authretries;                   //number of times the web proxy request was repeated after a challenge
+  int8_t restarted;                     //the connection was started over after a web proxy closed it
+  uint8_t command;                      //SOCKS5 command sent to the last proxy (SOCKS5_COMMAND_*)
+  int8_t accepting;                     //waiting for the second reply to a BIND command (the incoming connection)
+  int8_t fastopen;                      //TCP Fast Open is used for the connection to the first proxy
+  int8_t pipelined;                     //all SOCKS5 requests to the proxy of the current hop were sent at once
+  int8_t probing;                       //learning the capabilities of the first proxy (one of the PROBE_ROUND_* values, 0 if not probing)
+  uint64_t connectstart;                //time the direct connection was started (0 if it isn't timed)
+  uint64_t hopstart;                    //time the current hop was started (the direct connection for the first proxy)
+  uint64_t stepstart;                   //time in microseconds the connection or request now waiting for a reply was started (0 if it isn't timed)
+  uint32_t hoprtt;                      //shortest round trip time in microseconds measured to the proxy of the current hop (0 if not measured yet)
+  uint32_t basertt;                     //round trip time in microseconds to the proxy of the hop before the current one (0 for the first proxy)
+  uint32_t bindaddr;                    //address bound by the last proxy, or of the peer after a BIND (INADDR_NONE if not an IPv4 address)
+  uint16_t bindport;                    //port bound by the last proxy, or of the peer after a BIND
+  int admithop;                         //index of the next hop to be admitted by the connection limits of its proxy
+  int8_t queued;                        //waiting in the queue of the proxy of admithop
+  struct proxyinfo_limits_waiter waiter;
+  uint64_t queuestart;                  //time the handshake started waiting in the queue
+  uint64_t queuecheck;                  //time the handshake should check the queue again
+  struct timer_entry timer;             //timer of the event loop driving the handshake
+  int phase;                            //one of the PROXYSOCKET_ERROR_PHASE_* values
+  struct proxysocket_error error;       //details of the first error
+  int8_t keeperrmsg;                    //keep error message text (only needed by proxysocket_connect())
+  char* errmsg;
+};
+
+//record error details (only the first error is kept)
+void handshake_set_error (struct proxysocket_handshake_struct* handshake, int hop, int cause, int status)
+{
+  if (handshake->error.cause != PROXYSOCKET_ERROR_CAUSE_NONE)
+    return;
+  handshake->error.phase = handshake->phase;
+  handshake->error.cause = cause;
+  handshake->error.hop = hop;
+  handshake->error.status = status;
+  //count failures that tell something about the health of the proxy (not rejected requests or waiting for connection limits)
+  if (hop > 0 && hop < handshake->hopcount && !handshake->accepting && handshake->state != HANDSHAKE_STATE_QUEUED) {
+    switch (cause) {
+      case PROXYSOCKET_ERROR_CAUSE_CONNECT_FAILED :
+      case PROXYSOCKET_ERROR_CAUSE_SEND_FAILED :
+      case PROXYSOCKET_ERROR_CAUSE_RECEIVE_FAILED :
+      case PROXYSOCKET_ERROR_CAUSE_CONNECTION_LOST :
+      case PROXYSOCKET_ERROR_CAUSE_TIMEOUT :
+      case PROXYSOCKET_ERROR_CAUSE_PROTOCOL_ERROR :
+        proxyinfo_record_failure(handshake->hops[hop].proxyinfo);
+        break;
+      default :
+        break;
+    }
+  }
+  switch (cause) {
+    case PROXYSOCKET_ERROR_CAUSE_SOCKET_FAILED :
+    case PROXYSOCKET_ERROR_CAUSE_BIND_FAILED :
+    case PROXYSOCKET_ERROR_CAUSE_CONNECT_FAILED :
+    case PROXYSOCKET_ERROR_CAUSE_SEND_FAILED :
+    case PROXYSOCKET_ERROR_CAUSE_RECEIVE_FAILED :
+      handshake->error.syserror = get_socket_error_code();
+      break;
+    default :
+      handshake->error.syserror = 0;
+      break;
+  }
+}
+
+//record error, generate message text only if it will be logged or kept
+#define ERROR_AT_HOP_DISCONNECT_AND_ABORT(hop, cause, status, ...) \
+{ \
+  handshake_set_error(handshake, hop, PROXYSOCKET_ERROR_CAUSE_##cause, status); \
+  log_and_keep_error_message(handshake->proxy, (handshake->keeperrmsg && !handshake->errmsg ? &handshake->errmsg : NULL), __VA_ARGS__); \
+  return handshake_abort(handshake); \
+}
+
+#define ERROR_DISCONNECT_AND_ABORT(cause, status, ...) ERROR_AT_HOP_DISCONNECT_AND_ABORT(handshake->hop, cause, status, __VA_ARGS__)
+
+#define RESOLVER_CACHE_SIZE     256             //host names kept with the proxy information when no shared state is used
+
+//get the address of a host name without blocking if it is numeric or was resolved recently, returns zero if it must be resolved
+int proxy_resolve_cached (proxysocketconfig proxy, const char* hostname, uint32_t* addr)
+{
+  int found = 0;
+  struct resolver_cache_entry* entry;
+  if (!hostname || !*hostname)
+    return 0;
+  if ((*addr = inet_addr(hostname)) != INADDR_NONE)
+    return 1;
+  if (proxy->shared)
+    return shared_resolve_cached(proxy->shared, hostname, addr);
+  spin_lock(&proxy->dnscachelock);
+  if (proxy->dnscache && (entry = resolver_cache_find(proxy->dnscache, hostname))->hostname && entry->expires > get_monotonic_milliseconds()) {
+    *addr = entry->addr;
+    found = 1;
+  }
+  spin_unlock(&proxy->dnscachelock);
+  return found;
+}
+
+//resolve a host name (this will block unless it was resolved recently), results are kept in the shared state if there is one or else with the proxy information
+uint32_t proxy_resolve (proxysocketconfig proxy, const char* hostname)
+{
+  uint32_t addr;
+  struct resolver_cache_entry* entry = NULL;
+  if (proxy->shared || !hostname || !*hostname)
+    return shared_resolve(proxy->shared, hostname);
+  if (proxy_resolve_cached(proxy, hostname, &addr))
+    return addr;
+  addr = get_ipv4_address(hostname);
+  spin_lock(&proxy->dnscachelock);
+  if (!proxy->dnscache || (entry = resolver_cache_add(proxy->dnscache, hostname)) == NULL) {
+    //start over when the cache is full
+    resolver_cache_free(proxy->dnscache);
+    if ((proxy->dnscache = resolver_cache_create(RESOLVER_CACHE_SIZE)) != NULL)
+      entry = resolver_cache_add(proxy->dnscache, hostname);
+  }
+  if (entry) {
+    entry->addr = addr;
+    entry->expires = get_monotonic_milliseconds() + (addr == INADDR_NONE ? SHARED_NEGATIVE_DNS_TTL : SHARED_DEFAULT_DNS_TTL) * 1000;
+  }
+  spin_unlock(&proxy->dnscachelock);
+  return addr;
+}
+
+//look up host in cache (resolving and adding it if needed)
+uint32_t resolver_cache_lookup (struct resolver_cache_struct* cache, proxysocketconfig proxy, const char* hostname)
+{
+  struct resolver_cache_entry* entry;
+  if (!cache || !hostname || !*hostname)
+    return proxy_resolve(proxy, hostname);
+  if ((entry = resolver_cache_find(cache, hostname))->hostname)
+    return entry->addr;
+  //add new entry (unless the cache is full)
+  if ((entry = resolver_cache_add(cache, hostname)) == NULL)
+    return proxy_resolve(proxy, hostname);
+  return (entry->addr = proxy_resolve(proxy, hostname));
+}
+
+//count the host names that must be resolved (not numeric and not resolved recently)
+size_t resolver_count_uncached (proxysocketconfig proxy, const char** hostnames, size_t count)
+{
+  size_t i;
+  size_t result = 0;
+  uint32_t addr;
+  for (i = 0; i < count; i++) {
+    if (hostnames[i] && *hostnames[i] && !proxy_resolve_cached(proxy, hostnames[i], &addr))
+      result++;
+  }
+  return result;
+}
+
+#define RESOLVER_THREADS        8
+
+//host names being resolved in parallel, each thread takes the next one until none are left
+struct resolver_batch {
+  proxysocketconfig proxy;
+  struct resolver_cache_entry** entries;
+  size_t count;
+  size_t next;
+};
+
+void resolver_batch_run (struct resolver_batch* batch)
+{
+  size_t i;
+  while ((i = ATOMIC_ADD(&batch->next, 1) - 1) < batch->count)
+    batch->entries[i]->addr = proxy_resolve(batch->proxy, batch->entries[i]->hostname);
+}
+
+#ifdef _WIN32
+DWORD WINAPI resolver_batch_thread (LPVOID arg)
+#else
+void* resolver_batch_thread (void* arg)
+#endif
+{
+  thread_started();
+  resolver_batch_run((struct resolver_batch*)arg);
+  return 0;
+}
+
+//add host names that aren't cached yet to the cache, looking them up at the same time as lookups block
+void resolver_cache_prefetch (struct resolver_cache_struct* cache, proxysocketconfig proxy, const char** hostnames, size_t count)
+{
+  size_t i;
+  size_t threadcount;
+  uint32_t addr;
+  thread_handle threads[RESOLVER_THREADS];
+  struct resolver_cache_entry* entry;
+  struct resolver_batch batch;
+  if (!cache || count == 0 || (batch.entries = (struct resolver_cache_entry**)malloc(count * sizeof(struct resolver_cache_entry*))) == NULL)
+    return;
+  batch.proxy = proxy;
+  batch.count = 0;
+  batch.next = 0;
+  //add entries for names that need a lookup, names resolved recently are taken over right away (the entries don't move as nothing else is added meanwhile)
+  for (i = 0; i < count; i++) {
+    if (!hostnames[i] || !*hostnames[i] || inet_addr(hostnames[i]) != INADDR_NONE || resolver_cache_find(cache, hostnames[i])->hostname)
+      continue;
+    if ((entry = resolver_cache_add(cache, hostnames[i])) == NULL)
+      break;
+    if (proxy_resolve_cached(proxy, hostnames[i], &addr))
+      entry->addr = addr;
+    else
+      batch.entries[batch.count++] = entry;
+  }
+  //the calling thread does its share of the lookups
+  threadcount = 0;
+  while (threadcount < RESOLVER_THREADS && threadcount + 1 < batch.count && thread_start(&threads[threadcount], resolver_batch_thread, &batch) == 0)
+    threadcount++;
+  resolver_batch_run(&batch);
+  for (i = 0; i < threadcount; i++)
+    thread_join(threads[i]);
+  free(batch.entries);
+}
+
+const char* handshake_proxy_kind (int proxytype)
+{
+  switch (proxytype) {
+    case PROXYSOCKET_TYPE_NONE :
+      return "host";
+    case PROXYSOCKET_TYPE_SOCKS4 :
+      return "SOCKS4 proxy";
+    case PROXYSOCKET_TYPE_SOCKS5 :
+      return "SOCKS5 proxy";
+    case PROXYSOCKET_TYPE_WEB_CONNECT :
+      return "web proxy";
+    case PROXYSOCKET_TYPE_WEB_CONNECT_TLS :
+      return "HTTPS proxy";
+    case PROXYSOCKET_TYPE_WEB_CONNECT_H2 :
+      return "HTTP/2 proxy";
+    default :
+      return "unknown proxy";
+  }
+}
+
+//host name of the host the specified hop connects to
+const char* handshake_target_host (struct proxysocket_handshake_struct* handshake, int hop)
+{
+  return (hop + 1 < handshake->hopcount ? handshake->hops[hop + 1].proxyinfo->proxyhost : handshake->dsthost);
+}
+
+uint16_t handshake_target_port (struct proxysocket_handshake_struct* handshake, int hop)
+{
+  return (hop + 1 < handshake->hopcount ? handshake->hops[hop + 1].proxyinfo->proxyport : handshake->dstport);
+}
+
+//make sure the buffer can hold at least the specified number of bytes
+uint8_t* handshake_buffer_reserve (struct proxysocket_handshake_struct* handshake, size_t size)
+{
+  if (size > handshake->bufsize) {
+    uint8_t* buf;
+    size_t bufsize = (handshake->bufsize ? handshake->bufsize : 64);
+    while (bufsize < size)
+      bufsize <<= 1;
+    if ((buf = (uint8_t*)realloc(handshake->buf, bufsize)) == NULL)
+      return NULL;
+    handshake->buf = buf;
+    handshake->bufsize = bufsize;
+  }
+  return handshake->buf;
+}
+
+//admit waiting handshakes in FIFO order as far as the limits allow (lock must be held)
+void limits_admit (struct proxyinfo_limits* limits, uint64_t now)
+{
+  struct proxyinfo_limits_waiter* waiter;
+  //add tokens for the time passed
+  if (limits->rate) {
+    if (limits->refilled && now > limits->refilled) {
+      limits->tokens += (now - limits->refilled) * limits->rate;
+      if (limits->tokens > (uint64_t)limits->burst * 1000)
+        limits->tokens = (uint64_t)limits->burst * 1000;
+    }
+    if (now > limits->refilled)
+      limits->refilled = now;
+  }
+  if (now < limits->pauseduntil)
+    return;
+  while ((waiter = limits->first) != NULL && (!limits->maxhandshakes || limits->handshakes < limits->maxhandshakes) && (!limits->rate || limits->tokens >= 1000)) {
+    if ((limits->first = waiter->next) == NULL)
+      limits->last = &limits->first;
+    limits->queuelength--;
+    limits->handshakes++;
+    if (limits->rate)
+      limits->tokens -= 1000;
+    ATOMIC_STORE(&waiter->admitted, 1);
+  }
+}
+
+//remove a handshake from the queue (lock must be held)
+void limits_remove_waiter (struct proxyinfo_limits* limits, struct proxyinfo_limits_waiter* waiter)
+{
+  struct proxyinfo_limits_waiter** p;
+  for (p = &limits->first; *p; p = &(*p)->next) {
+    if (*p == waiter) {
+      if ((*p = waiter->next) == NULL)
+        limits->last = p;
+      limits->queuelength--;
+      return;
+    }
+  }
+}
+
+//time in milliseconds until the queue should be checked again (lock must be held)
+uint32_t limits_wait_time (struct proxyinfo_limits* limits, uint64_t now)
+{
+  //wait until the proxy wants connections again, for the next token unless only the number of handshakes is holding the queue up
+  if (now < limits->pauseduntil)
+    return (uint32_t)(limits->pauseduntil - now);
+  if (limits->rate && limits->tokens < 1000)
+    return (uint32_t)((1000 - limits->tokens + limits->rate - 1) / limits->rate);
+  return LIMITS_CHECK_INTERVAL;
+}
+
+//take away all tokens and admit no handshakes for the specified time (when the proxy asks to slow down)
+void limits_pause (struct proxyinfo_limits* limits, uint32_t milliseconds)
+{
+  uint64_t until = get_monotonic_milliseconds() + milliseconds;
+  spin_lock(&limits->lock);
+  if (until > limits->pauseduntil)
+    limits->pauseduntil = until;
+  //no tokens are added during the pause
+  limits->tokens = 0;
+  limits->refilled = limits->pauseduntil;
+  spin_unlock(&limits->lock);
+}
+
+//get the connection limits of a proxy, creating limits that only pause connections if the proxy has none (they stay with the proxy information)
+struct proxyinfo_limits* proxyinfo_get_limits (struct proxyinfo_struct* proxyinfo)
+{
+  struct proxyinfo_limits* limits;
+  struct proxyinfo_limits* current = NULL;
+  if ((limits = ATOMIC_LOAD(&proxyinfo->runtime->limits)) != NULL)
+    return limits;
+  if ((limits = limits_create()) == NULL)
+    return NULL;
+  //another handshake may have done the same
+  if (!ATOMIC_COMPARE_EXCHANGE(&proxyinfo->runtime->limits, &current, limits)) {
+    free(limits);
+    return current;
+  }
+  return limits;
+}
+
+//give up the places held in the connection limits of the proxies and leave the queue
+void handshake_release_limits (struct proxysocket_handshake_struct* handshake)
+{
+  int i;
+  uint64_t now = 0;
+  struct proxyinfo_limits* limits;
+  for (i = 0; i < handshake->hopcount && i <= handshake->admithop; i++) {
+    if ((limits = handshake->hops[i].limits) == NULL)
+      continue;
+    if (!now)
+      now = get_monotonic_milliseconds();
+    spin_lock(&limits->lock);
+    if (i == handshake->admithop && handshake->queued && !handshake->waiter.admitted)
+      limits_remove_waiter(limits, &handshake->waiter);
+    else
+      limits->handshakes--;
+    limits_admit(limits, now);
+    spin_unlock(&limits->lock);
+    handshake->hops[i].limits = NULL;
+  }
+  handshake->queued = 0;
+}
+
+int handshake_abort (struct proxysocket_handshake_struct* handshake)
+{
+  handshake_release_limits(handshake);
+  if (handshake->sock != INVALID_SOCKET) {
+    proxysocket_disconnect(handshake->proxy, handshake->sock);
+    handshake->sock = INVALID_SOCKET;
+  }
+  handshake->state = HANDSHAKE_STATE_FAILED;
+  return PROXYSOCKET_HANDSHAKE_FAILED;
+}
+
+//start sending the request of the specified step that was prepared in the buffer
+int handshake_send_request (struct proxysocket_handshake_struct* handshake, int step, size_t requestlen)
+{
+  handshake->step = step;
+  handshake->state = HANDSHAKE_STATE_SEND;
+  handshake->buflen = requestlen;
+  handshake->bufpos = 0;
+  return PROXYSOCKET_HANDSHAKE_WANT_WRITE;
+}
+
+//wait for the reply of the specified step to a request that was already sent
+int handshake_expect_reply (struct proxysocket_handshake_struct* handshake, int step)
+{
+  handshake->step = step;
+  handshake->state = HANDSHAKE_STATE_RECEIVE;
+  handshake->buflen = 0;
+  return PROXYSOCKET_HANDSHAKE_WANT_READ;
+}
+
+//SOCKS5 command for the proxy of the current hop (the proxies before the last one are always asked to connect)
+int handshake_socks_command (struct proxysocket_handshake_struct* handshake)
+{
+  return (handshake->hop == handshake->hopcount - 1 ? handshake->command : SOCKS5_COMMAND_CONNECT);
+}
+
+int handshake_socks4_connect_request (struct proxysocket_handshake_struct* handshake)
+{
+  struct socks4_connect_request* request;
+  struct proxyinfo_struct* proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+  const char* dsthost = handshake_target_host(handshake, handshake->hop);
+  uint16_t dstport = handshake_target_port(handshake, handshake->hop);
+  uint32_t hostaddr = handshake->hops[handshake->hop].targetaddr;
+  size_t proxyuserlen = (proxyinfo->proxyuser ? strlen(proxyinfo->proxyuser) : 0);
+  size_t dsthostlen = (handshake->proxy->proxy_dns == USE_CLIENT_DNS ? 0 : (dsthost ? strlen(dsthost) : 0) + 1);
+  size_t requestlen = sizeof(struct socks4_connect_request) + proxyuserlen + dsthostlen;
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_REQUEST;
+  if ((request = (struct socks4_connect_request*)handshake_buffer_reserve(handshake, requestlen)) == NULL)
+    ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+  request->socks_version = SOCKS4_VERSION;
+  request->socks_command = (handshake_socks_command(handshake) == SOCKS5_COMMAND_BIND ? SOCKS4_COMMAND_BIND : SOCKS4_COMMAND_CONNECT);
+  request->dst_port = htons(dstport);
+  request->dst_addr = (handshake->proxy->proxy_dns == USE_CLIENT_DNS ? hostaddr : htonl(0x000000FF));
+  if (proxyuserlen > 0)
+    memcpy(request->userid, proxyinfo->proxyuser, proxyuserlen);
+  request->userid[proxyuserlen] = 0;
+  if (dsthostlen > 0)
+    memcpy(request->userid + proxyuserlen + 1, (dsthost ? dsthost : ""), dsthostlen);
+  if (request->socks_command == SOCKS4_COMMAND_BIND)
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Requesting to listen for connection from: %s:%lu", (handshake->proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : dsthost), (unsigned long)dstport);
+  else if (!(proxyinfo->proxyuser && *proxyinfo->proxyuser))
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Connecting to destination: %s:%lu", (handshake->proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : dsthost), (unsigned long)dstport);
+  else
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Connecting to destination: %s:%lu (user-id: %s)", (handshake->proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : dsthost), (unsigned long)dstport, proxyinfo->proxyuser);
+  return handshake_send_request(handshake, HANDSHAKE_STEP_SOCKS4_CONNECT, requestlen);
+}
+
+int handshake_socks5_auth_request (struct proxysocket_handshake_struct* handshake)
+{
+  struct proxyinfo_struct* proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+  uint8_t* authbuf;
+  size_t proxyuserlen = (proxyinfo->proxyuser ? strlen(proxyinfo->proxyuser) : 0);
+  size_t proxypasslen = (proxyinfo->proxypass ? strlen(proxyinfo->proxypass) : 0);
+  size_t authbuflen = 3 + proxyuserlen + proxypasslen;
+  if (proxyuserlen > 255 || proxypasslen > 255)
+    ERROR_DISCONNECT_AND_ABORT(INVALID_ARGUMENT, 0, "SOCKS5 proxy login or password too long")
+  if ((authbuf = handshake_buffer_reserve(handshake, authbuflen)) == NULL)
+    ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+  authbuf[0] = 1;
+  authbuf[1] = proxyuserlen;
+  memcpy(authbuf + 2, proxyinfo->proxyuser, proxyuserlen);
+  authbuf[2 + proxyuserlen] = proxypasslen;
+  memcpy(authbuf + 3 + proxyuserlen, proxyinfo->proxypass, proxypasslen);
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Sending authentication (login: %s)", (proxyinfo->proxyuser ? proxyinfo->proxyuser : NULL));
+  return handshake_send_request(handshake, HANDSHAKE_STEP_SOCKS5_AUTH, authbuflen);
+}
+
+int handshake_socks5_connect_request (struct proxysocket_handshake_struct* handshake)
+{
+  const char* dsthost = handshake_target_host(handshake, handshake->hop);
+  uint16_t dstport = handshake_target_port(handshake, handshake->hop);
+  uint32_t hostaddr = handshake->hops[handshake->hop].targetaddr;
+  uint8_t command = handshake_socks_command(handshake);
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_REQUEST;
+  if (command == SOCKS5_COMMAND_UDP_ASSOCIATE) {
+    //the address datagrams will be sent from is not known yet
+    struct socks5_connect_request_ipv4* request;
+    if ((request = (struct socks5_connect_request_ipv4*)handshake_buffer_reserve(handshake, sizeof(struct socks5_connect_request_ipv4))) == NULL)
+      ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+    request->socks_version = SOCKS5_VERSION;
+    request->socks_command = SOCKS5_COMMAND_UDP_ASSOCIATE;
+    request->reserved = 0;
+    request->socks_addresstype = SOCKS5_ADDRESSTYPE_IPV4;
+    request->dst_addr = INADDR_ANY;
+    request->dst_port = 0;
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Requesting UDP association");
+    return handshake_send_request(handshake, HANDSHAKE_STEP_SOCKS5_CONNECT, sizeof(struct socks5_connect_request_ipv4));
+  }
+  if (handshake->proxy->proxy_dns == USE_CLIENT_DNS) {
+    struct socks5_connect_request_ipv4* request;
+    if ((request = (struct socks5_connect_request_ipv4*)handshake_buffer_reserve(handshake, sizeof(struct socks5_connect_request_ipv4))) == NULL)
+      ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+    request->socks_version = SOCKS5_VERSION;
+    request->socks_command = command;
+    request->reserved = 0;
+    request->socks_addresstype = SOCKS5_ADDRESSTYPE_IPV4;
+    request->dst_addr = hostaddr;
+    request->dst_port = htons(dstport);
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, (command == SOCKS5_COMMAND_BIND ? "Requesting to listen for connection from IPv4 address: %s:%lu" : "Connecting to IPv4 destination: %s:%lu"), inet_ntoa(*(struct in_addr*)&hostaddr), (unsigned long)dstport);
+    return handshake_send_request(handshake, HANDSHAKE_STEP_SOCKS5_CONNECT, sizeof(struct socks5_connect_request_ipv4));
+  } else {
+    uint8_t* request;
+    size_t dsthostlen = (dsthost ? strlen(dsthost) : 0);
+    size_t requestlen = 4 + 1 + dsthostlen + 2;
+    if (dsthostlen > 255)
+      ERROR_DISCONNECT_AND_ABORT(INVALID_ARGUMENT, 0, "Destination host name too long for SOCKS5 proxy: %s", dsthost)
+    if ((request = handshake_buffer_reserve(handshake, requestlen)) == NULL)
+      ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+    request[0] = SOCKS5_VERSION;
+    request[1] = command;
+    request[2] = 0;
+    request[3] = SOCKS5_ADDRESSTYPE_DOMAINNAME;
+    request[4] = dsthostlen;
+    memcpy(request + 5, dsthost, dsthostlen);
+    request[5 + dsthostlen] = dstport >> 8;
+    request[6 + dsthostlen] = dstport & 0xFF;
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, (command == SOCKS5_COMMAND_BIND ? "Requesting to listen for connection from host: %s:%lu" : "Connecting to destination host: %s:%lu"), dsthost, (unsigned long)dstport);
+    return handshake_send_request(handshake, HANDSHAKE_STEP_SOCKS5_CONNECT, requestlen);
+  }
+}
+
+//send the method selection, authentication and connect request at once if the proxy is known to accept this
+int handshake_socks5_pipelined_request (struct proxysocket_handshake_struct* handshake, uint8_t method)
+{
+  uint8_t connectrequest[4 + 1 + 255 + 2];
+  size_t connectrequestlen;
+  size_t authrequestlen = 0;
+  int status;
+  if ((status = handshake_socks5_connect_request(handshake)) != PROXYSOCKET_HANDSHAKE_WANT_WRITE)
+    return status;
+  connectrequestlen = handshake->buflen;
+  memcpy(connectrequest, handshake->buf, connectrequestlen);
+  if (method == SOCKS5_METHOD_LOGIN) {
+    if ((status = handshake_socks5_auth_request(handshake)) != PROXYSOCKET_HANDSHAKE_WANT_WRITE)
+      return status;
+    authrequestlen = handshake->buflen;
+  }
+  if (handshake_buffer_reserve(handshake, 3 + authrequestlen + connectrequestlen) == NULL)
+    ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+  memmove(handshake->buf + 3, handshake->buf, authrequestlen);
+  handshake->buf[0] = SOCKS5_VERSION;
+  handshake->buf[1] = 1;
+  handshake->buf[2] = method;
+  memcpy(handshake->buf + 3 + authrequestlen, connectrequest, connectrequestlen);
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_AUTHENTICATE;
+  handshake->pipelined = 1;
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_DEBUG, "Sending all SOCKS5 requests at once");
+  return handshake_send_request(handshake, HANDSHAKE_STEP_SOCKS5_METHOD, 3 + authrequestlen + connectrequestlen);
+}
+
+int handshake_socks5_method_request (struct proxysocket_handshake_struct* handshake)
+{
+  struct proxyinfo_struct* proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+  uint32_t capabilities = proxyinfo->runtime->capabilities.flags;
+  int credentials = (proxyinfo->proxyuser && *proxyinfo->proxyuser) || (proxyinfo->proxypass && *proxyinfo->proxypass);
+  uint8_t* request;
+  //skip the round trips for the method selection and authentication if the method to be selected by the proxy is already known
+  if (capabilities & PROXYSOCKET_CAPABILITY_PIPELINING || handshake->probing == PROBE_ROUND_PIPELINING) {
+    if (credentials && (capabilities & PROXYSOCKET_CAPABILITY_SOCKS5_LOGIN))
+      return handshake_socks5_pipelined_request(handshake, SOCKS5_METHOD_LOGIN);
+    if (capabilities & PROXYSOCKET_CAPABILITY_NO_AUTH)
+      return handshake_socks5_pipelined_request(handshake, SOCKS5_METHOD_NOAUTH);
+  }
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_AUTHENTICATE;
+  if ((request = handshake_buffer_reserve(handshake, 4)) == NULL)
+    ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+  request[0] = SOCKS5_VERSION;
+  if (!credentials) {
+    request[1] = 1;
+    request[2] = SOCKS5_METHOD_NOAUTH;
+    return handshake_send_request(handshake, HANDSHAKE_STEP_SOCKS5_METHOD, 3);
+  } else {
+    request[1] = 2;
+    request[2] = SOCKS5_METHOD_LOGIN;
+    request[3] = SOCKS5_METHOD_NOAUTH;
+    return handshake_send_request(handshake, HANDSHAKE_STEP_SOCKS5_METHOD, 4);
+  }
+}
+
+//acquire the lock protecting the authentication details learned for a proxy
+void proxyinfo_auth_lock (struct proxyinfo_struct* proxyinfo)
+{
+  spin_lock(&proxyinfo->runtime->lock);
+}
+
+void proxyinfo_auth_unlock (struct proxyinfo_struct* proxyinfo)
+{
+  spin_unlock(&proxyinfo->runtime->lock);
+}
+
+//copy a string to the specified position (removing quoted-string escapes if needed), returns position after terminating zero
+char* proxyinfo_auth_copy_string (char** dst, char* pos, const char* src, size_t srclen, int unescape)
+{
+  size_t i;
+  if (!src) {
+    *dst = NULL;
+    return pos;
+  }
+  *dst = pos;
+  for (i = 0; i < srclen; i++) {
+    if (unescape && src[i] == '\\' && i + 1 < srclen)
+      i++;
+    *pos++ = src[i];
+  }
+  *pos++ = 0;
+  return pos;
+}
+
+//allocate authentication details (strings are stored in the same allocation)
+struct proxyinfo_auth_struct* proxyinfo_auth_create (int scheme, int qop, int sess, int stale, const char* realm, size_t realmlen, const char* nonce, size_t noncelen, const char* opaque, size_t opaquelen, int unescape)
+{
+  char* pos;
+  struct proxyinfo_auth_struct* auth;
+  if ((auth = (struct proxyinfo_auth_struct*)malloc(sizeof(struct proxyinfo_auth_struct) + realmlen + noncelen + opaquelen + 3)) == NULL)
+    return NULL;
+  auth->scheme = scheme;
+  auth->qop = qop;
+  auth->sess = sess;
+  auth->stale = stale;
+  auth->nc = 0;
+  pos = proxyinfo_auth_copy_string(&auth->realm, (char*)(auth + 1), realm, realmlen, unescape);
+  pos = proxyinfo_auth_copy_string(&auth->nonce, pos, nonce, noncelen, unescape);
+  proxyinfo_auth_copy_string(&auth->opaque, pos, opaque, opaquelen, unescape);
+  return auth;
+}
+
+//replace the authentication details learned for a proxy
+void proxyinfo_set_auth (struct proxyinfo_struct* proxyinfo, struct proxyinfo_auth_struct* auth)
+{
+  struct proxyinfo_auth_struct* previous;
+  proxyinfo_auth_lock(proxyinfo);
+  previous = proxyinfo->runtime->auth;
+  proxyinfo->runtime->auth = auth;
+  proxyinfo_auth_unlock(proxyinfo);
+  free(previous);
+}
+
+//get a copy of the authentication details learned for a proxy (counting the use of the digest nonce), returns NULL if nothing was learned
+struct proxyinfo_auth_struct* proxyinfo_get_auth (struct proxyinfo_struct* proxyinfo, int* outofmemory)
+{
+  struct proxyinfo_auth_struct* auth = NULL;
+  *outofmemory = 0;
+  proxyinfo_auth_lock(proxyinfo);
+  if (proxyinfo->runtime->auth) {
+    struct proxyinfo_auth_struct* learned = proxyinfo->runtime->auth;
+    if ((auth = proxyinfo_auth_create(learned->scheme, learned->qop, learned->sess, learned->stale, learned->realm, (learned->realm ? strlen(learned->realm) : 0), learned->nonce, (learned->nonce ? strlen(learned->nonce) : 0), learned->opaque, (learned->opaque ? strlen(learned->opaque) : 0), 0)) != NULL)
+      auth->nc = ++learned->nc;
+    else
+      *outofmemory = 1;
+  }
+  proxyinfo_auth_unlock(proxyinfo);
+  return auth;
+}
+
+//generate a client nonce for digest authentication (16 hexadecimal characters)
+void http_digest_cnonce (char* cnonce, const void* unique)
+{
+  char hex[33];
+  char seed[64];
+  static uint32_t counter = 0;
+  snprintf(seed, sizeof(seed), "%p %lu %lu %lu", unique, (unsigned long)time(NULL), (unsigned long)get_monotonic_milliseconds(), (unsigned long)ATOMIC_ADD(&counter, 1));
+  md5_hex_joined(hex, seed, NULL);
+  memcpy(cnonce, hex, 16);
+  cnonce[16] = 0;
+}
+
+//build the value of the Proxy-Authorization header for basic authentication
+char* http_basic_credentials (const char* user, const char* pass)
+{
+  char* userpass;
+  char* encoded;
+  char* credentials;
+  if (asprintf(&userpass, "%s:%s", user, (pass ? pass : "")) < 0)
+    return NULL;
+  encoded = make_base64_string(userpass);
+  free(userpass);
+  if (!encoded)
+    return NULL;
+  if (asprintf(&credentials, "Basic %s", encoded) < 0)
+    credentials = NULL;
+  free(encoded);
+  return credentials;
+}
+
+//build the value of the Proxy-Authorization header for digest authentication (RFC 7616 with MD5)
+char* http_digest_credentials (const struct proxyinfo_auth_struct* auth, const char* user, const char* pass, const char* uri, const void* unique)
+{
+  char ha1[33];
+  char ha2[33];
+  char response[33];
+  char cnonce[17];
+  char nc[9];
+  char* credentials;
+  const char* realm = (auth->realm ? auth->realm : "");
+  http_digest_cnonce(cnonce, unique);
+  snprintf(nc, sizeof(nc), "%08lx", (unsigned long)auth->nc);
+  md5_hex_joined(ha1, user, realm, (pass ? pass : ""), NULL);
+  if (auth->sess) {
+    char ha1sess[33];
+    md5_hex_joined(ha1sess, ha1, auth->nonce, cnonce, NULL);
+    memcpy(ha1, ha1sess, sizeof(ha1));
+  }
+  md5_hex_joined(ha2, "CONNECT", uri, NULL);
+  if (auth->qop)
+    md5_hex_joined(response, ha1, auth->nonce, nc, cnonce, "auth", ha2, NULL);
+  else
+    md5_hex_joined(response, ha1, auth->nonce, ha2, NULL);
+  if (asprintf(&credentials, "Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", response=\"%s\"%s%s%s%s%s%s%s%s%s",
+      user, realm, auth->nonce, uri, response,
+      (auth->sess ? ", algorithm=MD5-sess" : ""),
+      (auth->qop ? ", qop=auth, nc=" : ""), (auth->qop ? nc : ""),
+      (auth->qop || auth->sess ? ", cnonce=\"" : ""), (auth->qop || auth->sess ? cnonce : ""), (auth->qop || auth->sess ? "\"" : ""),
+      (auth->opaque ? ", opaque=\"" : ""), (auth->opaque ? auth->opaque : ""), (auth->opaque ? "\"" : "")) < 0)
+    return NULL;
+  return credentials;
+}
+
+int handshake_http_connect_request (struct proxysocket_handshake_struct* handshake)
+{
+  struct proxyinfo_struct* proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+  const char* dsthost = handshake_target_host(handshake, handshake->hop);
+  uint16_t dstport = handshake_target_port(handshake, handshake->hop);
+  uint32_t hostaddr = handshake->hops[handshake->hop].targetaddr;
+  const char* host = (handshake->proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : (dsthost ? dsthost : ""));
+  char uri[300];
+  char* proxyauth = NULL;
+  char* proxycmd;
+  int proxycmdlen;
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_REQUEST;
+  handshake->authsent = HTTP_AUTH_NONE;
+  snprintf(uri, sizeof(uri), "%s:%u", host, (unsigned int)dstport);
+  //send credentials right away if the authentication scheme of the proxy is known
+  if (proxyinfo->proxyuser && *proxyinfo->proxyuser) {
+    int outofmemory;
+    struct proxyinfo_auth_struct* auth;
+    if ((auth = proxyinfo_get_auth(proxyinfo, &outofmemory)) == NULL && outofmemory)
+      ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+    //basic authentication learned from the capability cache doesn't need a challenge first
+    if (!auth && (proxyinfo->runtime->capabilities.flags & PROXYSOCKET_CAPABILITY_HTTP_BASIC)) {
+      if ((auth = proxyinfo_auth_create(HTTP_AUTH_BASIC, 0, 0, 0, NULL, 0, NULL, 0, NULL, 0, 0)) == NULL)
+        ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+    }
+    if (auth) {
+      write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Proxy authentication user: %s (%s)", proxyinfo->proxyuser, (auth->scheme == HTTP_AUTH_DIGEST ? "digest" : "basic"));
+      if (auth->scheme == HTTP_AUTH_DIGEST)
+        proxyauth = http_digest_credentials(auth, proxyinfo->proxyuser, proxyinfo->proxypass, uri, handshake);
+      else
+        proxyauth = http_basic_credentials(proxyinfo->proxyuser, proxyinfo->proxypass);
+      handshake->authsent = auth->scheme;
+      free(auth);
+      if (!proxyauth)
+        ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+    }
+  }
+  //connect proxy to destination
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Sending HTTP proxy CONNECT %s", uri);
+  proxycmdlen = snprintf(NULL, 0, "CONNECT %s HTTP/1.1\r\nHost: %s\r\n%s%s%s\r\n", uri, uri, (proxyauth ? "Proxy-Authorization: " : ""), (proxyauth ? proxyauth : ""), (proxyauth ? "\r\n" : ""));
+  if ((proxycmd = (char*)handshake_buffer_reserve(handshake, proxycmdlen + 1)) == NULL) {
+    free(proxyauth);
+    ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+  }
+  snprintf(proxycmd, proxycmdlen + 1, "CONNECT %s HTTP/1.1\r\nHost: %s\r\n%s%s%s\r\n", uri, uri, (proxyauth ? "Proxy-Authorization: " : ""), (proxyauth ? proxyauth : ""), (proxyauth ? "\r\n" : ""));
+  free(proxyauth);
+  return handshake_send_request(handshake, HANDSHAKE_STEP_HTTP_CONNECT, proxycmdlen);
+}
+
+//continue on a TLS connection to an HTTPS proxy
+int handshake_start_tls (struct proxysocket_handshake_struct* handshake)
+{
+#ifdef HAVE_OPENSSL
+  SOCKET sock;
+  struct tls_tunnel_result* result;
+  struct proxyinfo_struct* proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+  if ((sock = tls_open_tunnel(handshake->proxy, proxyinfo, handshake->sock, &result)) == INVALID_SOCKET)
+    ERROR_DISCONNECT_AND_ABORT(SOCKET_FAILED, 0, "Error setting up TLS connection to HTTPS proxy")
+  handshake->sock = sock;
+  tls_tunnel_result_unref(handshake->tlsresult);
+  handshake->tlsresult = result;
+  socket_set_nonblocking(handshake->sock, 1);
+  socket_set_timeouts_milliseconds(handshake->sock, handshake->proxy->sendtimeout, handshake->proxy->recvtimeout);
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_DEBUG, "Starting TLS with HTTPS proxy: %s:%lu", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);
+  return handshake_http_connect_request(handshake);
+#else
+  ERROR_DISCONNECT_AND_ABORT(INVALID_CONFIG, 0, "HTTPS proxy not supported (built without TLS support)")
+#endif
+}
+
+//the connection or request being timed got its reply, feed the round trip time to the proxy it went to
+void handshake_record_rtt (struct proxysocket_handshake_struct* handshake, struct proxyinfo_struct* proxyinfo)
+{
+  uint32_t rtt;
+  if (!handshake->stepstart)
+    return;
+  rtt = (uint32_t)(get_monotonic_microseconds() - handshake->stepstart);
+  handshake->stepstart = 0;
+  if (!handshake->hoprtt || rtt < handshake->hoprtt)
+    handshake->hoprtt = rtt;
+  //the proxy is only responsible for the part after the proxy before it
+  proxyinfo_record_rtt(proxyinfo, (rtt > handshake->basertt ? rtt - handshake->basertt : 1));
+}
+
+//continue with the next hop once the connection to a proxy is established
+int handshake_next_hop (struct proxysocket_handshake_struct* handshake)
+{
+  struct proxyinfo_struct* proxyinfo;
+  uint64_t now;
+  handshake->pipelined = 0;
+  //the proxy of the hop that just completed is healthy
+  if (handshake->hop > 0 && !handshake->accepting) {
+    TRACE_PROBE3(hop_done, handshake, handshake->hop, handshake->hops[handshake->hop].proxyinfo->proxytype);
+    now = get_monotonic_milliseconds();
+    proxyinfo_record_success(handshake->hops[handshake->hop].proxyinfo, (uint32_t)(handshake->hopstart ? now - handshake->hopstart : 0));
+    handshake->hopstart = now;
+    handshake->basertt = handshake->hoprtt;
+    handshake->hoprtt = 0;
+  }
+  if (++handshake->hop >= handshake->hopcount) {
+    handshake_release_limits(handshake);
+    handshake->step = HANDSHAKE_STEP_NONE;
+    handshake->state = HANDSHAKE_STATE_DONE;
+    return PROXYSOCKET_HANDSHAKE_DONE;
+  }
+  proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+  TRACE_PROBE3(hop_start, handshake, handshake->hop, proxyinfo->proxytype);
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_REQUEST;
+  handshake->authretries = 0;
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Connected to %s: %s:%lu", handshake_proxy_kind(proxyinfo->proxytype), proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);
+  switch (proxyinfo->proxytype) {
+    case PROXYSOCKET_TYPE_SOCKS4 :
+      return handshake_socks4_connect_request(handshake);
+    case PROXYSOCKET_TYPE_SOCKS5 :
+      return handshake_socks5_method_request(handshake);
+    case PROXYSOCKET_TYPE_WEB_CONNECT :
+    case PROXYSOCKET_TYPE_WEB_CONNECT_H2 :
+      return handshake_http_connect_request(handshake);
+    case PROXYSOCKET_TYPE_WEB_CONNECT_TLS :
+      return handshake_start_tls(handshake);
+    default :
+      ERROR_DISCONNECT_AND_ABORT(INVALID_CONFIG, 0, "Unknown proxy type")
+  }
+}
+
+//the direct connection is established
+int handshake_connected (struct proxysocket_handshake_struct* handshake)
+{
+  TRACE_PROBE2(connect_done, handshake, 0);
+  if (handshake->source)
+    ATOMIC_ADD(&handshake->source->stats.connections, 1);
+  if (handshake->connectstart) {
+    proxyinfo_learn_rtt(handshake->hops[1].proxyinfo, (uint32_t)(get_monotonic_milliseconds() - handshake->connectstart));
+    handshake_record_rtt(handshake, handshake->hops[1].proxyinfo);
+    handshake->connectstart = 0;
+  }
+  return handshake_next_hop(handshake);
+}
+
+int handshake_check_connected (struct proxysocket_handshake_struct* handshake)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  if (getpeername(handshake->sock, (struct sockaddr*)&addr, &addrlen) != 0) {
+    int error = 0;
+    socklen_t errorlen = sizeof(error);
+    getsockopt(handshake->sock, SOL_SOCKET, SO_ERROR, (char*)&error, &errorlen);
+    if (error == 0)
+      return PROXYSOCKET_HANDSHAKE_WANT_WRITE;
+    //keep the error so it can be retrieved with socket_get_error_message()
+#ifdef _WIN32
+    WSASetLastError(error);
+#else
+    errno = error;
+#endif
+    TRACE_PROBE2(connect_done, handshake, error);
+    if (handshake->source)
+      ATOMIC_ADD(&handshake->source->stats.failures, 1);
+    ERROR_AT_HOP_DISCONNECT_AND_ABORT(1, CONNECT_FAILED, 0, "Error connecting to host: %s:%lu", inet_ntoa(*(struct in_addr*)&handshake->hops[0].targetaddr), (unsigned long)handshake_target_port(handshake, 0))
+  }
+  return handshake_connected(handshake);
+}
+
+//start over once when a web proxy closes the connection after an authentication challenge (credentials will be sent right away)
+int handshake_restart_after_challenge (struct proxysocket_handshake_struct* handshake)
+{
+  if (handshake->restarted || handshake->authretries == 0 || (handshake->step != HANDSHAKE_STEP_HTTP_CONNECT && handshake->step != HANDSHAKE_STEP_HTTP_DRAIN))
+    return 0;
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Web proxy closed the connection after authentication challenge, reconnecting");
+  handshake->state = HANDSHAKE_STATE_RESTART;
+  return 1;
+}
+
+//the whole request was sent, wait for the reply
+int handshake_request_sent (struct proxysocket_handshake_struct* handshake)
+{
+  TRACE_PROBE4(request_sent, handshake, handshake->hop, handshake->hops[handshake->hop].proxyinfo->proxytype, handshake->step);
+  handshake->stepstart = get_monotonic_microseconds();
+  handshake->state = HANDSHAKE_STATE_RECEIVE;
+  handshake->buflen = 0;
+  return PROXYSOCKET_HANDSHAKE_WANT_READ;
+}
+
+int handshake_send (struct proxysocket_handshake_struct* handshake)
+{
+  int n;
+  while (handshake->bufpos < handshake->buflen) {
+    if ((n = send(handshake->sock, (const char*)handshake->buf + handshake->bufpos, handshake->buflen - handshake->bufpos, SOCKET_SEND_FLAGS)) < 0) {
+      if (socket_would_block())
+        return PROXYSOCKET_HANDSHAKE_WANT_WRITE;
+      if (handshake_restart_after_challenge(handshake))
+        return PROXYSOCKET_HANDSHAKE_WANT_READ;
+      switch (handshake->step) {
+        case HANDSHAKE_STEP_SOCKS4_CONNECT :
+          ERROR_DISCONNECT_AND_ABORT(SEND_FAILED, 0, "Error sending connect command to SOCKS4 proxy")
+        case HANDSHAKE_STEP_SOCKS5_METHOD :
+          ERROR_DISCONNECT_AND_ABORT(SEND_FAILED, 0, "Error sending data to SOCKS5 proxy")
+        case HANDSHAKE_STEP_SOCKS5_AUTH :
+          ERROR_DISCONNECT_AND_ABORT(SEND_FAILED, 0, "Error sending authentication data to SOCKS5 proxy")
+        case HANDSHAKE_STEP_SOCKS5_CONNECT :
+          ERROR_DISCONNECT_AND_ABORT(SEND_FAILED, 0, "Error sending connect command to SOCKS5 proxy")
+        default :
+          ERROR_DISCONNECT_AND_ABORT(SEND_FAILED, 0, "Error sending CONNECT request to web proxy")
+      }
+    }
+    handshake->bufpos += n;
+  }
+  return handshake_request_sent(handshake);
+}
+
+//determine the length of the reply (as far as known from the data received so far)
+size_t handshake_reply_length (struct proxysocket_handshake_struct* handshake)
+{
+  switch (handshake->step) {
+    case HANDSHAKE_STEP_SOCKS4_CONNECT :
+      return 8;
+    case HANDSHAKE_STEP_SOCKS5_METHOD :
+    case HANDSHAKE_STEP_SOCKS5_AUTH :
+      return 2;
+    case HANDSHAKE_STEP_SOCKS5_CONNECT :
+      //check status before reading the bound address
+      if (handshake->buflen < 2 || handshake->buf[0] != SOCKS5_VERSION || handshake->buf[1] != SOCKS5_STATUS_SUCCESS)
+        return 2;
+      if (handshake->buflen < 5)
+        return 5;
+      switch (handshake->buf[3]) {
+        case SOCKS5_ADDRESSTYPE_IPV4 :
+          return 4 + 4 + 2;
+        case SOCKS5_ADDRESSTYPE_DOMAINNAME :
+          return 4 + 1 + handshake->buf[4] + 2;
+        case SOCKS5_ADDRESSTYPE_IPV6 :
+          return 4 + 16 + 2;
+        default :
+          return handshake->buflen;
+      }
+    case HANDSHAKE_STEP_HTTP_DRAIN :
+      return handshake->drainlen;
+    default :
+      return 0;
+  }
+}
+
+//fill in the address the last proxy listens on for a BIND when it didn't report one, returns non-zero if it can't be known
+int handshake_complete_bind_address (struct proxysocket_handshake_struct* handshake)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  if (handshake->bindaddr != INADDR_ANY)
+    return (handshake->bindaddr == INADDR_NONE ? -1 : 0);
+  //the proxy listens on its own address, which is the peer of the connection when it is the only proxy
+  if (handshake->hopcount == 2) {
+    if (getpeername(handshake->sock, (struct sockaddr*)&addr, &addrlen) != 0 || addr.sin_family != AF_INET)
+      return -1;
+    handshake->bindaddr = addr.sin_addr.s_addr;
+    return 0;
+  }
+  //further down a chain it is the address the proxy before it connected to (only known when resolved locally)
+  handshake->bindaddr = handshake->hops[handshake->hopcount - 2].targetaddr;
+  return (handshake->bindaddr == INADDR_NONE ? -1 : 0);
+}
+
+int handshake_process_socks4_connect_reply (struct proxysocket_handshake_struct* handshake)
+{
+  struct socks4_connect_request* response = (struct socks4_connect_request*)handshake->buf;
+  const char* dsthost = handshake_target_host(handshake, handshake->hop);
+  uint32_t hostaddr = handshake->hops[handshake->hop].targetaddr;
+  //display response information
+  if (response->socks_version != 0)
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_WARNING, "Invalid SOCKS4 reply code version (%u)", (unsigned int)response->socks_version);
+  switch (response->socks_command) {
+    case SOCKS4_STATUS_SUCCESS :
+      if (handshake_socks_command(handshake) != SOCKS5_COMMAND_BIND) {
+        write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "SOCKS4 proxy connection established to: %s:%lu", (handshake->proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : dsthost), (unsigned long)handshake_target_port(handshake, handshake->hop));
+        break;
+      }
+      //the first reply to BIND has the listening address, the second one the address of the peer
+      handshake->bindaddr = response->dst_addr;
+      handshake->bindport = ntohs(response->dst_port);
+      if (!handshake->accepting && handshake_complete_bind_address(handshake) != 0)
+        ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, 0, "Unable to determine the address the SOCKS4 proxy listens on (proxy host not resolved locally)")
+      write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, (handshake->accepting ? "SOCKS4 proxy accepted connection from: %s:%lu" : "SOCKS4 proxy listening on: %s:%lu"), inet_ntoa(*(struct in_addr*)&handshake->bindaddr), (unsigned long)handshake->bindport);
+      break;
+    case SOCKS4_STATUS_FAILED :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response->socks_command, "SOCKS4 connection rejected or failed")
+    case SOCKS4_STATUS_IDENT_FAILED :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response->socks_command, "SOCKS4 request rejected because SOCKS server cannot connect to identd on the client")
+    case SOCKS4_STATUS_IDENT_MISMATCH :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response->socks_command, "SOCKS4 request rejected because the client program and identd report different user-ids")
+    default :
+      ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, response->socks_command, "Unsupported reply from SOCKS4 server (%u)", (unsigned int)response->socks_command)
+  }
+  return handshake_next_hop(handshake);
+}
+
+int handshake_process_socks5_method_reply (struct proxysocket_handshake_struct* handshake)
+{
+  static const char* methodmsg = "SOCKS5 proxy authentication method: %s";
+  //display response information
+  if (handshake->buf[0] != SOCKS5_VERSION)
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_WARNING, "SOCKS5 proxy version mismatch (%u)", (unsigned int)handshake->buf[0]);
+  switch (handshake->buf[1]) {
+    case SOCKS5_METHOD_NOAUTH :
+      write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, methodmsg, "no authentication required");
+      proxyinfo_learn(handshake->hops[handshake->hop].proxyinfo, PROXYSOCKET_CAPABILITY_NO_AUTH, PROXYSOCKET_CAPABILITY_SOCKS5_LOGIN);
+      if (handshake->pipelined) {
+        handshake->phase = PROXYSOCKET_ERROR_PHASE_REQUEST;
+        return handshake_expect_reply(handshake, HANDSHAKE_STEP_SOCKS5_CONNECT);
+      }
+      return handshake_socks5_connect_request(handshake);
+/*
+    case SOCKS5_METHOD_GSSAPI :
+      write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, methodmsg, "GSSAPI");
+      break;
+*/
+    case SOCKS5_METHOD_LOGIN :
+      write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, methodmsg, "username/password");
+      proxyinfo_learn(handshake->hops[handshake->hop].proxyinfo, PROXYSOCKET_CAPABILITY_SOCKS5_LOGIN, PROXYSOCKET_CAPABILITY_NO_AUTH);
+      if (handshake->pipelined)
+        return handshake_expect_reply(handshake, HANDSHAKE_STEP_SOCKS5_AUTH);
+      return handshake_socks5_auth_request(handshake);
+    case SOCKS5_METHOD_NONE :
+      write_log_info(handshake->proxy, PROXYSOCKET_LOG_ERROR, methodmsg, "no compatible methods");
+      //the only method offered was the one learned before, negotiate again next time
+      if (handshake->pipelined)
+        proxyinfo_learn(handshake->hops[handshake->hop].proxyinfo, 0, PROXYSOCKET_CAPABILITY_NO_AUTH | PROXYSOCKET_CAPABILITY_SOCKS5_LOGIN);
+      ERROR_DISCONNECT_AND_ABORT(AUTH_UNSUPPORTED, handshake->buf[1], "Unable to negociate SOCKS5 proxy authentication method")
+    default :
+      write_log_info(handshake->proxy, PROXYSOCKET_LOG_ERROR, "SOCKS5 proxy authentication method: unknown (%u)", (unsigned int)handshake->buf[1]);
+      ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, handshake->buf[1], "Received unknown SOCKS5 proxy authentication method (%u)", (unsigned int)handshake->buf[1])
+  }
+}
+
+int handshake_process_socks5_auth_reply (struct proxysocket_handshake_struct* handshake)
+{
+  struct proxyinfo_struct* proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+  if (handshake->buf[0] != 1)
+    ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, 0, "SOCKS5 proxy subnegotiation version mismatch (%u)", (unsigned int)handshake->buf[0])
+  if (handshake->buf[1] == SOCKS5_STATUS_CONNECTION_REFUSED)
+    ERROR_DISCONNECT_AND_ABORT(AUTH_FAILED, handshake->buf[1], "SOCKS5 access denied")
+  if (handshake->buf[1] != 0)
+    ERROR_DISCONNECT_AND_ABORT(AUTH_FAILED, handshake->buf[1], "SOCKS5 authentication failed with status code %u (login: %s)", (unsigned int)handshake->buf[1], (proxyinfo->proxyuser ? proxyinfo->proxyuser : NULL))
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 authentication succeeded (login: %s)", (proxyinfo->proxyuser ? proxyinfo->proxyuser : NULL));
+  if (handshake->pipelined) {
+    handshake->phase = PROXYSOCKET_ERROR_PHASE_REQUEST;
+    return handshake_expect_reply(handshake, HANDSHAKE_STEP_SOCKS5_CONNECT);
+  }
+  return handshake_socks5_connect_request(handshake);
+}
+
+int handshake_process_socks5_connect_reply (struct proxysocket_handshake_struct* handshake)
+{
+  uint8_t* response = handshake->buf;
+  const char* dsthost = handshake_target_host(handshake, handshake->hop);
+  uint32_t hostaddr = handshake->hops[handshake->hop].targetaddr;
+  uint16_t bindport;
+  if (response[0] != SOCKS5_VERSION)
+    ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, 0, "SOCKS5 proxy version mismatch (%u)", (unsigned int)response[0])
+  switch (response[1]) {
+    case SOCKS5_STATUS_SUCCESS :
+      if (handshake->command == SOCKS5_COMMAND_UDP_ASSOCIATE)
+        write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 proxy UDP association established");
+      else if (handshake_socks_command(handshake) == SOCKS5_COMMAND_BIND)
+        write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, (handshake->accepting ? "SOCKS5 proxy accepted incoming connection" : "SOCKS5 proxy listening for incoming connection"));
+      else
+        write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 proxy connection established to: %s:%lu", (handshake->proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : dsthost), (unsigned long)handshake_target_port(handshake, handshake->hop));
+      break;
+    case SOCKS5_STATUS_SOCKS_SERVER_FAILURE :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response[1], "General SOCKS5 server failure")
+    case SOCKS5_STATUS_DENIED :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response[1], "Connection denied by SOCKS5 server")
+    case SOCKS5_STATUS_NETWORK_UNREACHABLE :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response[1], "SOCKS5 server response: Network unreachable")
+    case SOCKS5_STATUS_HOST_UNREACHABLE :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response[1], "SOCKS5 server response: Host unreachable")
+    case SOCKS5_STATUS_CONNECTION_REFUSED :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response[1], "SOCKS5 server response: Connection refused")
+    case SOCKS5_STATUS_TTL_EXPIRES :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response[1], "SOCKS5 server response: TTL expired")
+    case SOCKS5_STATUS_COMMAND_NOT_SUPPORTED :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response[1], "Command not supported by SOCKS5 server")
+    case SOCKS5_STATUS_ADDRESS_TYPE_NOT_SUPPORTED :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, response[1], "Address type not supported by SOCKS5 server")
+    default :
+      ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, response[1], "Unsupported status code from SOCKS5 server (%u)", (unsigned int)response[1])
+  }
+  if (response[2] != 0)
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_WARNING, "Expected SOCKS5 response reserved value to be zero (%u)", (unsigned int)response[2]);
+  handshake->bindaddr = INADDR_NONE;
+  switch (response[3]) {
+    case SOCKS5_ADDRESSTYPE_IPV4 :
+      memcpy(&handshake->bindaddr, response + 4, sizeof(uint32_t));
+      write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 connection bound to IPv4 address: %s", inet_ntoa(*(struct in_addr*)(response + 4)));
+      break;
+    case SOCKS5_ADDRESSTYPE_DOMAINNAME :
+      write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 connection bound to host: %.*s", (int)response[4], (const char*)response + 5);
+      break;
+    case SOCKS5_ADDRESSTYPE_IPV6 :
+      //To do log IPv6 address
+      break;
+    default :
+      ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, 0, "Unsupported SOCKS5 address type (%u)", (unsigned int)response[3])
+  }
+  bindport = ((uint16_t)response[handshake->buflen - 2] << 8) | response[handshake->buflen - 1];
+  handshake->bindport = bindport;
+  if (handshake_socks_command(handshake) == SOCKS5_COMMAND_BIND && !handshake->accepting && handshake_complete_bind_address(handshake) != 0)
+    ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, 0, "Unable to determine the address the SOCKS5 proxy listens on (no IPv4 address reported and proxy host not resolved locally)")
+  if (handshake->pipelined)
+    proxyinfo_learn(handshake->hops[handshake->hop].proxyinfo, PROXYSOCKET_CAPABILITY_PIPELINING, 0);
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "SOCKS5 connection bound to port: %lu", (unsigned long)bindport);
+  return handshake_next_hop(handshake);
+}
+
+//get the result code from the status line of an HTTP response or -1 if it is invalid
+int get_http_response_code (const char* response)
+{
+  const char* p;
+  char* q;
+  long resultcode;
+  if (strncasecmp(response, "HTTP/", 5) != 0)
+    return -1;
+  p = response + 5;
+  while (*p && (isdigit((unsigned char)*p) || *p == '.'))
+    p++;
+  if (!*p || *p++ != ' ')
+    return -1;
+  if ((resultcode = strtol(p, &q, 10)) <= 0)
+    return -1;
+  return (int)resultcode;
+}
+
+//find the next header with the specified name in an HTTP response (pos keeps track of where to continue, initially NULL)
+const char* http_header_find (const char* response, const char* name, const char** pos, size_t* valuelen)
+{
+  const char* p;
+  const char* end;
+  const char* next;
+  const char* value;
+  size_t namelen = strlen(name);
+  //skip the status line
+  if ((p = *pos) == NULL) {
+    if ((p = strchr(response, '\n')) == NULL)
+      return NULL;
+    p++;
+  }
+  while (*p && *p != '\r' && *p != '\n') {
+    for (end = p; *end && *end != '\n'; end++)
+      ;
+    next = (*end ? end + 1 : end);
+    if (strncasecmp(p, name, namelen) == 0 && p[namelen] == ':') {
+      value = p + namelen + 1;
+      while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+      while (end > value && isspace((unsigned char)end[-1]))
+        end--;
+      *pos = next;
+      *valuelen = end - value;
+      return value;
+    }
+    p = next;
+  }
+  *pos = p;
+  return NULL;
+}
+
+//check if a comma separated header value contains the specified token
+int http_header_has_token (const char* value, size_t valuelen, const char* token)
+{
+  const char* p = value;
+  const char* q;
+  const char* end = value + valuelen;
+  size_t tokenlen = strlen(token);
+  while (p < end) {
+    while (p < end && (*p == ',' || *p == ' ' || *p == '\t'))
+      p++;
+    for (q = p; q < end && *q != ',' && *q != ' ' && *q != '\t'; q++)
+      ;
+    if ((size_t)(q - p) == tokenlen && strncasecmp(p, token, tokenlen) == 0)
+      return 1;
+    while (q < end && *q != ',')
+      q++;
+    p = q;
+  }
+  return 0;
+}
+
+//authentication challenges offered by a web proxy (strings point into the response and may contain quoted-string escapes)
+struct http_auth_challenge {
+  int8_t basic;
+  int8_t digest;
+  int8_t qop;
+  int8_t sess;
+  int8_t stale;
+  int8_t unsupported;
+  const char* realm;
+  size_t realmlen;
+  const char* nonce;
+  size_t noncelen;
+  const char* opaque;
+  size_t opaquelen;
+};
+
+//keep a parsed challenge if it is usable
+void http_auth_challenge_done (struct http_auth_challenge* challenges, int scheme, const struct http_auth_challenge* current)
+{
+  if (scheme == HTTP_AUTH_BASIC)
+    challenges->basic = 1;
+  if (scheme == HTTP_AUTH_DIGEST && !challenges->digest && !current->unsupported && current->nonce) {
+    *challenges = *current;
+    challenges->basic = 0;
+    challenges->digest = 1;
+  }
+}
+
+//parse the challenges in the value of a Proxy-Authenticate header (only Basic and Digest with MD5 are supported)
+void http_auth_challenge_parse (const char* value, size_t valuelen, struct http_auth_challenge* challenges)
+{
+  int basic = challenges->basic;
+  int scheme = HTTP_AUTH_NONE;
+  const char* p = value;
+  const char* end = value + valuelen;
+  const char* name;
+  size_t namelen;
+  const char* param;
+  size_t paramlen;
+  struct http_auth_challenge current;
+  memset(&current, 0, sizeof(current));
+  for (;;) {
+    while (p < end && (*p == ',' || isspace((unsigned char)*p)))
+      p++;
+    if (p >= end)
+      break;
+    name = p;
+    while (p < end && *p != '=' && *p != ',' && !isspace((unsigned char)*p))
+      p++;
+    namelen = p - name;
+    while (p < end && isspace((unsigned char)*p))
+      p++;
+    if (p >= end || *p != '=') {
+      //start of a new challenge
+      http_auth_challenge_done(challenges, scheme, &current);
+      memset(&current, 0, sizeof(current));
+      if (namelen == 5 && strncasecmp(name, "Basic", 5) == 0)
+        scheme = HTTP_AUTH_BASIC;
+      else if (namelen == 6 && strncasecmp(name, "Digest", 6) == 0)
+        scheme = HTTP_AUTH_DIGEST;
+      else
+        scheme = HTTP_AUTH_NONE;
+      continue;
+    }
+    //parameter (token or quoted string)
+    p++;
+    while (p < end && isspace((unsigned char)*p))
+      p++;
+    if (p < end && *p == '"') {
+      param = ++p;
+      while (p < end && *p != '"') {
+        if (*p == '\\' && p + 1 < end)
+          p++;
+        p++;
+      }
+      paramlen = p - param;
+      if (p < end)
+        p++;
+    } else {
+      param = p;
+      while (p < end && *p != ',' && !isspace((unsigned char)*p))
+        p++;
+      paramlen = p - param;
+    }
+    if (scheme != HTTP_AUTH_DIGEST)
+      continue;
+    if (namelen == 5 && strncasecmp(name, "realm", 5) == 0) {
+      current.realm = param;
+      current.realmlen = paramlen;
+    } else if (namelen == 5 && strncasecmp(name, "nonce", 5) == 0) {
+      current.nonce = param;
+      current.noncelen = paramlen;
+    } else if (namelen == 6 && strncasecmp(name, "opaque", 6) == 0) {
+      current.opaque = param;
+      current.opaquelen = paramlen;
+    } else if (namelen == 5 && strncasecmp(name, "stale", 5) == 0) {
+      current.stale = (paramlen == 4 && strncasecmp(param, "true", 4) == 0);
+    } else if (namelen == 9 && strncasecmp(name, "algorithm", 9) == 0) {
+      if (paramlen == 8 && strncasecmp(param, "MD5-sess", 8) == 0)
+        current.sess = 1;
+      else if (!(paramlen == 3 && strncasecmp(param, "MD5", 3) == 0))
+        current.unsupported = 1;
+    } else if (namelen == 3 && strncasecmp(name, "qop", 3) == 0) {
+      if (http_header_has_token(param, paramlen, "auth"))
+        current.qop = 1;
+      else
+        current.unsupported = 1;
+    }
+  }
+  http_auth_challenge_done(challenges, scheme, &current);
+  challenges->basic |= basic;
+}
+
+//answer an authentication challenge from a web proxy, on the same connection unless the proxy closes it
+int handshake_process_http_auth_challenge (struct proxysocket_handshake_struct* handshake, int result)
+{
+  int keepalive;
+  long contentlength = -1;
+  const char* pos;
+  const char* value;
+  size_t valuelen;
+  struct http_auth_challenge challenges;
+  struct proxyinfo_auth_struct* auth;
+  struct proxyinfo_struct* proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+  const char* response = (const char*)handshake->buf;
+  memset(&challenges, 0, sizeof(challenges));
+  pos = NULL;
+  while ((value = http_header_find(response, "Proxy-Authenticate", &pos, &valuelen)) != NULL)
+    http_auth_challenge_parse(value, valuelen, &challenges);
+  if (challenges.digest)
+    proxyinfo_learn(proxyinfo, PROXYSOCKET_CAPABILITY_HTTP_DIGEST, PROXYSOCKET_CAPABILITY_NO_AUTH | PROXYSOCKET_CAPABILITY_HTTP_BASIC);
+  else if (challenges.basic)
+    proxyinfo_learn(proxyinfo, PROXYSOCKET_CAPABILITY_HTTP_BASIC, PROXYSOCKET_CAPABILITY_NO_AUTH | PROXYSOCKET_CAPABILITY_HTTP_DIGEST);
+  if (!(proxyinfo->proxyuser && *proxyinfo->proxyuser))
+    ERROR_DISCONNECT_AND_ABORT(AUTH_REQUIRED, result, "Proxy authentication required")
+  if (!challenges.basic && !challenges.digest)
+    ERROR_DISCONNECT_AND_ABORT(AUTH_UNSUPPORTED, result, "Web proxy requires an unsupported authentication scheme")
+  //only try again if no credentials were sent yet or if the digest nonce has expired
+  if ((handshake->authsent != HTTP_AUTH_NONE && !(handshake->authsent == HTTP_AUTH_DIGEST && challenges.digest && challenges.stale)) || handshake->authretries >= 2)
+    ERROR_DISCONNECT_AND_ABORT(AUTH_FAILED, result, "Proxy authentication failed (user: %s)", proxyinfo->proxyuser)
+  //remember the scheme so later connections send credentials right away (digest is preferred)
+  if (challenges.digest)
+    auth = proxyinfo_auth_create(HTTP_AUTH_DIGEST, challenges.qop, challenges.sess, challenges.stale, challenges.realm, challenges.realmlen, challenges.nonce, challenges.noncelen, challenges.opaque, challenges.opaquelen, 1);
+  else
+    auth = proxyinfo_auth_create(HTTP_AUTH_BASIC, 0, 0, 0, NULL, 0, NULL, 0, NULL, 0, 0);
+  if (!auth)
+    ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+  proxyinfo_set_auth(proxyinfo, auth);
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_DEBUG, "Web proxy %s:%lu requires %s authentication", proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport, (challenges.digest ? "digest" : "basic"));
+  //check if the connection stays open (HTTP/1.1 default) and where the response ends
+  keepalive = (strncmp(response, "HTTP/1.0", 8) != 0);
+  pos = NULL;
+  while ((value = http_header_find(response, "Connection", &pos, &valuelen)) != NULL) {
+    if (http_header_has_token(value, valuelen, "close"))
+      keepalive = 0;
+    else if (http_header_has_token(value, valuelen, "keep-alive"))
+      keepalive = 1;
+  }
+  pos = NULL;
+  while ((value = http_header_find(response, "Proxy-Connection", &pos, &valuelen)) != NULL) {
+    if (http_header_has_token(value, valuelen, "close"))
+      keepalive = 0;
+    else if (http_header_has_token(value, valuelen, "keep-alive"))
+      keepalive = 1;
+  }
+  pos = NULL;
+  if ((value = http_header_find(response, "Content-Length", &pos, &valuelen)) != NULL && valuelen > 0 && isdigit((unsigned char)*value))
+    contentlength = strtol(value, NULL, 10);
+  pos = NULL;
+  if (http_header_find(response, "Transfer-Encoding", &pos, &valuelen) != NULL)
+    contentlength = -1;
+  handshake->authretries++;
+  if (keepalive && contentlength >= 0 && contentlength <= HANDSHAKE_MAX_HTTP_RESPONSE) {
+    if (contentlength > 0) {
+      //discard the response body before sending the request again
+      handshake->drainlen = contentlength;
+      handshake->step = HANDSHAKE_STEP_HTTP_DRAIN;
+      handshake->buflen = 0;
+      return PROXYSOCKET_HANDSHAKE_WANT_READ;
+    }
+    return handshake_http_connect_request(handshake);
+  }
+  //the proxy closes the connection
+  if (handshake_restart_after_challenge(handshake))
+    return PROXYSOCKET_HANDSHAKE_WANT_READ;
+  ERROR_DISCONNECT_AND_ABORT(AUTH_FAILED, result, "Web proxy closed the connection after authentication challenge")
+}
+
+//get the time in milliseconds from the Retry-After header of a reply (only delay-seconds, not HTTP dates), returns 0 if not given
+uint32_t http_get_retry_after (const char* response)
+{
+  const char* pos = NULL;
+  const char* value;
+  size_t valuelen;
+  size_t i;
+  uint32_t seconds = 0;
+  if ((value = http_header_find(response, "Retry-After", &pos, &valuelen)) == NULL || valuelen == 0)
+    return 0;
+  for (i = 0; i < valuelen; i++) {
+    if (!isdigit((unsigned char)value[i]))
+      return 0;
+    if (seconds < LIMITS_MAX_RETRY_AFTER / 1000)
+      seconds = seconds * 10 + (value[i] - '0');
+  }
+  return (seconds < LIMITS_MAX_RETRY_AFTER / 1000 ? seconds * 1000 : LIMITS_MAX_RETRY_AFTER);
+}
+
+//slow down all connections through a web proxy that answered 429 (Too many requests) for as long as it asks
+int handshake_process_http_too_many_requests (struct proxysocket_handshake_struct* handshake, int result)
+{
+  uint32_t pause;
+  struct proxyinfo_limits* limits;
+  struct proxyinfo_struct* proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+  if ((pause = http_get_retry_after((const char*)handshake->buf)) == 0)
+    pause = LIMITS_DEFAULT_RETRY_AFTER;
+  if ((limits = (handshake->hops[handshake->hop].limits ? handshake->hops[handshake->hop].limits : proxyinfo_get_limits(proxyinfo))) != NULL)
+    limits_pause(limits, pause);
+  ERROR_DISCONNECT_AND_ABORT(RATE_LIMITED, result, "Too many requests, web proxy is given no new connections for %lu ms: %s:%lu", (unsigned long)pause, (proxyinfo->proxyhost ? proxyinfo->proxyhost : ""), (unsigned long)proxyinfo->proxyport)
+}
+
+int handshake_process_http_connect_reply (struct proxysocket_handshake_struct* handshake)
+{
+  int result;
+  const char* dsthost = handshake_target_host(handshake, handshake->hop);
+  uint32_t hostaddr = handshake->hops[handshake->hop].targetaddr;
+  handshake->buf[handshake->buflen] = 0;
+  result = get_http_response_code((const char*)handshake->buf);
+  TRACE_PROBE5(reply_received, handshake, handshake->hop, handshake->hops[handshake->hop].proxyinfo->proxytype, handshake->step, result);
+  if (result != 200)
+    write_log_info(handshake->proxy, PROXYSOCKET_LOG_DEBUG, "HTTP proxy response code %i, details:\n%s", result, (const char*)handshake->buf);
+  if (result < 100 || result >= 600)
+    ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, (result > 0 ? result : 0), "Invalid response, probably not from a web proxy")
+  switch (result) {
+    case 400 :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Bad request")
+    case 401 :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Authentication required")
+    case 403 :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Access denied")
+    case 404 :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Not found")
+    case 405 :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Method not allowed")
+    case 407 :
+      return handshake_process_http_auth_challenge(handshake, result);
+    case 408 :
+      ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Request timed out")
+    case 429 :
+      return handshake_process_http_too_many_requests(handshake, result);
+  }
+  if (result >= 500)
+    ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Web proxy returned a server error")
+  if (result >= 400)
+    ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Web proxy returned a client error")
+  if (result >= 300)
+    ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Web proxy returned unexpected redirection")
+  if (result < 200)
+    ERROR_DISCONNECT_AND_ABORT(REJECTED, result, "Web proxy returned unexpected progress response")
+  if (handshake->authsent == HTTP_AUTH_NONE)
+    proxyinfo_learn(handshake->hops[handshake->hop].proxyinfo, PROXYSOCKET_CAPABILITY_NO_AUTH, PROXYSOCKET_CAPABILITY_HTTP_BASIC | PROXYSOCKET_CAPABILITY_HTTP_DIGEST);
+  write_log_info(handshake->proxy, PROXYSOCKET_LOG_INFO, "Web proxy connection established to: %s:%lu", (handshake->proxy->proxy_dns == USE_CLIENT_DNS ? inet_ntoa(*(struct in_addr*)&hostaddr) : dsthost), (unsigned long)handshake_target_port(handshake, handshake->hop));
+  return handshake_next_hop(handshake);
+}
+
+int handshake_process_reply (struct proxysocket_handshake_struct* handshake)
+{
+  //the first reply from the first proxy tells if TCP Fast Open was used
+  if (handshake->fastopen && handshake->hop == 1 && !handshake->accepting && handshake->step != HANDSHAKE_STEP_SOCKS5_AUTH && handshake->step != HANDSHAKE_STEP_SOCKS5_CONNECT && handshake->step != HANDSHAKE_STEP_HTTP_DRAIN && !(handshake->step == HANDSHAKE_STEP_HTTP_CONNECT && handshake->authretries > 0)) {
+    //by the last probing round the kernel has a cookie, so a request not sent in the SYN packet means the proxy doesn't accept it
+    if (!proxyinfo_update_fastopen_stats(handshake->proxy, handshake->hops[1].proxyinfo, handshake->sock) && handshake->probing == PROBE_ROUND_PIPELINING)
+      proxyinfo_learn(handshake->hops[1].proxyinfo, 0, PROXYSOCKET_CAPABILITY_FASTOPEN);
+  }
+  handshake_record_rtt(handshake, handshake->hops[handshake->hop].proxyinfo);
+  //the status of a SOCKS reply is its second byte, the status code of an HTTP reply is reported once parsed
+  if (handshake->step != HANDSHAKE_STEP_HTTP_CONNECT && handshake->step != HANDSHAKE_STEP_HTTP_DRAIN)
+    TRACE_PROBE5(reply_received, handshake, handshake->hop, handshake->hops[handshake->hop].proxyinfo->proxytype, handshake->step, handshake->buf[1]);
+  switch (handshake->step) {
+    case HANDSHAKE_STEP_SOCKS4_CONNECT :
+      return handshake_process_socks4_connect_reply(handshake);
+    case HANDSHAKE_STEP_SOCKS5_METHOD :
+      return handshake_process_socks5_method_reply(handshake);
+    case HANDSHAKE_STEP_SOCKS5_AUTH :
+      return handshake_process_socks5_auth_reply(handshake);
+    case HANDSHAKE_STEP_SOCKS5_CONNECT :
+      return handshake_process_socks5_connect_reply(handshake);
+    case HANDSHAKE_STEP_HTTP_CONNECT :
+      return handshake_process_http_connect_reply(handshake);
+    case HANDSHAKE_STEP_HTTP_DRAIN :
+      return handshake_http_connect_request(handshake);
+    default :
+      ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, 0, "Unexpected data received")
+  }
+}
+
+//reading a reply failed (received is the value returned by recv())
+int handshake_connection_lost (struct proxysocket_handshake_struct* handshake, int received)
+{
+#ifdef HAVE_OPENSSL
+  //the tunnel was closed because the TLS handshake with the proxy failed
+  if (handshake->tlsresult && ATOMIC_LOAD(&handshake->tlsresult->failed))
+    ERROR_DISCONNECT_AND_ABORT(TLS_FAILED, 0, "TLS handshake with HTTPS proxy failed: %s", handshake->tlsresult->reason)
+#endif
+  if (handshake_restart_after_challenge(handshake))
+    return PROXYSOCKET_HANDSHAKE_WANT_READ;
+  if (received < 0)
+    handshake_set_error(handshake, handshake->hop, PROXYSOCKET_ERROR_CAUSE_RECEIVE_FAILED, 0);
+  //the proxy may not accept requests sent before its reply to the previous one
+  if (handshake->pipelined && handshake->step != HANDSHAKE_STEP_SOCKS5_CONNECT)
+    proxyinfo_learn(handshake->hops[handshake->hop].proxyinfo, 0, PROXYSOCKET_CAPABILITY_PIPELINING);
+  switch (handshake->step) {
+    case HANDSHAKE_STEP_SOCKS4_CONNECT :
+      ERROR_DISCONNECT_AND_ABORT(CONNECTION_LOST, 0, "Connection lost while reading connect response from SOCKS4 proxy")
+    case HANDSHAKE_STEP_SOCKS5_METHOD :
+      ERROR_DISCONNECT_AND_ABORT(CONNECTION_LOST, 0, "Connection lost while reading data from SOCKS5 proxy")
+    case HANDSHAKE_STEP_SOCKS5_AUTH :
+      ERROR_DISCONNECT_AND_ABORT(CONNECTION_LOST, 0, "Connection lost while reading authentication response from SOCKS5 proxy")
+    case HANDSHAKE_STEP_SOCKS5_CONNECT :
+      ERROR_DISCONNECT_AND_ABORT(CONNECTION_LOST, 0, "Connection lost while reading connect response from SOCKS5 proxy")
+    default :
+      ERROR_DISCONNECT_AND_ABORT(CONNECTION_LOST, 0, "Connection lost while reading response from web proxy")
+  }
+}
+
+//receive HTTP response header without reading any data beyond it
+int handshake_receive_http (struct proxysocket_handshake_struct* handshake)
+{
+  int n;
+  int received;
+  size_t i;
+  size_t end;
+  for (;;) {
+    if (handshake_buffer_reserve(handshake, handshake->buflen + READ_BUFFER_SIZE + 1) == NULL)
+      ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+    if ((n = recv(handshake->sock, (char*)handshake->buf + handshake->buflen, handshake->bufsize - handshake->buflen - 1, MSG_PEEK)) <= 0) {
+      if (n < 0 && socket_would_block())
+        return PROXYSOCKET_HANDSHAKE_WANT_READ;
+      return handshake_connection_lost(handshake, n);
+    }
+    //look for the empty line at the end of the header
+    end = 0;
+    for (i = (handshake->buflen > 2 ? handshake->buflen - 2 : 0); i < handshake->buflen + n; i++) {
+      if (handshake->buf[i] == '\n' && ((i >= 1 && handshake->buf[i - 1] == '\n') || (i >= 2 && handshake->buf[i - 1] == '\r' && handshake->buf[i - 2] == '\n'))) {
+        end = i + 1;
+        break;
+      }
+    }
+    //consume the peeked data up to the end of the header
+    if (end)
+      n = end - handshake->buflen;
+    if ((received = recv(handshake->sock, (char*)handshake->buf + handshake->buflen, n, 0)) != n)
+      return handshake_connection_lost(handshake, received);
+    handshake->buflen += n;
+    if (end)
+      return handshake_process_reply(handshake);
+    if (handshake->buflen > HANDSHAKE_MAX_HTTP_RESPONSE)
+      ERROR_DISCONNECT_AND_ABORT(PROTOCOL_ERROR, 0, "Response header from web proxy too large")
+  }
+}
+
+int handshake_receive (struct proxysocket_handshake_struct* handshake)
+{
+  int n;
+  size_t needed;
+  if (handshake->step == HANDSHAKE_STEP_HTTP_CONNECT)
+    return handshake_receive_http(handshake);
+  //only read what is needed so no data after the reply is consumed
+  while ((needed = handshake_reply_length(handshake)) > handshake->buflen) {
+    if (handshake_buffer_reserve(handshake, needed) == NULL)
+      ERROR_DISCONNECT_AND_ABORT(OUT_OF_MEMORY, 0, memory_allocation_error)
+    if ((n = recv(handshake->sock, (char*)handshake->buf + handshake->buflen, needed - handshake->buflen, 0)) <= 0) {
+      if (n < 0 && socket_would_block())
+        return PROXYSOCKET_HANDSHAKE_WANT_READ;
+      return handshake_connection_lost(handshake, n);
+    }
+    handshake->buflen += n;
+  }
+  return handshake_process_reply(handshake);
+}
+
+//check if the first proxy is an HTTP/2 proxy
+int handshake_uses_http2 (struct proxysocket_handshake_struct* handshake)
+{
+  return (handshake->hopcount > 1 && handshake->hops[1].proxyinfo->proxytype == PROXYSOCKET_TYPE_WEB_CONNECT_H2);
+}
+
+//check if the connection is relayed by a thread (the socket is one end of a socket pair)
+int handshake_uses_relay (struct proxysocket_handshake_struct* handshake)
+{
+  int i;
+  for (i = 1; i < handshake->hopcount; i++) {
+    if (handshake->hops[i].proxyinfo->proxytype == PROXYSOCKET_TYPE_WEB_CONNECT_H2 || handshake->hops[i].proxyinfo->proxytype == PROXYSOCKET_TYPE_WEB_CONNECT_TLS)
+      return 1;
+  }
+  return 0;
+}
+
+//use TCP Fast Open for the connection to the first proxy if enabled or if the proxy is known to accept it
+int handshake_use_fastopen (struct proxysocket_handshake_struct* handshake)
+{
+  if (handshake->probing)
+    return (handshake->probing >= PROBE_ROUND_FASTOPEN);
+  return handshake->proxy->fastopen || (handshake->hopcount > 1 && (handshake->hops[1].proxyinfo->runtime->capabilities.flags & PROXYSOCKET_CAPABILITY_FASTOPEN));
+}
+
+//start the direct connection (to the first proxy)
+int handshake_connect_direct (struct proxysocket_handshake_struct* handshake)
+{
+  uint32_t addr;
+  proxysocketconfig proxy = handshake->proxy;
+  struct proxyinfo_struct* proxyinfo;
+  struct sockaddr_in remote_sock_addr;
+  /* * * DIRECT CONNECTION * * */
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_CONNECT;
+  handshake->hopstart = get_monotonic_milliseconds();
+  proxyinfo = handshake->hops[0].proxyinfo;
+  if (handshake->hopcount > 1)
+    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Preparing to connect to %s: %s:%lu", handshake_proxy_kind(handshake->hops[1].proxyinfo->proxytype), handshake->hops[1].proxyinfo->proxyhost, (unsigned long)handshake->hops[1].proxyinfo->proxyport);
+  //tunnels through an HTTP/2 proxy share connections handled by a relay thread
+  if (handshake_uses_http2(handshake)) {
+    if ((handshake->sock = http2_open_tunnel(proxy, handshake->hops[1].proxyinfo)) == INVALID_SOCKET)
+      ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, SOCKET_FAILED, 0, "Error creating HTTP/2 proxy tunnel")
+    if (socket_set_nonblocking(handshake->sock, 1) != 0)
+      ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, SOCKET_FAILED, 0, "Error setting connection socket to non-blocking mode")
+    socket_set_timeouts_milliseconds(handshake->sock, proxy->sendtimeout, proxy->recvtimeout);
+    return handshake_connected(handshake);
+  }
+  //create the socket
+  if ((handshake->sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET)
+    ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, SOCKET_FAILED, 0, "Error creating connection socket")
+  if (socket_set_nonblocking(handshake->sock, 1) != 0)
+    ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, SOCKET_FAILED, 0, "Error setting connection socket to non-blocking mode")
+  //send the first data along with the connection request if TCP Fast Open is enabled
+  if ((handshake->fastopen = handshake_use_fastopen(handshake)) != 0)
+    socket_enable_fastopen(proxy, handshake->sock);
+  //set socket options for the handshake phase (linger can be configured with PROXYSOCKET_SOCKOPT_LINGER)
+  socket_apply_options(proxy, handshake->sock, PROXYSOCKET_PHASE_HANDSHAKE);
+  //bind the socket
+  if (proxy->sourcecount > 0) {
+    if ((handshake->source = socket_bind_source(proxy, handshake->sock)) == NULL)
+      ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, BIND_FAILED, 0, "Error binding socket to source address")
+  } else if ((proxyinfo->proxyhost && *proxyinfo->proxyhost) || proxyinfo->proxyport) {
+    struct sockaddr_in local_sock_addr;
+    addr = INADDR_NONE;
+    if (proxyinfo->proxyhost && *proxyinfo->proxyhost) {
+      if ((addr = resolver_cache_lookup(handshake->resolvercache, proxy, proxyinfo->proxyhost)) == INADDR_NONE)
+        ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, RESOLVE_FAILED, 0, "Error looking up proxy host: %s", proxyinfo->proxyhost)
+      write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Resolved proxy host %s to IP: %s", proxyinfo->proxyhost, inet_ntoa(*(struct in_addr*)&addr));
+    }
+    if ((addr != INADDR_NONE && addr != INADDR_ANY) || proxyinfo->proxyport) {
+      local_sock_addr.sin_family = AF_INET;
+      local_sock_addr.sin_port = htons(proxyinfo->proxyport);
+      local_sock_addr.sin_addr.s_addr = (addr == INADDR_NONE ? INADDR_ANY : addr);
+      write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Binding to: %s:%lu", inet_ntoa(*(struct in_addr*)&local_sock_addr.sin_addr.s_addr), (unsigned long)ntohs(local_sock_addr.sin_port));
+      if (bind(handshake->sock, (struct sockaddr*)&local_sock_addr, sizeof(local_sock_addr)) != 0)
+        ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, BIND_FAILED, 0, "Error binding socket to: %s:%lu", inet_ntoa(*(struct in_addr*)&local_sock_addr.sin_addr.s_addr), (unsigned long)ntohs(local_sock_addr.sin_port))
+    }
+  }
+  //set connection timeout
+  socket_set_timeouts_milliseconds(handshake->sock, proxy->sendtimeout, proxy->recvtimeout);
+  //connect to host
+  remote_sock_addr.sin_family = AF_INET;
+  remote_sock_addr.sin_port = htons(handshake_target_port(handshake, 0));
+  remote_sock_addr.sin_addr.s_addr = handshake->hops[0].targetaddr;
+  write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Connecting to host: %s:%lu", inet_ntoa(*(struct in_addr*)&remote_sock_addr.sin_addr.s_addr), (unsigned long)ntohs(remote_sock_addr.sin_port));
+  //time the connection to the first proxy (with TCP Fast Open connect() returns before anything is sent)
+  handshake->connectstart = (handshake->hopcount > 1 && !handshake->fastopen ? get_monotonic_milliseconds() : 0);
+  handshake->stepstart = (handshake->connectstart ? get_monotonic_microseconds() : 0);
+  TRACE_PROBE4(connect_start, handshake, remote_sock_addr.sin_addr.s_addr, ntohs(remote_sock_addr.sin_port), handshake->fastopen);
+  if (connect(handshake->sock, (struct sockaddr*)&remote_sock_addr, sizeof(remote_sock_addr)) == 0)
+    return handshake_connected(handshake);
+  if (!socket_would_block()) {
+    TRACE_PROBE2(connect_done, handshake, get_socket_error_code());
+    if (handshake->source)
+      ATOMIC_ADD(&handshake->source->stats.failures, 1);
+    ERROR_AT_HOP_DISCONNECT_AND_ABORT(1, CONNECT_FAILED, 0, "Error connecting to host: %s:%lu", inet_ntoa(*(struct in_addr*)&remote_sock_addr.sin_addr.s_addr), (unsigned long)ntohs(remote_sock_addr.sin_port))
+  }
+  handshake->state = HANDSHAKE_STATE_CONNECT;
+  return PROXYSOCKET_HANDSHAKE_WANT_WRITE;
+}
+
+//wait in the queues of the proxies with connection limits in connection order, returns PROXYSOCKET_HANDSHAKE_DONE when all hops are admitted
+int handshake_admit (struct proxysocket_handshake_struct* handshake)
+{
+  uint64_t now;
+  uint32_t waittime = 0;
+  uint32_t maxwait;
+  struct proxyinfo_struct* proxyinfo;
+  struct proxyinfo_limits* limits;
+  while (handshake->admithop < handshake->hopcount) {
+    proxyinfo = handshake->hops[handshake->admithop].proxyinfo;
+    //limits can be added by a proxy answering 429 while other handshakes are made
+    if (!handshake->queued && (limits = ATOMIC_LOAD(&proxyinfo->runtime->limits)) != NULL) {
+      //join the end of the queue
+      handshake->hops[handshake->admithop].limits = limits;
+      handshake->waiter.next = NULL;
+      handshake->waiter.admitted = 0;
+      handshake->queued = 1;
+      handshake->queuestart = get_monotonic_milliseconds();
+      spin_lock(&limits->lock);
+      *limits->last = &handshake->waiter;
+      limits->last = &handshake->waiter.next;
+      limits->queuelength++;
+      limits_admit(limits, handshake->queuestart);
+      waittime = limits_wait_time(limits, handshake->queuestart);
+      spin_unlock(&limits->lock);
+      if (!handshake->waiter.admitted) {
+        ATOMIC_ADD(&proxyinfo->runtime->state->stats.queued, 1);
+        write_log_info(handshake->proxy, PROXYSOCKET_LOG_DEBUG, "Waiting for connection limits of %s: %s:%lu", handshake_proxy_kind(proxyinfo->proxytype), (proxyinfo->proxyhost ? proxyinfo->proxyhost : ""), (unsigned long)proxyinfo->proxyport);
+      }
+    } else if (handshake->queued) {
+      //check if a place became available
+      now = get_monotonic_milliseconds();
+      limits = handshake->hops[handshake->admithop].limits;
+      spin_lock(&limits->lock);
+      limits_admit(limits, now);
+      waittime = limits_wait_time(limits, now);
+      maxwait = limits->maxwait;
+      if (!handshake->waiter.admitted && maxwait && now - handshake->queuestart >= maxwait) {
+        limits_remove_waiter(limits, &handshake->waiter);
+        spin_unlock(&limits->lock);
+        handshake->hops[handshake->admithop].limits = NULL;
+        handshake->queued = 0;
+        ATOMIC_ADD(&proxyinfo->runtime->state->stats.queue_timeouts, 1);
+        ATOMIC_ADD(&proxyinfo->runtime->state->stats.queue_wait_time, now - handshake->queuestart);
+        ERROR_AT_HOP_DISCONNECT_AND_ABORT(handshake->admithop, QUEUE_TIMEOUT, 0, "Timeout waiting for connection limits of %s: %s:%lu", handshake_proxy_kind(proxyinfo->proxytype), (proxyinfo->proxyhost ? proxyinfo->proxyhost : ""), (unsigned long)proxyinfo->proxyport)
+      }
+      spin_unlock(&limits->lock);
+    }
+    if (handshake->queued) {
+      if (!handshake->waiter.admitted) {
+        //check again when a token is due or the maximum wait time is reached
+        now = get_monotonic_milliseconds();
+        maxwait = ATOMIC_LOAD(&handshake->hops[handshake->admithop].limits->maxwait);
+        if (maxwait && handshake->queuestart + maxwait < now + waittime)
+          waittime = (handshake->queuestart + maxwait > now ? (uint32_t)(handshake->queuestart + maxwait - now) : 0);
+        handshake->queuecheck = now + waittime;
+        handshake->state = HANDSHAKE_STATE_QUEUED;
+        return PROXYSOCKET_HANDSHAKE_WANT_TIMER;
+      }
+      handshake->queued = 0;
+      ATOMIC_ADD(&proxyinfo->runtime->state->stats.queue_wait_time, get_monotonic_milliseconds() - handshake->queuestart);
+    }
+    handshake->admithop++;
+  }
+  return PROXYSOCKET_HANDSHAKE_DONE;
+}
+
+//continue a handshake waiting for connection limits
+int handshake_continue_admission (struct proxysocket_handshake_struct* handshake)
+{
+  int status;
+  if ((status = handshake_admit(handshake)) != PROXYSOCKET_HANDSHAKE_DONE)
+    return status;
+  return handshake_connect_direct(handshake);
+}
+
+//host names of the hops that are resolved locally (when client DNS is used or for the direct connection), returns the number of names
+int handshake_get_resolve_hosts (struct proxysocket_handshake_struct* handshake, const char** hostnames)
+{
+  int i;
+  int count = 0;
+  for (i = 0; i < handshake->hopcount; i++) {
+    if (handshake->proxy->proxy_dns == USE_CLIENT_DNS || i == 0)
+      hostnames[count++] = handshake_target_host(handshake, i);
+  }
+  return count;
+}
+
+//resolve all needed addresses and start the direct connection
+int handshake_begin (struct proxysocket_handshake_struct* handshake)
+{
+  int i;
+  int count;
+  uint32_t addr;
+  const char* host;
+  const char** hostnames;
+  proxysocketconfig proxy = handshake->proxy;
+  struct proxyinfo_struct* proxyinfo;
+  struct resolver_cache_struct* resolvercache;
+  TRACE_PROBE4(handshake_start, handshake, handshake->dsthost, handshake->dstport, handshake->hopcount);
+  if (handshake->hopcount == 0 || handshake->hops[0].proxyinfo->proxytype != PROXYSOCKET_TYPE_NONE)
+    ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, INVALID_CONFIG, 0, "Proxy connection information missing")
+  for (i = 1; i < handshake->hopcount; i++) {
+    proxyinfo = handshake->hops[i].proxyinfo;
+    if (!(proxyinfo->proxyhost && *proxyinfo->proxyhost))
+      ERROR_AT_HOP_DISCONNECT_AND_ABORT(i, INVALID_CONFIG, 0, "Missing proxy host")
+    if (proxyinfo->proxytype == PROXYSOCKET_TYPE_WEB_CONNECT_H2 && i != 1)
+      ERROR_AT_HOP_DISCONNECT_AND_ABORT(i, INVALID_CONFIG, 0, "HTTP/2 proxy can only be used as the first proxy")
+  }
+  //datagrams are sent to the relay of the proxy directly, so an association can't go through a chain (a group of SOCKS5 proxies is a single hop)
+  if (handshake->command == SOCKS5_COMMAND_UDP_ASSOCIATE && (handshake->hopcount != 2 || handshake->hops[1].proxyinfo->proxytype != PROXYSOCKET_TYPE_SOCKS5))
+    ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, INVALID_CONFIG, 0, "UDP association requires exactly one SOCKS5 proxy")
+  if (handshake->command == SOCKS5_COMMAND_BIND && (handshake->hopcount < 2 || (handshake->hops[handshake->hopcount - 1].proxyinfo->proxytype != PROXYSOCKET_TYPE_SOCKS4 && handshake->hops[handshake->hopcount - 1].proxyinfo->proxytype != PROXYSOCKET_TYPE_SOCKS5)))
+    ERROR_AT_HOP_DISCONNECT_AND_ABORT(0, INVALID_CONFIG, 0, "Listening for incoming connections requires a SOCKS4 or SOCKS5 proxy as the last proxy")
+  //resolve hosts if needed (when client DNS is used or for the direct connection)
+  //the hosts of a chain are looked up at the same time when more than one of them wasn't resolved recently (handshakes started together were prefetched by handshake_begin_many())
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_RESOLVE;
+  resolvercache = handshake->resolvercache;
+  if (!resolvercache && proxy->proxy_dns == USE_CLIENT_DNS && handshake->hopcount > 1 && (hostnames = (const char**)malloc(handshake->hopcount * sizeof(const char*))) != NULL) {
+    count = handshake_get_resolve_hosts(handshake, hostnames);
+    if (resolver_count_uncached(proxy, hostnames, count) > 1 && (resolvercache = resolver_cache_create(count)) != NULL)
+      resolver_cache_prefetch(resolvercache, proxy, hostnames, count);
+    free(hostnames);
+  }
+  for (i = 0; i < handshake->hopcount; i++) {
+    handshake->hops[i].targetaddr = INADDR_NONE;
+    if (proxy->proxy_dns == USE_CLIENT_DNS || i == 0) {
+      host = handshake_target_host(handshake, i);
+      TRACE_PROBE3(resolve_start, handshake, i + 1, host);
+      handshake->hops[i].targetaddr = resolver_cache_lookup(resolvercache, proxy, host);
+      TRACE_PROBE4(resolve_done, handshake, i + 1, host, handshake->hops[i].targetaddr);
+    }
+  }
+  if (resolvercache != handshake->resolvercache)
+    resolver_cache_free(resolvercache);
+  for (i = 0; i < handshake->hopcount; i++) {
+    if (proxy->proxy_dns == USE_CLIENT_DNS || i == 0) {
+      host = handshake_target_host(handshake, i);
+      if ((addr = handshake->hops[i].targetaddr) == INADDR_NONE) {
+        if (i + 1 < handshake->hopcount)
+          ERROR_AT_HOP_DISCONNECT_AND_ABORT(i + 1, RESOLVE_FAILED, 0, "Error looking up proxy host: %s", host)
+        else
+          ERROR_AT_HOP_DISCONNECT_AND_ABORT(i + 1, RESOLVE_FAILED, 0, "Error looking up host: %s", (host ? host : ""))
+      }
+      write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, (i + 1 < handshake->hopcount ? "Resolved proxy host %s to IP: %s" : "Resolved host %s to IP: %s"), host, inet_ntoa(*(struct in_addr*)&addr));
+    }
+  }
+  //wait for the connection limits of the proxies
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_ADMISSION;
+  return handshake_continue_admission(handshake);
+}
+
+//start over with a new direct connection
+int handshake_restart (struct proxysocket_handshake_struct* handshake)
+{
+  proxysocket_disconnect(handshake->proxy, handshake->sock);
+  handshake->sock = INVALID_SOCKET;
+  handshake->source = NULL;
+  tls_tunnel_result_unref(handshake->tlsresult);
+  handshake->tlsresult = NULL;
+  handshake->hop = 0;
+  handshake->step = HANDSHAKE_STEP_NONE;
+  handshake->pipelined = 0;
+  handshake->restarted = 1;
+  handshake->stepstart = 0;
+  handshake->hoprtt = 0;
+  handshake->basertt = 0;
+  return handshake_connect_direct(handshake);
+}
+
+//allocate a handshake with room for the specified number of hops (filled in by the caller)
+struct proxysocket_handshake_struct* handshake_alloc_hops (proxysocketconfig proxy, int hopcount, const char* dsthost, uint16_t dstport, struct resolver_cache_struct* resolvercache, int keeperrmsg, int command)
+{
+  int i;
+  struct proxysocket_handshake_struct* handshake;
+  if ((handshake = (struct proxysocket_handshake_struct*)malloc(sizeof(struct proxysocket_handshake_struct))) == NULL)
+    return NULL;
+  handshake->proxy = proxy;
+  handshake->resolvercache = resolvercache;
+  handshake->dsthost = (dsthost ? strdup(dsthost) : NULL);
+  handshake->dstport = dstport;
+  handshake->hopcount = hopcount;
+  handshake->hop = 0;
+  handshake->state = HANDSHAKE_STATE_CONNECT;
+  handshake->step = HANDSHAKE_STEP_NONE;
+  handshake->sock = INVALID_SOCKET;
+  handshake->source = NULL;
+  handshake->tlsresult = NULL;
+  handshake->buf = NULL;
+  handshake->buflen = 0;
+  handshake->bufpos = 0;
+  handshake->bufsize = 0;
+  handshake->drainlen = 0;
+  handshake->authsent = HTTP_AUTH_NONE;
+  handshake->authretries = 0;
+  handshake->restarted = 0;
+  handshake->fastopen = 0;
+  handshake->pipelined = 0;
+  handshake->probing = 0;
+  handshake->connectstart = 0;
+  handshake->hopstart = 0;
+  handshake->stepstart = 0;
+  handshake->hoprtt = 0;
+  handshake->basertt = 0;
+  handshake->command = command;
+  handshake->accepting = 0;
+  handshake->bindaddr = INADDR_NONE;
+  handshake->bindport = 0;
+  handshake->admithop = 0;
+  handshake->queued = 0;
+  handshake->queuestart = 0;
+  handshake->queuecheck = 0;
+  timer_entry_init(&handshake->timer, NULL);
+  handshake->phase = PROXYSOCKET_ERROR_PHASE_SETUP;
+  set_error(&handshake->error, PROXYSOCKET_ERROR_PHASE_NONE, PROXYSOCKET_ERROR_CAUSE_NONE);
+  handshake->keeperrmsg = (keeperrmsg ? 1 : 0);
+  handshake->errmsg = NULL;
+  if ((handshake->hops = (struct proxysocket_handshake_hop*)malloc((handshake->hopcount + 1) * sizeof(struct proxysocket_handshake_hop))) == NULL || (dsthost && !handshake->dsthost)) {
+    free(handshake->hops);
+    free(handshake->dsthost);
+    free(handshake);
+    return NULL;
+  }
+  for (i = 0; i < hopcount; i++)
+    handshake->hops[i].limits = NULL;
+  return handshake;
+}
+
+//allocate a handshake without starting it (the parser benchmarks attach it to one end of a socket pair instead),
+//a proxy is selected from each group of equivalent proxies by key (NULL to use the destination host)
+struct proxysocket_handshake_struct* handshake_alloc (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, const char* key, struct resolver_cache_struct* resolvercache, int keeperrmsg, int command)
+{
+  int i;
+  struct proxyinfo_struct* proxyinfo;
+  struct proxyinfo_struct* first;
+  struct proxysocket_handshake_struct* handshake;
+  if ((handshake = handshake_alloc_hops(proxy, proxysocketconfig_get_hop_count(proxy), dsthost, dstport, resolvercache, keeperrmsg, command)) == NULL)
+    return NULL;
+  //store hops in connection order (the list starts with the last proxy)
+  i = handshake->hopcount;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    first = proxyinfo;
+    while ((proxyinfo->flags & PROXYINFO_FLAG_GROUP) && proxyinfo->next)
+      proxyinfo = proxyinfo->next;
+    handshake->hops[--i].proxyinfo = (first == proxyinfo ? proxyinfo : proxy_group_select(proxy, first, proxyinfo, (key ? key : dsthost)));
+  }
+  return handshake;
+}
+
+//create a handshake and start connecting
+struct proxysocket_handshake_struct* handshake_create (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, const char* key, struct resolver_cache_struct* resolvercache, int keeperrmsg, int command)
+{
+  struct proxysocket_handshake_struct* handshake;
+  if ((handshake = handshake_alloc(proxy, dsthost, dstport, key, resolvercache, keeperrmsg, command)) != NULL)
+    handshake_begin(handshake);
+  return handshake;
+}
+
+//start many handshakes (NULL if they couldn't be created), looking up the host names of all of them at the same time first
+void handshake_begin_many (proxysocketconfig proxy, struct resolver_cache_struct* resolvercache, struct proxysocket_handshake_struct** handshakes, int* status, int count)
+{
+  int i;
+  size_t hostcount = 0;
+  const char** hostnames;
+  for (i = 0; i < count; i++) {
+    if (handshakes[i])
+      hostcount += handshakes[i]->hopcount;
+  }
+  if (hostcount > 0 && (hostnames = (const char**)malloc(hostcount * sizeof(const char*))) != NULL) {
+    hostcount = 0;
+    for (i = 0; i < count; i++) {
+      if (handshakes[i])
+        hostcount += handshake_get_resolve_hosts(handshakes[i], hostnames + hostcount);
+    }
+    resolver_cache_prefetch(resolvercache, proxy, hostnames, hostcount);
+    free(hostnames);
+  }
+  for (i = 0; i < count; i++) {
+    if (!handshakes[i]) {
+      status[i] = PROXYSOCKET_HANDSHAKE_FAILED;
+    } else {
+      handshake_begin(handshakes[i]);
+      status[i] = proxysocket_handshake_step(handshakes[i]);
+    }
+  }
+}
+
+void handshake_free (struct proxysocket_handshake_struct* handshake)
+{
+  handshake_release_limits(handshake);
+  if (handshake->sock != INVALID_SOCKET)
+    proxysocket_disconnect(handshake->proxy, handshake->sock);
+  tls_tunnel_result_unref(handshake->tlsresult);
+  free(handshake->errmsg);
+  free(handshake->buf);
+  free(handshake->hops);
+  free(handshake->dsthost);
+  free(handshake);
+}
+
+//abort handshake that didn't complete in time
+void handshake_timeout (struct proxysocket_handshake_struct* handshake)
+{
+  struct proxyinfo_struct* proxyinfo;
+  char** errmsg = (handshake->keeperrmsg && !handshake->errmsg ? &handshake->errmsg : NULL);
+  if (handshake->state == HANDSHAKE_STATE_CONNECT) {
+    if (handshake->source)
+      ATOMIC_ADD(&handshake->source->stats.failures, 1);
+    handshake_set_error(handshake, 1, PROXYSOCKET_ERROR_CAUSE_TIMEOUT, 0);
+    log_and_keep_error_message(handshake->proxy, errmsg, "Timeout connecting to host: %s:%lu", inet_ntoa(*(struct in_addr*)&handshake->hops[0].targetaddr), (unsigned long)handshake_target_port(handshake, 0));
+  } else if (handshake->state == HANDSHAKE_STATE_SEND || handshake->state == HANDSHAKE_STATE_RECEIVE) {
+    proxyinfo = handshake->hops[handshake->hop].proxyinfo;
+    //no reply to the method selection or authentication means the proxy discarded the requests sent along with it
+    if (handshake->pipelined && handshake->step != HANDSHAKE_STEP_SOCKS5_CONNECT)
+      proxyinfo_learn(proxyinfo, 0, PROXYSOCKET_CAPABILITY_PIPELINING);
+    handshake_set_error(handshake, handshake->hop, PROXYSOCKET_ERROR_CAUSE_TIMEOUT, 0);
+    log_and_keep_error_message(handshake->proxy, errmsg, "Timeout %s %s: %s:%lu", (handshake->state == HANDSHAKE_STATE_SEND ? "sending request to" : "waiting for response from"), handshake_proxy_kind(proxyinfo->proxytype), proxyinfo->proxyhost, (unsigned long)proxyinfo->proxyport);
+  } else if (handshake->state == HANDSHAKE_STATE_QUEUED) {
+    proxyinfo = handshake->hops[handshake->admithop].proxyinfo;
+    ATOMIC_ADD(&proxyinfo->runtime->state->stats.queue_wait_time, get_monotonic_milliseconds() - handshake->queuestart);
+    handshake_set_error(handshake, handshake->admithop, PROXYSOCKET_ERROR_CAUSE_TIMEOUT, 0);
+    log_and_keep_error_message(handshake->proxy, errmsg, "Timeout waiting for connection limits of %s: %s:%lu", handshake_proxy_kind(proxyinfo->proxytype), (proxyinfo->proxyhost ? proxyinfo->proxyhost : ""), (unsigned long)proxyinfo->proxyport);
+  } else {
+    return;
+  }
+  handshake_abort(handshake);
+}
+
+DLL_EXPORT_PROXYSOCKET proxysockethandshake proxysocket_handshake_start (proxysocketconfig proxy, const char* dsthost, uint16_t dstport)
+{
+  if (!proxy)
+    return NULL;
+  return handshake_create(proxy, dsthost, dstport, NULL, NULL, 0, SOCKS5_COMMAND_CONNECT);
+}
+
+DLL_EXPORT_PROXYSOCKET proxysockethandshake proxysocket_handshake_start_with_key (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, const char* key)
+{
+  if (!proxy)
+    return NULL;
+  return handshake_create(proxy, dsthost, dstport, key, NULL, 0, SOCKS5_COMMAND_CONNECT);
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_handshake_step (proxysockethandshake handshake)
+{
+  int status;
+  if (!handshake)
+    return PROXYSOCKET_HANDSHAKE_FAILED;
+  //keep going until the socket would block
+  for (;;) {
+    switch (handshake->state) {
+      case HANDSHAKE_STATE_CONNECT :
+        status = handshake_check_connected(handshake);
+        break;
+      case HANDSHAKE_STATE_SEND :
+        status = handshake_send(handshake);
+        break;
+      case HANDSHAKE_STATE_RECEIVE :
+        status = handshake_receive(handshake);
+        break;
+      case HANDSHAKE_STATE_RESTART :
+        status = handshake_restart(handshake);
+        break;
+      case HANDSHAKE_STATE_QUEUED :
+        status = handshake_continue_admission(handshake);
+        break;
+      case HANDSHAKE_STATE_DONE :
+        return PROXYSOCKET_HANDSHAKE_DONE;
+      default :
+        return PROXYSOCKET_HANDSHAKE_FAILED;
+    }
+    if ((status == PROXYSOCKET_HANDSHAKE_WANT_READ && handshake->state == HANDSHAKE_STATE_RECEIVE) || (status == PROXYSOCKET_HANDSHAKE_WANT_WRITE && handshake->state != HANDSHAKE_STATE_RECEIVE) || status == PROXYSOCKET_HANDSHAKE_WANT_TIMER)
+      return status;
+  }
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_handshake_get_socket (proxysockethandshake handshake)
+{
+  return (handshake ? handshake->sock : INVALID_SOCKET);
+}
+
+DLL_EXPORT_PROXYSOCKET uint32_t proxysocket_handshake_get_wait_time (proxysockethandshake handshake)
+{
+  uint64_t now;
+  if (!handshake || handshake->state != HANDSHAKE_STATE_QUEUED)
+    return 0;
+  now = get_monotonic_milliseconds();
+  return (handshake->queuecheck > now ? (uint32_t)(handshake->queuecheck - now) : 0);
+}
+
+//finish handshake and free it, returning error message text and/or error details on failure
+SOCKET handshake_finish (struct proxysocket_handshake_struct* handshake, char** errmsg, struct proxysocket_error* error)
+{
+  SOCKET sock = INVALID_SOCKET;
+  if (handshake->state == HANDSHAKE_STATE_DONE) {
+    //return a blocking socket with the socket options for the data phase
+    sock = handshake->sock;
+    handshake->sock = INVALID_SOCKET;
+    socket_set_nonblocking(sock, 0);
+    if (!handshake_uses_relay(handshake))
+      socket_apply_options(handshake->proxy, sock, PROXYSOCKET_PHASE_DATA);
+    set_error(error, PROXYSOCKET_ERROR_PHASE_NONE, PROXYSOCKET_ERROR_CAUSE_NONE);
+  } else {
+    if (handshake->state != HANDSHAKE_STATE_FAILED) {
+      handshake_set_error(handshake, handshake->hop, PROXYSOCKET_ERROR_CAUSE_ABORTED, 0);
+      log_and_keep_error_message(handshake->proxy, (handshake->keeperrmsg && !handshake->errmsg ? &handshake->errmsg : NULL), "Connection handshake aborted");
+    }
+    if (error)
+      *error = handshake->error;
+    if (errmsg) {
+      if (handshake->errmsg) {
+        *errmsg = handshake->errmsg;
+        handshake->errmsg = NULL;
+      } else {
+        //generate message from the error details
+        char buf[256];
+        proxysocket_error_format(&handshake->error, buf, sizeof(buf));
+        *errmsg = strdup(buf);
+      }
+    }
+  }
+  TRACE_PROBE5(handshake_done, handshake, sock, handshake->error.cause, handshake->error.hop, handshake->error.status);
+  handshake_free(handshake);
+  return sock;
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_handshake_finish (proxysockethandshake handshake, char** errmsg)
+{
+  if (!handshake)
+    return INVALID_SOCKET;
+  return handshake_finish(handshake, errmsg, NULL);
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_handshake_finish_ex (proxysockethandshake handshake, struct proxysocket_error* error)
+{
+  if (!handshake) {
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_INVALID_CONFIG);
+    return INVALID_SOCKET;
+  }
+  return handshake_finish(handshake, NULL, error);
+}
+
+//get the proxy a handshake is waiting for (NULL for the direct connection or when not waiting for a proxy)
+struct proxyinfo_struct* handshake_waiting_for (struct proxysocket_handshake_struct* handshake)
+{
+  if (handshake->state == HANDSHAKE_STATE_CONNECT && handshake->hopcount > 1)
+    return handshake->hops[1].proxyinfo;
+  if ((handshake->state == HANDSHAKE_STATE_SEND || handshake->state == HANDSHAKE_STATE_RECEIVE) && handshake->hop > 0 && !handshake->accepting)
+    return handshake->hops[handshake->hop].proxyinfo;
+  return NULL;
+}
+
+//get the time in milliseconds to wait for the socket of a handshake (0 to wait indefinitely)
+//with adaptive timeouts a step may take the round trip time to the proxy of the hop before it plus the retransmission timeout of its own proxy
+uint32_t handshake_get_timeout (struct proxysocket_handshake_struct* handshake, int status)
+{
+  uint64_t timeout;
+  uint64_t elapsed;
+  struct proxyinfo_struct* proxyinfo;
+  proxysocketconfig proxy = handshake->proxy;
+  if (!proxy->adaptivemax)
+    return (status == PROXYSOCKET_HANDSHAKE_WANT_READ ? proxy->recvtimeout : proxy->sendtimeout);
+  if ((proxyinfo = handshake_waiting_for(handshake)) == NULL || (timeout = proxyinfo_get_rto(proxyinfo)) == 0)
+    return proxy->adaptivemax;
+  timeout = (timeout + handshake->basertt + 999) / 1000;
+  if (timeout < proxy->adaptivemin)
+    timeout = proxy->adaptivemin;
+  else if (timeout > proxy->adaptivemax)
+    timeout = proxy->adaptivemax;
+  //the time since the connection or request was started counts
+  if (handshake->stepstart) {
+    elapsed = (get_monotonic_microseconds() - handshake->stepstart) / 1000;
+    timeout = (timeout > elapsed ? timeout - elapsed : 0);
+  }
+  return (timeout ? (uint32_t)timeout : 1);
+}
+
+//abort a handshake whose socket wasn't ready within the time from handshake_get_timeout()
+void handshake_wait_timeout (struct proxysocket_handshake_struct* handshake)
+{
+  struct proxyinfo_struct* proxyinfo;
+  //a proxy that didn't answer within its adaptive timeout gets twice as long next time (like TCP)
+  if (handshake->proxy->adaptivemax && (proxyinfo = handshake_waiting_for(handshake)) != NULL)
+    proxyinfo_backoff_rtt(proxyinfo);
+  handshake_timeout(handshake);
+}
+
+DLL_EXPORT_PROXYSOCKET uint32_t proxysocket_handshake_get_timeout (proxysockethandshake handshake, int status)
+{
+  if (!handshake || (status != PROXYSOCKET_HANDSHAKE_WANT_READ && status != PROXYSOCKET_HANDSHAKE_WANT_WRITE))
+    return 0;
+  return handshake_get_timeout(handshake, status);
+}
+
+DLL_EXPORT_PROXYSOCKET void proxysocket_handshake_timeout (proxysockethandshake handshake)
+{
+  if (handshake)
+    handshake_wait_timeout(handshake);
+}
+
+//complete a handshake waiting for the socket using the configured timeouts
+void handshake_wait (struct proxysocket_handshake_struct* handshake)
+{
+  int status;
+  while ((status = proxysocket_handshake_step(handshake)) == PROXYSOCKET_HANDSHAKE_WANT_READ || status == PROXYSOCKET_HANDSHAKE_WANT_WRITE || status == PROXYSOCKET_HANDSHAKE_WANT_TIMER) {
+    if (status == PROXYSOCKET_HANDSHAKE_WANT_TIMER) {
+      thread_sleep(proxysocket_handshake_get_wait_time(handshake));
+      continue;
+    }
+    if (socket_wait(handshake->sock, status, handshake_get_timeout(handshake, status)) <= 0) {
+      handshake_wait_timeout(handshake);
+      break;
+    }
+  }
+}
+
+SOCKET proxyinfo_connect (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, const char* key, char** errmsg, struct proxysocket_error* error)
+{
+  struct proxysocket_handshake_struct* handshake;
+  if ((handshake = handshake_create(proxy, dsthost, dstport, key, NULL, (errmsg != NULL), SOCKS5_COMMAND_CONNECT)) == NULL) {
+    log_and_keep_error_message(proxy, errmsg, memory_allocation_error);
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+    return INVALID_SOCKET;
+  }
+  handshake_wait(handshake);
+  return handshake_finish(handshake, errmsg, error);
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_connect (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, char** errmsg)
 {
   if (proxy) {
-    return proxyinfo_connect(proxy, proxy->proxyinfolist, dsthost, dstport, errmsg);
+    return proxyinfo_connect(proxy, dsthost, dstport, NULL, errmsg, NULL);
   } else {
     //use direct connection if proxy is NULL
     SOCKET result;
     if ((proxy = proxysocketconfig_create_direct()) == NULL)
       return SOCKET_ERROR;
-    result = proxyinfo_connect(proxy, proxy->proxyinfolist, dsthost, dstport, errmsg);
+    result = proxyinfo_connect(proxy, dsthost, dstport, NULL, errmsg, NULL);
+    proxysocketconfig_free(proxy);
+    return result;
+  }
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_connect_ex (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, struct proxysocket_error* error)
+{
+  if (proxy) {
+    return proxyinfo_connect(proxy, dsthost, dstport, NULL, NULL, error);
+  } else {
+    //use direct connection if proxy is NULL
+    SOCKET result;
+    if ((proxy = proxysocketconfig_create_direct()) == NULL) {
+      set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+      return INVALID_SOCKET;
+    }
+    result = proxyinfo_connect(proxy, dsthost, dstport, NULL, NULL, error);
+    proxysocketconfig_free(proxy);
+    return result;
+  }
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_connect_with_key (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, const char* key, struct proxysocket_error* error)
+{
+  //without proxy information there are no groups to select from
+  if (!proxy)
+    return proxysocket_connect_ex(proxy, dsthost, dstport, error);
+  return proxyinfo_connect(proxy, dsthost, dstport, key, NULL, error);
+}
+
+//process handshakes as their sockets become ready using poll()
+void connect_many_poll (struct proxysocket_handshake_struct** handshakes, int* status, int count, uint64_t deadline)
+{
+  int i;
+  int n;
+  int active;
+  int queued;
+  int timedout = 0;
+  uint64_t now;
+  struct pollfd* pollinfo;
+  int* pollindex;
+  struct timer_wheel timers;
+  struct timer_entry deadlinetimer;
+  struct timer_entry* entry;
+  pollinfo = (struct pollfd*)malloc(count * sizeof(struct pollfd));
+  pollindex = (int*)malloc(count * sizeof(int));
+  timer_wheel_init(&timers, get_monotonic_milliseconds());
+  timer_entry_init(&deadlinetimer, NULL);
+  if (deadline)
+    timer_add(&timers, &deadlinetimer, deadline);
+  for (;;) {
+    active = 0;
+    queued = 0;
+    now = get_monotonic_milliseconds();
+    for (i = 0; i < count; i++) {
+      //handshakes waiting for connection limits don't have a socket yet, they check their queue again when their timer expires
+      if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER) {
+        if (!timer_is_pending(&handshakes[i]->timer)) {
+          handshakes[i]->timer.data = &status[i];
+          timer_add(&timers, &handshakes[i]->timer, handshakes[i]->queuecheck);
+        }
+        queued++;
+        continue;
+      }
+      if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_READ || status[i] == PROXYSOCKET_HANDSHAKE_WANT_WRITE) {
+        if (!pollinfo || !pollindex) {
+          handshake_set_error(handshakes[i], handshakes[i]->hop, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY, 0);
+          log_and_keep_error_message(handshakes[i]->proxy, NULL, memory_allocation_error);
+          handshake_abort(handshakes[i]);
+          continue;
+        }
+        //with adaptive timeouts each step of a handshake has its own timer
+        if (handshakes[i]->proxy->adaptivemax && !timer_is_pending(&handshakes[i]->timer)) {
+          handshakes[i]->timer.data = &status[i];
+          timer_add(&timers, &handshakes[i]->timer, now + handshake_get_timeout(handshakes[i], status[i]));
+        }
+        pollinfo[active].fd = handshakes[i]->sock;
+        pollinfo[active].events = (status[i] == PROXYSOCKET_HANDSHAKE_WANT_READ ? POLLIN : POLLOUT);
+        pollinfo[active].revents = 0;
+        pollindex[active++] = i;
+      }
+    }
+    if (active == 0 && queued == 0)
+      break;
+    if (timedout) {
+      for (i = 0; i < count; i++) {
+        if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_READ || status[i] == PROXYSOCKET_HANDSHAKE_WANT_WRITE || status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER)
+          handshake_timeout(handshakes[i]);
+      }
+      break;
+    }
+    //wait until the first timer (the deadline or a queued handshake) is due
+    if (active == 0) {
+      if ((n = timer_wheel_timeout(&timers)) > 0)
+        thread_sleep(n);
+      n = 0;
+    } else if ((n = poll(pollinfo, active, timer_wheel_timeout(&timers))) < 0) {
+#ifndef _WIN32
+      if (errno == EINTR)
+        continue;
+#endif
+      timedout = 1;
+      continue;
+    }
+    for (i = 0; i < active && n > 0; i++) {
+      if (pollinfo[i].revents) {
+        timer_cancel(&timers, &handshakes[pollindex[i]]->timer);
+        status[pollindex[i]] = proxysocket_handshake_step(handshakes[pollindex[i]]);
+        n--;
+      }
+    }
+    //continue queued handshakes that need to check their queue and abort steps that took too long
+    timer_wheel_advance(&timers, get_monotonic_milliseconds());
+    while ((entry = timer_wheel_next_expired(&timers)) != NULL) {
+      if (entry == &deadlinetimer) {
+        timedout = 1;
+      } else if (*(int*)entry->data == PROXYSOCKET_HANDSHAKE_WANT_TIMER) {
+        *(int*)entry->data = proxysocket_handshake_step(handshakes[(int*)entry->data - status]);
+      } else if (*(int*)entry->data == PROXYSOCKET_HANDSHAKE_WANT_READ || *(int*)entry->data == PROXYSOCKET_HANDSHAKE_WANT_WRITE) {
+        handshake_wait_timeout(handshakes[(int*)entry->data - status]);
+        *(int*)entry->data = proxysocket_handshake_step(handshakes[(int*)entry->data - status]);
+      }
+    }
+    //continue queued handshakes that were given a place
+    if (queued) {
+      for (i = 0; i < count; i++) {
+        if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER && ATOMIC_LOAD(&handshakes[i]->waiter.admitted)) {
+          timer_cancel(&timers, &handshakes[i]->timer);
+          status[i] = proxysocket_handshake_step(handshakes[i]);
+        }
+      }
+    }
+  }
+  //the wheel goes away with this function
+  for (i = 0; i < count; i++)
+    if (handshakes[i])
+      timer_cancel(&timers, &handshakes[i]->timer);
+  free(pollindex);
+  free(pollinfo);
+}
+
+#ifdef HAVE_IO_URING
+
+/* * * io_uring backend (Linux only) * * */
+
+//operations queued for a handshake, kept in the low bits of the user data of their entries (the handshake index is in the other bits)
+#define URING_OP_WRITABLE       0               //wait until the socket is writable (connection established or room to send)
+#define URING_OP_SEND           1               //send the request
+#define URING_OP_READABLE       2               //wait for the reply
+#define URING_OP_RECV           3               //read the part of a SOCKS reply that is known to be needed
+#define URING_OP_TIMEOUT        4               //linked timeout of the wait before it (adaptive timeouts)
+#define URING_OP_TIMER          5               //time to check the queue of the connection limits again
+#define URING_OP_BITS           3
+#define URING_OP_MASK           ((1 << URING_OP_BITS) - 1)
+
+#define URING_MAX_ENTRIES       32768
+#define URING_ENTRIES_PER_HANDSHAKE 7           //largest number of entries queued for one handshake between submissions (linked entries and a cancellation)
+#define URING_TIMEOUT_USER_DATA ((uint64_t)-1)
+#define URING_CANCEL_USER_DATA  ((uint64_t)-2)
+
+struct uring_struct {
+  int fd;
+  uint32_t* sqhead;
+  uint32_t* sqtail;
+  uint32_t* sqmask;
+  uint32_t* sqarray;
+  uint32_t sqlocaltail;                 //tail including queued entries not yet made visible to the kernel
+  uint32_t sqpending;                   //number of queued entries not yet submitted
+  struct io_uring_sqe* sqes;
+  uint32_t* cqhead;
+  uint32_t* cqtail;
+  uint32_t* cqmask;
+  struct io_uring_cqe* cqes;
+  void* sqring;
+  size_t sqringsize;
+  void* cqring;
+  size_t cqringsize;
+  size_t sqessize;
+};
+
+//progress of a handshake processed with io_uring
+struct uring_handshake_state {
+  uint8_t inflight;                     //number of completions still to come
+  int8_t expired;                       //a linked timeout expired before the socket was ready
+  int8_t admitted;                      //the timer of a queued handshake is being cancelled because it was given a place
+  struct __kernel_timespec timeouts[2]; //linked timeouts of the queued waits (read by the kernel on submission)
+};
+
+//io_uring availability (0 = not checked yet, 1 = available, -1 = not available)
+static int uring_available = 0;
+
+void uring_cleanup (struct uring_struct* ring)
+{
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqessize);
+  if (ring->cqring && ring->cqring != ring->sqring)
+    munmap(ring->cqring, ring->cqringsize);
+  if (ring->sqring)
+    munmap(ring->sqring, ring->sqringsize);
+  if (ring->fd >= 0)
+    close(ring->fd);
+}
+
+void* uring_map (int fd, size_t size, off_t offset)
+{
+  void* result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return (result == MAP_FAILED ? NULL : result);
+}
+
+//check if the kernel supports the operations needed
+int uring_probe (struct uring_struct* ring)
+{
+  int result = -1;
+  struct io_uring_probe* probe;
+  size_t probesize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  if ((probe = (struct io_uring_probe*)calloc(1, probesize)) == NULL)
+    return -1;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+    if (probe->last_op >= IORING_OP_RECV && (probe->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED) && (probe->ops[IORING_OP_TIMEOUT].flags & IO_URING_OP_SUPPORTED) && (probe->ops[IORING_OP_LINK_TIMEOUT].flags & IO_URING_OP_SUPPORTED) && (probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED) && (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED) && (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED))
+      result = 0;
+  }
+  free(probe);
+  return result;
+}
+
+//set up an io_uring instance, returns zero on success
+int uring_init (struct uring_struct* ring, uint32_t entries)
+{
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(struct uring_struct));
+  memset(&params, 0, sizeof(params));
+  if ((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+    //don't try again if io_uring is not supported or not allowed
+    if (errno == ENOSYS || errno == EPERM)
+      ATOMIC_STORE(&uring_available, -1);
+    return -1;
+  }
+  //map the submission and completion rings (in one mapping if supported)
+  ring->sqringsize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqringsize > ring->sqringsize)
+      ring->sqringsize = ring->cqringsize;
+    ring->cqringsize = ring->sqringsize;
+  }
+  ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+  if ((ring->sqring = uring_map(ring->fd, ring->sqringsize, IORING_OFF_SQ_RING)) == NULL ||
+      (ring->cqring = ((params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sqring : uring_map(ring->fd, ring->cqringsize, IORING_OFF_CQ_RING))) == NULL ||
+      (ring->sqes = (struct io_uring_sqe*)uring_map(ring->fd, ring->sqessize, IORING_OFF_SQES)) == NULL) {
+    uring_cleanup(ring);
+    return -1;
+  }
+  ring->sqhead = (uint32_t*)((uint8_t*)ring->sqring + params.sq_off.head);
+  ring->sqtail = (uint32_t*)((uint8_t*)ring->sqring + params.sq_off.tail);
+  ring->sqmask = (uint32_t*)((uint8_t*)ring->sqring + params.sq_off.ring_mask);
+  ring->sqarray = (uint32_t*)((uint8_t*)ring->sqring + params.sq_off.array);
+  ring->sqlocaltail = *ring->sqtail;
+  ring->cqhead = (uint32_t*)((uint8_t*)ring->cqring + params.cq_off.head);
+  ring->cqtail = (uint32_t*)((uint8_t*)ring->cqring + params.cq_off.tail);
+  ring->cqmask = (uint32_t*)((uint8_t*)ring->cqring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)((uint8_t*)ring->cqring + params.cq_off.cqes);
+  //check once if the needed operations are supported
+  if (ATOMIC_LOAD(&uring_available) == 0)
+    ATOMIC_STORE(&uring_available, (uring_probe(ring) == 0 ? 1 : -1));
+  if (ATOMIC_LOAD(&uring_available) < 0) {
+    uring_cleanup(ring);
+    return -1;
+  }
+  return 0;
+}
+
+//get the next free submission queue entry (the caller makes sure the queue never overflows)
+struct io_uring_sqe* uring_get_sqe (struct uring_struct* ring)
+{
+  uint32_t index = ring->sqlocaltail++ & *ring->sqmask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sqarray[index] = index;
+  ring->sqpending++;
+  return sqe;
+}
+
+//submit queued entries and wait for at least one completion
+int uring_submit_and_wait (struct uring_struct* ring)
+{
+  int result;
+  __atomic_store_n(ring->sqtail, ring->sqlocaltail, __ATOMIC_RELEASE);
+  if ((result = syscall(__NR_io_uring_enter, ring->fd, ring->sqpending, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0)
+    return -1;
+  ring->sqpending -= ((uint32_t)result < ring->sqpending ? (uint32_t)result : ring->sqpending);
+  return 0;
+}
+
+struct io_uring_sqe* uring_queue (struct uring_struct* ring, int index, int op, uint8_t opcode, SOCKET sock, uint8_t flags)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  sqe->opcode = opcode;
+  sqe->fd = sock;
+  sqe->flags = flags;
+  sqe->user_data = ((uint64_t)index << URING_OP_BITS) | op;
+  return sqe;
+}
+
+void uring_queue_poll (struct uring_struct* ring, int index, int op, SOCKET sock, short events, uint8_t flags)
+{
+  uring_queue(ring, index, op, IORING_OP_POLL_ADD, sock, flags)->poll_events = events;
+}
+
+void uring_queue_recv (struct uring_struct* ring, int index, SOCKET sock, uint8_t* buf, size_t len)
+{
+  struct io_uring_sqe* sqe = uring_queue(ring, index, URING_OP_RECV, IORING_OP_RECV, sock, 0);
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = (uint32_t)len;
+}
+
+//cancel a pending operation of a handshake (its completion and those of the entries linked to it still arrive)
+void uring_queue_cancel (struct uring_struct* ring, int index, int op)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = ((uint64_t)index << URING_OP_BITS) | op;
+  sqe->user_data = URING_CANCEL_USER_DATA;
+}
+
+//wait until the socket of a handshake is ready, returns the number of entries queued
+//with adaptive timeouts the wait is followed by a linked timeout for the time the step may take
+int uring_queue_wait (struct uring_struct* ring, struct proxysocket_handshake_struct* handshake, int index, int op, uint8_t flags, struct __kernel_timespec* timeout)
+{
+  uint32_t milliseconds;
+  struct io_uring_sqe* sqe;
+  if (!handshake->proxy->adaptivemax) {
+    uring_queue_poll(ring, index, op, handshake->sock, (op == URING_OP_READABLE ? POLLIN : POLLOUT), flags);
+    return 1;
+  }
+  milliseconds = handshake_get_timeout(handshake, (op == URING_OP_READABLE ? PROXYSOCKET_HANDSHAKE_WANT_READ : PROXYSOCKET_HANDSHAKE_WANT_WRITE));
+  timeout->tv_sec = milliseconds / 1000;
+  timeout->tv_nsec = (milliseconds % 1000) * 1000000;
+  uring_queue_poll(ring, index, op, handshake->sock, (op == URING_OP_READABLE ? POLLIN : POLLOUT), flags | IOSQE_IO_LINK);
+  sqe = uring_queue(ring, index, URING_OP_TIMEOUT, IORING_OP_LINK_TIMEOUT, -1, flags);
+  sqe->addr = (uint64_t)(uintptr_t)timeout;
+  sqe->len = 1;
+  return 2;
+}
+
+//wake up a handshake waiting for connection limits when it should check the queue again, returns the number of entries queued
+int uring_queue_timer (struct uring_struct* ring, struct proxysocket_handshake_struct* handshake, int index, struct __kernel_timespec* timeout)
+{
+  struct io_uring_sqe* sqe;
+  timeout->tv_sec = handshake->queuecheck / 1000;
+  timeout->tv_nsec = (handshake->queuecheck % 1000) * 1000000;
+  sqe = uring_queue(ring, index, URING_OP_TIMER, IORING_OP_TIMEOUT, -1, 0);
+  sqe->addr = (uint64_t)(uintptr_t)timeout;
+  sqe->len = 1;
+  sqe->timeout_flags = IORING_TIMEOUT_ABS;
+  return 1;
+}
+
+//queue what a handshake is waiting for, returns the number of entries queued
+//a prepared request is sent and the fixed size start of a SOCKS reply is read as one chain of linked entries,
+//web proxy replies are left to the handshake as it must not read beyond the header
+int uring_queue_handshake (struct uring_struct* ring, struct proxysocket_handshake_struct* handshake, int index, int status, struct __kernel_timespec* timeouts)
+{
+  int queued;
+  struct io_uring_sqe* sqe;
+  size_t needed = 0;
+  if (status == PROXYSOCKET_HANDSHAKE_WANT_TIMER)
+    return uring_queue_timer(ring, handshake, index, &timeouts[0]);
+  if (status == PROXYSOCKET_HANDSHAKE_WANT_WRITE && handshake->state == HANDSHAKE_STATE_SEND) {
+    if (handshake->step != HANDSHAKE_STEP_HTTP_CONNECT)
+      needed = (handshake->step == HANDSHAKE_STEP_SOCKS4_CONNECT ? 8 : 2);
+    //the reply is read into the buffer once the request was sent from it
+    if (needed && handshake_buffer_reserve(handshake, needed) == NULL)
+      needed = 0;
+    queued = uring_queue_wait(ring, handshake, index, URING_OP_WRITABLE, IOSQE_IO_LINK, &timeouts[0]);
+    sqe = uring_queue(ring, index, URING_OP_SEND, IORING_OP_SEND, handshake->sock, IOSQE_IO_LINK);
+    sqe->addr = (uint64_t)(uintptr_t)(handshake->buf + handshake->bufpos);
+    sqe->len = (uint32_t)(handshake->buflen - handshake->bufpos);
+    sqe->msg_flags = SOCKET_SEND_FLAGS;
+    queued += 1 + uring_queue_wait(ring, handshake, index, URING_OP_READABLE, (needed ? IOSQE_IO_LINK : 0), &timeouts[1]);
+    if (!needed)
+      return queued;
+    uring_queue_recv(ring, index, handshake->sock, handshake->buf, needed);
+    return queued + 1;
+  }
+  if (status == PROXYSOCKET_HANDSHAKE_WANT_READ && handshake->state == HANDSHAKE_STATE_RECEIVE && handshake->step != HANDSHAKE_STEP_HTTP_CONNECT) {
+    if ((needed = handshake_reply_length(handshake)) > handshake->buflen && handshake_buffer_reserve(handshake, needed) != NULL) {
+      queued = uring_queue_wait(ring, handshake, index, URING_OP_READABLE, IOSQE_IO_LINK, &timeouts[0]);
+      uring_queue_recv(ring, index, handshake->sock, handshake->buf + handshake->buflen, needed - handshake->buflen);
+      return queued + 1;
+    }
+  }
+  return uring_queue_wait(ring, handshake, index, (status == PROXYSOCKET_HANDSHAKE_WANT_READ ? URING_OP_READABLE : URING_OP_WRITABLE), 0, &timeouts[0]);
+}
+
+//process handshakes using io_uring, returns non-zero if io_uring can't be used (any handshakes still in progress can be continued with connect_many_poll())
+int connect_many_uring (struct proxysocket_handshake_struct** handshakes, int* status, int count, uint64_t deadline)
+{
+  int i;
+  int op;
+  int active;
+  int queued;
+  int pending;
+  int timedout;
+  uint32_t head;
+  uint32_t entries;
+  struct uring_handshake_state* state;
+  struct io_uring_cqe* cqe;
+  struct io_uring_sqe* sqe;
+  struct proxysocket_handshake_struct* handshake;
+  struct __kernel_timespec timeout;
+  struct uring_struct ring;
+  //make sure the entries of all handshakes and the timeout fit in the ring at once
+  entries = 1;
+  while (entries < (uint32_t)count * URING_ENTRIES_PER_HANDSHAKE + 1 && entries <= URING_MAX_ENTRIES)
+    entries <<= 1;
+  if (entries > URING_MAX_ENTRIES || ATOMIC_LOAD(&uring_available) < 0)
+    return -1;
+  if ((state = (struct uring_handshake_state*)calloc(count, sizeof(struct uring_handshake_state))) == NULL)
+    return -1;
+  if (uring_init(&ring, entries) != 0) {
+    free(state);
+    return -1;
+  }
+  //the deadline is an absolute CLOCK_MONOTONIC time like get_monotonic_milliseconds()
+  if (deadline) {
+    timeout.tv_sec = deadline / 1000;
+    timeout.tv_nsec = (deadline % 1000) * 1000000;
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&timeout;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = URING_TIMEOUT_USER_DATA;
+  }
+  //handshakes waiting for connection limits don't have a socket yet, a timer wakes them up to check their queue again
+  active = 0;
+  queued = 0;
+  for (i = 0; i < count; i++) {
+    if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_READ || status[i] == PROXYSOCKET_HANDSHAKE_WANT_WRITE || status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER) {
+      state[i].inflight = uring_queue_handshake(&ring, handshakes[i], i, status[i], state[i].timeouts);
+      if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER)
+        queued++;
+      active++;
+    }
+  }
+  timedout = 0;
+  while (active > 0 && !timedout) {
+    //submit everything queued since the previous call in one system call
+    if (uring_submit_and_wait(&ring) != 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      //closing the ring cancels pending operations, let poll() take over
+      uring_cleanup(&ring);
+      free(state);
+      return -1;
+    }
+    head = *ring.cqhead;
+    while (head != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring.cqes[head++ & *ring.cqmask];
+      if (cqe->user_data == URING_TIMEOUT_USER_DATA) {
+        timedout = 1;
+        continue;
+      }
+      if (cqe->user_data == URING_CANCEL_USER_DATA)
+        continue;
+      i = (int)(cqe->user_data >> URING_OP_BITS);
+      op = (int)(cqe->user_data & URING_OP_MASK);
+      handshake = handshakes[i];
+      state[i].inflight--;
+      if (op == URING_OP_TIMEOUT && cqe->res == -ETIME) {
+        state[i].expired = 1;
+      } else if (op == URING_OP_SEND && cqe->res > 0 && handshake->state == HANDSHAKE_STATE_SEND) {
+        handshake->bufpos += cqe->res;
+        if (handshake->bufpos == handshake->buflen)
+          handshake_request_sent(handshake);
+        else if (state[i].inflight > 0)
+          //only part of the request was sent, don't wait for a reply (the handshake sends the rest)
+          uring_queue_cancel(&ring, i, URING_OP_READABLE);
+      } else if (op == URING_OP_RECV && cqe->res > 0 && handshake->state == HANDSHAKE_STATE_RECEIVE) {
+        handshake->buflen += cqe->res;
+      }
+      //continue the handshake once its chain is complete (on errors the handshake repeats the operation to report them)
+      if (state[i].inflight > 0)
+        continue;
+      //a step that took longer than its adaptive timeout is aborted like in connect_many_poll()
+      if (state[i].expired) {
+        state[i].expired = 0;
+        handshake_wait_timeout(handshake);
+      }
+      if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER)
+        queued--;
+      state[i].admitted = 0;
+      status[i] = proxysocket_handshake_step(handshake);
+      if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_READ || status[i] == PROXYSOCKET_HANDSHAKE_WANT_WRITE || status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER)
+        state[i].inflight = uring_queue_handshake(&ring, handshake, i, status[i], state[i].timeouts);
+      else
+        active--;
+      if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER)
+        queued++;
+    }
+    __atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+    //continue queued handshakes that were given a place right away by cancelling their timers (they continue on its completion)
+    if (queued) {
+      for (i = 0; i < count; i++) {
+        if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER && !state[i].admitted && state[i].inflight > 0 && ATOMIC_LOAD(&handshakes[i]->waiter.admitted)) {
+          uring_queue_cancel(&ring, i, URING_OP_TIMER);
+          state[i].admitted = 1;
+        }
+      }
+    }
+  }
+  //cancel what didn't finish in time and wait until the kernel no longer uses the buffers of the handshakes
+  pending = 0;
+  for (i = 0; i < count; i++) {
+    if (state[i].inflight > 0) {
+      if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER) {
+        if (!state[i].admitted)
+          uring_queue_cancel(&ring, i, URING_OP_TIMER);
+      } else {
+        uring_queue_cancel(&ring, i, URING_OP_WRITABLE);
+        uring_queue_cancel(&ring, i, URING_OP_READABLE);
+      }
+      pending += state[i].inflight;
+    }
+  }
+  while (pending > 0) {
+    if (uring_submit_and_wait(&ring) != 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      break;
+    }
+    head = *ring.cqhead;
+    while (head != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring.cqes[head++ & *ring.cqmask];
+      if (cqe->user_data != URING_TIMEOUT_USER_DATA && cqe->user_data != URING_CANCEL_USER_DATA)
+        pending--;
+    }
+    __atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+  }
+  //abort what didn't finish in time
+  for (i = 0; i < count; i++) {
+    if (status[i] == PROXYSOCKET_HANDSHAKE_WANT_READ || status[i] == PROXYSOCKET_HANDSHAKE_WANT_WRITE || status[i] == PROXYSOCKET_HANDSHAKE_WANT_TIMER)
+      handshake_timeout(handshakes[i]);
+  }
+  uring_cleanup(&ring);
+  free(state);
+  return 0;
+}
+
+#endif
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_connect_many (proxysocketconfig proxy, const struct proxysocket_target* targets, int count, struct proxysocket_result* results, uint32_t timeout)
+{
+  int i;
+  int connected;
+  uint64_t deadline;
+  int* status;
+  struct proxysocket_handshake_struct** handshakes;
+  struct resolver_cache_struct* resolvercache;
+  proxysocketconfig directproxy = NULL;
+  if (!targets || !results || count <= 0)
+    return 0;
+  if (!proxy && (proxy = directproxy = proxysocketconfig_create_direct()) == NULL)
+    return 0;
+  handshakes = (struct proxysocket_handshake_struct**)malloc(count * sizeof(struct proxysocket_handshake_struct*));
+  status = (int*)malloc(count * sizeof(int));
+  //share name resolution between all connections
+  resolvercache = resolver_cache_create(count + proxysocketconfig_get_proxy_count(proxy));
+  if (!handshakes || !status || !resolvercache) {
+    log_and_keep_error_message(proxy, NULL, memory_allocation_error);
+    for (i = 0; i < count; i++) {
+      results[i].sock = INVALID_SOCKET;
+      set_error(&results[i].error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+    }
+    resolver_cache_free(resolvercache);
+    free(status);
+    free(handshakes);
+    proxysocketconfig_free(directproxy);
+    return 0;
+  }
+  deadline = (timeout ? get_monotonic_milliseconds() + timeout : 0);
+  //start all connections
+  for (i = 0; i < count; i++)
+    handshakes[i] = handshake_alloc(proxy, targets[i].host, targets[i].port, NULL, resolvercache, 0, SOCKS5_COMMAND_CONNECT);
+  handshake_begin_many(proxy, resolvercache, handshakes, status, count);
+  //process all connections as their sockets become ready
+#ifdef HAVE_IO_URING
+  if (connect_many_uring(handshakes, status, count, deadline) != 0)
+#endif
+    connect_many_poll(handshakes, status, count, deadline);
+  //collect results
+  connected = 0;
+  for (i = 0; i < count; i++) {
+    if (!handshakes[i]) {
+      results[i].sock = INVALID_SOCKET;
+      set_error(&results[i].error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+      log_and_keep_error_message(proxy, NULL, memory_allocation_error);
+    } else if ((results[i].sock = handshake_finish(handshakes[i], NULL, &results[i].error)) != INVALID_SOCKET) {
+      connected++;
+    }
+  }
+  resolver_cache_free(resolvercache);
+  free(status);
+  free(handshakes);
+  proxysocketconfig_free(directproxy);
+  return connected;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_probe_proxies (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, uint32_t timeout)
+{
+  int i;
+  int round;
+  int count;
+  int reached;
+  int* status;
+  int8_t* succeeded;
+  struct proxyinfo_struct** proxies;
+  struct proxysocket_handshake_struct** handshakes;
+  struct resolver_cache_struct* resolvercache;
+  struct proxyinfo_struct* proxyinfo;
+  if (!proxy || !dsthost || (count = proxysocketconfig_get_proxy_count(proxy) - 1) <= 0)
+    return 0;
+  proxies = (struct proxyinfo_struct**)malloc((count + 1) * sizeof(struct proxyinfo_struct*));
+  handshakes = (struct proxysocket_handshake_struct**)malloc(count * sizeof(struct proxysocket_handshake_struct*));
+  status = (int*)malloc(count * sizeof(int));
+  succeeded = (int8_t*)calloc(count, sizeof(int8_t));
+  resolvercache = resolver_cache_create(count + 1);
+  if (!proxies || !handshakes || !status || !succeeded || !resolvercache) {
+    log_and_keep_error_message(proxy, NULL, memory_allocation_error);
+    resolver_cache_free(resolvercache);
+    free(succeeded);
+    free(status);
+    free(handshakes);
+    free(proxies);
+    return -1;
+  }
+  //proxies in connection order (the list starts with the last proxy and ends with the direct connection)
+  i = count + 1;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next)
+    proxies[--i] = proxyinfo;
+  //connect to the destination through each proxy on its own, all proxies in parallel
+  for (round = PROBE_ROUND_PLAIN; round <= PROBE_ROUNDS; round++) {
+    for (i = 0; i < count; i++) {
+      handshakes[i] = NULL;
+      //only proxies that could be reached in the first round are probed further
+      if (round != PROBE_ROUND_PLAIN && !succeeded[i])
+        continue;
+      if ((handshakes[i] = handshake_alloc_hops(proxy, 2, dsthost, dstport, resolvercache, 0, SOCKS5_COMMAND_CONNECT)) == NULL)
+        continue;
+      handshakes[i]->hops[0].proxyinfo = proxies[0];
+      handshakes[i]->hops[1].proxyinfo = proxies[i + 1];
+      handshakes[i]->probing = round;
+    }
+    handshake_begin_many(proxy, resolvercache, handshakes, status, count);
+#ifdef HAVE_IO_URING
+    if (connect_many_uring(handshakes, status, count, (timeout ? get_monotonic_milliseconds() + timeout : 0)) != 0)
+#endif
+      connect_many_poll(handshakes, status, count, (timeout ? get_monotonic_milliseconds() + timeout : 0));
+    for (i = 0; i < count; i++) {
+      SOCKET sock;
+      if (!handshakes[i])
+        continue;
+      if ((sock = handshake_finish(handshakes[i], NULL, NULL)) != INVALID_SOCKET) {
+        if (round == PROBE_ROUND_PLAIN)
+          succeeded[i] = 1;
+        proxysocket_disconnect(proxy, sock);
+      }
+    }
+  }
+  reached = 0;
+  for (i = 0; i < count; i++)
+    if (succeeded[i])
+      reached++;
+  resolver_cache_free(resolvercache);
+  free(succeeded);
+  free(status);
+  free(handshakes);
+  free(proxies);
+  return reached;
+}
+
+/* * * UDP datagrams through a SOCKS5 proxy * * */
+
+//datagrams are sent and received in batches with sendmmsg()/recvmmsg() where available,
+//the SOCKS5 UDP request headers are kept in buffers that are reused for each batch
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define HAVE_SENDMMSG 1
+#endif
+
+#define UDP_BATCH_SIZE                  64
+#define UDP_HEADER_SIZE                 (4 + 1 + 255 + 2)       //largest SOCKS5 UDP request header (with host name)
+#define UDP_IPV4_HEADER_SIZE            (4 + 4 + 2)
+#define UDP_MAX_DATAGRAM                65535
+
+struct proxysocket_udp_struct {
+  proxysocketconfig proxy;              //proxy information the association was made with (NULL if none)
+  SOCKET sock;                          //UDP socket (connected to the relay of the proxy)
+  SOCKET controlsock;                   //connection to the proxy that keeps the association alive (INVALID_SOCKET for direct datagrams)
+  uint8_t headers[UDP_BATCH_SIZE][UDP_HEADER_SIZE];
+  uint32_t hostaddrs[UDP_BATCH_SIZE];   //destination addresses of a batch of direct datagrams
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[UDP_BATCH_SIZE];
+  struct iovec iov[UDP_BATCH_SIZE][2];
+  struct sockaddr_in addrs[UDP_BATCH_SIZE];
+#else
+  uint8_t packet[UDP_HEADER_SIZE + UDP_MAX_DATAGRAM];
+#endif
+};
+
+//build the SOCKS5 UDP request header for a datagram, returns header length or 0 if the host name is too long
+size_t udp_build_header (uint8_t* header, const struct proxysocket_datagram* datagram)
+{
+  size_t hostlen;
+  header[0] = 0;
+  header[1] = 0;
+  header[2] = 0;                        //fragments are not used
+  if (datagram->host) {
+    if ((hostlen = strlen(datagram->host)) > 255)
+      return 0;
+    header[3] = SOCKS5_ADDRESSTYPE_DOMAINNAME;
+    header[4] = hostlen;
+    memcpy(header + 5, datagram->host, hostlen);
+    header[5 + hostlen] = datagram->port >> 8;
+    header[6 + hostlen] = datagram->port & 0xFF;
+    return 7 + hostlen;
+  }
+  header[3] = SOCKS5_ADDRESSTYPE_IPV4;
+  memcpy(header + 4, &datagram->addr, sizeof(uint32_t));
+  header[8] = datagram->port >> 8;
+  header[9] = datagram->port & 0xFF;
+  return UDP_IPV4_HEADER_SIZE;
+}
+
+//get the length of a received SOCKS5 UDP request header (storing the source in the datagram), returns 0 if the datagram must be dropped
+size_t udp_parse_header (const uint8_t* packet, size_t packetlen, struct proxysocket_datagram* datagram)
+{
+  size_t headerlen;
+  if (packetlen < 5 || packet[2] != 0)
+    return 0;
+  switch (packet[3]) {
+    case SOCKS5_ADDRESSTYPE_IPV4 :
+      headerlen = UDP_IPV4_HEADER_SIZE;
+      break;
+    case SOCKS5_ADDRESSTYPE_DOMAINNAME :
+      headerlen = 4 + 1 + packet[4] + 2;
+      break;
+    case SOCKS5_ADDRESSTYPE_IPV6 :
+      headerlen = 4 + 16 + 2;
+      break;
+    default :
+      return 0;
+  }
+  if (packetlen < headerlen)
+    return 0;
+  if (packet[3] == SOCKS5_ADDRESSTYPE_IPV4)
+    memcpy(&datagram->addr, packet + 4, sizeof(uint32_t));
+  else
+    datagram->addr = INADDR_NONE;
+  datagram->port = ((uint16_t)packet[headerlen - 2] << 8) | packet[headerlen - 1];
+  return headerlen;
+}
+
+DLL_EXPORT_PROXYSOCKET proxysocketudp proxysocket_udp_associate (proxysocketconfig proxy, struct proxysocket_error* error)
+{
+  struct sockaddr_in relayaddr;
+  struct proxysocket_udp_struct* udp;
+  struct proxysocket_handshake_struct* handshake;
+  if ((udp = (struct proxysocket_udp_struct*)malloc(sizeof(struct proxysocket_udp_struct))) == NULL) {
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, memory_allocation_error);
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+    return NULL;
+  }
+  udp->proxy = proxy;
+  udp->controlsock = INVALID_SOCKET;
+  if ((udp->sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == INVALID_SOCKET) {
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, "Error creating UDP socket");
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_SOCKET_FAILED);
+    free(udp);
+    return NULL;
+  }
+  //send datagrams directly if no proxy is used
+  if (!proxy || proxysocketconfig_get_proxy_count(proxy) <= 1) {
+    set_error(error, PROXYSOCKET_ERROR_PHASE_NONE, PROXYSOCKET_ERROR_CAUSE_NONE);
+    return udp;
+  }
+  //set up the association on a connection to the proxy
+  if ((handshake = handshake_create(proxy, "0.0.0.0", 0, NULL, NULL, 0, SOCKS5_COMMAND_UDP_ASSOCIATE)) == NULL) {
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, memory_allocation_error);
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+    proxysocket_udp_close(udp);
+    return NULL;
+  }
+  handshake_wait(handshake);
+  //the relay listens on the address of the proxy if it didn't report one
+  relayaddr.sin_family = AF_INET;
+  relayaddr.sin_port = htons(handshake->bindport);
+  relayaddr.sin_addr.s_addr = (handshake->bindaddr == INADDR_NONE || handshake->bindaddr == INADDR_ANY ? handshake->hops[0].targetaddr : handshake->bindaddr);
+  if ((udp->controlsock = handshake_finish(handshake, NULL, error)) == INVALID_SOCKET) {
+    proxysocket_udp_close(udp);
+    return NULL;
+  }
+  write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Sending datagrams to SOCKS5 UDP relay: %s:%lu", inet_ntoa(relayaddr.sin_addr), (unsigned long)ntohs(relayaddr.sin_port));
+  if (connect(udp->sock, (struct sockaddr*)&relayaddr, sizeof(relayaddr)) != 0) {
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, "Error connecting UDP socket to: %s:%lu", inet_ntoa(relayaddr.sin_addr), (unsigned long)ntohs(relayaddr.sin_port));
+    set_error(error, PROXYSOCKET_ERROR_PHASE_REQUEST, PROXYSOCKET_ERROR_CAUSE_CONNECT_FAILED);
+    proxysocket_udp_close(udp);
+    return NULL;
+  }
+  return udp;
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_udp_get_socket (proxysocketudp udp)
+{
+  return (udp ? udp->sock : INVALID_SOCKET);
+}
+
+//get the destination addresses of a batch of direct datagrams, each distinct host name is only resolved once (and kept with the proxy information if there is one)
+void udp_resolve_batch (struct proxysocket_udp_struct* udp, const struct proxysocket_datagram* datagram, int count)
+{
+  int i;
+  int j;
+  for (i = 0; i < count; i++) {
+    if (!datagram[i].host) {
+      udp->hostaddrs[i] = datagram[i].addr;
+      continue;
+    }
+    for (j = 0; j < i; j++) {
+      if (datagram[j].host && (datagram[j].host == datagram[i].host || strcmp(datagram[j].host, datagram[i].host) == 0))
+        break;
+    }
+    if (j < i)
+      udp->hostaddrs[i] = udp->hostaddrs[j];
+    else
+      udp->hostaddrs[i] = (udp->proxy ? proxy_resolve(udp->proxy, datagram[i].host) : get_ipv4_address(datagram[i].host));
+  }
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_udp_send (proxysocketudp udp, const struct proxysocket_datagram* datagrams, int count)
+{
+  int i;
+  int n;
+  int sent = 0;
+  if (!udp || !datagrams || count < 0)
+    return -1;
+  while (sent < count) {
+    int batch = (count - sent < UDP_BATCH_SIZE ? count - sent : UDP_BATCH_SIZE);
+    const struct proxysocket_datagram* datagram = datagrams + sent;
+    if (udp->controlsock == INVALID_SOCKET)
+      udp_resolve_batch(udp, datagram, batch);
+#ifdef HAVE_SENDMMSG
+    for (i = 0; i < batch; i++) {
+      struct msghdr* msg = &udp->msgs[i].msg_hdr;
+      memset(msg, 0, sizeof(struct msghdr));
+      if (udp->controlsock == INVALID_SOCKET) {
+        //direct datagrams have no header
+        udp->addrs[i].sin_family = AF_INET;
+        udp->addrs[i].sin_port = htons(datagram[i].port);
+        udp->addrs[i].sin_addr.s_addr = udp->hostaddrs[i];
+        udp->iov[i][0].iov_base = datagram[i].data;
+        udp->iov[i][0].iov_len = datagram[i].len;
+        msg->msg_name = &udp->addrs[i];
+        msg->msg_namelen = sizeof(struct sockaddr_in);
+        msg->msg_iovlen = 1;
+      } else {
+        if ((udp->iov[i][0].iov_len = udp_build_header(udp->headers[i], datagram + i)) == 0)
+          return (sent > 0 ? sent : -1);
+        udp->iov[i][0].iov_base = udp->headers[i];
+        udp->iov[i][1].iov_base = datagram[i].data;
+        udp->iov[i][1].iov_len = datagram[i].len;
+        msg->msg_iovlen = 2;
+      }
+      msg->msg_iov = udp->iov[i];
+    }
+    if ((n = sendmmsg(udp->sock, udp->msgs, batch, SOCKET_SEND_FLAGS)) <= 0)
+      return (sent > 0 ? sent : -1);
+    sent += n;
+    if (n < batch)
+      break;
+#else
+    for (i = 0; i < batch; i++) {
+      if (udp->controlsock == INVALID_SOCKET) {
+        struct sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(datagram[i].port);
+        addr.sin_addr.s_addr = udp->hostaddrs[i];
+        n = sendto(udp->sock, (const char*)datagram[i].data, datagram[i].len, SOCKET_SEND_FLAGS, (struct sockaddr*)&addr, sizeof(addr));
+      } else {
+        //without scatter/gather the header and data are copied into one packet
+        size_t headerlen;
+        if ((headerlen = udp_build_header(udp->packet, datagram + i)) == 0 || datagram[i].len > UDP_MAX_DATAGRAM)
+          return (sent > 0 ? sent : -1);
+        memcpy(udp->packet + headerlen, datagram[i].data, datagram[i].len);
+        n = send(udp->sock, (const char*)udp->packet, headerlen + datagram[i].len, SOCKET_SEND_FLAGS);
+      }
+      if (n < 0)
+        return (sent > 0 ? sent : -1);
+      sent++;
+    }
+#endif
+  }
+  return sent;
+}
+
+//wait for datagrams or the end of the association, returns 1 if datagrams can be received, 0 on timeout or -1 if the association ended
+int udp_wait (struct proxysocket_udp_struct* udp, uint64_t deadline)
+{
+  int n;
+  int64_t remaining;
+  struct pollfd pollinfo[2];
+  pollinfo[0].fd = udp->sock;
+  pollinfo[0].events = POLLIN;
+  pollinfo[0].revents = 0;
+  pollinfo[1].fd = udp->controlsock;
+  pollinfo[1].events = POLLIN;
+  pollinfo[1].revents = 0;
+  do {
+    remaining = (deadline ? (int64_t)(deadline - get_monotonic_milliseconds()) : -1);
+    if (deadline && remaining < 0)
+      remaining = 0;
+    n = poll(pollinfo, (udp->controlsock == INVALID_SOCKET ? 1 : 2), (int)remaining);
+#ifdef _WIN32
+  } while (0);
+#else
+  } while (n < 0 && errno == EINTR);
+#endif
+  if (n < 0)
+    return -1;
+  //the proxy ends the association by closing the connection
+  if (pollinfo[1].revents)
+    return -1;
+  return (pollinfo[0].revents ? 1 : 0);
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_udp_recv (proxysocketudp udp, struct proxysocket_datagram* datagrams, int count, uint32_t timeout)
+{
+  int i;
+  int n;
+  int received = 0;
+  uint64_t deadline;
+  if (!udp || !datagrams || count <= 0)
+    return -1;
+  deadline = (timeout ? get_monotonic_milliseconds() + timeout : 0);
+  //wait for the first datagram and take everything that is available (dropping invalid datagrams)
+  while (received == 0) {
+    if ((n = udp_wait(udp, deadline)) <= 0)
+      return n;
+#ifdef HAVE_SENDMMSG
+    {
+      int batch = (count < UDP_BATCH_SIZE ? count : UDP_BATCH_SIZE);
+      for (i = 0; i < batch; i++) {
+        struct msghdr* msg = &udp->msgs[i].msg_hdr;
+        memset(msg, 0, sizeof(struct msghdr));
+        if (udp->controlsock == INVALID_SOCKET) {
+          udp->iov[i][0].iov_base = datagrams[i].data;
+          udp->iov[i][0].iov_len = datagrams[i].size;
+          msg->msg_name = &udp->addrs[i];
+          msg->msg_namelen = sizeof(struct sockaddr_in);
+          msg->msg_iovlen = 1;
+        } else {
+          //receive the header separately, assuming the usual IPv4 address
+          udp->iov[i][0].iov_base = udp->headers[i];
+          udp->iov[i][0].iov_len = UDP_IPV4_HEADER_SIZE;
+          udp->iov[i][1].iov_base = datagrams[i].data;
+          udp->iov[i][1].iov_len = datagrams[i].size;
+          msg->msg_iovlen = 2;
+        }
+        msg->msg_iov = udp->iov[i];
+      }
+      if ((n = recvmmsg(udp->sock, udp->msgs, batch, MSG_DONTWAIT, NULL)) < 0)
+        return (socket_would_block() ? 0 : -1);
+      for (i = 0; i < n; i++) {
+        struct proxysocket_datagram source;
+        struct proxysocket_datagram* datagram = datagrams + received;
+        uint8_t* data = (uint8_t*)datagrams[i].data;
+        size_t len = udp->msgs[i].msg_len;
+        if (udp->controlsock == INVALID_SOCKET) {
+          source.addr = udp->addrs[i].sin_addr.s_addr;
+          source.port = ntohs(udp->addrs[i].sin_port);
+        } else {
+          size_t headerlen;
+          if (len < UDP_IPV4_HEADER_SIZE) {
+            continue;
+          } else if (udp->headers[i][3] == SOCKS5_ADDRESSTYPE_IPV4) {
+            if ((headerlen = udp_parse_header(udp->headers[i], len, &source)) == 0)
+              continue;
+          } else {
+            //a longer header continues at the start of the data
+            uint8_t header[UDP_HEADER_SIZE];
+            size_t headerpart = (len < UDP_HEADER_SIZE ? len : UDP_HEADER_SIZE) - UDP_IPV4_HEADER_SIZE;
+            if (headerpart > datagrams[i].size)
+              headerpart = datagrams[i].size;
+            memcpy(header, udp->headers[i], UDP_IPV4_HEADER_SIZE);
+            memcpy(header + UDP_IPV4_HEADER_SIZE, data, headerpart);
+            if ((headerlen = udp_parse_header(header, UDP_IPV4_HEADER_SIZE + headerpart, &source)) == 0)
+              continue;
+            memmove(data, data + (headerlen - UDP_IPV4_HEADER_SIZE), len - headerlen);
+          }
+          len -= headerlen;
+        }
+        //move the data to the next free entry if datagrams were dropped
+        if (datagram != datagrams + i) {
+          if (len > datagram->size)
+            len = datagram->size;
+          memcpy(datagram->data, data, len);
+        }
+        datagram->addr = source.addr;
+        datagram->port = source.port;
+        datagram->len = len;
+        received++;
+      }
+    }
+#else
+    for (i = 0; i < count; i++) {
+      struct proxysocket_datagram* datagram = datagrams + received;
+      if (i > 0 && udp_wait(udp, get_monotonic_milliseconds()) <= 0)
+        break;
+      if (udp->controlsock == INVALID_SOCKET) {
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        if ((n = recvfrom(udp->sock, (char*)datagram->data, datagram->size, 0, (struct sockaddr*)&addr, &addrlen)) < 0)
+          return (received > 0 ? received : -1);
+        datagram->addr = addr.sin_addr.s_addr;
+        datagram->port = ntohs(addr.sin_port);
+        datagram->len = n;
+      } else {
+        size_t headerlen;
+        if ((n = recv(udp->sock, (char*)udp->packet, sizeof(udp->packet), 0)) < 0)
+          return (received > 0 ? received : -1);
+        if ((headerlen = udp_parse_header(udp->packet, n, datagram)) == 0)
+          continue;
+        datagram->len = ((size_t)n - headerlen < datagram->size ? (size_t)n - headerlen : datagram->size);
+        memcpy(datagram->data, udp->packet + headerlen, datagram->len);
+      }
+      received++;
+    }
+#endif
+  }
+  return received;
+}
+
+DLL_EXPORT_PROXYSOCKET void proxysocket_udp_close (proxysocketudp udp)
+{
+  if (udp) {
+    if (udp->sock != INVALID_SOCKET)
+      closesocket(udp->sock);
+    if (udp->controlsock != INVALID_SOCKET)
+      closesocket(udp->controlsock);
+    free(udp);
+  }
+}
+
+/* * * incoming connections through a SOCKS proxy (BIND) * * */
+
+//the handshake of a BIND session ends after the first reply and is resumed to receive the second one
+struct proxysocket_bind_struct {
+  struct proxysocket_handshake_struct* handshake;
+  uint32_t addr;                        //address the proxy listens on
+  uint16_t port;
+  uint64_t armed;                       //time the proxy started listening
+  struct proxysocket_bind_struct* next; //next session in the pool
+};
+
+//create a BIND session from a handshake that received the first reply
+struct proxysocket_bind_struct* bind_create (struct proxysocket_handshake_struct* handshake)
+{
+  struct proxysocket_bind_struct* session;
+  if ((session = (struct proxysocket_bind_struct*)malloc(sizeof(struct proxysocket_bind_struct))) == NULL)
+    return NULL;
+  session->handshake = handshake;
+  session->addr = handshake->bindaddr;
+  session->port = handshake->bindport;
+  session->armed = get_monotonic_milliseconds();
+  session->next = NULL;
+  return session;
+}
+
+//check if a pooled session can still be used (the proxy didn't close it and no connection arrived that was not asked for)
+int bind_is_usable (struct proxysocket_bind_struct* session, uint32_t maxidle, uint64_t now)
+{
+  struct pollfd pollinfo;
+  if (maxidle && now - session->armed > maxidle)
+    return 0;
+  pollinfo.fd = session->handshake->sock;
+  pollinfo.events = POLLIN;
+  pollinfo.revents = 0;
+  return (poll(&pollinfo, 1, 0) == 0);
+}
+
+//check if the pool is armed for the specified peer (lock must be held)
+int bind_pool_matches (struct bind_pool* pool, const char* peerhost, uint16_t peerport)
+{
+  return (peerport == pool->peerport && strcmp((peerhost ? peerhost : ""), (pool->peerhost ? pool->peerhost : "")) == 0);
+}
+
+//add an armed session to the pool, returns zero if the pool is full or is for another peer now
+int bind_pool_add (struct bind_pool* pool, struct proxysocket_bind_struct* session, const char* peerhost, uint16_t peerport)
+{
+  int matches;
+  spin_lock(&pool->lock);
+  if ((matches = (pool->count < pool->size && bind_pool_matches(pool, peerhost, peerport))) != 0) {
+    session->next = pool->sessions;
+    pool->sessions = session;
+    pool->count++;
+  }
+  spin_unlock(&pool->lock);
+  return matches;
+}
+
+//take an armed session for the specified peer from the pool
+struct proxysocket_bind_struct* bind_pool_take (proxysocketconfig proxy, const char* peerhost, uint16_t peerport)
+{
+  uint64_t now;
+  uint32_t maxidle;
+  struct bind_pool* pool = ATOMIC_LOAD(&proxy->bindpool);
+  struct proxysocket_bind_struct* session;
+  if (!pool)
+    return NULL;
+  now = get_monotonic_milliseconds();
+  for (;;) {
+    session = NULL;
+    spin_lock(&pool->lock);
+    if (bind_pool_matches(pool, peerhost, peerport) && (session = pool->sessions) != NULL) {
+      pool->sessions = session->next;
+      pool->count--;
+    }
+    maxidle = pool->maxidle;
+    spin_unlock(&pool->lock);
+    if (!session || bind_is_usable(session, maxidle, now))
+      break;
+    write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Discarding expired BIND session listening on: %s:%lu", inet_ntoa(*(struct in_addr*)&session->addr), (unsigned long)session->port);
+    proxysocket_bind_close(session);
+  }
+  if (session)
+    session->next = NULL;
+  return session;
+}
+
+DLL_EXPORT_PROXYSOCKET proxysocketbind proxysocket_bind (proxysocketconfig proxy, const char* peerhost, uint16_t peerport, struct proxysocket_error* error)
+{
+  struct proxysocket_bind_struct* session;
+  struct proxysocket_handshake_struct* handshake;
+  if (!proxy) {
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_INVALID_CONFIG);
+    return NULL;
+  }
+  //use a session armed in advance if available
+  if ((session = bind_pool_take(proxy, peerhost, peerport)) != NULL) {
+    write_log_info(proxy, PROXYSOCKET_LOG_INFO, "Using pooled BIND session listening on: %s:%lu", inet_ntoa(*(struct in_addr*)&session->addr), (unsigned long)session->port);
+    set_error(error, PROXYSOCKET_ERROR_PHASE_NONE, PROXYSOCKET_ERROR_CAUSE_NONE);
+    return session;
+  }
+  if ((handshake = handshake_create(proxy, (peerhost ? peerhost : "0.0.0.0"), peerport, NULL, NULL, 0, SOCKS5_COMMAND_BIND)) == NULL) {
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, memory_allocation_error);
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+    return NULL;
+  }
+  handshake_wait(handshake);
+  if (handshake->state != HANDSHAKE_STATE_DONE) {
+    handshake_finish(handshake, NULL, error);
+    return NULL;
+  }
+  if ((session = bind_create(handshake)) == NULL) {
+    write_log_info(proxy, PROXYSOCKET_LOG_ERROR, memory_allocation_error);
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+    handshake_free(handshake);
+    return NULL;
+  }
+  set_error(error, PROXYSOCKET_ERROR_PHASE_NONE, PROXYSOCKET_ERROR_CAUSE_NONE);
+  return session;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_bind_get_address (proxysocketbind session, uint32_t* addr, uint16_t* port)
+{
+  if (!session)
+    return -1;
+  if (addr)
+    *addr = session->addr;
+  if (port)
+    *port = session->port;
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_bind_get_socket (proxysocketbind session)
+{
+  return (session && session->handshake ? session->handshake->sock : INVALID_SOCKET);
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_bind_accept (proxysocketbind session, uint32_t timeout, uint32_t* peeraddr, uint16_t* peerport, struct proxysocket_error* error)
+{
+  int status;
+  int ready;
+  struct proxysocket_handshake_struct* handshake;
+  if (!session || (handshake = session->handshake) == NULL) {
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_INVALID_ARGUMENT);
+    return INVALID_SOCKET;
+  }
+  //resume the handshake to receive the second reply from the last proxy
+  if (!handshake->accepting) {
+    handshake->accepting = 1;
+    handshake->hop = handshake->hopcount - 1;
+    handshake->step = (handshake->hops[handshake->hop].proxyinfo->proxytype == PROXYSOCKET_TYPE_SOCKS4 ? HANDSHAKE_STEP_SOCKS4_CONNECT : HANDSHAKE_STEP_SOCKS5_CONNECT);
+    handshake->state = HANDSHAKE_STATE_RECEIVE;
+    handshake->phase = PROXYSOCKET_ERROR_PHASE_ACCEPT;
+    handshake->buflen = 0;
+  }
+  while ((status = proxysocket_handshake_step(handshake)) == PROXYSOCKET_HANDSHAKE_WANT_READ) {
+    if ((ready = socket_wait(handshake->sock, status, timeout)) == 0) {
+      //keep the session armed so the caller can wait again
+      set_error(error, PROXYSOCKET_ERROR_PHASE_ACCEPT, PROXYSOCKET_ERROR_CAUSE_TIMEOUT);
+      if (error)
+        error->hop = handshake->hop;
+      return INVALID_SOCKET;
+    }
+    if (ready < 0) {
+      handshake_timeout(handshake);
+      break;
+    }
+  }
+  if (handshake->state == HANDSHAKE_STATE_DONE) {
+    if (peeraddr)
+      *peeraddr = handshake->bindaddr;
+    if (peerport)
+      *peerport = handshake->bindport;
+  }
+  session->handshake = NULL;
+  return handshake_finish(handshake, NULL, error);
+}
+
+DLL_EXPORT_PROXYSOCKET void proxysocket_bind_close (proxysocketbind session)
+{
+  if (session) {
+    if (session->handshake)
+      handshake_free(session->handshake);
+    free(session);
+  }
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_bind_pool (proxysocketconfig proxy, const char* peerhost, uint16_t peerport, uint32_t size, uint32_t maxidle)
+{
+  char* host;
+  struct bind_pool* pool;
+  struct proxysocket_bind_struct* session;
+  struct bind_pool* current = NULL;
+  struct proxysocket_bind_struct* sessions = NULL;
+  if (!proxy)
+    return -1;
+  if ((pool = ATOMIC_LOAD(&proxy->bindpool)) == NULL) {
+    if (size == 0)
+      return 0;
+    if ((pool = (struct bind_pool*)malloc(sizeof(struct bind_pool))) == NULL)
+      return -1;
+    pool->lock = 0;
+    pool->peerhost = NULL;
+    pool->peerport = 0;
+    pool->size = 0;
+    pool->maxidle = 0;
+    pool->sessions = NULL;
+    pool->count = 0;
+    //another thread may have created the pool in the meantime
+    if (!ATOMIC_COMPARE_EXCHANGE(&proxy->bindpool, &current, pool)) {
+      free(pool);
+      pool = current;
+    }
+  }
+  host = (peerhost ? strdup(peerhost) : NULL);
+  if (peerhost && !host)
+    return -1;
+  //sessions armed for another peer can't be used anymore
+  spin_lock(&pool->lock);
+  if (size == 0 || !bind_pool_matches(pool, peerhost, peerport)) {
+    sessions = pool->sessions;
+    pool->sessions = NULL;
+    pool->count = 0;
+  }
+  free(pool->peerhost);
+  pool->peerhost = host;
+  pool->peerport = peerport;
+  pool->size = size;
+  pool->maxidle = maxidle;
+  spin_unlock(&pool->lock);
+  while ((session = sessions) != NULL) {
+    sessions = session->next;
+    proxysocket_bind_close(session);
+  }
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_fill_bind_pool (proxysocketconfig proxy, uint32_t timeout)
+{
+  int i;
+  int count;
+  int* status;
+  uint64_t now;
+  uint64_t deadline;
+  char* peerhost;
+  uint16_t peerport;
+  uint32_t maxidle;
+  struct bind_pool* pool;
+  struct proxysocket_bind_struct* session;
+  struct proxysocket_bind_struct* sessions;
+  struct proxysocket_handshake_struct** handshakes;
+  struct resolver_cache_struct* resolvercache;
+  if (!proxy || (pool = ATOMIC_LOAD(&proxy->bindpool)) == NULL)
+    return -1;
+  //take the sessions and a copy of the peer, proxysocketconfig_set_bind_pool() may change it meanwhile
+  now = get_monotonic_milliseconds();
+  spin_lock(&pool->lock);
+  if (pool->peerhost && (peerhost = strdup(pool->peerhost)) == NULL) {
+    spin_unlock(&pool->lock);
+    log_and_keep_error_message(proxy, NULL, memory_allocation_error);
+    return -1;
+  }
+  if (!pool->peerhost)
+    peerhost = NULL;
+  sessions = pool->sessions;
+  pool->sessions = NULL;
+  pool->count = 0;
+  peerport = pool->peerport;
+  maxidle = pool->maxidle;
+  spin_unlock(&pool->lock);
+  //put back the sessions that haven't expired
+  while ((session = sessions) != NULL) {
+    sessions = session->next;
+    if (!bind_is_usable(session, maxidle, now)) {
+      write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Discarding expired BIND session listening on: %s:%lu", inet_ntoa(*(struct in_addr*)&session->addr), (unsigned long)session->port);
+      proxysocket_bind_close(session);
+    } else if (!bind_pool_add(pool, session, peerhost, peerport)) {
+      proxysocket_bind_close(session);
+    }
+  }
+  spin_lock(&pool->lock);
+  count = (pool->count < pool->size ? pool->size - pool->count : 0);
+  //the pool may have been set up for another peer while sessions were checked
+  if (!bind_pool_matches(pool, peerhost, peerport))
+    count = 0;
+  spin_unlock(&pool->lock);
+  if (count == 0) {
+    free(peerhost);
+    spin_lock(&pool->lock);
+    count = pool->count;
+    spin_unlock(&pool->lock);
+    return count;
+  }
+  //arm the missing sessions concurrently
+  handshakes = (struct proxysocket_handshake_struct**)malloc(count * sizeof(struct proxysocket_handshake_struct*));
+  status = (int*)malloc(count * sizeof(int));
+  resolvercache = resolver_cache_create(proxysocketconfig_get_proxy_count(proxy) + 1);
+  if (!handshakes || !status || !resolvercache) {
+    log_and_keep_error_message(proxy, NULL, memory_allocation_error);
+    resolver_cache_free(resolvercache);
+    free(status);
+    free(handshakes);
+    free(peerhost);
+    return -1;
+  }
+  deadline = (timeout ? now + timeout : 0);
+  for (i = 0; i < count; i++)
+    handshakes[i] = handshake_alloc(proxy, (peerhost ? peerhost : "0.0.0.0"), peerport, NULL, resolvercache, 0, SOCKS5_COMMAND_BIND);
+  handshake_begin_many(proxy, resolvercache, handshakes, status, count);
+#ifdef HAVE_IO_URING
+  if (connect_many_uring(handshakes, status, count, deadline) != 0)
+#endif
+    connect_many_poll(handshakes, status, count, deadline);
+  //add the armed sessions to the pool
+  for (i = 0; i < count; i++) {
+    if (!handshakes[i])
+      continue;
+    if (handshakes[i]->state != HANDSHAKE_STATE_DONE || (session = bind_create(handshakes[i])) == NULL) {
+      handshake_finish(handshakes[i], NULL, NULL);
+      continue;
+    }
+    //discard sessions armed for a peer the pool isn't used for anymore or more than fit (when filled concurrently)
+    if (!bind_pool_add(pool, session, peerhost, peerport))
+      proxysocket_bind_close(session);
+  }
+  resolver_cache_free(resolvercache);
+  free(status);
+  free(handshakes);
+  free(peerhost);
+  spin_lock(&pool->lock);
+  count = pool->count;
+  spin_unlock(&pool->lock);
+  return count;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/* * * byte accounting and bandwidth shaping of established connections * * */
+
+struct proxysocket_tunnel_struct {
+  proxysocketconfig proxy;
+  SOCKET sock;
+  struct bandwidth_limits* bandwidth;   //limits of this tunnel (NULL if not limited)
+  struct proxyinfo_struct** hops;       //entries of the proxy information the connection was made with
+  int hopcount;
+  uint64_t bytes[2];                    //indexed by BANDWIDTH_SEND and BANDWIDTH_RECV
+  uint64_t throttled;
+  int blocked;                          //directions in which the last transfer failed because of the bandwidth limits (bit 1 << direction)
+  uint64_t sampledbytes[2];             //bytes counted at the previous call to proxysocket_tunnel_get_stats()
+  uint64_t sampled;                     //time of the previous call to proxysocket_tunnel_get_stats()
+};
+
+//add tokens for the time passed, returns the time in milliseconds until tokens are available (0 if available now)
+uint32_t bandwidth_bucket_refill (struct bandwidth_bucket* bucket)
+{
+  int64_t tokens;
+  uint64_t now;
+  uint64_t elapsed;
+  uint64_t add;
+  spin_lock(&bucket->lock);
+  now = get_monotonic_milliseconds();
+  if (!bucket->refilled) {
+    bucket->refilled = now;
+  } else if (now > bucket->refilled) {
+    //only move the refill time forward when tokens were added so slow rates don't lose time
+    //after an idle period no more than the burst is added (checked before multiplying so it can't overflow)
+    elapsed = now - bucket->refilled;
+    add = (elapsed < ((uint64_t)bucket->burst * 1000 + bucket->rate - 1) / bucket->rate ? elapsed * bucket->rate / 1000 : (uint64_t)bucket->burst);
+    if (add > (uint64_t)bucket->burst)
+      add = (uint64_t)bucket->burst;
+    if (add > 0) {
+      bucket->refilled = now;
+      if ((tokens = ATOMIC_ADD(&bucket->tokens, (int64_t)add)) > bucket->burst)
+        ATOMIC_SUB(&bucket->tokens, tokens - bucket->burst);
+    }
+  }
+  spin_unlock(&bucket->lock);
+  if ((tokens = ATOMIC_LOAD(&bucket->tokens)) > 0)
+    return 0;
+  return (uint32_t)(((uint64_t)(1 - tokens) * 1000 + bucket->rate - 1) / bucket->rate);
+}
+
+//get the bucket for a direction at a level of the hierarchy (level 0 is the tunnel itself, then the entries of the proxy information)
+struct bandwidth_bucket* tunnel_get_bucket (struct proxysocket_tunnel_struct* tunnel, int direction, int level)
+{
+  struct bandwidth_limits* bandwidth = (level == 0 ? tunnel->bandwidth : tunnel->hops[level - 1]->runtime->bandwidth);
+  if (!bandwidth || !bandwidth->direction[direction].rate)
+    return NULL;
+  return &bandwidth->direction[direction];
+}
+
+//get the number of bytes all levels allow to transfer now, or 0 and the time in milliseconds until they allow it in waittime
+size_t tunnel_allow (struct proxysocket_tunnel_struct* tunnel, int direction, size_t len, uint32_t* waittime)
+{
+  int level;
+  size_t allowed;
+  int64_t tokens;
+  uint32_t levelwaittime;
+  struct bandwidth_bucket* bucket;
+  allowed = len;
+  *waittime = 0;
+  for (level = 0; level <= tunnel->hopcount; level++) {
+    if ((bucket = tunnel_get_bucket(tunnel, direction, level)) == NULL)
+      continue;
+    //the clock is only read when a bucket runs out
+    if ((tokens = ATOMIC_LOAD(&bucket->tokens)) <= 0) {
+      if ((levelwaittime = bandwidth_bucket_refill(bucket)) > 0) {
+        if (levelwaittime > *waittime)
+          *waittime = levelwaittime;
+        continue;
+      }
+      tokens = ATOMIC_LOAD(&bucket->tokens);
+    }
+    if (tokens > 0 && (uint64_t)tokens < allowed)
+      allowed = (size_t)tokens;
+  }
+  return (*waittime ? 0 : allowed);
+}
+
+//count transferred bytes and take them from all buckets
+void tunnel_account (struct proxysocket_tunnel_struct* tunnel, int direction, size_t len)
+{
+  int level;
+  struct bandwidth_bucket* bucket;
+  ATOMIC_ADD(&tunnel->bytes[direction], len);
+  for (level = 0; level <= tunnel->hopcount; level++) {
+    if (level > 0)
+      ATOMIC_ADD((direction == BANDWIDTH_SEND ? &tunnel->hops[level - 1]->runtime->state->stats.bytes_sent : &tunnel->hops[level - 1]->runtime->state->stats.bytes_received), len);
+    if ((bucket = tunnel_get_bucket(tunnel, direction, level)) != NULL)
+      ATOMIC_SUB(&bucket->tokens, (int64_t)len);
+  }
+}
+
+//check if the caller doesn't want to wait (MSG_DONTWAIT in flags or a non-blocking socket where this can be checked)
+int tunnel_dontwait (struct proxysocket_tunnel_struct* tunnel, int flags)
+{
+#ifdef MSG_DONTWAIT
+  if (flags & MSG_DONTWAIT)
+    return 1;
+#endif
+#ifndef _WIN32
+  {
+    int sockflags;
+    if ((sockflags = fcntl(tunnel->sock, F_GETFL, 0)) != -1 && (sockflags & O_NONBLOCK))
+      return 1;
+  }
+#else
+  (void)tunnel;
+#endif
+  (void)flags;
+  return 0;
+}
+
+//fail like a non-blocking socket that isn't ready
+int tunnel_would_block ()
+{
+#ifdef _WIN32
+  WSASetLastError(WSAEWOULDBLOCK);
+#else
+  errno = EWOULDBLOCK;
+#endif
+  return -1;
+}
+
+//get the number of bytes that can be transferred, sleeping until the bandwidth limits allow it unless the caller doesn't want to wait (returns 0 then)
+size_t tunnel_wait (struct proxysocket_tunnel_struct* tunnel, int direction, size_t len, int flags)
+{
+  size_t allowed;
+  uint32_t waittime;
+  while ((allowed = tunnel_allow(tunnel, direction, len, &waittime)) == 0) {
+    if (tunnel_dontwait(tunnel, flags)) {
+      ATOMIC_OR(&tunnel->blocked, 1 << direction);
+      return 0;
+    }
+    thread_sleep(waittime);
+    ATOMIC_ADD(&tunnel->throttled, waittime);
+  }
+  if (ATOMIC_LOAD(&tunnel->blocked) & (1 << direction))
+    ATOMIC_AND(&tunnel->blocked, ~(1 << direction));
+  return allowed;
+}
+
+//allocate a tunnel for the entries of the proxy information it was made with (filled in by the caller)
+struct proxysocket_tunnel_struct* tunnel_alloc (proxysocketconfig proxy, SOCKET sock, int hopcount)
+{
+  struct proxysocket_tunnel_struct* tunnel;
+  if ((tunnel = (struct proxysocket_tunnel_struct*)malloc(sizeof(struct proxysocket_tunnel_struct))) == NULL)
+    return NULL;
+  tunnel->proxy = proxy;
+  tunnel->sock = sock;
+  tunnel->bandwidth = NULL;
+  tunnel->hopcount = hopcount;
+  tunnel->bytes[BANDWIDTH_SEND] = 0;
+  tunnel->bytes[BANDWIDTH_RECV] = 0;
+  tunnel->throttled = 0;
+  tunnel->blocked = 0;
+  tunnel->sampledbytes[BANDWIDTH_SEND] = 0;
+  tunnel->sampledbytes[BANDWIDTH_RECV] = 0;
+  tunnel->sampled = get_monotonic_milliseconds();
+  if ((tunnel->hops = (struct proxyinfo_struct**)malloc((hopcount + 1) * sizeof(struct proxyinfo_struct*))) == NULL) {
+    free(tunnel);
+    return NULL;
+  }
+  return tunnel;
+}
+
+DLL_EXPORT_PROXYSOCKET proxysockettunnel proxysocket_tunnel_create (proxysocketconfig proxy, SOCKET sock)
+{
+  int i;
+  struct proxyinfo_struct* proxyinfo;
+  struct proxysocket_tunnel_struct* tunnel;
+  if (!proxy || sock == INVALID_SOCKET)
+    return NULL;
+  if ((tunnel = tunnel_alloc(proxy, sock, proxysocketconfig_get_hop_count(proxy))) == NULL)
+    return NULL;
+  //store entries in connection order (the list starts with the last proxy), the socket doesn't tell which proxy of a group was used so the first one added counts
+  i = tunnel->hopcount;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    while ((proxyinfo->flags & PROXYINFO_FLAG_GROUP) && proxyinfo->next)
+      proxyinfo = proxyinfo->next;
+    tunnel->hops[--i] = proxyinfo;
+  }
+  return tunnel;
+}
+
+DLL_EXPORT_PROXYSOCKET proxysockettunnel proxysocket_handshake_finish_tunnel (proxysockethandshake handshake, struct proxysocket_error* error)
+{
+  int i;
+  SOCKET sock;
+  proxysocketconfig proxy;
+  struct proxysocket_tunnel_struct* tunnel = NULL;
+  if (!handshake) {
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_INVALID_CONFIG);
+    return NULL;
+  }
+  //take the entries the handshake went through (including the proxies it selected from groups) before it is freed
+  proxy = handshake->proxy;
+  if (handshake->state == HANDSHAKE_STATE_DONE && (tunnel = tunnel_alloc(proxy, INVALID_SOCKET, handshake->hopcount)) != NULL) {
+    for (i = 0; i < handshake->hopcount; i++)
+      tunnel->hops[i] = handshake->hops[i].proxyinfo;
+  }
+  if ((sock = handshake_finish(handshake, NULL, error)) == INVALID_SOCKET) {
+    if (tunnel)
+      free(tunnel->hops);
+    free(tunnel);
+    return NULL;
+  }
+  if (!tunnel) {
+    proxysocket_disconnect(proxy, sock);
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+    return NULL;
+  }
+  tunnel->sock = sock;
+  return tunnel;
+}
+
+DLL_EXPORT_PROXYSOCKET proxysockettunnel proxysocket_connect_tunnel (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, const char* key, struct proxysocket_error* error)
+{
+  struct proxysocket_handshake_struct* handshake;
+  if (!proxy) {
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_INVALID_CONFIG);
+    return NULL;
+  }
+  if ((handshake = handshake_create(proxy, dsthost, dstport, key, NULL, 0, SOCKS5_COMMAND_CONNECT)) == NULL) {
+    log_and_keep_error_message(proxy, NULL, memory_allocation_error);
+    set_error(error, PROXYSOCKET_ERROR_PHASE_SETUP, PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY);
+    return NULL;
+  }
+  handshake_wait(handshake);
+  return proxysocket_handshake_finish_tunnel(handshake, error);
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_tunnel_get_socket (proxysockettunnel tunnel)
+{
+  return (tunnel ? tunnel->sock : INVALID_SOCKET);
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_tunnel_set_bandwidth_limit (proxysockettunnel tunnel, uint32_t sendrate, uint32_t recvrate, uint32_t burst)
+{
+  if (!tunnel)
+    return -1;
+  if (!tunnel->bandwidth && (tunnel->bandwidth = bandwidth_limits_create()) == NULL)
+    return -1;
+  bandwidth_bucket_set(&tunnel->bandwidth->direction[BANDWIDTH_SEND], sendrate, burst);
+  bandwidth_bucket_set(&tunnel->bandwidth->direction[BANDWIDTH_RECV], recvrate, burst);
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_tunnel_send (proxysockettunnel tunnel, const void* buf, size_t len, int flags)
+{
+  int result;
+  size_t allowed;
+  if (!tunnel)
+    return -1;
+  if (len > 0 && (allowed = tunnel_wait(tunnel, BANDWIDTH_SEND, len, flags)) == 0)
+    return tunnel_would_block();
+  if ((result = send(tunnel->sock, (const char*)buf, (int)(len > 0 ? allowed : 0), flags | SOCKET_SEND_FLAGS)) > 0)
+    tunnel_account(tunnel, BANDWIDTH_SEND, result);
+  return result;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_tunnel_recv (proxysockettunnel tunnel, void* buf, size_t len, int flags)
+{
+  int result;
+  size_t allowed;
+  if (!tunnel)
+    return -1;
+  if (len > 0 && (allowed = tunnel_wait(tunnel, BANDWIDTH_RECV, len, flags)) == 0)
+    return tunnel_would_block();
+  if ((result = recv(tunnel->sock, (char*)buf, (int)(len > 0 ? allowed : 0), flags)) > 0)
+    tunnel_account(tunnel, BANDWIDTH_RECV, result);
+  return result;
+}
+
+DLL_EXPORT_PROXYSOCKET uint32_t proxysocket_tunnel_get_wait_time (proxysockettunnel tunnel)
+{
+  int direction;
+  int blocked;
+  uint32_t waittime;
+  uint32_t result = 0;
+  if (!tunnel || (blocked = ATOMIC_LOAD(&tunnel->blocked)) == 0)
+    return 0;
+  for (direction = BANDWIDTH_SEND; direction <= BANDWIDTH_RECV; direction++) {
+    if ((blocked & (1 << direction)) && tunnel_allow(tunnel, direction, 1, &waittime) == 0 && waittime > result)
+      result = waittime;
+  }
+  return result;
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocket_tunnel_get_stats (proxysockettunnel tunnel, struct proxysocket_tunnel_stats* stats)
+{
+  uint64_t now;
+  uint64_t elapsed;
+  if (!tunnel || !stats)
+    return -1;
+  now = get_monotonic_milliseconds();
+  elapsed = (now > tunnel->sampled ? now - tunnel->sampled : 1);
+  stats->bytes_sent = ATOMIC_LOAD(&tunnel->bytes[BANDWIDTH_SEND]);
+  stats->bytes_received = ATOMIC_LOAD(&tunnel->bytes[BANDWIDTH_RECV]);
+  stats->send_rate = (uint32_t)((stats->bytes_sent - tunnel->sampledbytes[BANDWIDTH_SEND]) * 1000 / elapsed);
+  stats->recv_rate = (uint32_t)((stats->bytes_received - tunnel->sampledbytes[BANDWIDTH_RECV]) * 1000 / elapsed);
+  stats->throttled_time = ATOMIC_LOAD(&tunnel->throttled);
+  tunnel->sampledbytes[BANDWIDTH_SEND] = stats->bytes_sent;
+  tunnel->sampledbytes[BANDWIDTH_RECV] = stats->bytes_received;
+  tunnel->sampled = now;
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET void proxysocket_tunnel_close (proxysockettunnel tunnel)
+{
+  if (tunnel) {
+    proxysocket_disconnect(tunnel->proxy, tunnel->sock);
+    free(tunnel->bandwidth);
+    free(tunnel->hops);
+    free(tunnel);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+
+/* * * hot reloadable proxy information * * */
+
+//readers register in one of two counters (selected by the epoch) while taking a reference to the current proxy information,
+//publishers wait until both counters drained (switching the epoch in between) before releasing the replaced proxy information
+struct proxysocketconfighandle_struct {
+  proxysocketconfig current;
+  uint32_t epoch;
+  uint32_t publishing;
+  struct {
+    uint32_t count;
+    char padding[64 - sizeof(uint32_t)];
+  } readers[2];
+};
+
+DLL_EXPORT_PROXYSOCKET proxysocketconfighandle proxysocketconfighandle_create (proxysocketconfig proxy)
+{
+  struct proxysocketconfighandle_struct* handle;
+  if (!proxy || proxysocketconfig_freeze(proxy) != 0)
+    return NULL;
+  if ((handle = (struct proxysocketconfighandle_struct*)malloc(sizeof(struct proxysocketconfighandle_struct))) == NULL)
+    return NULL;
+  handle->current = proxy;
+  handle->epoch = 0;
+  handle->publishing = 0;
+  handle->readers[0].count = 0;
+  handle->readers[1].count = 0;
+  return handle;
+}
+
+DLL_EXPORT_PROXYSOCKET proxysocketconfig proxysocketconfighandle_acquire (proxysocketconfighandle handle)
+{
+  uint32_t index;
+  proxysocketconfig proxy;
+  if (!handle)
+    return NULL;
+  index = ATOMIC_LOAD(&handle->epoch) & 1;
+  ATOMIC_ADD(&handle->readers[index].count, 1);
+  proxy = ATOMIC_LOAD(&handle->current);
+  ATOMIC_ADD(&proxy->refcount, 1);
+  ATOMIC_SUB(&handle->readers[index].count, 1);
+  return proxy;
+}
+
+DLL_EXPORT_PROXYSOCKET void proxysocketconfighandle_release (proxysocketconfig proxy)
+{
+  if (proxy && ATOMIC_SUB(&proxy->refcount, 1) == 0)
     proxysocketconfig_free(proxy);
-    return result;
+}
+
+//copy the statistics and health of a proxy (while connections may still update them)
+void proxyinfo_state_copy (struct proxyinfo_state* state, struct proxyinfo_state* from)
+{
+  state->stats.fastopen_attempts = ATOMIC_LOAD(&from->stats.fastopen_attempts);
+  state->stats.fastopen_successes = ATOMIC_LOAD(&from->stats.fastopen_successes);
+  state->stats.queued = ATOMIC_LOAD(&from->stats.queued);
+  state->stats.queue_timeouts = ATOMIC_LOAD(&from->stats.queue_timeouts);
+  state->stats.queue_wait_time = ATOMIC_LOAD(&from->stats.queue_wait_time);
+  state->stats.bytes_sent = ATOMIC_LOAD(&from->stats.bytes_sent);
+  state->stats.bytes_received = ATOMIC_LOAD(&from->stats.bytes_received);
+  state->stats.failures = ATOMIC_LOAD(&from->stats.failures);
+  state->stats.consecutive_failures = ATOMIC_LOAD(&from->stats.consecutive_failures);
+  state->latency = ATOMIC_LOAD(&from->latency);
+  state->rtobackoff = ATOMIC_LOAD(&from->rtobackoff);
+  state->lastfailure = ATOMIC_LOAD(&from->lastfailure);
+  state->rtt = ATOMIC_LOAD(&from->rtt);
+}
+
+//take over what was learned about a proxy from the entry it replaces (which may still be used by connections in progress)
+void proxyinfo_runtime_carry_over (struct proxyinfo_runtime* runtime, struct proxyinfo_runtime* from, int sharetls)
+{
+  struct proxyinfo_limits* own;
+  struct proxyinfo_limits* limits;
+  struct proxyinfo_auth_struct* auth;
+  //statistics and health are copied unless they are kept in a shared memory region
+  if (runtime->state == &runtime->localstate && from->state == &from->localstate)
+    proxyinfo_state_copy(&runtime->localstate, &from->localstate);
+  if (!ATOMIC_LOAD(&runtime->capabilities.updated)) {
+    ATOMIC_STORE(&runtime->capabilities.flags, ATOMIC_LOAD(&from->capabilities.flags));
+    ATOMIC_STORE(&runtime->capabilities.rtt, ATOMIC_LOAD(&from->capabilities.rtt));
+    ATOMIC_STORE(&runtime->capabilities.updated, ATOMIC_LOAD(&from->capabilities.updated));
+  }
+  //the authentication details are copied (digest nonce included), the TLS session cache is shared
+  spin_lock(&from->lock);
+  runtime->load = from->load;
+  if (!runtime->auth && (auth = from->auth) != NULL && (runtime->auth = proxyinfo_auth_create(auth->scheme, auth->qop, auth->sess, auth->stale, auth->realm, (auth->realm ? strlen(auth->realm) : 0), auth->nonce, (auth->nonce ? strlen(auth->nonce) : 0), auth->opaque, (auth->opaque ? strlen(auth->opaque) : 0), 0)) != NULL)
+    runtime->auth->nc = auth->nc;
+  if (sharetls && !runtime->tlsproxy)
+    tls_proxy_ref(runtime->tlsproxy = from->tlsproxy);
+  spin_unlock(&from->lock);
+  //share the queue of the connection limits with the limits set on the new entry, or only when no limits were set but the proxy asked to slow down
+  if ((limits = ATOMIC_LOAD(&from->limits)) != NULL) {
+    own = runtime->limits;
+    spin_lock(&limits->lock);
+    if (own) {
+      limits->rate = own->rate;
+      limits->burst = own->burst;
+      limits->maxhandshakes = own->maxhandshakes;
+      //read without the lock by handshakes waiting in the queue
+      ATOMIC_STORE(&limits->maxwait, own->maxwait);
+      if (limits->tokens > (uint64_t)limits->burst * 1000)
+        limits->tokens = (uint64_t)limits->burst * 1000;
+    }
+    if (own || (!limits->rate && !limits->maxhandshakes)) {
+      ATOMIC_ADD(&limits->refcount, 1);
+      runtime->limits = limits;
+    }
+    spin_unlock(&limits->lock);
+    if (runtime->limits != own)
+      limits_unref(own);
+  }
+}
+
+//carry what was learned over from the entries of replaced proxy information with the same type, host, port and user
+void proxyinfo_carry_over (proxysocketconfig proxy, proxysocketconfig previous)
+{
+  size_t count;
+  size_t slot;
+  size_t slotmask;
+  int sharetls;
+  struct proxyinfo_struct** slots;
+  struct proxyinfo_struct* proxyinfo;
+  struct proxyinfo_struct* from;
+  count = 0;
+  for (from = previous->proxyinfolist; from; from = from->next)
+    count++;
+  for (slotmask = 15; slotmask < count * 2; slotmask = slotmask * 2 + 1)
+    ;
+  if ((slots = (struct proxyinfo_struct**)calloc(slotmask + 1, sizeof(struct proxyinfo_struct*))) == NULL) {
+    write_log_info(proxy, PROXYSOCKET_LOG_WARNING, "Unable to carry over what was learned about the proxies: %s", memory_allocation_error);
+    return;
+  }
+  //index the previous entries (the first of equal ones is used)
+  for (from = previous->proxyinfolist; from; from = from->next) {
+    if (from->proxytype == PROXYSOCKET_TYPE_NONE)
+      continue;
+    slot = capability_cache_hash(from->proxytype, from->proxyhost, from->proxyport, from->proxyuser) & slotmask;
+    while (slots[slot])
+      slot = (slot + 1) & slotmask;
+    slots[slot] = from;
+  }
+  //TLS sessions can only be resumed with the same certificate authorities
+  sharetls = (strcmp((proxy->tlscafile ? proxy->tlscafile : ""), (previous->tlscafile ? previous->tlscafile : "")) == 0);
+  count = 0;
+  for (proxyinfo = proxy->proxyinfolist; proxyinfo; proxyinfo = proxyinfo->next) {
+    if (proxyinfo->proxytype == PROXYSOCKET_TYPE_NONE)
+      continue;
+    slot = capability_cache_hash(proxyinfo->proxytype, proxyinfo->proxyhost, proxyinfo->proxyport, proxyinfo->proxyuser) & slotmask;
+    for (; (from = slots[slot]) != NULL; slot = (slot + 1) & slotmask) {
+      if (from->proxytype == proxyinfo->proxytype && from->proxyport == proxyinfo->proxyport &&
+          strcmp((from->proxyhost ? from->proxyhost : ""), (proxyinfo->proxyhost ? proxyinfo->proxyhost : "")) == 0 &&
+          strcmp((from->proxyuser ? from->proxyuser : ""), (proxyinfo->proxyuser ? proxyinfo->proxyuser : "")) == 0) {
+        proxyinfo_runtime_carry_over(proxyinfo->runtime, from->runtime, sharetls);
+        count++;
+        break;
+      }
+    }
+  }
+  free(slots);
+  write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Carried over what was learned about %lu proxies", (unsigned long)count);
+}
+
+DLL_EXPORT_PROXYSOCKET int proxysocketconfighandle_publish (proxysocketconfighandle handle, proxysocketconfig proxy)
+{
+  int i;
+  uint32_t index;
+  proxysocketconfig previous;
+  if (!handle || !proxy || proxysocketconfig_freeze(proxy) != 0)
+    return -1;
+  //only one publisher at a time
+  while (ATOMIC_EXCHANGE(&handle->publishing, 1) != 0)
+    thread_yield();
+  //the previous proxy information stays alive at least until it is released below
+  if ((previous = ATOMIC_LOAD(&handle->current)) != proxy)
+    proxyinfo_carry_over(proxy, previous);
+  previous = ATOMIC_EXCHANGE(&handle->current, proxy);
+  //wait for readers that may have seen the previous proxy information but didn't take a reference yet
+  for (i = 0; i < 2; i++) {
+    index = ATOMIC_ADD(&handle->epoch, 1) & 1;
+    while (ATOMIC_LOAD(&handle->readers[index ^ 1].count) != 0)
+      thread_yield();
+  }
+  ATOMIC_STORE(&handle->publishing, 0);
+  write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Published new proxy information");
+  //connections in progress keep using the previous proxy information until they release it
+  proxysocketconfighandle_release(previous);
+  return 0;
+}
+
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocketconfighandle_connect (proxysocketconfighandle handle, const char* dsthost, uint16_t dstport, char** errmsg)
+{
+  SOCKET result;
+  proxysocketconfig proxy;
+  if ((proxy = proxysocketconfighandle_acquire(handle)) == NULL)
+    return INVALID_SOCKET;
+  result = proxysocket_connect(proxy, dsthost, dstport, errmsg);
+  proxysocketconfighandle_release(proxy);
+  return result;
+}
+
+DLL_EXPORT_PROXYSOCKET void proxysocketconfighandle_free (proxysocketconfighandle handle)
+{
+  if (handle) {
+    proxysocketconfighandle_release(handle->current);
+    free(handle);
   }
 }
 
 DLL_EXPORT_PROXYSOCKET void proxysocket_disconnect (proxysocketconfig proxy, SOCKET sock)
 {
   int status;
+  TRACE_PROBE2(disconnect, proxy, sock);
   write_log_info(proxy, PROXYSOCKET_LOG_DEBUG, "Closing connection");
 #if defined(__WIN32__) || defined(__DJGPP__)
   //shutdown(sock, SD_BOTH);
@@ -938,8 +9430,6 @@ DLL_EXPORT_PROXYSOCKET void socket_set_timeouts_milliseconds (SOCKET sock, uint3
 #endif
 }
 
-#define READ_BUFFER_SIZE 128
-
 DLL_EXPORT_PROXYSOCKET char* socket_receiveline (SOCKET sock)
 {
   char* buf;
@@ -990,21 +9480,12 @@ DLL_EXPORT_PROXYSOCKET char* socket_receiveline (SOCKET sock)
 
 DLL_EXPORT_PROXYSOCKET char* socket_get_error_message ()
 {
-  char* result = NULL;
+  char errmsg[256];
 #ifdef _WIN32
-  //get Windows error message
-  LPSTR errmsg;
-  if (FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&errmsg, 0, NULL) > 0) {
-    result = strdup(errmsg);
-    LocalFree(errmsg);
-  }
+  get_system_error_message(GetLastError(), errmsg, sizeof(errmsg));
 #else
-  char* errmsg;
-  //to do: use strerror_r instead
-  if ((errmsg = strerror(errno)) != NULL) {
-    result = strdup(errmsg);
-  }
+  get_system_error_message(errno, errmsg, sizeof(errmsg));
 #endif
-  return result;
+  return strdup(errmsg);
 }
 
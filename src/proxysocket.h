@@ -14,6 +14,7 @@
 #define __INCLUDED_PROXYSOCKET_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -48,9 +49,9 @@ extern "C" {
 /*! \brief major version number */
 #define PROXYSOCKET_VERSION_MAJOR 0
 /*! \brief minor version number */
-#define PROXYSOCKET_VERSION_MINOR 1
+#define PROXYSOCKET_VERSION_MINOR 2
 /*! \brief micro version number */
-#define PROXYSOCKET_VERSION_MICRO 12
+#define PROXYSOCKET_VERSION_MICRO 0
 /*! @} */
 
 /*! \brief proxy types
@@ -66,6 +67,10 @@ extern "C" {
 #define PROXYSOCKET_TYPE_SOCKS5         0x05
 /*! \brief HTTP proxy */
 #define PROXYSOCKET_TYPE_WEB_CONNECT    0x20
+/*! \brief HTTPS proxy (HTTP proxy reached over TLS, only available when built with OpenSSL) */
+#define PROXYSOCKET_TYPE_WEB_CONNECT_TLS 0x21
+/*! \brief HTTP/2 proxy (cleartext, tunnels are multiplexed over shared connections, only as first proxy) */
+#define PROXYSOCKET_TYPE_WEB_CONNECT_H2 0x22
 /*! \brief invalid proxy type */
 #define PROXYSOCKET_TYPE_INVALID        -1
 /*! @} */
@@ -81,6 +86,141 @@ extern "C" {
 #define PROXYSOCKET_LOG_DEBUG   3
 /*! @} */
 
+/*! \brief socket option phases
+ * \sa     proxysocketconfig_set_socket_option()
+ * \name   PROXYSOCKET_PHASE_*
+ * \{
+ */
+/*! \brief while connecting and negotiating with the proxies */
+#define PROXYSOCKET_PHASE_HANDSHAKE     0
+/*! \brief after the connection to the destination is established */
+#define PROXYSOCKET_PHASE_DATA          1
+/*! @} */
+
+/*! \brief socket options
+ * \sa     proxysocketconfig_set_socket_option()
+ * \name   PROXYSOCKET_SOCKOPT_*
+ * \{
+ */
+/*! \brief disable Nagle algorithm if non-zero (TCP_NODELAY) */
+#define PROXYSOCKET_SOCKOPT_NODELAY             0
+/*! \brief send acknowledgements immediately if non-zero (TCP_QUICKACK, Linux only) */
+#define PROXYSOCKET_SOCKOPT_QUICKACK            1
+/*! \brief enable keepalive and set idle time in seconds before the first probe (TCP_KEEPIDLE) */
+#define PROXYSOCKET_SOCKOPT_KEEPALIVE_IDLE      2
+/*! \brief enable keepalive and set interval in seconds between probes (TCP_KEEPINTVL) */
+#define PROXYSOCKET_SOCKOPT_KEEPALIVE_INTERVAL  3
+/*! \brief enable keepalive and set number of unanswered probes before disconnecting (TCP_KEEPCNT) */
+#define PROXYSOCKET_SOCKOPT_KEEPALIVE_COUNT     4
+/*! \brief receive buffer size in bytes (SO_RCVBUF) */
+#define PROXYSOCKET_SOCKOPT_RCVBUF              5
+/*! \brief send buffer size in bytes (SO_SNDBUF) */
+#define PROXYSOCKET_SOCKOPT_SNDBUF              6
+/*! \brief maximum number of unsent bytes before the socket is reported writable (TCP_NOTSENT_LOWAT) */
+#define PROXYSOCKET_SOCKOPT_NOTSENT_LOWAT       7
+/*! \brief type of service field of outgoing IP packets (IP_TOS) */
+#define PROXYSOCKET_SOCKOPT_TOS                 8
+/*! \brief queuing priority of outgoing packets (SO_PRIORITY, Linux only) */
+#define PROXYSOCKET_SOCKOPT_PRIORITY            9
+/*! \brief firewall mark of outgoing packets (SO_MARK, Linux only) */
+#define PROXYSOCKET_SOCKOPT_MARK                10
+/*! \brief maximum time in milliseconds sent data may remain unacknowledged (TCP_USER_TIMEOUT) */
+#define PROXYSOCKET_SOCKOPT_USER_TIMEOUT        11
+/*! \brief linger time in seconds when closing the connection (SO_LINGER) */
+#define PROXYSOCKET_SOCKOPT_LINGER              12
+/*! \brief number of socket options */
+#define PROXYSOCKET_SOCKOPT_COUNT               13
+/*! @} */
+
+/*! \brief status values returned by proxysocket_handshake_step()
+ * \sa     proxysocket_handshake_step()
+ * \name   PROXYSOCKET_HANDSHAKE_*
+ * \{
+ */
+/*! \brief connection established, call proxysocket_handshake_finish() to get the socket */
+#define PROXYSOCKET_HANDSHAKE_DONE              0
+/*! \brief connection failed, call proxysocket_handshake_finish() to get the error message */
+#define PROXYSOCKET_HANDSHAKE_FAILED            -1
+/*! \brief wait until the socket is readable before calling proxysocket_handshake_step() again */
+#define PROXYSOCKET_HANDSHAKE_WANT_READ         1
+/*! \brief wait until the socket is writable before calling proxysocket_handshake_step() again */
+#define PROXYSOCKET_HANDSHAKE_WANT_WRITE        2
+/*! \brief waiting for the connection limits of a proxy, call proxysocket_handshake_step() again after proxysocket_handshake_get_wait_time() milliseconds */
+#define PROXYSOCKET_HANDSHAKE_WANT_TIMER        3
+/*! @} */
+
+/*! \brief phase of the connection in which an error occurred
+ * \sa     proxysocket_error_phase_string()
+ * \name   PROXYSOCKET_ERROR_PHASE_*
+ * \{
+ */
+/*! \brief no error */
+#define PROXYSOCKET_ERROR_PHASE_NONE            0
+/*! \brief checking proxy information and preparing the connection */
+#define PROXYSOCKET_ERROR_PHASE_SETUP           1
+/*! \brief looking up host names */
+#define PROXYSOCKET_ERROR_PHASE_RESOLVE         2
+/*! \brief creating the socket and connecting to the first host */
+#define PROXYSOCKET_ERROR_PHASE_CONNECT         3
+/*! \brief authenticating with a proxy */
+#define PROXYSOCKET_ERROR_PHASE_AUTHENTICATE    4
+/*! \brief requesting a proxy to connect to the next host */
+#define PROXYSOCKET_ERROR_PHASE_REQUEST         5
+/*! \brief waiting for the connection limits of a proxy */
+#define PROXYSOCKET_ERROR_PHASE_ADMISSION       6
+/*! \brief waiting for the proxy to accept an incoming connection (BIND) */
+#define PROXYSOCKET_ERROR_PHASE_ACCEPT          7
+/*! @} */
+
+/*! \brief cause of an error
+ * \sa     proxysocket_error_cause_string()
+ * \name   PROXYSOCKET_ERROR_CAUSE_*
+ * \{
+ */
+/*! \brief no error */
+#define PROXYSOCKET_ERROR_CAUSE_NONE            0
+/*! \brief memory allocation failed */
+#define PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY   1
+/*! \brief invalid or incomplete proxy information */
+#define PROXYSOCKET_ERROR_CAUSE_INVALID_CONFIG  2
+/*! \brief host name, login or password too long for the proxy protocol */
+#define PROXYSOCKET_ERROR_CAUSE_INVALID_ARGUMENT 3
+/*! \brief host name lookup failed */
+#define PROXYSOCKET_ERROR_CAUSE_RESOLVE_FAILED  4
+/*! \brief socket creation or configuration failed (see syserror) */
+#define PROXYSOCKET_ERROR_CAUSE_SOCKET_FAILED   5
+/*! \brief binding to the local address failed (see syserror) */
+#define PROXYSOCKET_ERROR_CAUSE_BIND_FAILED     6
+/*! \brief connecting to the first host failed (see syserror) */
+#define PROXYSOCKET_ERROR_CAUSE_CONNECT_FAILED  7
+/*! \brief sending data failed (see syserror) */
+#define PROXYSOCKET_ERROR_CAUSE_SEND_FAILED     8
+/*! \brief receiving data failed (see syserror) */
+#define PROXYSOCKET_ERROR_CAUSE_RECEIVE_FAILED  9
+/*! \brief connection closed by the proxy */
+#define PROXYSOCKET_ERROR_CAUSE_CONNECTION_LOST 10
+/*! \brief no response in time */
+#define PROXYSOCKET_ERROR_CAUSE_TIMEOUT         11
+/*! \brief invalid or unsupported response from the proxy (see status) */
+#define PROXYSOCKET_ERROR_CAUSE_PROTOCOL_ERROR  12
+/*! \brief proxy requires authentication but no login was given */
+#define PROXYSOCKET_ERROR_CAUSE_AUTH_REQUIRED   13
+/*! \brief no supported authentication method */
+#define PROXYSOCKET_ERROR_CAUSE_AUTH_UNSUPPORTED 14
+/*! \brief proxy rejected the login (see status) */
+#define PROXYSOCKET_ERROR_CAUSE_AUTH_FAILED     15
+/*! \brief proxy rejected the request (see status) */
+#define PROXYSOCKET_ERROR_CAUSE_REJECTED        16
+/*! \brief connection handshake aborted before it completed */
+#define PROXYSOCKET_ERROR_CAUSE_ABORTED         17
+/*! \brief connection limits of a proxy didn't allow the connection within the maximum wait time */
+#define PROXYSOCKET_ERROR_CAUSE_QUEUE_TIMEOUT   18
+/*! \brief TLS handshake with an HTTPS proxy failed, e.g. its certificate could not be verified (see the error message for the reason) */
+#define PROXYSOCKET_ERROR_CAUSE_TLS_FAILED      19
+/*! \brief web proxy answered 429 (Too many requests), new connections through it wait as long as it asked (see status) */
+#define PROXYSOCKET_ERROR_CAUSE_RATE_LIMITED    20
+/*! @} */
+
 //goal: function to create a socket that can be used by system function and connect it to a remote host, optionally through a proxy
 
 /*! \brief get proxysocket version
@@ -118,6 +258,23 @@ DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_name_type (const char* proxytyp
  */
 DLL_EXPORT_PROXYSOCKET int proxysocket_initialize ();
 
+/*! \brief function called at the start of each thread started by the library
+ * \param  userdata    custom data as passed to proxysocket_set_thread_start_hook()
+ * \sa     proxysocket_set_thread_start_hook()
+ */
+typedef void (*proxysocket_thread_start_fn)(void* userdata);
+
+/*! \brief set a function to be called at the start of each thread started by the library
+ *
+ * The library starts threads of its own to relay connections to HTTP/2 and HTTPS proxies
+ * and to resolve host names in parallel. These threads make their own connect() and getaddrinfo() calls,
+ * code intercepting those calls (like an LD_PRELOAD library) can use the hook to recognize them.
+ * Set it before the first connection is made.
+ * \param  hook_fn     function to call at the start of each thread or NULL for none
+ * \param  userdata    custom data passed to hook_fn
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocket_set_thread_start_hook (proxysocket_thread_start_fn hook_fn, void* userdata);
+
 /*! \brief proxysocketconfig object type */
 typedef struct proxysocketconfig_struct* proxysocketconfig;
 
@@ -156,6 +313,51 @@ DLL_EXPORT_PROXYSOCKET proxysocketconfig proxysocketconfig_create (int proxytype
  */
 DLL_EXPORT_PROXYSOCKET int proxysocketconfig_add_proxy (proxysocketconfig proxy, int proxytype, const char* proxyhost, uint16_t proxyport, const char* proxyuser, const char* proxypass);
 
+/*! \brief add a proxy method specified as URL to proxy information data structure
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  url         proxy URL in the form type://[user[:pass]@]host:port (type as accepted by proxysocketconfig_get_name_type(), user and pass may contain %XX escape sequences)
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_add_proxy()
+ * \sa     proxysocketconfig_load_proxy_list()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_add_proxy_url (proxysocketconfig proxy, const char* url);
+
+/*! \brief add all proxies listed in a file to proxy information data structure
+ *
+ * Each line of the file contains a proxy URL as accepted by proxysocketconfig_add_proxy_url().
+ * Empty lines and lines starting with # are ignored.
+ * The file is memory mapped and all entries and their strings are stored in a single allocation,
+ * identical strings (e.g. shared credentials) are only stored once.
+ * The entries are added in the same order as if proxysocketconfig_add_proxy() was called for each line.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  filename    path of the file containing the proxy list
+ * \param  errmsg      pointer to string that will receive error message including the line number, can be NULL, caller must free
+ * \return number of proxies added or -1 on failure (in which case nothing was added)
+ * \sa     proxysocketconfig_add_proxy_url()
+ * \sa     proxysocketconfig_save_snapshot()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_load_proxy_list (proxysocketconfig proxy, const char* filename, char** errmsg);
+
+/*! \brief save the proxies of a proxy information data structure to a binary snapshot file
+ *
+ * The snapshot can be loaded much faster than a text proxy list.
+ * It is only meant to be loaded on a machine with the same byte order.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  filename    path of the snapshot file to create
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_load_snapshot()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_save_snapshot (proxysocketconfig proxy, const char* filename);
+
+/*! \brief add the proxies from a binary snapshot file to proxy information data structure
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  filename    path of the snapshot file as created by proxysocketconfig_save_snapshot()
+ * \param  errmsg      pointer to string that will receive error message, can be NULL, caller must free
+ * \return number of proxies added or -1 on failure
+ * \sa     proxysocketconfig_save_snapshot()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_load_snapshot (proxysocketconfig proxy, const char* filename, char** errmsg);
+
 /*! \brief type of pointer to function for logging
  * \param  level       logging level (one of the PROXYSOCKET_LOG_ constants)
  * \param  message     text to be logged
@@ -187,13 +389,426 @@ DLL_EXPORT_PROXYSOCKET void proxysocketconfig_set_logging (proxysocketconfig pro
  */
 DLL_EXPORT_PROXYSOCKET void proxysocketconfig_set_timeout (proxysocketconfig proxy, uint32_t sendtimeout, uint32_t recvtimeout);
 
+/*! \brief use handshake timeouts adapted to the round trip times measured for each proxy
+ *
+ * Like the retransmission timeout of TCP a smoothed round trip time and its mean deviation are kept
+ * for each proxy, measured from the connection to it and from each request and reply going through it.
+ * A step of a handshake times out after the smoothed round trip time of its proxy plus 4 times the
+ * deviation (plus the round trip time to the proxy before it in the chain), within \b minimum and \b maximum.
+ * After a timeout the proxy gets twice as long until the next round trip time is measured, which ends the backoff.
+ * Proxies without measurements and direct connections use \b maximum.
+ * The timeouts set with proxysocketconfig_set_timeout() still apply to the established connection.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  minimum     shortest timeout in milliseconds for a step of a handshake
+ * \param  maximum     longest timeout in milliseconds for a step of a handshake (0 to use the timeouts set with proxysocketconfig_set_timeout())
+ * \sa     proxysocketconfig_set_timeout()
+ * \sa     proxysocketconfig_get_proxy_stats()
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocketconfig_set_adaptive_timeout (proxysocketconfig proxy, uint32_t minimum, uint32_t maximum);
+
 /*! \brief specify where name resolution is done
+ *
+ * Host names resolved on the client are kept for 60 seconds with the proxy information
+ * (or in the shared state for its time, see proxysocket_shared_create()), so only the
+ * hosts of a chain that weren't resolved recently are looked up, in parallel when there is more than one.
  * \param  proxy       proxy information as returned by proxysocketconfig_create()
  * \param  proxy_dns   perform DNS lookup on the proxy server if non-zero or on client if zero (default)
  * \sa     proxysocketconfig_create()
  */
 DLL_EXPORT_PROXYSOCKET void proxysocketconfig_use_proxy_dns (proxysocketconfig proxy, int proxy_dns);
 
+/*! \brief make proxy information immutable and pack it in a compact memory layout
+ *
+ * All proxy entries are stored in list order (the last proxy first, ending with the direct connection,
+ * the same order as the list they replace) in a single array followed by what is learned while
+ * using them (statistics, capabilities, authentication and limits) and all their strings (identical
+ * strings are only stored once) in one allocation. Only that learned state is written afterwards,
+ * the entries themselves are never modified again.
+ * Once frozen the proxy information can no longer be modified (adding proxies fails and
+ * changing settings is ignored), so it can be shared by multiple threads without locking.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_create()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_freeze (proxysocketconfig proxy);
+
+/*! \brief configure a socket option
+ *
+ * Options for the handshake phase are set when the connection socket is created.
+ * Options for the data phase are set after the connection via all proxies is established,
+ * options that are not set for the data phase keep the value they had during the handshake.
+ * Options not supported by the platform are ignored.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  phase       phase the option applies to (one of the PROXYSOCKET_PHASE_ constants)
+ * \param  option      socket option (one of the PROXYSOCKET_SOCKOPT_ constants)
+ * \param  value       value of the option or -1 to not change the operating system default
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_create()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_socket_option (proxysocketconfig proxy, int phase, int option, int value);
+
+/*! \brief add a local address to the pool of source addresses used for direct connections
+ *
+ * Direct connections (to the destination or to the first proxy) are spread over all addresses in the pool.
+ * When a pool is configured it takes precedence over the bind address of the PROXYSOCKET_TYPE_NONE entry.
+ * On Linux the port is only chosen when connecting (IP_BIND_ADDRESS_NO_PORT), so the same local port
+ * can be reused towards different destinations.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  address     local IP address
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_set_source_port_range()
+ * \sa     proxysocketconfig_get_source_address_stats()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_add_source_address (proxysocketconfig proxy, const char* address);
+
+/*! \brief use an explicit local port range for the source address pool
+ *
+ * The port range is split in the specified number of partitions, each thread uses ports from its own partition.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  firstport   first local port number or 0 to let the operating system choose (default)
+ * \param  lastport    last local port number
+ * \param  partitions  number of partitions to split the port range in (typically the number of threads)
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_add_source_address()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_source_port_range (proxysocketconfig proxy, uint16_t firstport, uint16_t lastport, int partitions);
+
+/*! \brief usage statistics of a source address
+ * \sa     proxysocketconfig_get_source_address_stats()
+ */
+struct proxysocket_source_stats {
+  /*! \brief number of connections made from the source address */
+  uint32_t connections;
+  /*! \brief number of failed attempts to bind or connect from the source address */
+  uint32_t failures;
+};
+
+/*! \brief get usage statistics of a source address
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  index       index of the source address in the order they were added
+ * \param  stats       pointer to structure that will receive the statistics
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_add_source_address()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_source_address_stats (proxysocketconfig proxy, int index, struct proxysocket_source_stats* stats);
+
+/*! \brief use TCP Fast Open for the first connection that is made
+ *
+ * When enabled the first data (the proxy request for the first proxy or the first data sent by the caller
+ * on a direct connection) is sent along with the connection request, saving one round trip if the server supports it.
+ * If no TCP Fast Open cookie is available yet for the server a normal connection is made.
+ * Only supported on Linux, ignored on other platforms.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  fastopen    use TCP Fast Open if non-zero or don't use it if zero (default)
+ * \sa     proxysocketconfig_create()
+ * \sa     proxysocketconfig_get_proxy_stats()
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocketconfig_use_fastopen (proxysocketconfig proxy, int fastopen);
+
+/*! \brief set the number of connections opened to an HTTP/2 proxy
+ *
+ * Connections through an HTTP/2 proxy (PROXYSOCKET_TYPE_WEB_CONNECT_H2) are carried as streams
+ * over a small number of shared connections to the proxy, each handled by a relay thread.
+ * The returned socket is one end of a local socket pair connected to the relay thread.
+ * The number of connections is fixed when the proxy is first used.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  connections maximum number of connections to each HTTP/2 proxy or zero for the default (4)
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_create()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_http2_connections (proxysocketconfig proxy, int connections);
+
+/*! \brief set the certificate authorities used to verify HTTPS proxies
+ *
+ * The certificate of an HTTPS proxy (PROXYSOCKET_TYPE_WEB_CONNECT_TLS) is always verified against the proxy host name or address.
+ * Sessions are cached for each proxy so later connections use an abbreviated handshake,
+ * sending the CONNECT request as TLS 1.3 early data when the proxy allows it.
+ * Early data can be replayed by an attacker, so it is only used when no login is set for the proxy (the request carries no credentials).
+ * A failed TLS handshake is reported as PROXYSOCKET_ERROR_CAUSE_TLS_FAILED with the reason in the error message.
+ * The certificate authorities are loaded when the proxy is first used.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  cafile      PEM file with trusted certificate authorities or NULL to use the system defaults
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_create()
+ * \sa     proxysocketconfig_get_proxy_stats()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_tls_ca_file (proxysocketconfig proxy, const char* cafile);
+
+/*! \brief limit the rate of connections and the number of concurrent handshakes through a proxy
+ *
+ * Connections that exceed the limits wait in a first-in first-out queue for the proxy instead of failing.
+ * The rate is enforced with a token bucket that starts full and holds up to burst connections.
+ * A handshake keeps its place from the moment it is admitted until it completes or fails.
+ * When a web proxy answers 429 (Too many requests) the token bucket is emptied and no connections are admitted
+ * for the time given in its Retry-After header (in seconds, at most 60 seconds, 1 second if missing or a date).
+ * A proxy without limits is given limits that only do this, the connection fails with PROXYSOCKET_ERROR_CAUSE_RATE_LIMITED.
+ * \param  proxy         proxy information as returned by proxysocketconfig_create()
+ * \param  index         index of the entry in the order they were added (0 is the direct connection, 1 the first proxy connected to, ...)
+ * \param  rate          maximum number of new connections per second or 0 for no rate limit
+ * \param  burst         number of connections that can be made at once before the rate limit applies (0 for 1)
+ * \param  maxhandshakes maximum number of handshakes in progress through the proxy or 0 for no limit
+ * \param  maxwait       maximum time in milliseconds a connection waits in the queue or 0 to wait indefinitely
+ * \return zero on success or non-zero on failure (invalid index or proxy information already in use)
+ * \sa     proxysocketconfig_create()
+ * \sa     proxysocketconfig_get_proxy_stats()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_proxy_limits (proxysocketconfig proxy, int index, uint32_t rate, uint32_t burst, uint32_t maxhandshakes, uint32_t maxwait);
+
+/*! \brief limit the bandwidth shared by all tunnels through a proxy
+ *
+ * Only applies to data transferred with proxysocket_tunnel_send() and proxysocket_tunnel_recv().
+ * Every tunnel passes the direct connection entry, so index 0 limits all tunnels made with the proxy information together.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  index       index of the entry in the order they were added (0 is the direct connection, 1 the first proxy connected to, ...)
+ * \param  sendrate    maximum number of bytes sent per second or 0 for no limit
+ * \param  recvrate    maximum number of bytes received per second or 0 for no limit
+ * \param  burst       number of bytes that can be transferred at once or 0 for 100 milliseconds worth of data (at least 16 KB)
+ * \return zero on success or non-zero on failure (invalid index or proxy information already in use)
+ * \sa     proxysocket_tunnel_set_bandwidth_limit()
+ * \sa     proxysocketconfig_get_proxy_stats()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_bandwidth_limit (proxysocketconfig proxy, int index, uint32_t sendrate, uint32_t recvrate, uint32_t burst);
+
+/*! \brief use equivalent proxies in turn */
+#define PROXYSOCKET_GROUP_SELECT_ROUND_ROBIN    0
+/*! \brief always use the same proxy for the same destination host or key (rendezvous hashing) */
+#define PROXYSOCKET_GROUP_SELECT_AFFINITY       1
+
+/*! \brief make consecutive proxies equivalent so each connection only goes through one of them
+ *
+ * The proxies form a group that takes a single place in the chain, a proxy is selected from it for each connection
+ * as set with proxysocketconfig_set_group_selection(). Proxies that failed 3 times in a row are avoided for 10 seconds
+ * unless all proxies of the group are failing. Statistics, limits and capabilities are still kept for each proxy.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  index       index of the first proxy of the group in the order they were added (1 is the first proxy connected to, ...)
+ * \param  count       number of proxies in the group (the proxies added after the first one)
+ * \return zero on success or non-zero on failure (invalid index or count or proxy information already in use)
+ * \sa     proxysocketconfig_set_group_selection()
+ * \sa     proxysocketconfig_get_hop_count()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_group_proxies (proxysocketconfig proxy, int index, int count);
+
+/*! \brief set how a proxy is selected from a group of equivalent proxies
+ *
+ * With PROXYSOCKET_GROUP_SELECT_AFFINITY the destination host (or the key passed to proxysocket_connect_with_key())
+ * is hashed with each proxy and the proxy with the highest weight is used, so connections to the same destination
+ * reuse the caches and sessions of the same proxy and adding or removing a proxy only moves the destinations it serves.
+ * When maxload is set a proxy that made more than maxload percent of the average number of recent connections of the group
+ * is skipped for the proxy with the next highest weight, so a busy destination can't overload a single proxy.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  mode        one of the PROXYSOCKET_GROUP_SELECT_* values (default: PROXYSOCKET_GROUP_SELECT_ROUND_ROBIN)
+ * \param  maxload     maximum load of a proxy in percent of the average (at least 100, e.g. 125) or 0 for no limit
+ * \return zero on success or non-zero on failure (invalid parameters or proxy information already in use)
+ * \sa     proxysocketconfig_group_proxies()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_group_selection (proxysocketconfig proxy, int mode, uint32_t maxload);
+
+/*! \brief statistics of a proxy
+ * \sa     proxysocketconfig_get_proxy_stats()
+ */
+struct proxysocket_proxy_stats {
+  /*! \brief number of connections to the proxy made with TCP Fast Open */
+  uint32_t fastopen_attempts;
+  /*! \brief number of connections to the proxy where the request sent with TCP Fast Open was accepted */
+  uint32_t fastopen_successes;
+  /*! \brief number of completed TLS handshakes with an HTTPS proxy */
+  uint32_t tls_handshakes;
+  /*! \brief number of TLS handshakes with an HTTPS proxy that resumed a cached session */
+  uint32_t tls_resumptions;
+  /*! \brief number of requests to an HTTPS proxy accepted as TLS early data (0-RTT) */
+  uint32_t tls_early_data;
+  /*! \brief number of connections that had to wait for the connection limits of the proxy */
+  uint32_t queued;
+  /*! \brief number of connections that failed because they waited longer than the maximum wait time */
+  uint32_t queue_timeouts;
+  /*! \brief total time in milliseconds connections waited for the connection limits of the proxy */
+  uint64_t queue_wait_time;
+  /*! \brief number of connections currently waiting for the connection limits of the proxy */
+  uint32_t queue_length;
+  /*! \brief number of handshakes currently in progress (only counted for a proxy with connection limits) */
+  uint32_t handshakes;
+  /*! \brief number of bytes sent through tunnels using the proxy (only counted with proxysocket_tunnel_send()) */
+  uint64_t bytes_sent;
+  /*! \brief number of bytes received through tunnels using the proxy (only counted with proxysocket_tunnel_recv()) */
+  uint64_t bytes_received;
+  /*! \brief number of handshakes that failed at the proxy (connection, timeout or protocol errors, not rejected requests) */
+  uint32_t failures;
+  /*! \brief number of handshakes that failed at the proxy since the last one that got through it */
+  uint32_t consecutive_failures;
+  /*! \brief moving average of the time in milliseconds the proxy took to complete its part of a handshake (0 if not measured yet) */
+  uint32_t latency;
+  /*! \brief smoothed round trip time in microseconds of a handshake step through the proxy (0 if not measured yet) */
+  uint32_t rtt;
+  /*! \brief mean deviation of the round trip time in microseconds (see proxysocketconfig_set_adaptive_timeout()) */
+  uint32_t rtt_variation;
+};
+
+/*! \brief get number of entries in proxy information (including the direct connection)
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \return number of entries
+ * \sa     proxysocketconfig_get_proxy_stats()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_proxy_count (proxysocketconfig proxy);
+
+/*! \brief get number of hosts a connection goes through before the destination (including the direct connection)
+ *
+ * This is the number of entries with each group of equivalent proxies counted once.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \return number of hops
+ * \sa     proxysocketconfig_group_proxies()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_hop_count (proxysocketconfig proxy);
+
+/*! \brief get statistics of a proxy
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  index       index of the entry in the order they were added (0 is the direct connection, 1 the first proxy connected to, ...)
+ * \param  stats       pointer to structure that will receive the statistics
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_get_proxy_count()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_proxy_stats (proxysocketconfig proxy, int index, struct proxysocket_proxy_stats* stats);
+
+/*! \brief connections to the proxy succeeded */
+#define PROXYSOCKET_CAPABILITY_REACHABLE        0x0001
+/*! \brief the proxy accepted requests without authentication */
+#define PROXYSOCKET_CAPABILITY_NO_AUTH          0x0002
+/*! \brief the SOCKS5 proxy selected username/password authentication */
+#define PROXYSOCKET_CAPABILITY_SOCKS5_LOGIN     0x0004
+/*! \brief the web proxy requires basic authentication */
+#define PROXYSOCKET_CAPABILITY_HTTP_BASIC       0x0008
+/*! \brief the web proxy requires digest authentication */
+#define PROXYSOCKET_CAPABILITY_HTTP_DIGEST      0x0010
+/*! \brief the proxy accepted a request sent with TCP Fast Open (it is then used for connections to this proxy even if not enabled with proxysocketconfig_use_fastopen()) */
+#define PROXYSOCKET_CAPABILITY_FASTOPEN         0x0020
+/*! \brief the SOCKS5 proxy accepted the method selection, authentication and connect request sent at once (they are then always sent at once to this proxy) */
+#define PROXYSOCKET_CAPABILITY_PIPELINING       0x0040
+
+/*! \brief behavior of a proxy learned from connections made through it
+ * \sa     proxysocketconfig_get_proxy_capabilities()
+ * \sa     proxysocketconfig_probe_proxies()
+ */
+struct proxysocket_proxy_capabilities {
+  /*! \brief combination of PROXYSOCKET_CAPABILITY_* flags */
+  uint32_t flags;
+  /*! \brief shortest time in milliseconds it took to connect to the proxy (only valid with PROXYSOCKET_CAPABILITY_REACHABLE) */
+  uint32_t rtt;
+  /*! \brief time the capabilities were last learned (seconds since 1970-01-01 00:00:00 UTC) or 0 if nothing was learned yet */
+  int64_t updated;
+};
+
+/*! \brief get what was learned about the behavior of a proxy
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  index       index of the entry in the order they were added (0 is the direct connection, 1 the first proxy connected to, ...)
+ * \param  capabilities pointer to structure that will receive the capabilities
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_probe_proxies()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_get_proxy_capabilities (proxysocketconfig proxy, int index, struct proxysocket_proxy_capabilities* capabilities);
+
+/*! \brief learn the capabilities of all proxies by connecting to each of them directly from this host in parallel
+ *
+ * Every proxy is asked to connect to the specified destination a few times: once to learn its authentication method,
+ * connection time and TCP Fast Open support (a second connection is needed for a TCP Fast Open cookie to be used),
+ * and once more with all SOCKS5 requests sent at once to check if it tolerates that.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  dsthost     destination hostname or IP address the proxies are asked to connect to
+ * \param  dstport     destination port number
+ * \param  timeout     maximum time in milliseconds for each round of connections or 0 to wait indefinitely
+ * \return number of proxies through which the destination could be reached or -1 on failure
+ * \sa     proxysocketconfig_get_proxy_capabilities()
+ * \sa     proxysocketconfig_save_capabilities()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_probe_proxies (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, uint32_t timeout);
+
+/*! \brief save the capabilities learned for the proxies to a binary cache file
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  filename    path of the cache file to create
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_load_capabilities()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_save_capabilities (proxysocketconfig proxy, const char* filename);
+
+/*! \brief apply the capabilities from a cache file to the matching proxies (same type, host, port and user)
+ *
+ * Capabilities already learned by this proxy information are kept.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  filename    path of the cache file as created by proxysocketconfig_save_capabilities()
+ * \param  maxage      ignore capabilities learned more than this many seconds ago or 0 to use them regardless of their age
+ * \param  errmsg      pointer to string that will receive error message, can be NULL, caller must free
+ * \return number of proxies capabilities were applied to or -1 on failure
+ * \sa     proxysocketconfig_save_capabilities()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_load_capabilities (proxysocketconfig proxy, const char* filename, uint32_t maxage, char** errmsg);
+
+/*! \brief state shared between processes (resolver cache, proxy health and statistics) */
+typedef struct proxysocket_shared_struct* proxysocketshared;
+
+/*! \brief create or attach to a shared memory region holding state that all processes using it read and update
+ *
+ * The region holds fixed-size tables that are updated without locks: a resolver cache with the addresses of host names,
+ * and the statistics, health and average latency of each proxy (proxies are matched by type, host, port and user).
+ * Without a name the region is anonymous (memfd on Linux) and is shared with child processes,
+ * so it should be created before forking worker processes.
+ * With a name a POSIX shared memory object is used that unrelated processes on the same host can attach to,
+ * the sizes of the process that created it are used.
+ * Not available on Windows.
+ * \param  name        name of the shared memory object (starting with /, see shm_open()) or NULL for an anonymous region
+ * \param  maxhosts    maximum number of host names in the resolver cache (0 for the default of 4096)
+ * \param  maxproxies  maximum number of proxies (0 for the default of 1024)
+ * \param  dnsttl      time in seconds resolved addresses are kept (0 for the default of 60 seconds)
+ * \return handle to the shared state or NULL on failure
+ * \sa     proxysocketconfig_use_shared()
+ * \sa     proxysocket_shared_free()
+ */
+DLL_EXPORT_PROXYSOCKET proxysocketshared proxysocket_shared_create (const char* name, uint32_t maxhosts, uint32_t maxproxies, uint32_t dnsttl);
+
+/*! \brief keep the state of proxy information in a shared memory region
+ *
+ * Statistics, health and latency of the proxies added so far (and their host name lookups) are kept in the shared region
+ * from now on, statistics collected before are not carried over. This should be called after all proxies were added.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  shared      shared state as returned by proxysocket_shared_create() (kept until the proxy information is freed)
+ * \return number of proxies kept in the shared region (fewer if its proxy table is full) or -1 on failure
+ * \sa     proxysocket_shared_create()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_use_shared (proxysocketconfig proxy, proxysocketshared shared);
+
+/*! \brief usage statistics of a shared memory region
+ * \sa     proxysocket_shared_get_stats()
+ */
+struct proxysocket_shared_stats {
+  /*! \brief number of host name lookups answered from the resolver cache */
+  uint64_t resolver_hits;
+  /*! \brief number of host name lookups that had to be resolved (not cached yet or expired) */
+  uint64_t resolver_misses;
+  /*! \brief number of host names in the resolver cache */
+  uint32_t hosts;
+  /*! \brief number of proxies in the proxy table */
+  uint32_t proxies;
+  /*! \brief number of host names or proxies that could not be added because a table was full */
+  uint32_t table_full;
+};
+
+/*! \brief get usage statistics of a shared memory region (of all processes using it)
+ * \param  shared      shared state as returned by proxysocket_shared_create()
+ * \param  stats       pointer to structure that will receive the statistics
+ * \return zero on success or non-zero on failure
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_shared_get_stats (proxysocketshared shared, struct proxysocket_shared_stats* stats);
+
+/*! \brief release shared state (the region is unmapped once no proxy information uses it anymore)
+ *
+ * A named shared memory object remains on the system until removed with proxysocket_shared_remove().
+ * \param  shared      shared state as returned by proxysocket_shared_create()
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocket_shared_free (proxysocketshared shared);
+
+/*! \brief remove a named shared memory object (processes that attached to it keep using it)
+ * \param  name        name of the shared memory object as passed to proxysocket_shared_create()
+ * \return zero on success or non-zero on failure
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_shared_remove (const char* name);
+
 /*! \brief clean up proxy information
  * \param  proxy       proxy information as returned by proxysocketconfig_create()
  * \sa     proxysocketconfig_create()
@@ -210,6 +825,539 @@ DLL_EXPORT_PROXYSOCKET void proxysocketconfig_free (proxysocketconfig proxy);
  */
 DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_connect (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, char** errmsg);
 
+/*! \brief details of a failed connection (no memory needs to be freed) */
+struct proxysocket_error {
+  /*! \brief phase in which the error occurred (one of the PROXYSOCKET_ERROR_PHASE_* values) */
+  int phase;
+  /*! \brief cause of the error (one of the PROXYSOCKET_ERROR_CAUSE_* values) */
+  int cause;
+  /*! \brief host involved, counted in the order they are connected to (0 = local side, 1 = first proxy, proxysocketconfig_get_hop_count() = destination) */
+  int hop;
+  /*! \brief SOCKS reply code or HTTP status code returned by the proxy or 0 if none */
+  int status;
+  /*! \brief operating system error code (errno or WSAGetLastError()) or 0 if none */
+  int syserror;
+};
+
+/*! \brief establish a TCP connection using the specified proxy, reporting failure without allocating memory
+ *
+ * Unlike proxysocket_connect() no error message is generated (unless logging is enabled).
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  dsthost     destination hostname or IP address
+ * \param  dstport     destination port number
+ * \param  error       pointer to structure that will receive error details, can be NULL
+ * \return network socket on success or INVALID_SOCKET on failure
+ * \sa     proxysocket_connect()
+ * \sa     proxysocket_error_format()
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_connect_ex (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, struct proxysocket_error* error);
+
+/*! \brief establish a TCP connection like proxysocket_connect_ex() selecting proxies from groups by a key instead of the destination host
+ *
+ * Connections with the same key go through the same proxy of each group (with PROXYSOCKET_GROUP_SELECT_AFFINITY),
+ * e.g. to keep a session of the destination on the same outgoing address.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  dsthost     destination hostname or IP address
+ * \param  dstport     destination port number
+ * \param  key         key used to select the proxies or NULL to use the destination host
+ * \param  error       pointer to structure that will receive error details, can be NULL
+ * \return network socket on success or INVALID_SOCKET on failure
+ * \sa     proxysocketconfig_set_group_selection()
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_connect_with_key (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, const char* key, struct proxysocket_error* error);
+
+/*! \brief get the textual description of an error phase
+ * \param  phase       one of the PROXYSOCKET_ERROR_PHASE_* values
+ * \return static string
+ */
+DLL_EXPORT_PROXYSOCKET const char* proxysocket_error_phase_string (int phase);
+
+/*! \brief get the textual description of an error cause
+ * \param  cause       one of the PROXYSOCKET_ERROR_CAUSE_* values
+ * \return static string
+ */
+DLL_EXPORT_PROXYSOCKET const char* proxysocket_error_cause_string (int cause);
+
+/*! \brief write a human-readable description of an error in a buffer
+ * \param  error       error details
+ * \param  buf         buffer that will receive the null-terminated text (truncated if needed)
+ * \param  buflen      size of the buffer
+ * \return length of the full text (like snprintf())
+ * \sa     proxysocket_connect_ex()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_error_format (const struct proxysocket_error* error, char* buf, size_t buflen);
+
+/*! \brief proxysockethandshake object type */
+typedef struct proxysocket_handshake_struct* proxysockethandshake;
+
+/*! \brief start establishing a TCP connection using the specified proxy without blocking
+ *
+ * Host names are resolved before this function returns.
+ * The connection handshake is continued by calling proxysocket_handshake_step()
+ * each time the socket becomes ready, e.g. from an event loop.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  dsthost     destination hostname or IP address
+ * \param  dstport     destination port number
+ * \return handshake handle (must be passed to proxysocket_handshake_finish()) or NULL if memory allocation failed
+ * \sa     proxysocket_handshake_step()
+ * \sa     proxysocket_handshake_get_socket()
+ * \sa     proxysocket_handshake_finish()
+ */
+DLL_EXPORT_PROXYSOCKET proxysockethandshake proxysocket_handshake_start (proxysocketconfig proxy, const char* dsthost, uint16_t dstport);
+
+/*! \brief start establishing a TCP connection without blocking, selecting proxies from groups by a key instead of the destination host
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  dsthost     destination hostname or IP address
+ * \param  dstport     destination port number
+ * \param  key         key used to select the proxies or NULL to use the destination host
+ * \return handshake handle (must be passed to proxysocket_handshake_finish()) or NULL if memory allocation failed
+ * \sa     proxysocket_handshake_start()
+ * \sa     proxysocket_connect_with_key()
+ */
+DLL_EXPORT_PROXYSOCKET proxysockethandshake proxysocket_handshake_start_with_key (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, const char* key);
+
+/*! \brief continue a connection handshake as far as possible without blocking
+ * \param  handshake   handshake handle as returned by proxysocket_handshake_start()
+ * \return one of the PROXYSOCKET_HANDSHAKE_* values
+ * \sa     proxysocket_handshake_start()
+ * \sa     PROXYSOCKET_HANDSHAKE_*
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_handshake_step (proxysockethandshake handshake);
+
+/*! \brief get the socket to wait for while a connection handshake is in progress
+ *
+ * The socket can change after proxysocket_handshake_step() when a web proxy
+ * closes the connection after an authentication challenge and the handshake
+ * starts over, so call this function again after each step.
+ * \param  handshake   handshake handle as returned by proxysocket_handshake_start()
+ * \return network socket or INVALID_SOCKET if the handshake failed
+ * \sa     proxysocket_handshake_step()
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_handshake_get_socket (proxysockethandshake handshake);
+
+/*! \brief get the time to wait before continuing a connection handshake that is waiting for the connection limits of a proxy
+ * \param  handshake   handshake handle as returned by proxysocket_handshake_start()
+ * \return time in milliseconds or 0 if the handshake isn't waiting
+ * \sa     proxysocket_handshake_step()
+ * \sa     proxysocketconfig_set_proxy_limits()
+ */
+DLL_EXPORT_PROXYSOCKET uint32_t proxysocket_handshake_get_wait_time (proxysockethandshake handshake);
+
+/*! \brief get the time to wait for the socket of a connection handshake before giving up on the current step
+ *
+ * With adaptive timeouts (see proxysocketconfig_set_adaptive_timeout()) this is
+ * based on the round trip times measured to the proxies and shrinks as the step goes on,
+ * so call this function again each time the wait starts over.
+ * If the socket isn't ready in time call proxysocket_handshake_timeout().
+ * \param  handshake   handshake handle as returned by proxysocket_handshake_start()
+ * \param  status      PROXYSOCKET_HANDSHAKE_WANT_READ or PROXYSOCKET_HANDSHAKE_WANT_WRITE as returned by proxysocket_handshake_step()
+ * \return time in milliseconds or 0 to wait indefinitely
+ * \sa     proxysocket_handshake_step()
+ * \sa     proxysocket_handshake_timeout()
+ */
+DLL_EXPORT_PROXYSOCKET uint32_t proxysocket_handshake_get_timeout (proxysockethandshake handshake, int status);
+
+/*! \brief abort a connection handshake whose socket wasn't ready within the time from proxysocket_handshake_get_timeout()
+ *
+ * The handshake fails with PROXYSOCKET_ERROR_CAUSE_TIMEOUT, proxysocket_handshake_finish() must still be called.
+ * \param  handshake   handshake handle as returned by proxysocket_handshake_start()
+ * \sa     proxysocket_handshake_get_timeout()
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocket_handshake_timeout (proxysockethandshake handshake);
+
+/*! \brief finish a connection handshake and free the handshake handle
+ *
+ * If the handshake hasn't completed yet it is aborted.
+ * \param  handshake   handshake handle as returned by proxysocket_handshake_start()
+ * \param  errmsg      pointer to string that will receive error message, can be NULL, caller must free
+ * \return blocking network socket on success or INVALID_SOCKET on failure
+ * \sa     proxysocket_handshake_start()
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_handshake_finish (proxysockethandshake handshake, char** errmsg);
+
+/*! \brief finish a connection handshake and free the handshake handle, reporting failure without allocating memory
+ *
+ * If the handshake hasn't completed yet it is aborted.
+ * \param  handshake   handshake handle as returned by proxysocket_handshake_start()
+ * \param  error       pointer to structure that will receive error details, can be NULL
+ * \return blocking network socket on success or INVALID_SOCKET on failure
+ * \sa     proxysocket_handshake_finish()
+ * \sa     proxysocket_error_format()
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_handshake_finish_ex (proxysockethandshake handshake, struct proxysocket_error* error);
+
+/*! \brief destination for proxysocket_connect_many() */
+struct proxysocket_target {
+  /*! \brief destination hostname or IP address */
+  const char* host;
+  /*! \brief destination port number */
+  uint16_t port;
+};
+
+/*! \brief result of proxysocket_connect_many() */
+struct proxysocket_result {
+  /*! \brief network socket or INVALID_SOCKET on failure */
+  SOCKET sock;
+  /*! \brief error details on failure */
+  struct proxysocket_error error;
+};
+
+/*! \brief establish TCP connections to multiple destinations using the specified proxy
+ *
+ * All connections are made concurrently and host names are only resolved once, looking up different host names in parallel before connecting.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  targets     destinations to connect to
+ * \param  count       number of destinations
+ * \param  results     array of count entries that will receive the result for each destination
+ * \param  timeout     maximum time in milliseconds for all connections to be established or 0 to wait indefinitely
+ * \return number of connections established
+ * \sa     proxysocket_connect()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_connect_many (proxysocketconfig proxy, const struct proxysocket_target* targets, int count, struct proxysocket_result* results, uint32_t timeout);
+
+/*! \brief proxysocketudp object type */
+typedef struct proxysocket_udp_struct* proxysocketudp;
+
+/*! \brief UDP datagram for proxysocket_udp_send() and proxysocket_udp_recv() */
+struct proxysocket_datagram {
+  /*! \brief destination host name resolved by the proxy (sending only, NULL to use addr) */
+  const char* host;
+  /*! \brief IPv4 address in network byte order (destination when sending, source when receiving or INADDR_NONE if not an IPv4 address) */
+  uint32_t addr;
+  /*! \brief port number (destination when sending, source when receiving) */
+  uint16_t port;
+  /*! \brief datagram data */
+  void* data;
+  /*! \brief length of the data */
+  size_t len;
+  /*! \brief size of the data buffer (receiving only, longer datagrams are truncated) */
+  size_t size;
+};
+
+/*! \brief set up an association to send and receive UDP datagrams through a SOCKS5 proxy
+ *
+ * The association is requested from the proxy with the SOCKS5 UDP ASSOCIATE command and lasts until proxysocket_udp_close() is called.
+ * Only a single SOCKS5 hop is supported: datagrams are sent to the relay of the proxy directly, so the proxy information
+ * must contain exactly one SOCKS5 proxy (or one group of SOCKS5 proxies), or no proxy at all to send datagrams directly.
+ * Chains fail with PROXYSOCKET_ERROR_CAUSE_INVALID_CONFIG.
+ * The proxy information must not be freed before the association.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  error       pointer to structure that will receive error details, can be NULL
+ * \return UDP association handle or NULL on failure
+ * \sa     proxysocket_udp_send()
+ * \sa     proxysocket_udp_recv()
+ * \sa     proxysocket_udp_close()
+ */
+DLL_EXPORT_PROXYSOCKET proxysocketudp proxysocket_udp_associate (proxysocketconfig proxy, struct proxysocket_error* error);
+
+/*! \brief get the UDP socket of an association (e.g. to wait for datagrams from an event loop)
+ * \param  udp         UDP association handle as returned by proxysocket_udp_associate()
+ * \return network socket
+ * \sa     proxysocket_udp_associate()
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_udp_get_socket (proxysocketudp udp);
+
+/*! \brief send UDP datagrams through a SOCKS5 proxy
+ *
+ * Datagrams are sent in batches (with sendmmsg() where available) without allocating memory.
+ * Host names are resolved by the proxy. When sending directly each distinct host name of a batch is resolved once,
+ * with the result kept for later batches like other host names of the proxy information, so use addresses where
+ * waiting for a lookup is not acceptable.
+ * \param  udp         UDP association handle as returned by proxysocket_udp_associate()
+ * \param  datagrams   datagrams to send
+ * \param  count       number of datagrams
+ * \return number of datagrams sent or -1 on failure
+ * \sa     proxysocket_udp_associate()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_udp_send (proxysocketudp udp, const struct proxysocket_datagram* datagrams, int count);
+
+/*! \brief receive UDP datagrams through a SOCKS5 proxy
+ *
+ * Waits for the first datagram and then receives as many datagrams as are available without blocking
+ * (with recvmmsg() where available).
+ * \param  udp         UDP association handle as returned by proxysocket_udp_associate()
+ * \param  datagrams   datagrams that will receive the data, data and size must be set
+ * \param  count       number of datagrams
+ * \param  timeout     maximum time in milliseconds to wait for the first datagram or 0 to wait indefinitely
+ * \return number of datagrams received, 0 on timeout or -1 on failure or when the proxy ended the association
+ * \sa     proxysocket_udp_associate()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_udp_recv (proxysocketudp udp, struct proxysocket_datagram* datagrams, int count, uint32_t timeout);
+
+/*! \brief end an association to send and receive UDP datagrams and free the handle
+ * \param  udp         UDP association handle as returned by proxysocket_udp_associate()
+ * \sa     proxysocket_udp_associate()
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocket_udp_close (proxysocketudp udp);
+
+/*! \brief proxysocketbind object type */
+typedef struct proxysocket_bind_struct* proxysocketbind;
+
+/*! \brief ask the last proxy to listen for an incoming connection (SOCKS4 or SOCKS5 BIND command)
+ *
+ * Returns after the proxy reported the address it listens on, which can then be passed on to the peer
+ * (e.g. in the PORT command of an active mode FTP connection).
+ * An armed session is taken from the pool set up with proxysocketconfig_set_bind_pool() when the peer matches,
+ * otherwise a new connection is made to the proxy.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create(), the last proxy must be a SOCKS4 or SOCKS5 proxy
+ * \param  peerhost    host the incoming connection is expected from (the proxy may refuse others) or NULL for any host
+ * \param  peerport    port the incoming connection is expected from or 0 for any port
+ * \param  error       pointer to structure that will receive error details, can be NULL
+ * \return BIND session handle or NULL on failure
+ * \sa     proxysocket_bind_get_address()
+ * \sa     proxysocket_bind_accept()
+ * \sa     proxysocket_bind_close()
+ */
+DLL_EXPORT_PROXYSOCKET proxysocketbind proxysocket_bind (proxysocketconfig proxy, const char* peerhost, uint16_t peerport, struct proxysocket_error* error);
+
+/*! \brief get the address the proxy listens on for the incoming connection
+ * \param  session     BIND session handle as returned by proxysocket_bind()
+ * \param  addr        pointer that will receive the IPv4 address in network byte order (the address of the proxy if it didn't report one, INADDR_NONE if unknown)
+ * \param  port        pointer that will receive the port number
+ * \return 0 on success or -1 on error
+ * \sa     proxysocket_bind()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_bind_get_address (proxysocketbind session, uint32_t* addr, uint16_t* port);
+
+/*! \brief get the socket of a BIND session (e.g. to wait from an event loop until it is readable, which is when the incoming connection arrived)
+ * \param  session     BIND session handle as returned by proxysocket_bind()
+ * \return network socket or INVALID_SOCKET if the connection was already returned by proxysocket_bind_accept()
+ * \sa     proxysocket_bind()
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_bind_get_socket (proxysocketbind session);
+
+/*! \brief wait for the incoming connection of a BIND session (the second reply of the proxy)
+ *
+ * On timeout the session stays armed and this function can be called again.
+ * \param  session     BIND session handle as returned by proxysocket_bind()
+ * \param  timeout     maximum time in milliseconds to wait or 0 to wait indefinitely
+ * \param  peeraddr    pointer that will receive the IPv4 address of the peer in network byte order (INADDR_NONE if not an IPv4 address), can be NULL
+ * \param  peerport    pointer that will receive the port number of the peer, can be NULL
+ * \param  error       pointer to structure that will receive error details, can be NULL
+ * \return network socket connected to the peer or INVALID_SOCKET on failure or timeout
+ * \sa     proxysocket_bind()
+ * \sa     proxysocket_bind_close()
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_bind_accept (proxysocketbind session, uint32_t timeout, uint32_t* peeraddr, uint16_t* peerport, struct proxysocket_error* error);
+
+/*! \brief end a BIND session and free the handle (a connection returned by proxysocket_bind_accept() is not closed)
+ * \param  session     BIND session handle as returned by proxysocket_bind()
+ * \sa     proxysocket_bind()
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocket_bind_close (proxysocketbind session);
+
+/*! \brief set up a pool of BIND sessions armed in advance, so proxysocket_bind() can return a listening address without waiting for the proxy
+ * \param  proxy       proxy information as returned by proxysocketconfig_create(), the last proxy must be a SOCKS4 or SOCKS5 proxy
+ * \param  peerhost    host incoming connections are expected from or NULL for any host
+ * \param  peerport    port incoming connections are expected from or 0 for any port
+ * \param  size        number of sessions to keep armed (0 to close all pooled sessions)
+ * \param  maxidle     maximum time in milliseconds a session is kept in the pool (proxies close idle listeners) or 0 for no limit
+ * \return 0 on success or -1 on error
+ * \sa     proxysocketconfig_fill_bind_pool()
+ * \sa     proxysocket_bind()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_set_bind_pool (proxysocketconfig proxy, const char* peerhost, uint16_t peerport, uint32_t size, uint32_t maxidle);
+
+/*! \brief arm BIND sessions until the pool is full, the sessions are set up concurrently
+ *
+ * Call this outside the time critical path, e.g. after taking sessions with proxysocket_bind() or periodically to replace expired ones.
+ * Can be called from several threads at once, sessions that don't fit in the pool or were armed for a peer it was changed away from meanwhile are closed.
+ * \param  proxy       proxy information with a BIND session pool
+ * \param  timeout     maximum time in milliseconds to wait for the proxies or 0 to wait indefinitely
+ * \return number of armed sessions in the pool or -1 on error
+ * \sa     proxysocketconfig_set_bind_pool()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfig_fill_bind_pool (proxysocketconfig proxy, uint32_t timeout);
+
+/*! \brief proxysockettunnel object type */
+typedef struct proxysocket_tunnel_struct* proxysockettunnel;
+
+/*! \brief statistics of a tunnel
+ * \sa     proxysocket_tunnel_get_stats()
+ */
+struct proxysocket_tunnel_stats {
+  /*! \brief number of bytes sent */
+  uint64_t bytes_sent;
+  /*! \brief number of bytes received */
+  uint64_t bytes_received;
+  /*! \brief bytes sent per second since the previous call to proxysocket_tunnel_get_stats() (or since the tunnel was created) */
+  uint32_t send_rate;
+  /*! \brief bytes received per second since the previous call to proxysocket_tunnel_get_stats() (or since the tunnel was created) */
+  uint32_t recv_rate;
+  /*! \brief total time in milliseconds spent waiting for bandwidth limits */
+  uint64_t throttled_time;
+};
+
+/*! \brief keep track of an established connection to count its traffic and shape its bandwidth
+ *
+ * Bandwidth is shaped with token buckets for the tunnel, for each proxy it uses and for the proxy information as a whole
+ * (see proxysocketconfig_set_bandwidth_limit()), data is only transferred when all of them allow it.
+ * The clock is only read when a bucket runs out, not for each transfer.
+ * The proxy information must not be freed before the tunnel.
+ * The socket doesn't tell which proxy of a group (see proxysocketconfig_group_proxies()) was used,
+ * so the traffic is counted for the first proxy added to each group. Use proxysocket_connect_tunnel()
+ * or proxysocket_handshake_finish_tunnel() instead to count it for the proxies that were actually used.
+ * \param  proxy       proxy information the connection was made with
+ * \param  sock        connected socket as returned by proxysocket_connect() (the tunnel takes ownership)
+ * \return tunnel handle or NULL if memory allocation failed (the socket is not closed)
+ * \sa     proxysocket_tunnel_send()
+ * \sa     proxysocket_tunnel_recv()
+ * \sa     proxysocket_tunnel_close()
+ */
+DLL_EXPORT_PROXYSOCKET proxysockettunnel proxysocket_tunnel_create (proxysocketconfig proxy, SOCKET sock);
+
+/*! \brief finish a connection handshake like proxysocket_handshake_finish_ex() and keep track of the connection as a tunnel
+ *
+ * The traffic of the tunnel is counted for (and limited by) the proxies the handshake selected from groups.
+ * \param  handshake   handshake handle as returned by proxysocket_handshake_start()
+ * \param  error       pointer to structure that will receive error details, can be NULL
+ * \return tunnel handle or NULL on failure
+ * \sa     proxysocket_tunnel_create()
+ * \sa     proxysocket_tunnel_close()
+ */
+DLL_EXPORT_PROXYSOCKET proxysockettunnel proxysocket_handshake_finish_tunnel (proxysockethandshake handshake, struct proxysocket_error* error);
+
+/*! \brief establish a TCP connection like proxysocket_connect_with_key() and keep track of it as a tunnel
+ *
+ * The traffic of the tunnel is counted for (and limited by) the proxies selected from groups.
+ * \param  proxy       proxy information as returned by proxysocketconfig_create()
+ * \param  dsthost     destination hostname or IP address
+ * \param  dstport     destination port number
+ * \param  key         key used to select the proxies or NULL to use the destination host
+ * \param  error       pointer to structure that will receive error details, can be NULL
+ * \return tunnel handle or NULL on failure
+ * \sa     proxysocket_tunnel_create()
+ * \sa     proxysocket_tunnel_close()
+ */
+DLL_EXPORT_PROXYSOCKET proxysockettunnel proxysocket_connect_tunnel (proxysocketconfig proxy, const char* dsthost, uint16_t dstport, const char* key, struct proxysocket_error* error);
+
+/*! \brief get the socket of a tunnel (e.g. to wait for data from an event loop)
+ * \param  tunnel      tunnel handle as returned by proxysocket_tunnel_create()
+ * \return network socket
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocket_tunnel_get_socket (proxysockettunnel tunnel);
+
+/*! \brief limit the bandwidth of a single tunnel
+ * \param  tunnel      tunnel handle as returned by proxysocket_tunnel_create()
+ * \param  sendrate    maximum number of bytes sent per second or 0 for no limit
+ * \param  recvrate    maximum number of bytes received per second or 0 for no limit
+ * \param  burst       number of bytes that can be transferred at once or 0 for 100 milliseconds worth of data (at least 16 KB)
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfig_set_bandwidth_limit()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_tunnel_set_bandwidth_limit (proxysockettunnel tunnel, uint32_t sendrate, uint32_t recvrate, uint32_t burst);
+
+/*! \brief send data through a tunnel like send()
+ *
+ * Waits until the bandwidth limits allow sending, unless MSG_DONTWAIT is in flags (where available)
+ * or the socket is non-blocking (not detected on Windows) in which case it fails with EWOULDBLOCK
+ * (see proxysocket_tunnel_get_wait_time()).
+ * Less data than requested can be sent.
+ * \param  tunnel      tunnel handle as returned by proxysocket_tunnel_create()
+ * \param  buf         data to send
+ * \param  len         length of the data
+ * \param  flags       flags passed to send()
+ * \return number of bytes sent or -1 on failure
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_tunnel_send (proxysockettunnel tunnel, const void* buf, size_t len, int flags);
+
+/*! \brief receive data from a tunnel like recv()
+ *
+ * Waits until the bandwidth limits allow receiving, unless MSG_DONTWAIT is in flags (where available)
+ * or the socket is non-blocking (not detected on Windows) in which case it fails with EWOULDBLOCK
+ * (see proxysocket_tunnel_get_wait_time()).
+ * \param  tunnel      tunnel handle as returned by proxysocket_tunnel_create()
+ * \param  buf         buffer that will receive the data
+ * \param  len         size of the buffer
+ * \param  flags       flags passed to recv()
+ * \return number of bytes received, 0 when the connection was closed or -1 on failure
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_tunnel_recv (proxysockettunnel tunnel, void* buf, size_t len, int flags);
+
+/*! \brief get the time to wait before the bandwidth limits allow a transfer that failed with EWOULDBLOCK
+ *
+ * Only covers failures caused by the bandwidth limits, not a socket that isn't ready.
+ * \param  tunnel      tunnel handle as returned by proxysocket_tunnel_create()
+ * \return time in milliseconds or 0 if the limits allow transferring now
+ * \sa     proxysocket_tunnel_send()
+ * \sa     proxysocket_tunnel_recv()
+ */
+DLL_EXPORT_PROXYSOCKET uint32_t proxysocket_tunnel_get_wait_time (proxysockettunnel tunnel);
+
+/*! \brief get statistics of a tunnel
+ * \param  tunnel      tunnel handle as returned by proxysocket_tunnel_create()
+ * \param  stats       pointer to structure that will receive the statistics
+ * \return zero on success or non-zero on failure
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocket_tunnel_get_stats (proxysockettunnel tunnel, struct proxysocket_tunnel_stats* stats);
+
+/*! \brief close the connection of a tunnel and free the handle
+ * \param  tunnel      tunnel handle as returned by proxysocket_tunnel_create()
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocket_tunnel_close (proxysockettunnel tunnel);
+
+/*! \brief proxysocketconfighandle object type */
+typedef struct proxysocketconfighandle_struct* proxysocketconfighandle;
+
+/*! \brief create a handle that allows replacing proxy information while connections are being made
+ *
+ * Connections made via the handle use an immutable snapshot of the proxy information.
+ * A new snapshot can be published at any time with proxysocketconfighandle_publish(),
+ * connections in progress keep using the snapshot they started with.
+ * Getting the current snapshot doesn't involve locking.
+ * \param  proxy       initial proxy information as returned by proxysocketconfig_create(), will be frozen, the handle takes ownership
+ * \return handle or NULL on failure
+ * \sa     proxysocketconfighandle_publish()
+ * \sa     proxysocketconfighandle_connect()
+ * \sa     proxysocketconfighandle_free()
+ * \sa     proxysocketconfig_freeze()
+ */
+DLL_EXPORT_PROXYSOCKET proxysocketconfighandle proxysocketconfighandle_create (proxysocketconfig proxy);
+
+/*! \brief replace the proxy information used by a handle
+ *
+ * The previous proxy information is freed as soon as no more connections are using it.
+ * What was learned about a proxy is carried over to the entry with the same type, host, port and user:
+ * statistics, capabilities, authentication details (including a digest nonce), the TLS session cache
+ * (if the certificate authorities didn't change) and the queue of its connection limits.
+ * Connection limits not set on the new proxy information are dropped, unless only the proxy asked to slow down (HTTP 429).
+ * HTTP/2 connections to a proxy are not carried over, connections made through the new proxy information open their own.
+ * \param  handle      handle as returned by proxysocketconfighandle_create()
+ * \param  proxy       new proxy information as returned by proxysocketconfig_create(), will be frozen, the handle takes ownership
+ * \return zero on success or non-zero on failure
+ * \sa     proxysocketconfighandle_create()
+ */
+DLL_EXPORT_PROXYSOCKET int proxysocketconfighandle_publish (proxysocketconfighandle handle, proxysocketconfig proxy);
+
+/*! \brief get a reference to the current proxy information of a handle
+ * \param  handle      handle as returned by proxysocketconfighandle_create()
+ * \return proxy information (must be released with proxysocketconfighandle_release()) or NULL on failure
+ * \sa     proxysocketconfighandle_release()
+ */
+DLL_EXPORT_PROXYSOCKET proxysocketconfig proxysocketconfighandle_acquire (proxysocketconfighandle handle);
+
+/*! \brief release a reference to proxy information
+ * \param  proxy       proxy information as returned by proxysocketconfighandle_acquire()
+ * \sa     proxysocketconfighandle_acquire()
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocketconfighandle_release (proxysocketconfig proxy);
+
+/*! \brief establish a TCP connection using the current proxy information of a handle
+ * \param  handle      handle as returned by proxysocketconfighandle_create()
+ * \param  dsthost     destination hostname or IP address
+ * \param  dstport     destination port number
+ * \param  errmsg      pointer to string that will receive error message, can be NULL, caller must free
+ * \return network socket on success or INVALID_SOCKET on failure
+ * \sa     proxysocket_connect()
+ */
+DLL_EXPORT_PROXYSOCKET SOCKET proxysocketconfighandle_connect (proxysocketconfighandle handle, const char* dsthost, uint16_t dstport, char** errmsg);
+
+/*! \brief clean up handle
+ * \param  handle      handle as returned by proxysocketconfighandle_create()
+ * \sa     proxysocketconfighandle_create()
+ */
+DLL_EXPORT_PROXYSOCKET void proxysocketconfighandle_free (proxysocketconfighandle handle);
+
 /*! \brief disconnect a proxy socket
  * \param  proxy       proxy information as returned by proxysocketconfig_create()
  * \param  sock        network socket as returned by proxysocket_connect()
@@ -0,0 +1,397 @@
+/*
+  LD_PRELOAD library that makes unmodified programs connect through a proxy chain
+
+  Usage:  PROXYSOCKET_CHAIN="socks5://127.0.0.1:1080 http://proxy:3128" LD_PRELOAD=libproxysocket_preload.so program
+
+  Environment variables:
+    PROXYSOCKET_CHAIN      proxy URLs in connection order (separated by spaces or commas), nothing is proxied if not set,
+                           equivalent proxies of which each connection uses one are separated by | (e.g. "socks5://a:1080|socks5://b:1080")
+    PROXYSOCKET_AFFINITY   select proxies of a group by destination host, the value is the maximum load in percent of the average (e.g. 125) or 1 for no limit
+    PROXYSOCKET_DIRECT     networks connected to directly (e.g. "10.0.0.0/8,192.168.1.0/24"), loopback is always direct
+    PROXYSOCKET_PROXY_DNS  if set to 1 getaddrinfo() returns placeholder addresses and host names are resolved by the proxy
+    PROXYSOCKET_TIMEOUT    send and receive timeout in milliseconds for the proxy handshake
+    PROXYSOCKET_ADAPTIVE_TIMEOUT  shortest handshake timeout in milliseconds, enables timeouts adapted to the round trip time of each proxy (up to PROXYSOCKET_TIMEOUT)
+    PROXYSOCKET_CA_FILE    PEM file with the certificate authorities used to verify HTTPS proxies
+    PROXYSOCKET_SHARED     name of a shared memory object (e.g. "/proxysocket") in which all processes keep resolved host names and proxy statistics
+    PROXYSOCKET_DEBUG      if set log to stderr (1 = errors, 2 = warnings, 3 = information, 4 = debug)
+
+  Only IPv4 TCP connections are proxied, everything else goes straight to the system.
+  The handshake runs on a new socket that replaces the file descriptor passed to connect() (keeping its
+  file descriptor flags, status flags and common socket options), so the program keeps using its own descriptor.
+  The handshake blocks, also for non-blocking sockets (connect() then returns 0 instead of EINPROGRESS).
+*/
+
+#define _GNU_SOURCE
+#include "proxysocket.h"
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ATOMIC_LOAD(ptr)                __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, val)          __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define ATOMIC_ADD(ptr, val)            __atomic_add_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_COMPARE_EXCHANGE(ptr, expected, val) __atomic_compare_exchange_n(ptr, expected, val, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+#define PRELOAD_MAX_FDS                 (1 << 20)       //maximum size of the file descriptor table
+#define PRELOAD_MAX_DIRECT              32              //maximum number of networks in PROXYSOCKET_DIRECT
+#define PRELOAD_FAKE_NETWORK            0xF0000000      //placeholder addresses returned by getaddrinfo() (240.0.0.0/12, reserved)
+#define PRELOAD_FAKE_MASK               0xFFF00000
+#define PRELOAD_MAX_NAMES               0x000FFFFF      //number of host names that fit in the placeholder network
+#define PRELOAD_ADAPTIVE_MAX_TIMEOUT    30000           //longest adaptive handshake timeout in milliseconds if PROXYSOCKET_TIMEOUT is not set
+
+#define FDSTATE_PROXIED                 ((uint64_t)1 << 63)     //connected through the proxy chain (destination address << 16 | port)
+
+typedef int (*connect_fn)(int, const struct sockaddr*, socklen_t);
+typedef int (*close_fn)(int);
+typedef int (*getaddrinfo_fn)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
+typedef int (*getpeername_fn)(int, struct sockaddr*, socklen_t*);
+
+struct preload_network {
+  uint32_t addr;                        //host byte order
+  uint32_t mask;
+};
+
+static struct {
+  connect_fn real_connect;
+  close_fn real_close;
+  getaddrinfo_fn real_getaddrinfo;
+  getpeername_fn real_getpeername;
+  proxysocketconfig config;             //NULL if nothing is proxied
+  int loglevel;
+  int8_t proxydns;
+  struct preload_network direct[PRELOAD_MAX_DIRECT];
+  int directcount;
+  uint64_t* fdstate;                    //state of each file descriptor (only changed with atomic operations)
+  int fdcount;
+  char** names;                         //host names of placeholder addresses (slots are filled once with atomic operations)
+  uint32_t namecount;
+} preload;
+
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+
+//set while the library itself connects and in the threads it starts so its own calls go straight to the system
+static __thread int8_t preload_busy = 0;
+
+//threads relaying connections to HTTP/2 and HTTPS proxies or resolving host names belong to the library
+static void preload_thread_start (void* userdata)
+{
+  (void)userdata;
+  preload_busy = 1;
+}
+
+static void preload_logger (int level, const char* message, void* userdata)
+{
+  (void)userdata;
+  if (level <= preload.loglevel)
+    fprintf(stderr, "proxysocket: %s\n", message);
+}
+
+//parse networks like "10.0.0.0/8,192.168.1.1"
+static void preload_parse_direct (const char* list)
+{
+  char buf[32];
+  size_t len;
+  char* bits;
+  struct in_addr addr;
+  while (list && *list && preload.directcount < PRELOAD_MAX_DIRECT) {
+    len = strcspn(list, ", ");
+    if (len > 0 && len < sizeof(buf)) {
+      memcpy(buf, list, len);
+      buf[len] = 0;
+      if ((bits = strchr(buf, '/')) != NULL)
+        *bits++ = 0;
+      if (inet_pton(AF_INET, buf, &addr) == 1) {
+        len = (bits ? (size_t)atoi(bits) : 32);
+        preload.direct[preload.directcount].mask = (len == 0 ? 0 : len >= 32 ? 0xFFFFFFFF : ~((uint32_t)0xFFFFFFFF >> len));
+        preload.direct[preload.directcount].addr = ntohl(addr.s_addr) & preload.direct[preload.directcount].mask;
+        preload.directcount++;
+      }
+    }
+    list += len;
+    list += strspn(list, ", ");
+  }
+}
+
+static void preload_init ()
+{
+  const char* chain;
+  const char* value;
+  char url[1024];
+  size_t len;
+  int grouped;
+  uint32_t timeout = 0;
+  struct rlimit limit;
+  preload.real_connect = (connect_fn)dlsym(RTLD_NEXT, "connect");
+  preload.real_close = (close_fn)dlsym(RTLD_NEXT, "close");
+  preload.real_getaddrinfo = (getaddrinfo_fn)dlsym(RTLD_NEXT, "getaddrinfo");
+  preload.real_getpeername = (getpeername_fn)dlsym(RTLD_NEXT, "getpeername");
+  if ((value = getenv("PROXYSOCKET_DEBUG")) != NULL)
+    preload.loglevel = (*value ? atoi(value) : PROXYSOCKET_LOG_ERROR);
+  if ((chain = getenv("PROXYSOCKET_CHAIN")) == NULL || !*chain)
+    return;
+  //the file descriptor table covers all descriptors the process can open
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > PRELOAD_MAX_FDS)
+    limit.rlim_cur = PRELOAD_MAX_FDS;
+  preload.fdcount = (int)limit.rlim_cur;
+  if ((preload.fdstate = (uint64_t*)calloc(preload.fdcount, sizeof(uint64_t))) == NULL)
+    return;
+  proxysocket_initialize();
+  proxysocket_set_thread_start_hook(preload_thread_start, NULL);
+  if ((preload.config = proxysocketconfig_create_direct()) == NULL)
+    return;
+  if (preload.loglevel > 0)
+    proxysocketconfig_set_logging(preload.config, preload_logger, NULL);
+  grouped = 0;
+  while (*(chain += strspn(chain, ", |"))) {
+    len = strcspn(chain, ", |");
+    if (len < sizeof(url)) {
+      memcpy(url, chain, len);
+      url[len] = 0;
+      if (proxysocketconfig_add_proxy_url(preload.config, url) != 0) {
+        preload_logger(PROXYSOCKET_LOG_ERROR, "Invalid proxy URL in PROXYSOCKET_CHAIN, not using proxies", NULL);
+        proxysocketconfig_free(preload.config);
+        preload.config = NULL;
+        return;
+      }
+      //join the hop of the proxy before it
+      if (grouped)
+        proxysocketconfig_group_proxies(preload.config, proxysocketconfig_get_proxy_count(preload.config) - 2, 2);
+    }
+    chain += len;
+    grouped = (*chain == '|');
+  }
+  if ((value = getenv("PROXYSOCKET_AFFINITY")) != NULL && atoi(value) > 0)
+    proxysocketconfig_set_group_selection(preload.config, PROXYSOCKET_GROUP_SELECT_AFFINITY, (atoi(value) >= 100 ? (uint32_t)atoi(value) : 0));
+  preload_parse_direct(getenv("PROXYSOCKET_DIRECT"));
+  if ((value = getenv("PROXYSOCKET_TIMEOUT")) != NULL && atoi(value) > 0) {
+    timeout = (uint32_t)atoi(value);
+    proxysocketconfig_set_timeout(preload.config, timeout, timeout);
+  }
+  if ((value = getenv("PROXYSOCKET_ADAPTIVE_TIMEOUT")) != NULL && atoi(value) > 0)
+    proxysocketconfig_set_adaptive_timeout(preload.config, (uint32_t)atoi(value), (timeout ? timeout : PRELOAD_ADAPTIVE_MAX_TIMEOUT));
+  if ((value = getenv("PROXYSOCKET_CA_FILE")) != NULL && *value)
+    proxysocketconfig_set_tls_ca_file(preload.config, value);
+  if ((value = getenv("PROXYSOCKET_PROXY_DNS")) != NULL && atoi(value) == 1 && (preload.names = (char**)calloc(PRELOAD_MAX_NAMES, sizeof(char*))) != NULL) {
+    preload.proxydns = 1;
+    proxysocketconfig_use_proxy_dns(preload.config, 1);
+  }
+  if ((value = getenv("PROXYSOCKET_SHARED")) != NULL && *value) {
+    proxysocketshared shared;
+    if ((shared = proxysocket_shared_create(value, 0, 0, 0)) != NULL) {
+      proxysocketconfig_use_shared(preload.config, shared);
+      proxysocket_shared_free(shared);
+    } else {
+      preload_logger(PROXYSOCKET_LOG_WARNING, "Unable to use shared memory object in PROXYSOCKET_SHARED", NULL);
+    }
+  }
+  proxysocketconfig_freeze(preload.config);
+}
+
+//check if a destination (host byte order) is connected to directly
+static int preload_is_direct (uint32_t addr)
+{
+  int i;
+  if ((addr >> 24) == 127)
+    return 1;
+  for (i = 0; i < preload.directcount; i++) {
+    if ((addr & preload.direct[i].mask) == preload.direct[i].addr)
+      return 1;
+  }
+  return 0;
+}
+
+//get the placeholder address for a host name (host byte order)
+static uint32_t preload_name_address (const char* name)
+{
+  uint32_t i;
+  uint32_t count;
+  char* copy;
+  char* expected;
+  count = ATOMIC_LOAD(&preload.namecount);
+  for (i = 0; i < count && i < PRELOAD_MAX_NAMES; i++) {
+    if ((copy = ATOMIC_LOAD(&preload.names[i])) != NULL && strcasecmp(copy, name) == 0)
+      return PRELOAD_FAKE_NETWORK | (i + 1);
+  }
+  //claim a new slot (a name added twice at the same time just gets two addresses)
+  if ((i = ATOMIC_ADD(&preload.namecount, 1) - 1) >= PRELOAD_MAX_NAMES || (copy = strdup(name)) == NULL)
+    return INADDR_NONE;
+  expected = NULL;
+  if (!ATOMIC_COMPARE_EXCHANGE(&preload.names[i], &expected, copy))
+    free(copy);
+  return PRELOAD_FAKE_NETWORK | (i + 1);
+}
+
+//get the host name of a placeholder address (host byte order)
+static const char* preload_address_name (uint32_t addr)
+{
+  uint32_t i = (addr & ~PRELOAD_FAKE_MASK);
+  if ((addr & PRELOAD_FAKE_MASK) != PRELOAD_FAKE_NETWORK || i == 0 || i > PRELOAD_MAX_NAMES)
+    return NULL;
+  return ATOMIC_LOAD(&preload.names[i - 1]);
+}
+
+//map the cause of a failed handshake to errno
+static int preload_errno (const struct proxysocket_error* error)
+{
+  switch (error->cause) {
+    case PROXYSOCKET_ERROR_CAUSE_OUT_OF_MEMORY :
+      return ENOMEM;
+    case PROXYSOCKET_ERROR_CAUSE_SOCKET_FAILED :
+    case PROXYSOCKET_ERROR_CAUSE_BIND_FAILED :
+    case PROXYSOCKET_ERROR_CAUSE_CONNECT_FAILED :
+    case PROXYSOCKET_ERROR_CAUSE_SEND_FAILED :
+    case PROXYSOCKET_ERROR_CAUSE_RECEIVE_FAILED :
+      return (error->syserror ? error->syserror : ECONNREFUSED);
+    case PROXYSOCKET_ERROR_CAUSE_RESOLVE_FAILED :
+      return EHOSTUNREACH;
+    case PROXYSOCKET_ERROR_CAUSE_TIMEOUT :
+    case PROXYSOCKET_ERROR_CAUSE_QUEUE_TIMEOUT :
+      return ETIMEDOUT;
+    case PROXYSOCKET_ERROR_CAUSE_CONNECTION_LOST :
+      return ECONNRESET;
+    case PROXYSOCKET_ERROR_CAUSE_INVALID_CONFIG :
+    case PROXYSOCKET_ERROR_CAUSE_INVALID_ARGUMENT :
+      return EINVAL;
+    default :
+      return ECONNREFUSED;
+  }
+}
+
+//replace the file descriptor of the caller with the connected socket
+static int preload_replace_socket (int fd, int sock)
+{
+  static const int options[][2] = {
+    {SOL_SOCKET, SO_KEEPALIVE},
+    {SOL_SOCKET, SO_RCVBUF},
+    {SOL_SOCKET, SO_SNDBUF},
+    {SOL_SOCKET, SO_PRIORITY},
+    {SOL_SOCKET, SO_MARK},
+    {IPPROTO_TCP, TCP_NODELAY}
+  };
+  int i;
+  int fdflags;
+  int statusflags;
+  int value;
+  socklen_t valuelen;
+  struct timeval timeout;
+  if ((fdflags = fcntl(fd, F_GETFD)) == -1 || (statusflags = fcntl(fd, F_GETFL)) == -1)
+    return -1;
+  //socket options set by the program before connecting (ignored if the connection is a relay socket pair)
+  for (i = 0; i < (int)(sizeof(options) / sizeof(options[0])); i++) {
+    valuelen = sizeof(value);
+    if (getsockopt(fd, options[i][0], options[i][1], &value, &valuelen) == 0)
+      setsockopt(sock, options[i][0], options[i][1], &value, valuelen);
+  }
+  //drop the timeouts used for the handshake
+  valuelen = sizeof(timeout);
+  if (getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &valuelen) == 0)
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, valuelen);
+  valuelen = sizeof(timeout);
+  if (getsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, &valuelen) == 0)
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, valuelen);
+  if (dup2(sock, fd) == -1)
+    return -1;
+  fcntl(fd, F_SETFD, fdflags);
+  fcntl(fd, F_SETFL, statusflags);
+  return 0;
+}
+
+int connect (int fd, const struct sockaddr* addr, socklen_t addrlen)
+{
+  int type;
+  int result;
+  SOCKET sock;
+  uint32_t dstaddr;
+  uint16_t dstport;
+  socklen_t typelen;
+  const char* host;
+  char buf[INET_ADDRSTRLEN];
+  struct proxysocket_error error;
+  pthread_once(&preload_once, preload_init);
+  //pass through everything that isn't an IPv4 connection to a proxied destination
+  if (preload_busy || !preload.config || !addr || addr->sa_family != AF_INET || addrlen < (socklen_t)sizeof(struct sockaddr_in) || fd < 0 || fd >= preload.fdcount)
+    return preload.real_connect(fd, addr, addrlen);
+  dstaddr = ntohl(((const struct sockaddr_in*)addr)->sin_addr.s_addr);
+  dstport = ntohs(((const struct sockaddr_in*)addr)->sin_port);
+  if (preload_is_direct(dstaddr))
+    return preload.real_connect(fd, addr, addrlen);
+  typelen = sizeof(type);
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typelen) != 0 || type != SOCK_STREAM)
+    return preload.real_connect(fd, addr, addrlen);
+  if ((host = (preload.proxydns ? preload_address_name(dstaddr) : NULL)) == NULL)
+    host = inet_ntop(AF_INET, &((const struct sockaddr_in*)addr)->sin_addr, buf, sizeof(buf));
+  //connect through the proxy chain and put the connection in place of the caller's socket
+  preload_busy = 1;
+  sock = proxysocket_connect_ex(preload.config, host, dstport, &error);
+  preload_busy = 0;
+  if (sock == INVALID_SOCKET) {
+    errno = preload_errno(&error);
+    return -1;
+  }
+  result = preload_replace_socket(fd, sock);
+  preload.real_close(sock);
+  if (result != 0)
+    return -1;
+  ATOMIC_STORE(&preload.fdstate[fd], FDSTATE_PROXIED | ((uint64_t)dstaddr << 16) | dstport);
+  return 0;
+}
+
+int close (int fd)
+{
+  pthread_once(&preload_once, preload_init);
+  if (fd >= 0 && fd < preload.fdcount && ATOMIC_LOAD(&preload.fdstate[fd]))
+    ATOMIC_STORE(&preload.fdstate[fd], 0);
+  return preload.real_close(fd);
+}
+
+//report the destination instead of the proxy as the peer of a proxied connection
+int getpeername (int fd, struct sockaddr* addr, socklen_t* addrlen)
+{
+  uint64_t state;
+  struct sockaddr_in peer;
+  pthread_once(&preload_once, preload_init);
+  if (fd < 0 || fd >= preload.fdcount || !addr || !addrlen || ((state = ATOMIC_LOAD(&preload.fdstate[fd])) & FDSTATE_PROXIED) == 0)
+    return preload.real_getpeername(fd, addr, addrlen);
+  memset(&peer, 0, sizeof(peer));
+  peer.sin_family = AF_INET;
+  peer.sin_addr.s_addr = htonl((uint32_t)(state >> 16));
+  peer.sin_port = htons((uint16_t)state);
+  memcpy(addr, &peer, (*addrlen < sizeof(peer) ? *addrlen : sizeof(peer)));
+  *addrlen = sizeof(peer);
+  return 0;
+}
+
+//return placeholder addresses for host names that will be resolved by the proxy
+int getaddrinfo (const char* node, const char* service, const struct addrinfo* hints, struct addrinfo** res)
+{
+  uint32_t addr;
+  struct in_addr numeric;
+  struct addrinfo fakehints;
+  char buf[INET_ADDRSTRLEN];
+  pthread_once(&preload_once, preload_init);
+  if (preload_busy || !preload.proxydns || !node || (hints && ((hints->ai_family != AF_UNSPEC && hints->ai_family != AF_INET) || hints->ai_socktype == SOCK_DGRAM || (hints->ai_flags & AI_NUMERICHOST))) || inet_pton(AF_INET, node, &numeric) == 1 || strcasecmp(node, "localhost") == 0 || strchr(node, ':'))
+    return preload.real_getaddrinfo(node, service, hints, res);
+  if ((addr = preload_name_address(node)) == INADDR_NONE)
+    return EAI_MEMORY;
+  //let the system build the result so freeaddrinfo() can release it
+  numeric.s_addr = htonl(addr);
+  inet_ntop(AF_INET, &numeric, buf, sizeof(buf));
+  if (hints)
+    fakehints = *hints;
+  else
+    memset(&fakehints, 0, sizeof(fakehints));
+  fakehints.ai_family = AF_INET;
+  fakehints.ai_flags = (fakehints.ai_flags & ~AI_CANONNAME) | AI_NUMERICHOST;
+  return preload.real_getaddrinfo(buf, service, &fakehints, res);
+}